@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -16,72 +16,261 @@
 #include "bio.h"
 
 #include "buf.h"
+#include "iostat.h"
+#include "kalloc.h"
+#include "memlayout.h"
 #include "param.h"
 #include "printf.h"
+#include "proc.h"
 #include "sleeplock.h"
+#include "slab.h"
 #include "spinlock.h"
+#include "string.h"
 #include "types.h"
+#include "virtio.h"
 #include "virtio_disk.h"
 
-struct {
+// Buffers are hashed by (dev, blockno) into buckets, each with
+// its own lock and its own list sorted by how recently its
+// buffers were used, so lookups of different blocks rarely
+// touch the same lock. Only one bucket lock is ever held at a
+// time.
+//
+// The cache starts with the NBUF static buffers and grows on
+// misses, with buffers from a slab cache, up to 1/BCACHEDIV of
+// RAM while memory is not short. Past that a miss recycles the
+// least recently used free buffer of the block's bucket, or
+// else steals one from another bucket. When the page allocator
+// runs out, bshrink() gives free buffers back.
+#define NBUCKET 509
+#define BUCKET(dev, blockno) \
+  (&bcache.bucket[((dev) * 31 + (blockno)) % NBUCKET])
+#define BMAX ((PHYSTOP - KERNBASE) / BCACHEDIV / BSIZE)
+#define BLOWPAGES (NPAGES / 16)  // don't grow with fewer free pages
+#define NSHRINK 256              // buffers bshrink() frees per call
+
+struct bucket {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  // Linked list of the bucket's buffers, through prev/next.
+  // mru is the most recently used, lru the least.
+  struct buf *mru;
+  struct buf *lru;
+};
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+struct {
+  struct buf buf[NBUF];
+  struct bucket bucket[NBUCKET];
+  struct kmem_cache *cache;  // the buffers past NBUF
+  int nbuf;                  // buffers in all
+  uint hand;                 // bucket where stealing starts next
+  struct {
+    uint64 hit, miss;  // bread()s on this hart
+  } stat[NCPU];
 } bcache;
 
+static void bunlock(struct buf *b);
+
+static void bremove(struct bucket *k, struct buf *b) {
+  if (b->prev)
+    b->prev->next = b->next;
+  else
+    k->mru = b->next;
+  if (b->next)
+    b->next->prev = b->prev;
+  else
+    k->lru = b->prev;
+}
+
+// Put b at the most recently used end of bucket k's list.
+static void pushfront(struct bucket *k, struct buf *b) {
+  b->prev = 0;
+  b->next = k->mru;
+  if (k->mru)
+    k->mru->prev = b;
+  else
+    k->lru = b;
+  k->mru = b;
+}
+
+// Put b at the least recently used end, to be recycled first.
+static void pushback(struct bucket *k, struct buf *b) {
+  b->next = 0;
+  b->prev = k->lru;
+  if (k->lru)
+    k->lru->next = b;
+  else
+    k->mru = b;
+  k->lru = b;
+}
+
+static void bufctor(void *obj) {
+  struct buf *b = obj;
+
+  memset(b, 0, sizeof(*b));
+  initsleeplock(&b->lock, "buffer");
+}
+
 void binit(void) {
   struct buf *b;
 
-  initlock(&bcache.lock, "bcache");
-
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
+  for (struct bucket *k = bcache.bucket; k < bcache.bucket + NBUCKET; k++)
+    initlock(&k->lock, "bcache");
+  // spread the buffers over the buckets; they hold no block yet.
   for (b = bcache.buf; b < bcache.buf + NBUF; b++) {
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
     initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->dev = ~0;
+    pushfront(&bcache.bucket[(b - bcache.buf) % NBUCKET], b);
+  }
+  bcache.nbuf = NBUF;
+  bcache.cache = kmem_cache_create("buf", sizeof(struct buf), bufctor, 0, 8);
+  if (bcache.cache == 0) panic("binit");
+}
+
+// Take a reference to the buffer for the block in bucket k.
+// Caller must hold k->lock.
+static struct buf *bfind(struct bucket *k, uint dev, uint blockno) {
+  for (struct buf *b = k->mru; b; b = b->next) {
+    if (b->dev == dev && b->blockno == blockno) {
+      b->refcnt++;
+      return b;
+    }
   }
+  return 0;
+}
+
+// Remove and return bucket k's least recently used free buffer,
+// or 0. A free buffer is clean, since the log pins the ones it
+// has yet to write. Caller must hold k->lock.
+static struct buf *bsteal(struct bucket *k) {
+  for (struct buf *b = k->lru; b; b = b->prev) {
+    if (b->refcnt == 0) {
+      bremove(k, b);
+      return b;
+    }
+  }
+  return 0;
+}
+
+static int bcangrow(void) {
+  return bcache.nbuf < BMAX && kfreepages() >= BLOWPAGES;
+}
+
+// A new buffer from the slab cache, if the cache may grow.
+static struct buf *bgrow(void) {
+  struct buf *b;
+
+  if (!bcangrow() || (b = kmem_cache_alloc(bcache.cache)) == 0) return 0;
+  __sync_fetch_and_add(&bcache.nbuf, 1);
+  return b;
+}
+
+// A free buffer taken from another bucket than home, or 0.
+static struct buf *bstealany(struct bucket *home) {
+  struct buf *b = 0;
+  uint start = __sync_fetch_and_add(&bcache.hand, 1);
+
+  for (int i = 0; i < NBUCKET && b == 0; i++) {
+    struct bucket *k = &bcache.bucket[(start + i) % NBUCKET];
+    if (k == home) continue;
+    acquire(&k->lock);
+    b = bsteal(k);
+    release(&k->lock);
+  }
+  return b;
 }
 
 // Look through buffer cache for block on device dev.
 // If not found, allocate a buffer.
-// In either case, return locked buffer.
-static struct buf *bget(uint dev, uint blockno) {
-  struct buf *b;
+// In either case, return locked buffer; but if fresh is set,
+// return 0 rather than a buffer that was caching the block.
+static struct buf *bget1(uint dev, uint blockno, int fresh) {
+  struct bucket *home = BUCKET(dev, blockno);
+  struct buf *b, *free;
 
-  acquire(&bcache.lock);
+  acquire(&home->lock);
 
   // Is the block already cached?
-  for (b = bcache.head.next; b != &bcache.head; b = b->next) {
-    if (b->dev == dev && b->blockno == blockno) {
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
+  if ((b = bfind(home, dev, blockno)) != 0) {
+    if (fresh) b->refcnt--;
+    release(&home->lock);
+    if (fresh) return 0;
+    acquiresleep(&b->lock);
+    return b;
   }
 
   // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for (b = bcache.head.prev; b != &bcache.head; b = b->prev) {
-    if (b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
+  // Recycle the least recently used (LRU) unused buffer of this
+  // bucket, unless the cache can grow instead. Growing and
+  // stealing happen with home->lock released.
+  free = bcangrow() ? 0 : bsteal(home);
+  if (free == 0) {
+    release(&home->lock);
+    if ((free = bgrow()) == 0 && (free = bstealany(home)) == 0) {
+      acquire(&home->lock);
+      free = bsteal(home);
+      release(&home->lock);
+    }
+    if (free == 0) panic("bget: no buffers");
+    acquire(&home->lock);
+    // the block may have been cached while home->lock was
+    // released; then keep the new buffer here unused.
+    if ((b = bfind(home, dev, blockno)) != 0) {
+      free->dev = ~0;
+      free->refcnt = 0;
+      pushfront(home, free);
+      if (fresh) b->refcnt--;
+      release(&home->lock);
+      if (fresh) return 0;
       acquiresleep(&b->lock);
       return b;
     }
   }
-  panic("bget: no buffers");
+
+  b = free;
+  b->dev = dev;
+  b->blockno = blockno;
+  b->valid = 0;
+  b->refcnt = 1;
+  // no one holds a free buffer's lock, so this does not sleep;
+  // and whoever finds b next waits for it to be read.
+  acquiresleep(&b->lock);
+  pushfront(home, b);
+  release(&home->lock);
+  return b;
+}
+
+static struct buf *bget(uint dev, uint blockno) {
+  return bget1(dev, blockno, 0);
+}
+
+// Give up to NSHRINK free buffers past the static ones back to
+// the slab cache, least recently used first, for the page
+// allocator when it runs out. Returns how many it freed.
+uint64 bshrink(void) {
+  uint64 n = 0;
+
+  for (int i = 0; i < NBUCKET && n < NSHRINK; i++) {
+    struct bucket *k = &bcache.bucket[i];
+    struct buf *b, *prev, *victims = 0;
+
+    acquire(&k->lock);
+    for (b = k->lru; b && n < NSHRINK; b = prev) {
+      prev = b->prev;
+      if (b->refcnt != 0 || (b >= bcache.buf && b < bcache.buf + NBUF))
+        continue;
+      bremove(k, b);
+      b->next = victims;
+      victims = b;
+      n++;
+    }
+    release(&k->lock);
+    while ((b = victims) != 0) {
+      victims = b->next;
+      kmem_cache_free(bcache.cache, b);
+      __sync_fetch_and_sub(&bcache.nbuf, 1);
+    }
+  }
+  return n;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -89,6 +278,12 @@ struct buf *bread(uint dev, uint blockno) {
   struct buf *b;
 
   b = bget(dev, blockno);
+  push_off();
+  if (b->valid)
+    bcache.stat[cpuid()].hit++;
+  else
+    bcache.stat[cpuid()].miss++;
+  pop_off();
   if (!b->valid) {
     virtio_disk_rw(b, 0);
     b->valid = 1;
@@ -96,6 +291,80 @@ struct buf *bread(uint dev, uint blockno) {
   return b;
 }
 
+// Add up the buffer cache's counts into st, or zero them.
+void bstat(struct iostat *st, int reset) {
+  for (int i = 0; i < NCPU; i++) {
+    if (reset) {
+      bcache.stat[i].hit = bcache.stat[i].miss = 0;
+    } else {
+      st->bhit += bcache.stat[i].hit;
+      st->bmiss += bcache.stat[i].miss;
+    }
+  }
+}
+
+// Is the indicated block in the cache? The answer can change as
+// soon as it is given, unless the caller holds off whatever else
+// might read or write the block.
+int bcached(uint dev, uint blockno) {
+  struct bucket *home = BUCKET(dev, blockno);
+  struct buf *b;
+
+  acquire(&home->lock);
+  b = bfind(home, dev, blockno);
+  if (b) b->refcnt--;
+  release(&home->lock);
+  return b != 0;
+}
+
+// Return a locked buf for the indicated block without reading
+// it, for a caller that is about to overwrite all of its data.
+struct buf *bclaim(uint dev, uint blockno) {
+  struct buf *b = bget(dev, blockno);
+
+  b->valid = 1;
+  return b;
+}
+
+// Start reading the n blocks from blockno on into the cache,
+// without waiting, in the hope that they are wanted soon. Each
+// run of them that is not cached goes to the disk as one
+// request. Stops when the disk queue is full, and does nothing
+// if the cache is down to the static buffers, which the log
+// may need.
+void breadahead(uint dev, uint blockno, uint n) {
+  struct buf *run[MAXSEG];
+  int k = 0;
+
+  if (bcache.nbuf < 2 * NBUF && !bcangrow()) return;
+
+  for (uint i = 0; i <= n; i++) {
+    // bget1() does not wait for a buffer someone else holds
+    // while this holds the run's.
+    struct buf *b = i < n ? bget1(dev, blockno + i, 1) : 0;
+    if (b) {
+      // the lock stays held until the read is done, so that
+      // bread() of the block waits for it.
+      disownsleep(&b->lock);
+      run[k++] = b;
+    }
+    if (k > 0 && (b == 0 || k == MAXSEG)) {
+      if (virtio_disk_submit(run, k, 0, bdone) < 0) {
+        while (k > 0) bunlock(run[--k]);
+        return;
+      }
+      k = 0;
+    }
+  }
+}
+
+// Finish a read started by breadahead(), from the disk
+// interrupt handler.
+void bdone(struct buf *b) {
+  b->valid = 1;
+  bunlock(b);
+}
+
 // Write b's contents to disk.  Must be locked.
 void bwrite(struct buf *b) {
   if (!holdingsleep(&b->lock)) panic("bwrite");
@@ -103,35 +372,67 @@ void bwrite(struct buf *b) {
 }
 
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
+// Move to the head of its bucket's most-recently-used list.
 void brelse(struct buf *b) {
   if (!holdingsleep(&b->lock)) panic("brelse");
+  bunlock(b);
+}
 
+// Release a locked buffer whose block is not expected to be
+// wanted again soon, such as file data now in the page cache.
+// If no one else holds it, a buffer from the slab goes back to
+// it and a static one is recycled next.
+void bforget(struct buf *b) {
+  struct bucket *k = BUCKET(b->dev, b->blockno);
+  int slab = b < bcache.buf || b >= bcache.buf + NBUF;
+
+  if (!holdingsleep(&b->lock)) panic("bforget");
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
+  acquire(&k->lock);
   b->refcnt--;
   if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    bremove(k, b);
+    if (slab) {
+      release(&k->lock);
+      kmem_cache_free(bcache.cache, b);
+      __sync_fetch_and_sub(&bcache.nbuf, 1);
+      return;
+    }
+    pushback(k, b);
   }
+  release(&k->lock);
+}
+
+// Unlock b and drop a reference to it, for brelse() or for a
+// buffer whose lock was disowned.
+static void bunlock(struct buf *b) {
+  struct bucket *k = BUCKET(b->dev, b->blockno);
+
+  releasesleep(&b->lock);
 
-  release(&bcache.lock);
+  acquire(&k->lock);
+  b->refcnt--;
+  if (b->refcnt == 0) {
+    // no one is waiting for it.
+    bremove(k, b);
+    pushfront(k, b);
+  }
+  release(&k->lock);
 }
 
 void bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *k = BUCKET(b->dev, b->blockno);
+
+  acquire(&k->lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&k->lock);
 }
 
 void bunpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *k = BUCKET(b->dev, b->blockno);
+
+  acquire(&k->lock);
   b->refcnt--;
-  release(&bcache.lock);
+  release(&k->lock);
 }
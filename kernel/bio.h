@@ -3,10 +3,18 @@
 #include "types.h"
 
 struct buf;
+struct iostat;
 
 void binit(void);
 struct buf *bread(uint, uint);
+void breadahead(uint, uint, uint);
+void bdone(struct buf *);
 void brelse(struct buf *);
+int bcached(uint, uint);
+struct buf *bclaim(uint, uint);
+void bforget(struct buf *);
 void bwrite(struct buf *);
 void bpin(struct buf *);
 void bunpin(struct buf *);
+uint64 bshrink(void);
+void bstat(struct iostat *, int);
@@ -11,7 +11,10 @@ struct buf {
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev;  // LRU cache list
+  struct buf *prev;  // LRU list of its hash bucket; 0 at the ends
   struct buf *next;
+  struct buf *qnext;             // disk queue (virtio_disk.c)
+  int qwrite;                    // queued to be written, not read
+  void (*iodone)(struct buf *);  // called when the disk is done, or 0
   uchar data[BSIZE];
 };
@@ -14,10 +14,12 @@
 #include <stdarg.h>
 
 #include "file.h"
+#include "poll.h"
 #include "proc.h"
 #include "spinlock.h"
 #include "types.h"
 #include "uart.h"
+#include "vm.h"
 
 #define BACKSPACE 0x100
 #define C(x) ((x) - '@')  // Control-x
@@ -47,13 +49,14 @@ struct {
   uint r;  // Read index
   uint w;  // Write index
   uint e;  // Edit index
+  int npoll;  // poll()s watching the console
 } cons;
 
 //
 // user write()s to the console go here.
 //
 int consolewrite(int user_src, uint64 src, int n) {
-  char buf[32];
+  char buf[128];
   int i = 0;
 
   while (i < n) {
@@ -104,7 +107,16 @@ int consoleread(int user_dst, uint64 dst, int n) {
 
     // copy the input byte to the user-space buffer.
     cbuf = c;
-    if (either_copyout(user_dst, dst, &cbuf, 1) == -1) break;
+    if (either_copyout(user_dst, dst, &cbuf, 1) == -1) {
+      // put it back, and fault dst in without cons.lock, since
+      // that may sleep.
+      cons.r--;
+      release(&cons.lock);
+      int bad = !user_dst || userfaultin(myproc()->pagetable, dst, 1, 1) < 0;
+      acquire(&cons.lock);
+      if (bad) break;
+      continue;
+    }
 
     dst++;
     --n;
@@ -162,6 +174,7 @@ void consoleintr(int c) {
           // has arrived.
           cons.w = cons.e;
           wakeup(&cons.r);
+          if (cons.npoll) pollwakeup();
         }
       }
       break;
@@ -170,6 +183,16 @@ void consoleintr(int c) {
   release(&cons.lock);
 }
 
+// Is a line waiting to be read? Also add arm to the poll()s
+// watching the console.
+int consolepoll(int arm) {
+  acquire(&cons.lock);
+  cons.npoll += arm;
+  int ev = POLLOUT | (cons.r != cons.w ? POLLIN : 0);
+  release(&cons.lock);
+  return ev;
+}
+
 void consoleinit(void) {
   initlock(&cons.lock, "cons");
 
@@ -179,4 +202,5 @@ void consoleinit(void) {
   // to consoleread and consolewrite.
   devsw[CONSOLE].read = consoleread;
   devsw[CONSOLE].write = consolewrite;
+  devsw[CONSOLE].poll = consolepoll;
 }
@@ -0,0 +1,168 @@
+// Directory entry cache.
+//
+// Maps a name in a directory to the inode number it names and
+// the offset of its dirent, so that dirlookup() need not read
+// the directory's blocks again. A negative entry, with inum 0,
+// records that the name is absent. Entries are looked up and
+// added with the directory locked, shared or not, and changed
+// by dirlink() and unlink with it locked exclusively, so an
+// entry always agrees with the directory. A directory's entries
+// are purged when its inode is freed, since the inode number
+// may then name another directory.
+//
+// dcache.lock protects the hash chains and the LRU list.
+
+#include "dcache.h"
+
+#include "file.h"
+#include "fs.h"
+#include "printf.h"
+#include "spinlock.h"
+#include "string.h"
+#include "types.h"
+
+#define NDENTRY 256
+#define NDHASH 127
+
+struct dentry {
+  uint dev;
+  uint dinum;            // the directory, or 0 if the entry is unused
+  char name[DIRSIZ];
+  uint inum;             // what name names, or 0 if nothing
+  uint off;              // offset of its dirent in the directory
+  struct dentry *hnext;  // hash chain
+  struct dentry *prev;   // LRU list
+  struct dentry *next;
+};
+
+static struct {
+  struct spinlock lock;
+  struct dentry ent[NDENTRY];
+  struct dentry *hash[NDHASH];
+  // All entries, through prev/next. mru is the most recently
+  // used, lru the least.
+  struct dentry *mru;
+  struct dentry *lru;
+} dcache;
+
+static struct dentry **dhash(uint dev, uint dinum, char *name) {
+  uint h = dev * 31 + dinum;
+
+  for (int i = 0; i < DIRSIZ && name[i]; i++) h = h * 31 + name[i];
+  return &dcache.hash[h % NDHASH];
+}
+
+static void lruremove(struct dentry *d) {
+  if (d->prev)
+    d->prev->next = d->next;
+  else
+    dcache.mru = d->next;
+  if (d->next)
+    d->next->prev = d->prev;
+  else
+    dcache.lru = d->prev;
+}
+
+static void lrupush(struct dentry *d) {
+  d->prev = 0;
+  d->next = dcache.mru;
+  if (dcache.mru)
+    dcache.mru->prev = d;
+  else
+    dcache.lru = d;
+  dcache.mru = d;
+}
+
+// Move d to the least recently used end, to be reused first.
+static void lrupushback(struct dentry *d) {
+  d->next = 0;
+  d->prev = dcache.lru;
+  if (dcache.lru)
+    dcache.lru->next = d;
+  else
+    dcache.mru = d;
+  dcache.lru = d;
+}
+
+static void unhash(struct dentry *d) {
+  struct dentry **pp = dhash(d->dev, d->dinum, d->name);
+
+  while (*pp != d) pp = &(*pp)->hnext;
+  *pp = d->hnext;
+  d->dinum = 0;
+}
+
+void dcacheinit(void) {
+  initlock(&dcache.lock, "dcache");
+  for (int i = 0; i < NDENTRY; i++) lrupush(&dcache.ent[i]);
+}
+
+// Find the entry for name in dp. Caller must hold dcache.lock.
+static struct dentry *find(struct inode *dp, char *name) {
+  struct dentry *d = *dhash(dp->dev, dp->inum, name);
+
+  for (; d; d = d->hnext)
+    if (d->dev == dp->dev && d->dinum == dp->inum &&
+        namecmp(d->name, name) == 0)
+      return d;
+  return 0;
+}
+
+// Look name up in dp's cached entries. Returns 1 and sets *pinum,
+// and *poff if there is a dirent, if the entry is cached, or 0.
+// Caller must hold dp->lock.
+int dcache_lookup(struct inode *dp, char *name, uint *pinum, uint *poff) {
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  if ((d = find(dp, name)) == 0) {
+    release(&dcache.lock);
+    return 0;
+  }
+  *pinum = d->inum;
+  if (poff) *poff = d->off;
+  lruremove(d);
+  lrupush(d);
+  release(&dcache.lock);
+  return 1;
+}
+
+// Record that name in dp names inode inum, whose dirent is at
+// off, or that it names nothing if inum is 0.
+// Caller must hold dp->lock, exclusively unless the entry only
+// records what the directory already says.
+void dcache_enter(struct inode *dp, char *name, uint inum, uint off) {
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  if ((d = find(dp, name)) == 0) {
+    d = dcache.lru;
+    if (d->dinum) unhash(d);
+    d->dev = dp->dev;
+    d->dinum = dp->inum;
+    strncpy(d->name, name, DIRSIZ);
+    struct dentry **h = dhash(d->dev, d->dinum, d->name);
+    d->hnext = *h;
+    *h = d;
+  }
+  d->inum = inum;
+  d->off = off;
+  lruremove(d);
+  lrupush(d);
+  release(&dcache.lock);
+}
+
+// Forget the entries of directory inode dinum on dev, which is
+// being freed.
+void dcache_purge(uint dev, uint dinum) {
+  acquire(&dcache.lock);
+  for (int i = 0; i < NDENTRY; i++) {
+    struct dentry *d = &dcache.ent[i];
+    if (d->dinum == dinum && d->dev == dev) {
+      unhash(d);
+      lruremove(d);
+      lrupushback(d);
+    }
+  }
+  release(&dcache.lock);
+}
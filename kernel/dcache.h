@@ -0,0 +1,11 @@
+#pragma once
+
+#include "types.h"
+
+struct inode;
+
+// dcache.c APIs
+void dcacheinit(void);
+int dcache_lookup(struct inode *, char *, uint *, uint *);
+void dcache_enter(struct inode *, char *, uint, uint);
+void dcache_purge(uint, uint);
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "types.h"
+
+// diskstat() operations
+#define DISKSTAT_GET 0    // copy out the statistics
+#define DISKSTAT_RESET 1  // zero them
+#define DISKSTAT_POLL 2   // set the polling budget, in microseconds
+
+// Latency histograms have NLAT buckets; bucket i counts what
+// took from 2^i up to 2^(i+1) microseconds, bucket 0 anything
+// quicker and bucket NLAT-1 anything slower.
+#define NLAT 20
+
+// Statistics for the virtio disk, from diskstat(). Times are in
+// cycles of the time CSR.
+struct diskstat {
+  uint64 nreq;         // requests started
+  uint64 nwrite;       // of those, writes
+  uint64 rblocks;      // blocks read
+  uint64 wblocks;      // blocks written
+  uint64 inflight;     // requests at the device now
+  uint64 maxinflight;  // most requests at one queue's device at once
+  uint64 nintr;        // completion interrupts
+  uint64 npoll;        // synchronous requests that polled
+  uint64 nhit;         // of those, finished within the budget
+  uint64 pollwait;     // total time spent polling
+  uint64 lat[NLAT];    // requests by time from start to completion
+  int pollus;          // polling budget; 0 means sleep at once
+  int nqueue;          // virtqueues in use
+};
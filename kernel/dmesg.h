@@ -0,0 +1,18 @@
+#pragma once
+
+#include "types.h"
+
+// A kernel log record, as dmesg() copies it out: this header,
+// len bytes of text, then padding to a multiple of 8 bytes. Each
+// printf() makes one record, so a line may take several.
+struct klogrec {
+  uint64 time;  // time CSR when the printf() began
+  ushort len;   // bytes of text
+  uchar cpu;    // hart that printed it
+  uchar flags;  // KLOG_*
+  uint pad;
+};
+
+#define KLOG_PRINTED 1  // written to the console at once, not by klogd
+
+#define KLOGRECSIZE(len) ((sizeof(struct klogrec) + (len) + 7) & ~7UL)
@@ -1,8 +1,11 @@
 #include "exec.h"
 
 #include "elf.h"
+#include "fcntl.h"
+#include "file.h"
 #include "fs.h"
 #include "log.h"
+#include "memlayout.h"
 #include "param.h"
 #include "printf.h"
 #include "proc.h"
@@ -11,28 +14,42 @@
 #include "types.h"
 #include "vm.h"
 
-static int loadseg(pde_t *, uint64, struct inode *, uint, uint);
-
-// map ELF permissions to PTE permission bits.
-int flags2perm(int flags) {
-  int perm = 0;
-  if (flags & 0x1) perm = PTE_X;
-  if (flags & 0x2) perm |= PTE_W;
-  return perm;
+// map ELF permissions to VMA protection bits.
+int flags2prot(int flags) {
+  int prot = PROT_READ;
+  if (flags & 0x1) prot |= PROT_EXEC;
+  if (flags & 0x2) prot |= PROT_WRITE;
+  return prot;
 }
 
 //
 // the implementation of the exec() system call
 //
 int kexec(char *path, char **argv) {
+  struct proc *p = myproc();
+
+  // the other threads would be left running the old image.
+  if (p != p->leader || p->threads) return -1;
+  return kexecproc(p, path, argv);
+}
+
+// Replace p's user image with the program at path, called either
+// by p itself or, for spawn(), on a new process that has not run.
+// Program segments are not read in here: each becomes a private
+// file-backed VMA, and vmfault() pages it in from the executable
+// on first touch, mapping the page cache's copy of text and other
+// pages it has not written.
+int kexecproc(struct proc *p, char *path, char **argv) {
   char *s, *last;
   int i, off;
   uint64 argc, sz = 0, sp, ustack[MAXARG], stackbase;
   struct elfhdr elf;
   struct inode *ip;
   struct proghdr ph;
+  struct vmatree segs = {0};
+  struct vma *v;
+  struct file *f = 0;
   pagetable_t pagetable = 0, oldpagetable;
-  struct proc *p = myproc();
 
   begin_op();
 
@@ -51,25 +68,41 @@ int kexec(char *path, char **argv) {
 
   if ((pagetable = proc_pagetable(p)) == 0) goto bad;
 
-  // Load program into memory.
+  // An open file for the segments to page in from.
+  if ((f = filealloc()) == 0) goto bad;
+  f->type = FD_INODE;
+  f->readable = 1;
+  f->writable = 0;
+  f->off = 0;
+  f->ip = idup(ip);
+
+  // Record the program's segments.
   for (i = 0, off = elf.phoff; i < elf.phnum; i++, off += sizeof(ph)) {
     if (readi(ip, 0, (uint64)&ph, off, sizeof(ph)) != sizeof(ph)) goto bad;
     if (ph.type != ELF_PROG_LOAD) continue;
     if (ph.memsz < ph.filesz) goto bad;
     if (ph.vaddr + ph.memsz < ph.vaddr) goto bad;
     if (ph.vaddr % PGSIZE != 0) goto bad;
-    uint64 sz1;
-    if ((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz,
-                        flags2perm(ph.flags))) == 0)
-      goto bad;
-    sz = sz1;
-    if (loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0) goto bad;
+    if (ph.vaddr + ph.memsz > UTOP) goto bad;
+    if (ph.memsz == 0) continue;
+    if ((v = vma_alloc()) == 0) goto bad;
+    v->addr = ph.vaddr;
+    v->len = ph.memsz;
+    v->prot = flags2prot(ph.flags);
+    v->flags = MAP_PRIVATE;
+    v->offset = ph.off;
+    v->filesz = ph.filesz;
+    if (vma_insert(&segs, v) < 0) {
+      vma_free(v);
+      goto bad;  // overlapping segments
+    }
+    v->file = filedup(f);
+    if (ph.vaddr + ph.memsz > sz) sz = ph.vaddr + ph.memsz;
   }
   iunlockput(ip);
   end_op();
   ip = 0;
 
-  p = myproc();
   uint64 oldsz = p->sz;
 
   // Allocate some pages at the next page boundary.
@@ -116,12 +149,17 @@ int kexec(char *path, char **argv) {
   safestrcpy(p->name, last, sizeof(p->name));
 
   // Commit to the user image.
+  proc_freevmas(p);
+  p->vmas = segs;
+  fileclose(f);  // the segments hold their own references
   oldpagetable = p->pagetable;
   p->pagetable = pagetable;
+  p->tlbstale = ~0UL;  // entries of the old one carry the same ASID
   p->sz = sz;
   p->trapframe->epc = elf.entry;  // initial program counter = ulib.c:start()
   p->trapframe->sp = sp;          // initial stack pointer
   proc_freepagetable(oldpagetable, oldsz);
+  ringfree(p);
 
   return argc;  // this ends up in a0, the first argument to main(argc, argv)
 
@@ -131,27 +169,10 @@ bad:
     iunlockput(ip);
     end_op();
   }
-  return -1;
-}
-
-// Load an ELF program segment into pagetable at virtual address va.
-// va must be page-aligned
-// and the pages from va to va+sz must already be mapped.
-// Returns 0 on success, -1 on failure.
-static int loadseg(pagetable_t pagetable, uint64 va, struct inode *ip,
-                   uint offset, uint sz) {
-  uint i, n;
-  uint64 pa;
-
-  for (i = 0; i < sz; i += PGSIZE) {
-    pa = walkaddr(pagetable, va + i);
-    if (pa == 0) panic("loadseg: address should exist");
-    if (sz - i < PGSIZE)
-      n = sz - i;
-    else
-      n = PGSIZE;
-    if (readi(ip, 0, (uint64)pa, offset + i, n) != n) return -1;
+  while ((v = vma_find(&segs, 0)) != 0) {
+    vma_remove(&segs, v);
+    vma_put(v);
   }
-
-  return 0;
+  if (f) fileclose(f);
+  return -1;
 }
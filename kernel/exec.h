@@ -1,3 +1,6 @@
 #pragma once
 
+struct proc;
+
 int kexec(char *path, char **argv);
+int kexecproc(struct proc *p, char *path, char **argv);
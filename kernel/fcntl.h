@@ -5,6 +5,7 @@
 #define O_RDWR 0x002
 #define O_CREATE 0x200
 #define O_TRUNC 0x400
+#define O_DIRECT 0x800  // aligned I/O goes straight to user memory
 
 // mmap prot flags
 #define PROT_NONE 0x0
@@ -14,4 +15,25 @@
 
 // mmap flags
 #define MAP_SHARED 0x01
-#define MAP_PRIVATE 0x02
\ No newline at end of file
+#define MAP_PRIVATE 0x02
+#define MAP_ANONYMOUS 0x04  // zero-filled memory, no file
+#define MAP_HUGE 0x08       // back aligned 2MB ranges with superpages
+
+// madvise advice
+#define MADV_NORMAL 0      // adapt fault-around to the access pattern
+#define MADV_RANDOM 1      // fault in one page at a time
+#define MADV_SEQUENTIAL 2  // always fault around as far as possible
+#define MADV_WILLNEED 3    // read the range in now
+#define MADV_DONTNEED 4    // drop the range's pages
+
+// msync flags; both write back before returning
+#define MS_ASYNC 0x1
+#define MS_SYNC 0x4
+
+// fcntl commands
+#define F_GETPIPE_SZ 1  // size of a pipe's buffer
+#define F_SETPIPE_SZ 2  // make it at least arg bytes; returns the size
+
+// futex operations
+#define FUTEX_WAIT 0  // sleep if the word still holds val
+#define FUTEX_WAKE 1  // wake up to val sleepers
@@ -5,37 +5,49 @@
 #include "file.h"
 
 #include "fs.h"
+#include "kalloc.h"
 #include "log.h"
+#include "pagecache.h"
 #include "param.h"
 #include "pipe.h"
+#include "poll.h"
 #include "printf.h"
 #include "proc.h"
+#include "riscv.h"
+#include "slab.h"
 #include "spinlock.h"
 #include "stat.h"
+#include "string.h"
+#include "trap.h"
 #include "types.h"
+#include "uio.h"
+#include "writeback.h"
 
 struct devsw devsw[NDEV];
+
+// Open files come from a slab cache; ftable.lock protects their
+// reference counts.
 struct {
   struct spinlock lock;
-  struct file file[NFILE];
+  struct kmem_cache *cache;
 } ftable;
 
-void fileinit(void) { initlock(&ftable.lock, "ftable"); }
+static void filector(void *obj) { memset(obj, 0, sizeof(struct file)); }
+
+void fileinit(void) {
+  initmcslock(&ftable.lock, "ftable");
+  ftable.cache = kmem_cache_create("file", sizeof(struct file), filector, 0,
+                                   SLAB_HWCACHE_ALIGN);
+  if (ftable.cache == 0) panic("fileinit");
+}
 
 // Allocate a file structure.
 struct file *filealloc(void) {
   struct file *f;
 
-  acquire(&ftable.lock);
-  for (f = ftable.file; f < ftable.file + NFILE; f++) {
-    if (f->ref == 0) {
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
-  }
-  release(&ftable.lock);
-  return 0;
+  if ((f = kmem_cache_alloc(ftable.cache)) == 0) return 0;
+  f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
@@ -58,12 +70,13 @@ void fileclose(struct file *f) {
     return;
   }
   ff = *f;
-  f->ref = 0;
-  f->type = FD_NONE;
   release(&ftable.lock);
+  kmem_cache_free(ftable.cache, f);
 
   if (ff.type == FD_PIPE) {
     pipeclose(ff.pipe, ff.writable);
+  } else if (ff.type == FD_MEM) {
+    anon_put(ff.anon);
   } else if (ff.type == FD_INODE || ff.type == FD_DEVICE) {
     begin_op();
     iput(ff.ip);
@@ -71,6 +84,57 @@ void fileclose(struct file *f) {
   }
 }
 
+// Descriptor tables. A process starts with its ofile0 and
+// moves to a kmalloc()ed table twice the size whenever it needs
+// more, up to NOFILEMAX descriptors. fdused has a bit for each
+// descriptor in use, so the lowest free one is found a word at
+// a time. The caller holds p->fdlock, unless p is not running.
+
+// Make room in p's table for n descriptors.
+// Returns -1 if that is too many or memory is short.
+int fdgrow(struct proc *p, int n) {
+  struct file **t;
+  int size = p->nofile;
+
+  if (n <= size) return 0;
+  if (n > NOFILEMAX) return -1;
+  while (size < n) size *= 2;
+  if ((t = kmalloc(size * sizeof(*t))) == 0) return -1;
+  memset(t, 0, size * sizeof(*t));
+  memmove(t, p->ofile, p->nofile * sizeof(*t));
+  if (p->ofile != p->ofile0) kfree_sized(p->ofile, p->nofile * sizeof(*t));
+  p->ofile = t;
+  p->nofile = size;
+  return 0;
+}
+
+// Set p's descriptor fd, which its table has room for, to f,
+// or mark it free if f is 0.
+void fdset(struct proc *p, int fd, struct file *f) {
+  p->ofile[fd] = f;
+  if (f)
+    p->fdused[fd / 64] |= 1UL << (fd % 64);
+  else
+    p->fdused[fd / 64] &= ~(1UL << (fd % 64));
+}
+
+// The lowest descriptor p has free, maybe past its table's end,
+// or -1 if it has NOFILEMAX open.
+int fdfirstfree(struct proc *p) {
+  for (int w = 0; w < NOFILEMAX / 64; w++)
+    if (~p->fdused[w]) return w * 64 + __builtin_ctzl(~p->fdused[w]);
+  return -1;
+}
+
+// Free the grown table of p, whose descriptors are all closed,
+// and go back to ofile0.
+void fdfree(struct proc *p) {
+  if (p->ofile && p->ofile != p->ofile0)
+    kfree_sized(p->ofile, p->nofile * sizeof(struct file *));
+  p->ofile = p->ofile0;
+  p->nofile = NOFILE;
+}
+
 // Get metadata about file f.
 // addr is a user virtual address, pointing to a struct stat.
 int filestat(struct file *f, uint64 addr) {
@@ -78,77 +142,305 @@ int filestat(struct file *f, uint64 addr) {
   struct stat st;
 
   if (f->type == FD_INODE || f->type == FD_DEVICE) {
-    ilock(f->ip);
+    ilockread(f->ip);
     stati(f->ip, &st);
-    iunlock(f->ip);
+    iunlockread(f->ip);
     if (copyout(p->pagetable, addr, (char *)&st, sizeof(st)) < 0) return -1;
     return 0;
   }
   return -1;
 }
 
-// Read from file f.
-// addr is a user virtual address.
-int fileread(struct file *f, uint64 addr, int n) {
-  int r = 0;
+// Read from file f into the cnt buffers of iov, user addresses
+// if user_dst is set and otherwise kernel ones, in order until
+// one comes up short. A file is read at *off, which is advanced,
+// under one hold of its lock.
+static int filereadv1(struct file *f, int user_dst, struct iovec *iov,
+                      int cnt, uint *off) {
+  int r = 0, tot = 0;
 
   if (f->readable == 0) return -1;
 
-  if (f->type == FD_PIPE) {
-    r = piperead(f->pipe, addr, n);
-  } else if (f->type == FD_DEVICE) {
-    if (f->major < 0 || f->major >= NDEV || !devsw[f->major].read) return -1;
-    r = devsw[f->major].read(1, addr, n);
-  } else if (f->type == FD_INODE) {
-    ilock(f->ip);
-    if ((r = readi(f->ip, 1, addr, f->off, n)) > 0) f->off += r;
-    iunlock(f->ip);
-  } else {
-    panic("fileread");
+  if (f->type == FD_INODE) ilock(f->ip);
+  for (int i = 0; i < cnt; i++) {
+    uint64 addr = (uint64)iov[i].iov_base;
+    int n = iov[i].iov_len;
+
+    // only the first buffer waits for a pipe or device.
+    if (f->type == FD_PIPE) {
+      if (i > 0 && pipeavail(f->pipe) == 0) break;
+      r = piperead(f->pipe, user_dst, addr, n);
+    } else if (f->type == FD_DEVICE) {
+      if (i > 0) break;
+      if (f->major < 0 || f->major >= NDEV || !devsw[f->major].read) {
+        r = -1;
+      } else {
+        r = devsw[f->major].read(user_dst, addr, n);
+      }
+    } else if (f->type == FD_INODE) {
+      if (f->direct && user_dst)
+        r = readdirect(f->ip, addr, *off, n);
+      else
+        r = readi(f->ip, user_dst, addr, *off, n);
+      if (r > 0) *off += r;
+    } else if (f->type == FD_MEM) {
+      r = anon_rw(f->anon, 0, user_dst, addr, *off, n);
+      if (r > 0) *off += r;
+    } else {
+      panic("fileread");
+    }
+    if (r < 0) {
+      if (tot == 0) tot = -1;
+      break;
+    }
+    tot += r;
+    if (r < n) break;
   }
+  if (f->type == FD_INODE) iunlock(f->ip);
 
-  return r;
+  return tot;
 }
 
-// Write to file f.
-// addr is a user virtual address.
-int filewrite(struct file *f, uint64 addr, int n) {
-  int r, ret = 0;
+// Write the cnt buffers of iov to file f, user addresses if
+// user_src is set and otherwise kernel ones. A file is written
+// at *off, which is advanced, with as many of the buffers as
+// fit in each log transaction.
+static int filewritev1(struct file *f, int user_src, struct iovec *iov,
+                       int cnt, uint *off) {
+  int r, tot = 0, want = 0;
 
   if (f->writable == 0) return -1;
+  for (int i = 0; i < cnt; i++) want += iov[i].iov_len;
 
-  if (f->type == FD_PIPE) {
-    ret = pipewrite(f->pipe, addr, n);
-  } else if (f->type == FD_DEVICE) {
-    if (f->major < 0 || f->major >= NDEV || !devsw[f->major].write) return -1;
-    ret = devsw[f->major].write(1, addr, n);
+  if (f->type == FD_PIPE || f->type == FD_DEVICE) {
+    for (int i = 0; i < cnt; i++) {
+      uint64 addr = (uint64)iov[i].iov_base;
+      int n = iov[i].iov_len;
+      if (f->type == FD_PIPE) {
+        r = pipewrite(f->pipe, user_src, addr, n);
+      } else if (f->major < 0 || f->major >= NDEV || !devsw[f->major].write) {
+        return -1;
+      } else {
+        r = devsw[f->major].write(user_src, addr, n);
+      }
+      if (r < 0) return tot > 0 ? tot : -1;
+      tot += r;
+      if (r < n) break;
+    }
   } else if (f->type == FD_INODE) {
     // write a few blocks at a time to avoid exceeding
     // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
-    int max = ((MAXOPBLOCKS - 1 - 1 - 2) / 2) * BSIZE;
-    int i = 0;
-    while (i < n) {
-      int n1 = n - i;
-      if (n1 > max) n1 = max;
-
+    // i-node, the indirect blocks of two trees' paths,
+    // 2 allocation blocks, and 1 block of slop for
+    // non-aligned writes.
+    int max = (MAXOPBLOCKS - 1 - 2 * NLEVEL - 2 - 1) * BSIZE;
+    int i = 0, done = 0, err = 0;
+    while (i < cnt && !err) {
+      wbthrottle(f->ip);
       begin_op();
       ilock(f->ip);
-      if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0) f->off += r;
+      for (int room = writeroom(f->ip, *off, max); i < cnt && room > 0;) {
+        int n1 = iov[i].iov_len - done;
+        if (n1 > room) n1 = room;
+        uint64 addr = (uint64)iov[i].iov_base + done;
+        if (f->direct && user_src)
+          r = writedirect(f->ip, addr, *off, n1);
+        else
+          r = writei(f->ip, user_src, addr, *off, n1);
+        if (r > 0) {
+          *off += r;
+          tot += r;
+          done += r;
+          room -= r;
+        }
+        if (r != n1) {
+          // error from writei
+          err = 1;
+          break;
+        }
+        if (done == iov[i].iov_len) {
+          i++;
+          done = 0;
+        }
+      }
       iunlock(f->ip);
       end_op();
-
-      if (r != n1) {
-        // error from writei
-        break;
-      }
-      i += r;
     }
-    ret = (i == n ? n : -1);
+    tot = (tot == want ? want : -1);
+  } else if (f->type == FD_MEM) {
+    for (int i = 0; i < cnt; i++) {
+      int n = iov[i].iov_len;
+      r = anon_rw(f->anon, 1, user_src, (uint64)iov[i].iov_base, *off, n);
+      if (r < 0) return tot > 0 ? tot : -1;
+      *off += r;
+      tot += r;
+      if (r < n) break;
+    }
   } else {
     panic("filewrite");
   }
 
-  return ret;
+  return tot;
+}
+
+static int fileread1(struct file *f, int user_dst, uint64 addr, int n) {
+  struct iovec v = {(void *)addr, n};
+  return filereadv1(f, user_dst, &v, 1, &f->off);
+}
+
+static int filewrite1(struct file *f, int user_src, uint64 addr, int n) {
+  struct iovec v = {(void *)addr, n};
+  return filewritev1(f, user_src, &v, 1, &f->off);
+}
+
+// Read from file f.
+// addr is a user virtual address.
+int fileread(struct file *f, uint64 addr, int n) {
+  return fileread1(f, 1, addr, n);
+}
+
+// Write to file f.
+// addr is a user virtual address.
+int filewrite(struct file *f, uint64 addr, int n) {
+  return filewrite1(f, 1, addr, n);
+}
+
+// Read from file f into the cnt user buffers in iov, at *off if
+// off is not 0 and otherwise at f's offset.
+int filereadv(struct file *f, struct iovec *iov, int cnt, uint *off) {
+  return filereadv1(f, 1, iov, cnt, off ? off : &f->off);
+}
+
+// Write the cnt user buffers in iov to file f, at *off if off is
+// not 0 and otherwise at f's offset.
+int filewritev(struct file *f, struct iovec *iov, int cnt, uint *off) {
+  return filewritev1(f, 1, iov, cnt, off ? off : &f->off);
+}
+
+// Copy up to n bytes from in to out without passing them through
+// user memory, for sendfile() and splice(). A file is read at *off,
+// which is advanced, straight from its cached pages; anything else
+// a page at a time into a kernel buffer, stopping once a read
+// comes up short. Returns the number of bytes copied, or -1 if an
+// error came before any were.
+int filesplice(struct file *out, struct file *in, uint *off, int n) {
+  char *buf = 0;
+  int tot = 0;
+
+  if (in->readable == 0 || out->writable == 0 || n < 0) return -1;
+
+  while (tot < n) {
+    int want = n - tot < PGSIZE ? n - tot : PGSIZE, m = want;
+    uint64 pa = 0, src = 0;
+
+    if (in->type == FD_INODE) {
+      struct inode *ip = in->ip;
+      ilockread(ip);
+      if (*off >= ip->size) m = 0;
+      if (m > ip->size - *off) m = ip->size - *off;
+      if (m > PGSIZE - *off % PGSIZE) m = PGSIZE - *off % PGSIZE;
+      if (m > 0 && ip->type == T_FILE) pa = pagecache_get(ip, *off / PGSIZE);
+      if (pa) {
+        src = pa + *off % PGSIZE;
+      } else if (m > 0 && (buf || (buf = kalloc())) &&
+                 readi(ip, 0, (uint64)buf, *off, m) == m) {
+        src = (uint64)buf;
+      } else if (m > 0) {
+        m = -1;
+      }
+      iunlockread(ip);
+    } else if (buf || (buf = kalloc())) {
+      src = (uint64)buf;
+      m = fileread1(in, 0, src, want);
+    } else {
+      m = -1;
+    }
+
+    // write with in unlocked: out may be a pipe that fills.
+    int w = m > 0 ? filewrite1(out, 0, src, m) : m;
+    if (pa) kfree((void *)pa);
+    if (w <= 0) {
+      if (w < 0 && tot == 0) tot = -1;
+      break;
+    }
+    if (in->type == FD_INODE) *off += m;
+    tot += m;
+    if (in->type != FD_INODE && m < want) break;
+  }
+
+  if (buf) kfree(buf);
+  return tot;
+}
+
+// poll() sleeps on ticks, so that pause()'s deadlines wake it as
+// well; pollseq counts the changes files have made for it since
+// boot, so that one made while it looked is not slept through.
+// A pipe or device calls pollwakeup() on a change only while a
+// poll() watches it, having said so through filepoll().
+static uint pollseq;
+
+// Wake up poll()s, for a file one of them may watch has changed.
+void pollwakeup(void) {
+  acquire(&tickslock);
+  pollseq++;
+  wakeup(&ticks);
+  release(&tickslock);
+}
+
+// What is ready of f, as poll() events; and add arm, 1 or -1 or
+// 0, to the poll()s watching it. Files and memfds are always
+// ready.
+int filepoll(struct file *f, int arm) {
+  if (f->type == FD_PIPE) return pipepoll(f->pipe, f->writable, arm);
+  if (f->type == FD_DEVICE && f->major >= 0 && f->major < NDEV &&
+      devsw[f->major].poll)
+    return devsw[f->major].poll(arm);
+  return (f->readable ? POLLIN : 0) | (f->writable ? POLLOUT : 0);
+}
+
+// Wait until one of the n files fs, for pfds, has an event pfds
+// asks for, or has an error, and set each revents; for at most
+// timeout ticks unless timeout is -1. A file is 0 if its fd is
+// not open. Returns how many have events, or -1 if killed.
+int kpoll(struct pollfd *pfds, struct file **fs, int n, int timeout) {
+  int ready = 0;
+  uint t0, seq;
+
+  for (int i = 0; i < n; i++)
+    if (fs[i]) filepoll(fs[i], 1);
+  acquire(&tickslock);
+  t0 = ticks;
+  for (;;) {
+    seq = pollseq;
+    release(&tickslock);
+
+    ready = 0;
+    for (int i = 0; i < n; i++) {
+      if (fs[i] == 0) {
+        pfds[i].revents = pfds[i].fd < 0 ? 0 : POLLNVAL;
+      } else {
+        int ev = filepoll(fs[i], 0);
+        pfds[i].revents = ev & (pfds[i].events | POLLERR | POLLHUP);
+      }
+      if (pfds[i].revents) ready++;
+    }
+
+    acquire(&tickslock);
+    tickupdate();
+    if (ready > 0 || timeout == 0 ||
+        (timeout > 0 && ticks - t0 >= timeout))
+      break;
+    if (killed(myproc())) {
+      ready = -1;
+      break;
+    }
+    if (pollseq == seq) {
+      if (timeout > 0) tickwakeat(t0 + timeout);
+      sleep(&ticks, &tickslock);
+    }
+  }
+  release(&tickslock);
+  for (int i = 0; i < n; i++)
+    if (fs[i]) filepoll(fs[i], -1);
+  return ready;
 }
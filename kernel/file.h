@@ -5,14 +5,23 @@
 #include "types.h"
 #include "vm.h"
 
+struct anon;
+struct cpage;
+struct iovec;
+struct pollfd;
+struct proc;
+struct sqe;
+
 struct file {
-  enum { FD_NONE, FD_PIPE, FD_INODE, FD_DEVICE } type;
+  enum { FD_NONE, FD_PIPE, FD_INODE, FD_DEVICE, FD_MEM } type;
   int ref;  // reference count
   char readable;
   char writable;
   struct pipe *pipe;  // FD_PIPE
   struct inode *ip;   // FD_INODE and FD_DEVICE
-  uint off;           // FD_INODE
+  struct anon *anon;  // FD_MEM
+  uint off;           // FD_INODE and FD_MEM
+  char direct;        // FD_INODE of a file opened O_DIRECT
   short major;        // FD_DEVICE
 };
 
@@ -25,21 +34,39 @@ struct inode {
   uint dev;               // Device number
   uint inum;              // Inode number
   int ref;                // Reference count
+  struct inode *hnext;    // hash chain in itable
+  struct inode *prev;     // itable's LRU list, while ref is 0
+  struct inode *next;
+  struct inode *wbnext;   // writeback list (writeback.c)
+  int wbq;                // on it, holding a reference
+  uint dirtied;           // ticks when it joined it
   struct sleeplock lock;  // protects everything below here
   int valid;              // inode has been read from disk?
+  struct cpage *pages;    // cached pages of shared mappings (pagecache.c)
+  uint ranext;            // block a sequential readi() starts at next
+  uint raend;             // blocks before it are read ahead already
+  uint dstart;            // first block with only cached data, if ndelay
+  uint ndelay;            // blocks from dstart on with no disk block yet
 
   short type;  // copy of disk inode
   short major;
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT + 1];
+  union {
+    struct {
+      struct extent ext[NEXTENT];
+      uint addrs[NLEVEL];
+    };
+    char data[INLINESIZE];
+  };
 };
 
 // map major device number to device functions.
 struct devsw {
   int (*read)(int, uint64, int);
   int (*write)(int, uint64, int);
+  int (*poll)(int);  // see filepoll(); 0 if always ready
 };
 
 extern struct devsw devsw[];
@@ -47,10 +74,24 @@ extern struct devsw devsw[];
 #define CONSOLE 1
 
 // file.c APIs
+int fdfirstfree(struct proc *);
+void fdfree(struct proc *);
+int fdgrow(struct proc *, int);
+void fdset(struct proc *, int, struct file *);
 struct file *filealloc(void);
 void fileclose(struct file *);
 struct file *filedup(struct file *);
 void fileinit(void);
 int fileread(struct file *, uint64, int n);
+int filereadv(struct file *, struct iovec *, int, uint *);
+int filesplice(struct file *, struct file *, uint *, int);
 int filestat(struct file *, uint64 addr);
 int filewrite(struct file *, uint64, int n);
+int filewritev(struct file *, struct iovec *, int, uint *);
+int filepoll(struct file *, int);
+int kpoll(struct pollfd *, struct file **, int, int);
+void pollwakeup(void);
+int ringop(struct sqe *);
+uint64 kringsetup(int);
+int kringenter(int, int);
+void ringfree(struct proc *);
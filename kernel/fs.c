@@ -13,16 +13,26 @@
 
 #include "bio.h"
 #include "buf.h"
+#include "dcache.h"
 #include "file.h"
+#include "kalloc.h"
 #include "log.h"
+#include "pagecache.h"
 #include "param.h"
 #include "printf.h"
 #include "proc.h"
+#include "riscv.h"
 #include "sleeplock.h"
+#include "slab.h"
 #include "spinlock.h"
 #include "stat.h"
 #include "string.h"
+#include "swap.h"
 #include "types.h"
+#include "virtio.h"
+#include "virtio_disk.h"
+#include "vm.h"
+#include "writeback.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 // there should be one superblock per disk device, but we run with
@@ -38,19 +48,25 @@ static void readsb(int dev, struct superblock *sb) {
   brelse(bp);
 }
 
+static void freemapinit(int dev);
+
 // Init fs
 void fsinit(int dev) {
   readsb(dev, &sb);
   if (sb.magic != FSMAGIC) panic("invalid file system");
+  if (sb.bsize != BSIZE) panic("fs: wrong block size");
   initlog(dev, &sb);
+  freemapinit(dev);
+  swapinit();
   ireclaim(dev);
+  wbinit();
 }
 
 // Zero a block.
 static void bzero(int dev, int bno) {
   struct buf *bp;
 
-  bp = bread(dev, bno);
+  bp = bclaim(dev, bno);
   memset(bp->data, 0, BSIZE);
   log_write(bp);
   brelse(bp);
@@ -58,31 +74,144 @@ static void bzero(int dev, int bno) {
 
 // Blocks.
 
-// Allocate a zeroed disk block.
-// returns 0 if out of disk space.
-static uint balloc(uint dev) {
-  int b, bi, m;
+// The allocator keeps a count of the free blocks each bitmap
+// block describes, to skip full ones without reading them, and
+// searches on from where it last allocated. The counts are
+// hints: they are updated after the bitmap is, under freemap.lock
+// rather than the bitmap block's lock.
+//
+// Blocks reserved for delayed file data (see writei()) count as
+// free in the bitmap, but only placing that data may take them.
+static struct {
+  struct spinlock lock;
+  uint *nfree;    // free blocks per bitmap block
+  uint nbmap;     // bitmap blocks
+  uint hint;      // block to search from next
+  uint free;      // free blocks in all
+  uint reserved;  // of those, ones delayed data will need
+} freemap;
+
+static void freemapinit(int dev) {
+  initlock(&freemap.lock, "freemap");
+  freemap.nbmap = (sb.size + BPB - 1) / BPB;
+  if (freemap.nbmap * sizeof(uint) > PGSIZE) panic("freemapinit: too big");
+  if ((freemap.nfree = kmalloc(freemap.nbmap * sizeof(uint))) == 0)
+    panic("freemapinit");
+  for (uint bb = 0; bb < freemap.nbmap; bb++) {
+    struct buf *bp = bread(dev, bb + sb.bmapstart);
+    uint n = 0;
+    for (uint b = bb * BPB; b < sb.size && b < (bb + 1) * BPB; b++)
+      if ((bp->data[(b % BPB) / 8] & (1 << (b % 8))) == 0) n++;
+    brelse(bp);
+    freemap.nfree[bb] = n;
+    freemap.free += n;
+  }
+}
+
+// Count block b freed, or allocated if delta is -1.
+static void freemapcount(uint b, int delta) {
+  acquire(&freemap.lock);
+  freemap.nfree[b / BPB] += delta;
+  freemap.free += delta;
+  release(&freemap.lock);
+}
+
+// Whether a block may be allocated: any free one if res is set,
+// for delayed data being placed, else one not reserved for it.
+static int bavail(int res) {
+  acquire(&freemap.lock);
+  int ok = freemap.free > (res ? 0 : freemap.reserved);
+  release(&freemap.lock);
+  return ok;
+}
+
+// Find and mark in use the first block of a run of n free
+// blocks in bitmap block bb, at or after block from.
+// returns 0 if there is none.
+static uint bfindrun(uint dev, uint bb, uint from, uint n) {
   struct buf *bp;
+  uint b, end, run = 0;
+
+  bp = bread(dev, bb + sb.bmapstart);
+  end = min(sb.size, (bb + 1) * BPB);
+  for (b = from; b < end; b++) {
+    uint bi = b % BPB;
+    if (bp->data[bi / 8] & (1 << (bi % 8))) {  // Is block in use?
+      run = 0;
+      continue;
+    }
+    if (++run == n) {
+      b -= n - 1;
+      bi = b % BPB;
+      bp->data[bi / 8] |= 1 << (bi % 8);  // Mark block in use.
+      log_write(bp);
+      brelse(bp);
+      return b;
+    }
+  }
+  brelse(bp);
+  return 0;
+}
 
-  bp = 0;
-  for (b = 0; b < sb.size; b += BPB) {
-    bp = bread(dev, BBLOCK(b, sb));
-    for (bi = 0; bi < BPB && b + bi < sb.size; bi++) {
-      m = 1 << (bi % 8);
-      if ((bp->data[bi / 8] & m) == 0) {  // Is block free?
-        bp->data[bi / 8] |= m;            // Mark block in use.
-        log_write(bp);
-        brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
+// Allocate a disk block, zeroed if zero is set, the first of a
+// run of want free blocks if there is one, else of the longest
+// run up to want there is. A run leaves the file room to grow
+// contiguously: the search goes on after it next time. res says
+// whether the block may be a reserved one, as for bavail().
+// returns 0 if out of disk space.
+static uint balloc(uint dev, uint want, int zero, int res) {
+  uint hint, b, bb;
+
+  if (!bavail(res)) {
+    printf("balloc: out of blocks\n");
+    return 0;
+  }
+  acquire(&freemap.lock);
+  hint = freemap.hint;
+  release(&freemap.lock);
+
+  for (uint n = want; n > 0; n /= 2) {
+    // from the hint to the end of its bitmap block, then the
+    // other bitmap blocks in turn, then all of the hint's one.
+    for (uint i = 0; i <= freemap.nbmap; i++) {
+      bb = (hint / BPB + i) % freemap.nbmap;
+      if (freemap.nfree[bb] < n) continue;
+      b = bfindrun(dev, bb, i == 0 ? hint : bb * BPB, n);
+      if (b) {
+        acquire(&freemap.lock);
+        freemap.nfree[bb]--;
+        freemap.free--;
+        freemap.hint = b + n < sb.size ? b + n : 0;
+        release(&freemap.lock);
+        if (zero) bzero(dev, b);
+        return b;
       }
     }
-    brelse(bp);
   }
   printf("balloc: out of blocks\n");
   return 0;
 }
 
+// Allocate block b, zeroed if zero is set, if it is free and
+// bavail(res) allows. returns 0 if it is not.
+static uint ballocat(uint dev, uint b, int zero, int res) {
+  struct buf *bp;
+  int bi = b % BPB, m = 1 << (bi % 8);
+
+  if (b >= sb.size || !bavail(res)) return 0;
+  bp = bread(dev, BBLOCK(b, sb));
+  if (bp->data[bi / 8] & m) {
+    brelse(bp);
+    return 0;
+  }
+  bp->data[bi / 8] |= m;
+  log_write(bp);
+  brelse(bp);
+  freemapcount(b, -1);
+  if (zero) bzero(dev, b);
+  return b;
+}
+
 // Free a disk block.
 static void bfree(int dev, uint b) {
   struct buf *bp;
@@ -95,6 +224,7 @@ static void bfree(int dev, uint b) {
   bp->data[bi / 8] &= ~m;
   log_write(bp);
   brelse(bp);
+  freemapcount(b, 1);
 }
 
 // Inodes.
@@ -112,7 +242,12 @@ static void bfree(int dev, uint b) {
 // to provide a place for synchronizing access
 // to inodes used by multiple processes. The in-memory
 // inodes include book-keeping information that is
-// not stored on disk: ip->ref and ip->valid.
+// not stored on disk: ip->ref and ip->valid. The table is
+// hashed by (dev, inum), and its entries come from a slab
+// cache. An entry whose last reference is dropped stays
+// cached, still valid, on an LRU list of up to NINODE unused
+// entries, the least recently used of which is freed or
+// recycled when the list is full.
 //
 // An inode and its in-memory representation go through a
 // sequence of states before they can be used by the
@@ -127,13 +262,13 @@ static void bfree(int dev, uint b) {
 //   the number of in-memory pointers to the entry (open
 //   files and current directories). iget() finds or
 //   creates a table entry and increments its ref; iput()
-//   decrements ref.
+//   decrements ref. An entry with ref zero is on the LRU.
 //
 // * Valid: the information (type, size, &c) in an inode
 //   table entry is only correct when ip->valid is 1.
 //   ilock() reads the inode from
-//   the disk and sets ip->valid, while iput() clears
-//   ip->valid if ip->ref has fallen to zero.
+//   the disk and sets ip->valid, and it stays valid until
+//   the entry is freed or the inode is.
 //
 // * Locked: file system code may only examine and modify
 //   the information in an inode and its content if it
@@ -157,27 +292,47 @@ static void bfree(int dev, uint b) {
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The itable.lock spin-lock protects the allocation of itable
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold itable.lock while using any of those fields.
+// The itable.lock reader-writer spin-lock protects the hash
+// chains, the LRU and the allocation of itable entries. Since
+// ip->ref indicates whether an entry is in use, and ip->dev and
+// ip->inum indicate which i-node an entry holds, one must hold
+// itable.lock while using any of those fields. Finding an inode
+// in use only reads the table, so iget() holds the lock for
+// reading and takes its reference atomically; taking an entry
+// off the LRU, turning one over, or dropping a reference (which
+// may put it on the LRU), needs the lock for writing. idup()
+// needs no lock, since its caller's reference already keeps ip
+// in place.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
+// ilockread() holds it shared, for lookups and stat that only
+// read the inode and its contents.
+
+#define NIHASH 127
+#define IHASH(dev, inum) (&itable.hash[((dev) * 31 + (inum)) % NIHASH])
 
 struct {
-  struct spinlock lock;
-  struct inode inode[NINODE];
+  struct rwspinlock lock;
+  struct kmem_cache *cache;
+  struct inode *hash[NIHASH];
+  // Unused entries, through prev/next. mru is the most recently
+  // used, lru the least.
+  struct inode *mru;
+  struct inode *lru;
+  int nlru;
 } itable;
 
-void iinit() {
-  int i = 0;
+static void inodector(void *obj) {
+  initsleeplock(&((struct inode *)obj)->lock, "inode");
+}
 
-  initlock(&itable.lock, "itable");
-  for (i = 0; i < NINODE; i++) {
-    initsleeplock(&itable.inode[i].lock, "inode");
-  }
+void iinit() {
+  initrwlock(&itable.lock, "itable");
+  itable.cache = kmem_cache_create("inode", sizeof(struct inode), inodector, 0,
+                                   SLAB_HWCACHE_ALIGN);
+  if (itable.cache == 0) panic("iinit");
 }
 
 static struct inode *iget(uint dev, uint inum);
@@ -209,7 +364,9 @@ struct inode *ialloc(uint dev, short type) {
 
 // Copy a modified in-memory inode to disk.
 // Must be called after every change to an ip->xxx field
-// that lives on disk.
+// that lives on disk. The size on disk stops short of delayed
+// blocks, so that a crash leaves the file only what it has on
+// the disk.
 // Caller must hold ip->lock.
 void iupdate(struct inode *ip) {
   struct buf *bp;
@@ -222,40 +379,102 @@ void iupdate(struct inode *ip) {
   dip->minor = ip->minor;
   dip->nlink = ip->nlink;
   dip->size = ip->size;
+  if (ip->ndelay > 0 && ip->dstart * BSIZE < ip->size)
+    dip->size = ip->dstart * BSIZE;
+  memmove(dip->ext, ip->ext, sizeof(ip->ext));
   memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
   log_write(bp);
   brelse(bp);
 }
 
+// The entry for inode inum on device dev, or 0.
+// Caller must hold itable.lock.
+static struct inode *ilookup(uint dev, uint inum) {
+  struct inode *ip;
+
+  for (ip = *IHASH(dev, inum); ip; ip = ip->hnext)
+    if (ip->dev == dev && ip->inum == inum) return ip;
+  return 0;
+}
+
+static void lruremove(struct inode *ip) {
+  if (ip->prev)
+    ip->prev->next = ip->next;
+  else
+    itable.mru = ip->next;
+  if (ip->next)
+    ip->next->prev = ip->prev;
+  else
+    itable.lru = ip->prev;
+  itable.nlru--;
+}
+
+static void lrupush(struct inode *ip) {
+  ip->prev = 0;
+  ip->next = itable.mru;
+  if (itable.mru)
+    itable.mru->prev = ip;
+  else
+    itable.lru = ip;
+  itable.mru = ip;
+  itable.nlru++;
+}
+
+// Take ip out of the table, for freeing or reuse.
+// Caller must hold itable.lock for writing.
+static void iunhash(struct inode *ip) {
+  struct inode **pp = IHASH(ip->dev, ip->inum);
+
+  while (*pp != ip) pp = &(*pp)->hnext;
+  *pp = ip->hnext;
+  // the page cache is keyed by ip.
+  if (ip->pages) pagecache_drop(ip);
+}
+
 // Find the inode with number inum on device dev
 // and return the in-memory copy. Does not lock
 // the inode and does not read it from disk.
 static struct inode *iget(uint dev, uint inum) {
-  struct inode *ip, *empty;
-
-  acquire(&itable.lock);
-
-  // Is the inode already in the table?
-  empty = 0;
-  for (ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++) {
-    if (ip->ref > 0 && ip->dev == dev && ip->inum == inum) {
-      ip->ref++;
-      release(&itable.lock);
-      return ip;
-    }
-    if (empty == 0 && ip->ref == 0)  // Remember empty slot.
-      empty = ip;
+  struct inode *ip, *new;
+
+  // Is the inode already in use?
+  acquireread(&itable.lock);
+  if ((ip = ilookup(dev, inum)) != 0 && ip->ref > 0) {
+    __sync_fetch_and_add(&ip->ref, 1);
+    releaseread(&itable.lock);
+    return ip;
+  }
+  releaseread(&itable.lock);
+
+  // the allocation may reclaim memory, so not under the lock.
+  new = kmem_cache_alloc(itable.cache);
+
+  acquirewrite(&itable.lock);
+  if ((ip = ilookup(dev, inum)) != 0) {
+    // cached, or another process got the inode in first.
+    if (ip->ref == 0) lruremove(ip);
+    __sync_fetch_and_add(&ip->ref, 1);
+    releasewrite(&itable.lock);
+    if (new) kmem_cache_free(itable.cache, new);
+    return ip;
+  }
+  if ((ip = new) == 0) {
+    // Recycle the least recently used entry.
+    if ((ip = itable.lru) == 0) panic("iget: no inodes");
+    lruremove(ip);
+    iunhash(ip);
   }
 
-  // Recycle an inode entry.
-  if (empty == 0) panic("iget: no inodes");
-
-  ip = empty;
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
-  release(&itable.lock);
+  ip->pages = 0;
+  ip->wbq = 0;
+  ip->ndelay = 0;
+  ip->hnext = *IHASH(dev, inum);
+  *IHASH(dev, inum) = ip;
+  releasewrite(&itable.lock);
 
   return ip;
 }
@@ -263,9 +482,7 @@ static struct inode *iget(uint dev, uint inum) {
 // Increment reference count for ip.
 // Returns ip to enable ip = idup(ip1) idiom.
 struct inode *idup(struct inode *ip) {
-  acquire(&itable.lock);
-  ip->ref++;
-  release(&itable.lock);
+  __sync_fetch_and_add(&ip->ref, 1);
   return ip;
 }
 
@@ -287,8 +504,10 @@ void ilock(struct inode *ip) {
     ip->minor = dip->minor;
     ip->nlink = dip->nlink;
     ip->size = dip->size;
+    memmove(ip->ext, dip->ext, sizeof(ip->ext));
     memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
     brelse(bp);
+    ip->ranext = ip->raend = 0;
     ip->valid = 1;
     if (ip->type == 0) panic("ilock: no type");
   }
@@ -301,6 +520,28 @@ void iunlock(struct inode *ip) {
   releasesleep(&ip->lock);
 }
 
+// Lock the given inode shared with other readers, which may
+// look at it but change nothing. The first locker reads it
+// from disk, and does so with the lock held exclusively; it
+// stays valid while the caller's reference is held.
+void ilockread(struct inode *ip) {
+  if (ip == 0 || ip->ref < 1) panic("ilockread");
+
+  acquiresleepread(&ip->lock);
+  if (ip->valid == 0) {
+    releasesleepread(&ip->lock);
+    ilock(ip);
+    iunlock(ip);
+    acquiresleepread(&ip->lock);
+  }
+}
+
+void iunlockread(struct inode *ip) {
+  if (ip == 0 || ip->ref < 1) panic("iunlockread");
+
+  releasesleepread(&ip->lock);
+}
+
 // Drop a reference to an in-memory inode.
 // If that was the last reference, the inode table entry can
 // be recycled.
@@ -309,7 +550,12 @@ void iunlock(struct inode *ip) {
 // All calls to iput() must be inside a transaction in
 // case it has to free the inode.
 void iput(struct inode *ip) {
-  acquire(&itable.lock);
+  acquirewrite(&itable.lock);
+
+  // the delayed data of a file with no links is never placed, so
+  // the writeback list's reference need not outlive this one.
+  if (ip->ref == 2 && ip->valid && ip->nlink == 0 && wbcancel(ip))
+    __sync_fetch_and_sub(&ip->ref, 1);
 
   if (ip->ref == 1 && ip->valid && ip->nlink == 0) {
     // inode has no links and no other references: truncate and free.
@@ -318,20 +564,40 @@ void iput(struct inode *ip) {
     // so this acquiresleep() won't block (or deadlock).
     acquiresleep(&ip->lock);
 
-    release(&itable.lock);
+    releasewrite(&itable.lock);
 
     itrunc(ip);
+    if (ip->type == T_DIR) dcache_purge(ip->dev, ip->inum);
     ip->type = 0;
     iupdate(ip);
     ip->valid = 0;
 
     releasesleep(&ip->lock);
 
-    acquire(&itable.lock);
+    acquirewrite(&itable.lock);
+  }
+
+  struct inode *victim = 0;
+  if (ip->ref == 1) {
+    if (ip->valid) {
+      // keep it cached, making room if need be.
+      lrupush(ip);
+      if (itable.nlru > NINODE) {
+        victim = itable.lru;
+        lruremove(victim);
+        iunhash(victim);
+      }
+    } else {
+      // freed, or never read: nothing worth keeping.
+      iunhash(ip);
+      victim = ip;
+    }
   }
 
-  ip->ref--;
-  release(&itable.lock);
+  // atomically, against a concurrent idup().
+  __sync_fetch_and_sub(&ip->ref, 1);
+  releasewrite(&itable.lock);
+  if (victim) kmem_cache_free(itable.cache, victim);
 }
 
 // Common idiom: unlock, then put.
@@ -342,6 +608,7 @@ void iunlockput(struct inode *ip) {
 
 void ireclaim(int dev) {
   for (int inum = 1; inum < sb.ninodes; inum++) {
+    cond_resched();
     struct inode *ip = 0;
     struct buf *bp = bread(dev, IBLOCK(inum, sb));
     struct dinode *dip = (struct dinode *)bp->data + inum % IPB;
@@ -363,73 +630,205 @@ void ireclaim(int dev) {
 // Inode content
 //
 // The content (data) associated with each inode is stored
-// in blocks on the disk. The first NDIRECT block numbers
-// are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
-
-// Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
-// returns 0 if out of disk space.
-static uint bmap(struct inode *ip, uint bn) {
-  uint addr, *a;
+// in blocks on the disk. The first blocks are in the runs
+// ip->ext[], which bmap() grows while the file's blocks are
+// allocated consecutively, as they mostly are when a file is
+// written once. Files are never sparse, since writei() only
+// appends, so the extents always map a prefix of the file.
+// Once they are all in use and the next block does not extend
+// the last, the remaining blocks are listed in the indirect
+// trees ip->addrs[]: NINDIRECT blocks under ip->addrs[0], then
+// NINDIRECT^2 under ip->addrs[1], then NINDIRECT^3 under
+// ip->addrs[2].
+
+// How tmap() and bmap1() allocate missing blocks.
+#define BMAP_ZERO 1   // zeroed
+#define BMAP_RAW 2    // data blocks not zeroed, for a caller to fill
+#define BMAP_PLACE 3  // like BMAP_RAW, from space reserved for delayed data
+
+// Return the disk block address of the nth block of the
+// indirect trees of inode ip, allocating it and the indirect
+// blocks above it, as alloc says, if alloc is set.
+// returns 0 if there is no such block or out of disk space.
+static uint tmap(struct inode *ip, uint bn, int alloc) {
+  uint addr, span, *a;
   struct buf *bp;
+  int level;
 
-  if (bn < NDIRECT) {
-    if ((addr = ip->addrs[bn]) == 0) {
-      addr = balloc(ip->dev);
-      if (addr == 0) return 0;
-      ip->addrs[bn] = addr;
-    }
-    return addr;
+  for (level = 0, span = NINDIRECT; bn >= span; level++, span *= NINDIRECT) {
+    if (level == NLEVEL - 1) panic("bmap: out of range");
+    bn -= span;
   }
-  bn -= NDIRECT;
 
-  if (bn < NINDIRECT) {
-    // Load indirect block, allocating if necessary.
-    if ((addr = ip->addrs[NDIRECT]) == 0) {
-      addr = balloc(ip->dev);
-      if (addr == 0) return 0;
-      ip->addrs[NDIRECT] = addr;
-    }
+  if ((addr = ip->addrs[level]) == 0) {
+    if (!alloc || (addr = balloc(ip->dev, 1, 1, alloc == BMAP_PLACE)) == 0)
+      return 0;
+    ip->addrs[level] = addr;
+  }
+  // Walk down the indirect blocks, allocating if necessary.
+  for (; level >= 0; level--) {
+    span /= NINDIRECT;
     bp = bread(ip->dev, addr);
-    a = (uint *)bp->data;
-    if ((addr = a[bn]) == 0) {
-      addr = balloc(ip->dev);
-      if (addr) {
-        a[bn] = addr;
-        log_write(bp);
-      }
+    a = (uint *)bp->data + bn / span;
+    bn %= span;
+    if ((addr = *a) == 0 && alloc &&
+        (addr = balloc(ip->dev, 1, level > 0 || alloc == BMAP_ZERO,
+                       alloc == BMAP_PLACE)) != 0) {
+      *a = addr;
+      log_write(bp);
     }
     brelse(bp);
-    return addr;
+    if (addr == 0) return 0;
+  }
+  return addr;
+}
+
+// Return the disk block address of the nth block in inode ip.
+// If there is no such block, bmap1 allocates one as alloc says.
+// returns 0 if out of disk space.
+static uint bmap1(struct inode *ip, uint bn, int alloc) {
+  struct extent *e;
+  uint addr, end = 0;
+  int i, zero = alloc == BMAP_ZERO, res = alloc == BMAP_PLACE;
+
+  for (i = 0; i < NEXTENT && ip->ext[i].len > 0; i++) {
+    e = &ip->ext[i];
+    if (bn < end + e->len) return e->start + bn - end;
+    end += e->len;
   }
 
-  panic("bmap: out of range");
+  // the next block, and the trees are still empty: grow the
+  // last extent if the block after it is free, else start one.
+  if (bn == end && ip->addrs[0] == 0) {
+    if (i > 0) {
+      e = &ip->ext[i - 1];
+      if ((addr = ballocat(ip->dev, e->start + e->len, zero, res)) != 0) {
+        e->len++;
+        return addr;
+      }
+    }
+    if (i < NEXTENT) {
+      // leave it room to grow: as much again as the file has,
+      // within limits, or all that is being placed.
+      uint want = min(NPREALLOC, bn < NPREALLOC / 8 ? NPREALLOC / 8 : bn);
+      if (res && ip->ndelay > want) want = min(ip->ndelay, BPB);
+      if ((addr = balloc(ip->dev, want, zero, res)) == 0) return 0;
+      ip->ext[i].start = addr;
+      ip->ext[i].len = 1;
+      return addr;
+    }
+  }
+
+  return tmap(ip, bn - end, alloc);
+}
+
+static uint bmap(struct inode *ip, uint bn) {
+  return bmap1(ip, bn, BMAP_ZERO);
+}
+
+// Small files: a T_FILE whose major is FINLINE has no blocks and
+// keeps its size bytes in ip->data, in place of the block map.
+// An empty file takes a first write that fits inline, and
+// writei() moves the data to a block once it no longer fits.
+static int isinline(struct inode *ip) {
+  return ip->type == T_FILE && ip->major == FINLINE;
+}
+
+// Move the data of inline file ip out to its first block.
+// returns -1 if out of disk space, leaving ip inline.
+static int uninline(struct inode *ip) {
+  char data[INLINESIZE];
+  struct buf *bp;
+  uint addr;
+
+  memmove(data, ip->data, INLINESIZE);
+  memset(ip->data, 0, INLINESIZE);
+  ip->major = 0;
+  if (ip->size == 0) return 0;
+  if ((addr = bmap1(ip, 0, BMAP_RAW)) == 0) {
+    memmove(ip->data, data, INLINESIZE);
+    ip->major = FINLINE;
+    return -1;
+  }
+  bp = bclaim(ip->dev, addr);
+  memset(bp->data, 0, BSIZE);
+  memmove(bp->data, data, ip->size);
+  log_write(bp);
+  brelse(bp);
+  return 0;
+}
+
+// Read n bytes at off of inline file ip. A page cached for a
+// shared mapping may have newer bytes than ip->data.
+static int readinline(struct inode *ip, int user_dst, uint64 dst, uint off,
+                      uint n) {
+  uint64 pa = pagecache_lookup(ip, 0);
+  char *src = pa ? (char *)pa : ip->data;
+  int r = either_copyout(user_dst, dst, src + off, n);
+
+  if (pa) kfree((void *)pa);
+  return r == -1 ? -1 : n;
+}
+
+// Write n bytes at off of inline file ip, which have room
+// there, and into its cached page, if any.
+static int writeinline(struct inode *ip, int user_src, uint64 src, uint off,
+                       uint n) {
+  uint64 pa;
+
+  if (either_copyin(ip->data + off, user_src, src, n) == -1) return -1;
+  if ((pa = pagecache_lookup(ip, 0)) != 0) {
+    memmove((char *)pa + off, ip->data + off, n);
+    kfree((void *)pa);
+  }
+  if (off + n > ip->size) ip->size = off + n;
+  iupdate(ip);
+  return n;
+}
+
+static void undelay(struct inode *);
+
+// Free the indirect block addr at level of a tree, and all
+// the blocks under it.
+static void tfree(uint dev, uint addr, int level) {
+  struct buf *bp = bread(dev, addr);
+  uint *a = (uint *)bp->data;
+
+  for (int j = 0; j < NINDIRECT; j++) {
+    if (a[j] == 0) continue;
+    cond_resched();
+    if (level > 0)
+      tfree(dev, a[j], level - 1);
+    else
+      bfree(dev, a[j]);
+  }
+  brelse(bp);
+  bfree(dev, addr);
 }
 
 // Truncate inode (discard contents).
 // Caller must hold ip->lock.
 void itrunc(struct inode *ip) {
-  int i, j;
-  struct buf *bp;
-  uint *a;
+  undelay(ip);
+  if (ip->pages) pagecache_drop(ip);
 
-  for (i = 0; i < NDIRECT; i++) {
-    if (ip->addrs[i]) {
-      bfree(ip->dev, ip->addrs[i]);
-      ip->addrs[i] = 0;
+  if (isinline(ip)) {
+    memset(ip->data, 0, INLINESIZE);
+    ip->major = 0;
+  }
+  for (int i = 0; i < NEXTENT; i++) {
+    for (uint b = 0; b < ip->ext[i].len; b++) {
+      cond_resched();
+      bfree(ip->dev, ip->ext[i].start + b);
     }
+    ip->ext[i].start = ip->ext[i].len = 0;
   }
 
-  if (ip->addrs[NDIRECT]) {
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint *)bp->data;
-    for (j = 0; j < NINDIRECT; j++) {
-      if (a[j]) bfree(ip->dev, a[j]);
+  for (int level = 0; level < NLEVEL; level++) {
+    if (ip->addrs[level]) {
+      tfree(ip->dev, ip->addrs[level], level);
+      ip->addrs[level] = 0;
     }
-    brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
-    ip->addrs[NDIRECT] = 0;
   }
 
   ip->size = 0;
@@ -446,6 +845,93 @@ void stati(struct inode *ip, struct stat *st) {
   st->size = ip->size;
 }
 
+// Return the disk block address of the nth block in inode ip,
+// or 0 if there is none. Unlike bmap(), never allocates.
+static uint bmapped(struct inode *ip, uint bn) {
+  uint end = 0;
+
+  for (int i = 0; i < NEXTENT && ip->ext[i].len > 0; i++) {
+    if (bn < end + ip->ext[i].len) return ip->ext[i].start + bn - end;
+    end += ip->ext[i].len;
+  }
+  if (bn - end >= MAXFILE) return 0;
+  return tmap(ip, bn - end, 0);
+}
+
+// Add block addr to the run of *len blocks from *start on to
+// read ahead, first starting the run if addr does not extend it;
+// addr 0 just starts it.
+static void rarun(uint dev, uint *start, uint *len, uint addr) {
+  if (*len > 0 && addr == *start + *len) {
+    (*len)++;
+    return;
+  }
+  if (*len > 0) breadahead(dev, *start, *len);
+  *start = addr;
+  *len = addr != 0;
+}
+
+// If a read of n > 0 bytes at off continues where the last
+// one left off, start reading the NREADAHEAD blocks after it,
+// skipping those whose page is already cached.
+// Readers holding ip->lock shared race on ranext and raend,
+// which can only cost a read ahead missed or repeated.
+static void readahead(struct inode *ip, uint off, uint n) {
+  uint bn = off / BSIZE, next = (off + n - 1) / BSIZE + 1;
+  uint end = next + NREADAHEAD, nblocks = (ip->size + BSIZE - 1) / BSIZE;
+  uint start = 0, len = 0;
+
+  // a small read may end in the block the last one did.
+  if (bn != ip->ranext && bn + 1 != ip->ranext) {
+    ip->ranext = next;
+    ip->raend = 0;
+    return;
+  }
+  ip->ranext = next;
+  if (end > nblocks) end = nblocks;
+  for (uint b = ip->raend > next ? ip->raend : next; b < end; b++) {
+    uint64 pa = pagecache_lookup(ip, b / (PGSIZE / BSIZE));
+    if (pa) {
+      kfree((void *)pa);
+      rarun(ip->dev, &start, &len, 0);
+      ip->raend = b + 1;
+      continue;
+    }
+    uint addr = bmapped(ip, b);
+    if (addr == 0) break;
+    rarun(ip->dev, &start, &len, addr);
+    ip->raend = b + 1;
+  }
+  rarun(ip->dev, &start, &len, 0);
+}
+
+// Fill mem, a zeroed page, with page pgno of file ip, for the
+// page cache. Holes and bytes past the end of the file stay
+// zero. The blocks pass through the buffer cache, which is the
+// newest copy of ones the log has yet to install, but are not
+// kept there. Caller must hold ip->lock.
+void readpage(struct inode *ip, uint pgno, char *mem) {
+  uint addr[PGSIZE / BSIZE];
+  uint off = pgno * PGSIZE, start = 0, len = 0;
+  int n = 0;
+
+  if (isinline(ip)) {
+    if (pgno == 0) memmove(mem, ip->data, ip->size);
+    return;
+  }
+  // start all the page's reads before waiting for any.
+  for (; n < PGSIZE / BSIZE && off + n * BSIZE < ip->size; n++)
+    rarun(ip->dev, &start, &len, addr[n] = bmapped(ip, off / BSIZE + n));
+  rarun(ip->dev, &start, &len, 0);
+  for (int i = 0; i < n; i++) {
+    if (addr[i] == 0) continue;
+    struct buf *bp = bread(ip->dev, addr[i]);
+    uint m = min(BSIZE, ip->size - (off + i * BSIZE));
+    memmove(mem + i * BSIZE, bp->data, m);
+    bforget(bp);
+  }
+}
+
 // Read data from inode.
 // Caller must hold ip->lock.
 // If user_dst==1, then dst is a user virtual address;
@@ -456,12 +942,29 @@ int readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n) {
 
   if (off > ip->size || off + n < off) return 0;
   if (off + n > ip->size) n = ip->size - off;
+  if (isinline(ip)) return readinline(ip, user_dst, dst, off, n);
+  if (n > 0) readahead(ip, off, n);
 
   for (tot = 0; tot < n; tot += m, off += m, dst += m) {
+    // file data is copied straight out of its cached page.
+    uint64 pa = ip->type == T_FILE ? pagecache_get(ip, off / PGSIZE) : 0;
+    if (pa) {
+      m = min(n - tot, PGSIZE - off % PGSIZE);
+      char *src = (char *)pa + off % PGSIZE;
+      int r = either_copyout(user_dst, dst, src, m);
+      kfree((void *)pa);
+      if (r == -1) {
+        tot = -1;
+        break;
+      }
+      continue;
+    }
+    // directories, and files while memory is short, are read
+    // a block at a time through the buffer cache.
+    m = min(n - tot, BSIZE - off % BSIZE);
     uint addr = bmap(ip, off / BSIZE);
     if (addr == 0) break;
     bp = bread(ip->dev, addr);
-    m = min(n - tot, BSIZE - off % BSIZE);
     if (either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
       brelse(bp);
       tot = -1;
@@ -472,29 +975,208 @@ int readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n) {
   return tot;
 }
 
-// Write data to inode.
+// Delayed allocation: what writei() appends to a regular file
+// goes into its cached pages only. The blocks it needs are
+// reserved on the disk but not placed, so a run of small writes
+// allocates no blocks and logs nothing.
+// The writeback thread (writeback.c), or fsync(), later places a
+// file's delayed blocks all at once with iflush(), which lets
+// bmap1() find them as few extents as it can. Their data goes
+// straight from the pages to the disk before the transaction
+// that maps them commits, so only the bitmap, the indirect
+// blocks and the inode go through the log. The pages stay
+// cached until then. Since a file only grows at its end, its
+// delayed blocks are its last, from ip->dstart on.
+
+static uint ndelayed;  // delayed blocks in all files
+
+// Blocks to reserve for n delayed blocks of one file: themselves
+// and the indirect blocks placing them may take.
+static uint nreserve(uint n) {
+  return n > 0 ? n + n / NINDIRECT + NLEVEL + 1 : 0;
+}
+
+// Make ip's delayed blocks number n, reserving the disk blocks
+// that needs or giving back those it no longer does. Returns -1,
+// changing nothing, if too few are free.
+static int setdelay(struct inode *ip, uint n) {
+  uint old = nreserve(ip->ndelay), new = nreserve(n);
+
+  acquire(&freemap.lock);
+  if (new > old && freemap.free < freemap.reserved + (new - old)) {
+    release(&freemap.lock);
+    return -1;
+  }
+  freemap.reserved += new - old;
+  release(&freemap.lock);
+  __sync_fetch_and_add(&ndelayed, n - ip->ndelay);
+  ip->ndelay = n;
+  return 0;
+}
+
+// Drop ip's delayed blocks, whose data is about to go.
+static void undelay(struct inode *ip) {
+  if (ip->ndelay > 0) setdelay(ip, 0);
+}
+
+// Decide for writei() about block bn of ip, whose page is cached
+// if cached is set: 1 if it is delayed, or now is, 0 if it is to
+// be written now, -1 if it can be neither. Blocks after a delayed
+// one have to be delayed too. A block starts a delayed run only
+// if start is set and not too many are delayed already.
+static int delay(struct inode *ip, uint bn, int cached, int start) {
+  if (ip->ndelay > 0 && bn >= ip->dstart) {
+    if (!cached) return -1;
+    if (bn < ip->dstart + ip->ndelay) return 1;
+    return setdelay(ip, ip->ndelay + 1) == 0 ? 1 : -1;
+  }
+  if (!cached || !start || ndelayed >= NDELAYED || bmapped(ip, bn) != 0 ||
+      setdelay(ip, 1) < 0)
+    return 0;
+  ip->dstart = bn;
+  wbqueue(ip);
+  return 1;
+}
+
+// Blocks place() may log besides the inode, the bitmap and the
+// indirect blocks: the transaction's room, as in filewrite().
+#define PLACELOG (MAXOPBLOCKS - 1 - 2 * NLEVEL - 2 - 1)
+
+// Place up to NDELAYOP of ip's delayed blocks, in the caller's
+// transaction, and write their data from the cached pages, a run
+// of blocks consecutive on the disk as one request. A block the
+// buffer cache holds may still be in the log for the file that
+// had it, so it goes through the log as well. Returns -1 if out
+// of disk space, having dropped the data that could not be
+// placed. Caller must hold ip->lock.
+static int place(struct inode *ip) {
+  uint64 pa[MAXSEG], page[MAXSEG];
+  uint start = 0, addr;
+  int n = 0, logged = 0, r = 0;
+
+  for (int k = 0; k < NDELAYOP && ip->ndelay > 0 && logged < PLACELOG; k++) {
+    uint bn = ip->dstart;
+    uint64 pg = pagecache_lookup(ip, bn / (PGSIZE / BSIZE));
+    if (pg == 0) panic("place: not cached");
+    if ((addr = bmap1(ip, bn, BMAP_PLACE)) == 0) {
+      kfree((void *)pg);
+      r = -1;
+      break;
+    }
+    char *blk = (char *)pg + bn % (PGSIZE / BSIZE) * BSIZE;
+    if (n > 0 && (addr != start + n || n == MAXSEG)) {
+      virtio_disk_rwpa(start, pa, n, 1);
+      while (n > 0) kfree((void *)page[--n]);
+    }
+    if (bcached(ip->dev, addr)) {
+      struct buf *bp = bclaim(ip->dev, addr);
+      memmove(bp->data, blk, BSIZE);
+      log_write(bp);
+      brelse(bp);
+      kfree((void *)pg);
+      logged++;
+    } else {
+      if (n == 0) start = addr;
+      pa[n] = (uint64)blk;
+      page[n++] = pg;
+    }
+    ip->dstart++;
+    setdelay(ip, ip->ndelay - 1);
+  }
+  if (n > 0) virtio_disk_rwpa(start, pa, n, 1);
+  while (n > 0) kfree((void *)page[--n]);
+
+  if (r < 0) {
+    printf("iflush: out of blocks\n");
+    if (ip->size > ip->dstart * BSIZE) ip->size = ip->dstart * BSIZE;
+    undelay(ip);
+  }
+  if (ip->ndelay == 0) pagecache_clean(ip);
+  iupdate(ip);
+  return r;
+}
+
+// Place all of ip's delayed blocks, a transaction at a time, for
+// fsync() and the writeback thread. Those of a file with no
+// links stay until it is freed. Must not be called inside a
+// transaction.
+void iflush(struct inode *ip) {
+  // a peek, but one that sees the writes that have returned.
+  while (ip->ndelay > 0) {
+    begin_op();
+    ilock(ip);
+    int stop = ip->nlink == 0 || (ip->ndelay > 0 && place(ip) < 0);
+    iunlock(ip);
+    end_op();
+    if (stop) break;
+  }
+}
+
+// Delayed blocks in all files, for throttling writers.
+uint fsdelayed(void) { return ndelayed; }
+
+// How many bytes at off filewrite() may write to ip in one
+// transaction, where max is its room for blocks written now:
+// more when they all go to delayed blocks, which log nothing.
 // Caller must hold ip->lock.
-// If user_src==1, then src is a user virtual address;
-// otherwise, src is a kernel address.
-// Returns the number of bytes successfully written.
-// If the return value is less than the requested n,
-// there was an error of some kind.
-int writei(struct inode *ip, int user_src, uint64 src, uint off, uint n) {
+uint writeroom(struct inode *ip, uint off, uint max) {
+  if (ip->ndelay > 0 && off >= ip->dstart * BSIZE) return NDELAYOP * BSIZE;
+  return max;
+}
+
+// writei(), but starting a run of delayed blocks only if start
+// is set.
+static int writei1(struct inode *ip, int user_src, uint64 src, uint off,
+                   uint n, int start) {
   uint tot, m;
   struct buf *bp;
+  int ondisk = 0;  // the inode on the disk may change
 
   if (off > ip->size || off + n < off) return -1;
   if (off + n > MAXFILE * BSIZE) return -1;
 
+  if (ip->type == T_FILE && !isinline(ip) && ip->size == 0 &&
+      ip->ext[0].len == 0 && n <= INLINESIZE)
+    ip->major = FINLINE;
+  if (isinline(ip)) {
+    if (off + n <= INLINESIZE) return writeinline(ip, user_src, src, off, n);
+    if (uninline(ip) < 0) return -1;
+    ondisk = 1;
+  }
+
   for (tot = 0; tot < n; tot += m, off += m, src += m) {
-    uint addr = bmap(ip, off / BSIZE);
-    if (addr == 0) break;
-    bp = bread(ip->dev, addr);
     m = min(n - tot, BSIZE - off % BSIZE);
-    if (either_copyin(bp->data + (off % BSIZE), user_src, src, m) == -1) {
-      brelse(bp);
+    uint64 pa = ip->type == T_FILE ? pagecache_get(ip, off / PGSIZE) : 0;
+    int d = delay(ip, off / BSIZE, pa != 0, start);
+    uint addr = d == 0 ? bmap(ip, off / BSIZE) : 0;
+    ondisk |= d == 0;
+    if (d < 0 || (d == 0 && addr == 0)) {
+      if (pa) kfree((void *)pa);
       break;
     }
+    if (pa) {
+      // file data is written into its cached page, and the log
+      // gets the whole block from there, unless it is delayed.
+      char *blk = (char *)pa + (off % PGSIZE - off % BSIZE);
+      if (either_copyin(blk + off % BSIZE, user_src, src, m) == -1) {
+        kfree((void *)pa);
+        break;
+      }
+      if (d) {
+        pagecache_dirty(ip, off / PGSIZE);
+        kfree((void *)pa);
+        continue;
+      }
+      bp = bclaim(ip->dev, addr);
+      memmove(bp->data, blk, BSIZE);
+      kfree((void *)pa);
+    } else {
+      bp = bread(ip->dev, addr);
+      if (either_copyin(bp->data + (off % BSIZE), user_src, src, m) == -1) {
+        brelse(bp);
+        break;
+      }
+    }
     log_write(bp);
     brelse(bp);
   }
@@ -503,9 +1185,129 @@ int writei(struct inode *ip, int user_src, uint64 src, uint off, uint n) {
 
   // write the i-node back to disk even if the size didn't change
   // because the loop above might have called bmap() and added a new
-  // block to ip->addrs[].
-  iupdate(ip);
+  // block to ip->addrs[]. Delayed blocks change neither.
+  if (ondisk) iupdate(ip);
+
+  return tot;
+}
+
+// Write data to inode.
+// Caller must hold ip->lock.
+// If user_src==1, then src is a user virtual address;
+// otherwise, src is a kernel address.
+// Returns the number of bytes successfully written.
+// If the return value is less than the requested n,
+// there was an error of some kind.
+int writei(struct inode *ip, int user_src, uint64 src, uint off, uint n) {
+  return writei1(ip, user_src, src, off, n, 1);
+}
+
+// O_DIRECT I/O: whole, aligned blocks of a file go between the
+// disk and the user's pages, pinned meanwhile, with no copy and
+// no buffer. A block that may be newer in a cached page or
+// buffer than on the disk, or a partial block, goes through
+// readi() or writei() instead, as does an unaligned call.
+
+static int isaligned(uint64 uva, uint off) {
+  return uva % BSIZE == 0 && off % BSIZE == 0;
+}
 
+// Is the nth block of ip, at addr, cached as a page or buffer?
+static int blockcached(struct inode *ip, uint bn, uint addr) {
+  uint64 pa = pagecache_lookup(ip, bn / (PGSIZE / BSIZE));
+
+  if (pa) {
+    kfree((void *)pa);
+    return 1;
+  }
+  return bcached(ip->dev, addr);
+}
+
+// Transfer the n blocks from addr on to or from the user pages
+// at uva, a block each. Returns -1 if a page is missing.
+static int directrun(uint addr, uint64 uva, int n, int write) {
+  pagetable_t pt = myproc()->pagetable;
+  uint64 pa[MAXSEG], page[MAXSEG];
+  int i, r = 0;
+
+  for (i = 0; i < n; i++)
+    if ((pa[i] = userpin(pt, uva + i * BSIZE, !write, &page[i])) == 0) break;
+  if (i == n)
+    virtio_disk_rwpa(addr, pa, n, write);
+  else
+    r = -1;
+  while (--i >= 0) kfree((void *)page[i]);
+  return r;
+}
+
+// Like readi() to user address uva.
+// Caller must hold ip->lock.
+int readdirect(struct inode *ip, uint64 uva, uint off, uint n) {
+  uint tot = 0, m;
+
+  if (off > ip->size || off + n < off) return 0;
+  if (off + n > ip->size) n = ip->size - off;
+  if (!isaligned(uva, off) || isinline(ip)) return readi(ip, 1, uva, off, n);
+
+  int locked = lockvm();
+  while (tot < n) {
+    uint bn = (off + tot) / BSIZE, addr = bmapped(ip, bn);
+    m = min(n - tot, BSIZE);
+    if (m < BSIZE || addr == 0 || blockcached(ip, bn, addr)) {
+      if (readi(ip, 1, uva + tot, off + tot, m) != m) break;
+      tot += m;
+      continue;
+    }
+    // as many blocks after as are consecutive on disk too.
+    int k = 1;
+    for (; k < MAXSEG && n - tot >= (k + 1) * BSIZE; k++)
+      if (bmapped(ip, bn + k) != addr + k || blockcached(ip, bn + k, addr + k))
+        break;
+    if (directrun(addr, uva + tot, k, 0) < 0) break;
+    tot += k * BSIZE;
+  }
+  unlockvm(locked);
+  return tot;
+}
+
+// Like writei() from user address uva, but delaying only blocks
+// after ones writei() delayed already. A whole block the file
+// does not have yet is allocated unzeroed, since the disk write
+// fills it before the transaction commits. (A crash before an
+// earlier transaction that freed the block commits leaves the
+// new data in the file that had it.)
+// Caller must hold ip->lock.
+int writedirect(struct inode *ip, uint64 uva, uint off, uint n) {
+  uint tot = 0, m;
+
+  if (off > ip->size || off + n < off) return -1;
+  if (off + n > MAXFILE * BSIZE) return -1;
+  if (!isaligned(uva, off) || isinline(ip))
+    return writei1(ip, 1, uva, off, n, 0);
+
+  int locked = lockvm();
+  // blocks from here on may only be delayed ones.
+  uint delayed = ip->ndelay > 0 ? ip->dstart : MAXFILE;
+  while (tot < n) {
+    uint bn = (off + tot) / BSIZE, addr;
+    m = min(n - tot, BSIZE);
+    if (m < BSIZE || bn >= delayed || (addr = bmap1(ip, bn, BMAP_RAW)) == 0 ||
+        blockcached(ip, bn, addr)) {
+      if (writei1(ip, 1, uva + tot, off + tot, m, 0) != m) break;
+      tot += m;
+      continue;
+    }
+    int k = 1;
+    for (; k < MAXSEG && n - tot >= (k + 1) * BSIZE && bn + k < delayed; k++)
+      if (bmap1(ip, bn + k, BMAP_RAW) != addr + k ||
+          blockcached(ip, bn + k, addr + k))
+        break;
+    if (directrun(addr, uva + tot, k, 1) < 0) break;
+    tot += k * BSIZE;
+    if (off + tot > ip->size) ip->size = off + tot;
+  }
+  unlockvm(locked);
+  iupdate(ip);
   return tot;
 }
 
@@ -513,14 +1315,291 @@ int writei(struct inode *ip, int user_src, uint64 src, uint off, uint n) {
 
 int namecmp(const char *s, const char *t) { return strncmp(s, t, DIRSIZ); }
 
+// Indexed directories.
+//
+// A linear directory that fills its first block is converted:
+// its entries move to leaf block 1 and block 0 becomes the
+// root index. A full leaf is split at the median of its name
+// hashes into a new leaf, and a full index block likewise into
+// a new index block, the root first growing a level if it is
+// the one full. Leaves are never merged. Lookups read one block
+// per level, so their cost does not grow with the directory.
+
+// The path from the root to a leaf: the index blocks on the
+// way, and which of their entries was followed.
+struct dxpath {
+  int depth;
+  uint bn[2];
+  int slot[2];
+};
+
+// Block bn of directory dp, which must exist.
+static struct buf *dxbread(struct inode *dp, uint bn) {
+  uint addr = bmapped(dp, bn);
+
+  if (addr == 0) panic("dxbread");
+  return bread(dp->dev, addr);
+}
+
+// Append a zeroed block to dp. Returns its number, or -1 if out
+// of disk space. Caller must iupdate(dp).
+static int dxappend(struct inode *dp) {
+  uint bn = dp->size / BSIZE;
+
+  if (bmap(dp, bn) == 0) return -1;
+  dp->size += BSIZE;
+  return bn;
+}
+
+// Find the leaf of indexed directory dp that holds hash h, and
+// record the way to it in p.
+static uint dxfind(struct inode *dp, uint h, struct dxpath *p) {
+  uint bn = 0;
+
+  for (int d = 0;; d++) {
+    struct buf *bp = dxbread(dp, bn);
+    struct dxentry *x = (struct dxentry *)bp->data;
+    int i = x[0].count - 1;
+    if (d == 0) p->depth = x[0].depth;
+    while (i > 1 && x[i].hash > h) i--;
+    p->bn[d] = bn;
+    p->slot[d] = i;
+    bn = x[i].block;
+    brelse(bp);
+    if (d == p->depth) return bn;
+  }
+}
+
+// Insert (h, bn) after entry slot of index block ibn, which
+// must have room for it.
+static void dxput(struct inode *dp, uint ibn, int slot, uint h, uint bn) {
+  struct buf *bp = dxbread(dp, ibn);
+  struct dxentry *x = (struct dxentry *)bp->data;
+
+  memmove(&x[slot + 2], &x[slot + 1], (x[0].count - slot - 1) * sizeof(*x));
+  memset(&x[slot + 1], 0, sizeof(*x));
+  x[slot + 1].hash = h;
+  x[slot + 1].block = bn;
+  x[0].count++;
+  log_write(bp);
+  brelse(bp);
+}
+
+// Number of entries of index block ibn in use.
+static int dxcount(struct inode *dp, uint ibn) {
+  struct buf *bp = dxbread(dp, ibn);
+  int n = ((struct dxentry *)bp->data)[0].count;
+
+  brelse(bp);
+  return n;
+}
+
+// Move the upper half of full index block ibn to a new index
+// block, and set *ph to the least hash under it. Returns the new
+// block's number, or -1 if out of disk space.
+static int dxsplitindex(struct inode *dp, uint ibn, uint *ph) {
+  int nbn = dxappend(dp);
+
+  if (nbn < 0) return -1;
+  struct buf *bp = dxbread(dp, ibn), *np = dxbread(dp, nbn);
+  struct dxentry *x = (struct dxentry *)bp->data;
+  struct dxentry *y = (struct dxentry *)np->data;
+  int n = x[0].count - NDX / 2;
+  memmove(&y[1], &x[NDX / 2], n * sizeof(*x));
+  memset(&x[NDX / 2], 0, n * sizeof(*x));
+  y[0].count = n + 1;
+  x[0].count = NDX / 2;
+  *ph = y[1].hash;
+  log_write(bp);
+  log_write(np);
+  brelse(bp);
+  brelse(np);
+  return nbn;
+}
+
+// Add (h, bn) to the index of dp after the leaf at the end of
+// path p, splitting index blocks as needed. Returns -1, having
+// added nothing, if the index is full or there's no disk space.
+static int dxinsert(struct inode *dp, struct dxpath *p, uint h, uint bn) {
+  uint ibn = p->bn[p->depth], sh;
+  int slot = p->slot[p->depth], nbn;
+
+  if (dxcount(dp, ibn) < NDX) {
+    dxput(dp, ibn, slot, h, bn);
+    return 0;
+  }
+  if (p->depth == 0) {
+    // the root is full: move its entries to a new index block
+    // below it.
+    if ((nbn = dxappend(dp)) < 0) return -1;
+    struct buf *bp = dxbread(dp, 0), *np = dxbread(dp, nbn);
+    struct dxentry *x = (struct dxentry *)bp->data;
+    memmove(np->data, bp->data, BSIZE);
+    ((struct dxentry *)np->data)[0].depth = 0;
+    memset(&x[1], 0, (NDX - 1) * sizeof(*x));
+    x[0].count = 2;
+    x[0].depth = 1;
+    x[1].block = nbn;
+    log_write(bp);
+    log_write(np);
+    brelse(bp);
+    brelse(np);
+    p->depth = 1;
+    p->bn[1] = ibn = nbn;
+    p->slot[1] = slot;
+    p->slot[0] = 1;
+  } else if (dxcount(dp, 0) >= NDX) {
+    return -1;
+  }
+  if ((nbn = dxsplitindex(dp, ibn, &sh)) < 0) return -1;
+  dxput(dp, 0, p->slot[0], sh, nbn);
+  if (slot >= NDX / 2) {
+    ibn = nbn;
+    slot -= NDX / 2 - 1;
+  }
+  dxput(dp, ibn, slot, h, bn);
+  return 0;
+}
+
+// Split full leaf lbn of dp at the median hash of its entries,
+// moving those above it to a new leaf. Returns -1 if the index
+// is full, there's no disk space, or all the names hash alike.
+static int dxsplit(struct inode *dp, struct dxpath *p, uint lbn) {
+  uint hs[DPB], h;
+  int n = 0, k;
+  struct buf *bp, *np;
+  struct dirent *de, *ne;
+
+  bp = dxbread(dp, lbn);
+  de = (struct dirent *)bp->data;
+  for (int i = 0; i < DPB; i++) {
+    if (de[i].inum == 0) continue;
+    h = dirhash(de[i].name);
+    for (k = n++; k > 0 && hs[k - 1] > h; k--) hs[k] = hs[k - 1];
+    hs[k] = h;
+  }
+  brelse(bp);
+
+  // the two halves must not share a hash.
+  for (k = n / 2; k < n && hs[k] == hs[k - 1]; k++);
+  if (k == n)
+    for (k = n / 2; k > 0 && hs[k] == hs[k - 1]; k--);
+  if (k == 0) return -1;
+  h = hs[k];
+
+  // the new leaf is empty until it is in the index.
+  int nbn = dxappend(dp);
+  if (nbn < 0 || dxinsert(dp, p, h, nbn) < 0) return -1;
+
+  bp = dxbread(dp, lbn);
+  np = dxbread(dp, nbn);
+  de = (struct dirent *)bp->data;
+  ne = (struct dirent *)np->data;
+  for (int i = 0, j = 0; i < DPB; i++) {
+    if (de[i].inum != 0 && dirhash(de[i].name) >= h) {
+      ne[j++] = de[i];
+      memset(&de[i], 0, sizeof(de[i]));
+    }
+  }
+  log_write(bp);
+  log_write(np);
+  brelse(bp);
+  brelse(np);
+  // the moved entries' offsets have changed.
+  dcache_purge(dp->dev, dp->inum);
+  return 0;
+}
+
+// Look for name in leaf lbn of dp. Returns its inum and sets
+// *poff, or returns 0.
+static uint dxscan(struct inode *dp, uint lbn, char *name, uint *poff) {
+  struct buf *bp = dxbread(dp, lbn);
+  struct dirent *de = (struct dirent *)bp->data;
+  uint inum = 0;
+
+  for (int i = 0; i < DPB; i++) {
+    if (de[i].inum != 0 && namecmp(name, de[i].name) == 0) {
+      inum = de[i].inum;
+      *poff = lbn * BSIZE + i * sizeof(*de);
+      break;
+    }
+  }
+  brelse(bp);
+  return inum;
+}
+
+// Add (name, inum) to indexed directory dp, at *poff.
+// Returns 0, or -1 if the directory can't grow.
+static int dxlink(struct inode *dp, char *name, uint inum, uint *poff) {
+  uint h = dirhash(name);
+  struct dxpath p;
+
+  // after a split, the leaf for h has room.
+  for (int tries = 0; tries < 2; tries++) {
+    uint lbn = dxfind(dp, h, &p);
+    struct buf *bp = dxbread(dp, lbn);
+    struct dirent *de = (struct dirent *)bp->data;
+    for (int i = 0; i < DPB; i++) {
+      if (de[i].inum == 0) {
+        de[i].inum = inum;
+        strncpy(de[i].name, name, DIRSIZ);
+        log_write(bp);
+        brelse(bp);
+        *poff = lbn * BSIZE + i * sizeof(*de);
+        return 0;
+      }
+    }
+    brelse(bp);
+    if (dxsplit(dp, &p, lbn) < 0) return -1;
+  }
+  return -1;
+}
+
+// Convert dp, a linear directory whose one block is full, to
+// an index over a leaf holding its entries.
+// Returns -1, leaving it linear, if out of disk space.
+static int dxconvert(struct inode *dp) {
+  int lbn = dxappend(dp);
+
+  if (lbn < 0) return -1;
+  struct buf *bp = dxbread(dp, 0), *np = dxbread(dp, lbn);
+  memmove(np->data, bp->data, BSIZE);
+  memset(bp->data, 0, BSIZE);
+  struct dxentry *x = (struct dxentry *)bp->data;
+  x[0].count = 2;
+  x[1].block = lbn;
+  log_write(bp);
+  log_write(np);
+  brelse(bp);
+  brelse(np);
+  dp->major = DIRHASHED;
+  dcache_purge(dp->dev, dp->inum);
+  return 0;
+}
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
+// Caller must hold dp->lock, shared or not.
 struct inode *dirlookup(struct inode *dp, char *name, uint *poff) {
   uint off, inum;
   struct dirent de;
+  struct dxpath p;
 
   if (dp->type != T_DIR) panic("dirlookup not DIR");
 
+  if (dcache_lookup(dp, name, &inum, poff))
+    return inum ? iget(dp->dev, inum) : 0;
+
+  if (dp->major == DIRHASHED) {
+    if ((inum = dxscan(dp, dxfind(dp, dirhash(name), &p), name, &off)) != 0) {
+      if (poff) *poff = off;
+      dcache_enter(dp, name, inum, off);
+      return iget(dp->dev, inum);
+    }
+    dcache_enter(dp, name, 0, 0);
+    return 0;
+  }
+
   for (off = 0; off < dp->size; off += sizeof(de)) {
     if (readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
       panic("dirlookup read");
@@ -529,19 +1608,23 @@ struct inode *dirlookup(struct inode *dp, char *name, uint *poff) {
       // entry matches path element
       if (poff) *poff = off;
       inum = de.inum;
+      dcache_enter(dp, name, inum, off);
       return iget(dp->dev, inum);
     }
   }
 
+  dcache_enter(dp, name, 0, 0);
   return 0;
 }
 
 // Write a new directory entry (name, inum) into the directory dp.
 // Returns 0 on success, -1 on failure (e.g. out of disk blocks).
+// Caller must hold dp->lock.
 int dirlink(struct inode *dp, char *name, uint inum) {
-  int off;
+  uint off;
   struct dirent de;
   struct inode *ip;
+  int r;
 
   // Check that name is not present.
   if ((ip = dirlookup(dp, name, 0)) != 0) {
@@ -549,18 +1632,34 @@ int dirlink(struct inode *dp, char *name, uint inum) {
     return -1;
   }
 
-  // Look for an empty dirent.
-  for (off = 0; off < dp->size; off += sizeof(de)) {
-    if (readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlink read");
-    if (de.inum == 0) break;
-  }
+  if (dp->major != DIRHASHED) {
+    // Look for an empty dirent.
+    for (off = 0; off < dp->size; off += sizeof(de)) {
+      if (readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+        panic("dirlink read");
+      if (de.inum == 0) break;
+    }
 
-  strncpy(de.name, name, DIRSIZ);
-  de.inum = inum;
-  if (writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de)) return -1;
+    // a full first block is converted, but a linear directory
+    // of more blocks, from an older mkfs, just grows.
+    if (off < dp->size || dp->size != BSIZE) {
+      strncpy(de.name, name, DIRSIZ);
+      de.inum = inum;
+      if (writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+        return -1;
+      dcache_enter(dp, name, inum, off);
+      return 0;
+    }
+    if (dxconvert(dp) < 0) {
+      iupdate(dp);
+      return -1;
+    }
+  }
 
-  return 0;
+  r = dxlink(dp, name, inum, &off);
+  iupdate(dp);
+  if (r == 0) dcache_enter(dp, name, inum, off);
+  return r;
 }
 
 // Paths
@@ -602,29 +1701,36 @@ static char *skipelem(char *path, char *name) {
 // Must be called inside a transaction since it calls iput().
 static struct inode *namex(char *path, int nameiparent, char *name) {
   struct inode *ip, *next;
+  struct proc *g;
 
-  if (*path == '/')
+  if (*path == '/') {
     ip = iget(ROOTDEV, ROOTINO);
-  else
-    ip = idup(myproc()->cwd);
+  } else {
+    // another thread's chdir() may swap cwd.
+    g = myproc()->leader;
+    acquire(&g->fdlock);
+    ip = idup(g->cwd);
+    release(&g->fdlock);
+  }
 
+  // lookups only read the directories, so that processes
+  // resolving the same paths do not wait on each other.
   while ((path = skipelem(path, name)) != 0) {
-    ilock(ip);
+    ilockread(ip);
     if (ip->type != T_DIR) {
-      iunlockput(ip);
+      iunlockread(ip);
+      iput(ip);
       return 0;
     }
     if (nameiparent && *path == '\0') {
       // Stop one level early.
-      iunlock(ip);
+      iunlockread(ip);
       return ip;
     }
-    if ((next = dirlookup(ip, name, 0)) == 0) {
-      iunlockput(ip);
-      return 0;
-    }
-    iunlockput(ip);
-    ip = next;
+    next = dirlookup(ip, name, 0);
+    iunlockread(ip);
+    iput(ip);
+    if ((ip = next) == 0) return 0;
   }
   if (nameiparent) {
     iput(ip);
@@ -6,12 +6,20 @@
 // On-disk file system format.
 // Both the kernel and user programs use this header file.
 
-#define ROOTINO 1   // root i-number
-#define BSIZE 1024  // block size
+#define ROOTINO 1  // root i-number
+
+// Block size, chosen when building (make FSBLOCK=4096) and
+// recorded in the super block.
+#ifndef BSIZE
+#define BSIZE 1024
+#endif
+#if BSIZE != 1024 && BSIZE != 2048 && BSIZE != 4096
+#error "BSIZE must be 1024, 2048 or 4096"
+#endif
 
 // Disk layout:
 // [ boot block | super block | log | inode blocks |
-//                                          free bit map | data blocks]
+//                            free bit map | data blocks | swap blocks ]
 //
 // mkfs computes the super block and builds an initial file system. The
 // super block describes the disk layout:
@@ -24,22 +32,46 @@ struct superblock {
   uint logstart;    // Block number of first log block
   uint inodestart;  // Block number of first inode block
   uint bmapstart;   // Block number of first free map block
+  uint swapstart;   // Block number of first swap block
+  uint nswap;       // Number of swap blocks
+  uint bsize;       // Block size (bytes); must be BSIZE
 };
 
 #define FSMAGIC 0x10203040
 
-#define NDIRECT 12
+// A file's blocks are mapped first by NEXTENT extents, runs of
+// consecutive blocks, then by NLEVEL trees of indirect blocks:
+// a single, a double and a triple indirect block.
+#define NEXTENT 5
+#define NLEVEL 3
 #define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define MAXFILE ((1U << 31) / BSIZE)  // in blocks; the size fits a uint
+
+// A run of len blocks starting at block start.
+struct extent {
+  uint start;
+  uint len;
+};
+
+// A file of at most INLINESIZE bytes may keep them in the inode,
+// in place of its block map, until it grows past that.
+#define INLINESIZE (NEXTENT * sizeof(struct extent) + NLEVEL * sizeof(uint))
+#define FINLINE 1  // dinode.major of a file whose data is inline
 
 // On-disk inode structure
 struct dinode {
-  short type;               // File type
-  short major;              // Major device number (T_DEVICE only)
-  short minor;              // Minor device number (T_DEVICE only)
-  short nlink;              // Number of links to inode in file system
-  uint size;                // Size of file (bytes)
-  uint addrs[NDIRECT + 1];  // Data block addresses
+  short type;   // File type
+  short major;  // Major device number (T_DEVICE only)
+  short minor;  // Minor device number (T_DEVICE only)
+  short nlink;  // Number of links to inode in file system
+  uint size;    // Size of file (bytes)
+  union {
+    struct {
+      struct extent ext[NEXTENT];  // The file's first blocks
+      uint addrs[NLEVEL];          // Indirect blocks for those after them
+    };
+    char data[INLINESIZE];  // Or the contents of a FINLINE file
+  };
 };
 
 // Inodes per block.
@@ -69,23 +101,64 @@ struct dirent {
   char name[DIRSIZ] NONSTRING;
 };
 
+// Directory entries per block.
+#define DPB (BSIZE / sizeof(struct dirent))
+
+// A directory of more than one block is indexed: block 0 is the
+// root of a hash tree of one or two levels of index blocks over
+// leaf blocks, each leaf holding the entries whose name hashes
+// fall in a range. Index blocks read as free dirents, so code
+// that reads a directory as an array of them need not know.
+#define DIRHASHED 1  // dinode.major of an indexed directory
+
+// The entries of an index block. Entry 0 is a header, the rest
+// are in increasing order of hash, the first of them covering
+// all hashes below the second.
+struct dxentry {
+  ushort zero;   // 0, the inum of a free dirent
+  ushort count;  // header: entries in use, the header included
+  uint hash;     // least name hash under block
+  uint block;    // directory block number of a leaf or index block
+  uint depth;    // root header: levels of index blocks below the root
+};
+
+// Index entries per block.
+#define NDX (BSIZE / sizeof(struct dxentry))
+
+// FNV-1a hash of a directory entry name.
+static inline uint dirhash(const char *name) {
+  uint h = 2166136261U;
+
+  for (int i = 0; i < DIRSIZ && name[i]; i++)
+    h = (h ^ (unsigned char)name[i]) * 16777619U;
+  return h;
+}
+
 // fs.c APIs
 struct inode;
 void fsinit(int);
 int dirlink(struct inode *, char *, uint);
 struct inode *dirlookup(struct inode *, char *, uint *);
+uint fsdelayed(void);
 struct inode *idup(struct inode *);
+void iflush(struct inode *);
 void iinit(void);
 void ilock(struct inode *);
+void ilockread(struct inode *);
 void iput(struct inode *);
 void iunlock(struct inode *);
+void iunlockread(struct inode *);
 void iunlockput(struct inode *);
 void iupdate(struct inode *);
 int namecmp(const char *, const char *);
 struct inode *namei(char *);
 struct inode *nameiparent(char *, char *);
+int readdirect(struct inode *, uint64, uint, uint);
 int readi(struct inode *, int, uint64, uint, uint);
+void readpage(struct inode *, uint, char *);
 void stati(struct inode *, struct stat *);
+int writedirect(struct inode *, uint64, uint, uint);
 int writei(struct inode *, int, uint64, uint, uint);
+uint writeroom(struct inode *, uint, uint);
 void itrunc(struct inode *);
 void ireclaim(int);
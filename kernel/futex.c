@@ -0,0 +1,77 @@
+// Futexes: sleeping on a user word until another thread or
+// process changes it and wakes the sleepers.
+//
+// A futex is named by the physical address of its word, so
+// processes sharing the page through MAP_SHARED use the same
+// one. Waiters sleep on that address; the queue of the word's
+// page holds the lock that orders the value check in
+// FUTEX_WAIT against FUTEX_WAKE.
+
+#include "futex.h"
+
+#include "fcntl.h"
+#include "proc.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "types.h"
+#include "vm.h"
+
+#define NFUTEXQ 64
+#define FUTEXQ(pa) (&futexqs[((pa) >> PGSHIFT) % NFUTEXQ])
+
+static struct futexq {
+  struct spinlock lock;
+  int waiters;  // sleeping on words in the pages hashed here
+} futexqs[NFUTEXQ];
+
+void futexinit(void) {
+  for (int i = 0; i < NFUTEXQ; i++) initlock(&futexqs[i].lock, "futex");
+}
+
+// FUTEX_WAIT: if the int at user address addr holds val, sleep
+// until a FUTEX_WAKE on it; returns 0 once woken, -1 if the word
+// held something else or the caller was killed.
+// FUTEX_WAKE: wake up to val sleepers on addr, the most recent
+// first; returns how many.
+int kfutex(uint64 addr, int op, int val) {
+  struct proc *p = myproc();
+  struct futexq *fq;
+  uint64 pa;
+  int r, locked;
+
+  if (addr % sizeof(int) != 0) return -1;
+  if (op != FUTEX_WAIT && op != FUTEX_WAKE) return -1;
+
+  // both ops fault the page in writable, so that breaking
+  // copy-on-write does not move the word away from waiters.
+  // vmlock keeps the other threads from unmapping it before
+  // fq->lock is held.
+  locked = lockvm();
+  if ((pa = userpa(p->pagetable, addr, 1)) == 0) {
+    unlockvm(locked);
+    return -1;
+  }
+  fq = FUTEXQ(pa);
+  acquire(&fq->lock);
+  unlockvm(locked);
+
+  if (op == FUTEX_WAKE) {
+    r = val > 0 ? wakeupn((void *)pa, val) : 0;
+    release(&fq->lock);
+    return r;
+  }
+
+  if (*(volatile int *)pa != val || killed(p)) {
+    release(&fq->lock);
+    return -1;
+  }
+  fq->waiters++;
+  sleep((void *)pa, &fq->lock);
+  fq->waiters--;
+  release(&fq->lock);
+  return killed(p) ? -1 : 0;
+}
+
+// Whether a futex waiter may be sleeping on a word of the page
+// at pa, which must then stay put.
+int futex_busy(uint64 pa) { return FUTEXQ(pa)->waiters != 0; }
@@ -0,0 +1,8 @@
+#pragma once
+
+#include "types.h"
+
+// futex.c APIs
+void futexinit(void);
+int kfutex(uint64, int, int);
+int futex_busy(uint64);
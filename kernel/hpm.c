@@ -0,0 +1,161 @@
+//
+// hardware performance counters: cycle, instret and the
+// programmable hpmcounter3-6. Supervisor mode can only read the
+// counters, so each context switch charges the process what they
+// advanced by while it ran. Only machine mode can choose their
+// events; hpm(HPM_SELECT) asks it with an ecall (see mipivec).
+//
+
+#include "hpm.h"
+
+#include "param.h"
+#include "proc.h"
+#include "riscv.h"
+#include "sleeplock.h"
+#include "string.h"
+#include "trap.h"
+#include "types.h"
+#include "vm.h"
+
+// One hart's counting. Only that hart changes it.
+struct hpmcpu {
+  uint gen;                 // the HPM_SELECT the counters follow
+  uint startgen;            // gen when start was read
+  uint64 start[NHPMCOUNT];  // the counters as the process began to run
+  uint64 total[NHPMCOUNT];  // charged to processes since the select
+} __attribute__((aligned(64)));
+
+static struct {
+  struct sleeplock lock;  // serializes HPM_SELECT
+  volatile uint gen;      // HPM_SELECTs made
+  uint64 event[NHPMCOUNT];
+  struct hpmcpu cpu[NCPU];
+} hpm = {.event = {HPM_CYCLES, HPM_INSTRUCTIONS}};
+
+static void readcounters(uint64 *v) {
+  asm volatile("csrr %0, cycle" : "=r"(v[0]));
+  asm volatile("csrr %0, instret" : "=r"(v[1]));
+  asm volatile("csrr %0, hpmcounter3" : "=r"(v[2]));
+  asm volatile("csrr %0, hpmcounter4" : "=r"(v[3]));
+  asm volatile("csrr %0, hpmcounter5" : "=r"(v[4]));
+  asm volatile("csrr %0, hpmcounter6" : "=r"(v[5]));
+}
+
+// in kernelvec.S: has machine mode make hpmcounter(3+i) count
+// event.
+extern void setevent(int i, uint64 event);
+
+void hpminit(void) { initsleeplock(&hpm.lock, "hpm"); }
+
+// Let user code read the counters too, with rdcycle and the like.
+void hpminithart(void) { w_scounteren(r_scounteren() | 0x7f); }
+
+// Program this hart's counters for the latest HPM_SELECT if they
+// are not yet, from the ipi() it sent. Called with interrupts off.
+void hpmsync(void) {
+  struct hpmcpu *c = &hpm.cpu[cpuid()];
+  struct proc *p = mycpu()->proc;
+  uint gen = hpm.gen;
+
+  if (c->gen == gen) return;
+  __sync_synchronize();
+  // charge p what it ran under the old events.
+  if (p) hpmstop(p);
+  for (int i = 0; i < NHPM; i++) setevent(i, hpm.event[HPM_COUNTER(i)]);
+  memset(c->total, 0, sizeof(c->total));
+  c->gen = gen;
+  if (p) hpmstart();
+}
+
+// From scheduler(): the process it is about to switch to starts
+// running on this hart.
+void hpmstart(void) {
+  struct hpmcpu *c = &hpm.cpu[cpuid()];
+
+  c->startgen = c->gen;
+  readcounters(c->start);
+}
+
+// Charge p, which has stopped running on this hart, with what
+// the counters advanced by since hpmstart(). A select while it
+// ran zeroes its counts.
+void hpmstop(struct proc *p) {
+  struct hpmcpu *c = &hpm.cpu[cpuid()];
+  uint64 now[NHPMCOUNT];
+
+  readcounters(now);
+  if (p->hpmgen != c->gen) {
+    memset(p->hpm, 0, sizeof(p->hpm));
+    p->hpmgen = c->gen;
+  }
+  if (c->startgen != c->gen) return;
+  for (int i = 0; i < NHPMCOUNT; i++) {
+    p->hpm[i] += now[i] - c->start[i];
+    c->total[i] += now[i] - c->start[i];
+  }
+}
+
+// From wait(): add the counts of p's exited child to p's.
+// Caller holds the lock of the child.
+void hpmreap(struct proc *p, struct proc *child) {
+  for (int i = 0; i < NHPMCOUNT; i++) {
+    if (child->hpmgen == hpm.gen) p->hpmchild[i] += child->hpm[i];
+    p->hpmchild[i] += child->hpmchild[i];
+  }
+}
+
+// Add what the counters advanced by since p, the caller, began
+// running on this hart to hc.
+static void live(struct hpmcount *hc) {
+  struct hpmcpu *c;
+  uint64 now[NHPMCOUNT];
+
+  push_off();
+  c = &hpm.cpu[cpuid()];
+  readcounters(now);
+  if (c->startgen == hpm.gen)
+    for (int i = 0; i < NHPMCOUNT; i++) hc->count[i] += now[i] - c->start[i];
+  pop_off();
+}
+
+// hpm(): HPM_SELECT has the counters count the NHPM events at
+// addr from now on; the other operations copy a struct hpmcount
+// out to addr. Returns 0, or -1.
+int khpm(int op, uint64 addr, int n) {
+  struct proc *p = myproc(), *q;
+  struct hpmcount hc;
+  uint64 event[NHPM];
+
+  memset(&hc, 0, sizeof(hc));
+  switch (op) {
+    case HPM_SELECT:
+      if (copyin(p->pagetable, (char *)event, addr, sizeof(event)) < 0)
+        return -1;
+      acquiresleep(&hpm.lock);
+      for (int i = 0; i < NHPM; i++) hpm.event[HPM_COUNTER(i)] = event[i];
+      __sync_synchronize();
+      hpm.gen++;
+      __sync_synchronize();
+      for (int i = 0; i < NCPU; i++) ipi(i);
+      releasesleep(&hpm.lock);
+      return 0;
+    case HPM_GET:
+      if ((q = findproc(n ? n : p->pid)) == 0) return -1;
+      if (q->hpmgen == hpm.gen) memmove(hc.count, q->hpm, sizeof(hc.count));
+      if (q == p) live(&hc);
+      release(&q->lock);
+      break;
+    case HPM_CHILDREN:
+      memmove(hc.count, p->hpmchild, sizeof(hc.count));
+      break;
+    case HPM_SYSTEM:
+      for (struct hpmcpu *c = hpm.cpu; c < hpm.cpu + NCPU; c++)
+        if (c->gen == hpm.gen)
+          for (int i = 0; i < NHPMCOUNT; i++) hc.count[i] += c->total[i];
+      break;
+    default:
+      return -1;
+  }
+  memmove(hc.event, hpm.event, sizeof(hc.event));
+  return copyout(p->pagetable, addr, (char *)&hc, sizeof(hc));
+}
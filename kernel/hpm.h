@@ -0,0 +1,45 @@
+#pragma once
+
+#include "types.h"
+
+// hpm() operations
+#define HPM_SELECT 0    // count events addr[0..NHPM) from now on
+#define HPM_GET 1       // the counts of process n (the caller if 0)
+#define HPM_CHILDREN 2  // the counts of the caller's reaped children
+#define HPM_SYSTEM 3    // the counts of all processes
+
+#define NHPM 4                // programmable counters, hpmcounter3-6
+#define NHPMCOUNT (2 + NHPM)  // with cycle and instret
+
+// struct hpmcount count[] indices
+#define HPM_CYCLE 0
+#define HPM_INSTRET 1
+#define HPM_COUNTER(i) (2 + (i))
+
+// Event codes for HPM_SELECT, numbered as by the SBI PMU
+// extension. Which ones count depends on the hart: QEMU's count
+// TLB misses, but not cache or branch misses.
+#define HPM_NONE 0
+#define HPM_CYCLES 0x1
+#define HPM_INSTRUCTIONS 0x2
+#define HPM_CACHE_MISS 0x4
+#define HPM_BRANCH_MISS 0x6
+#define HPM_DTLB_READ_MISS 0x10019
+#define HPM_DTLB_WRITE_MISS 0x1001b
+#define HPM_ITLB_MISS 0x10021
+
+// Counts since the last HPM_SELECT, from hpm().
+struct hpmcount {
+  uint64 count[NHPMCOUNT];
+  uint64 event[NHPMCOUNT];  // what each counted
+};
+
+struct proc;
+
+void hpminit(void);
+void hpminithart(void);
+void hpmsync(void);
+void hpmstart(void);
+void hpmstop(struct proc *);
+void hpmreap(struct proc *, struct proc *);
+int khpm(int, uint64, int);
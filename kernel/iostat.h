@@ -0,0 +1,20 @@
+#pragma once
+
+#include "diskstat.h"
+#include "types.h"
+
+// iostat() operations
+#define IOSTAT_GET 0    // copy out the statistics
+#define IOSTAT_RESET 1  // zero them
+
+// Block I/O statistics, from iostat(), for telling cache misses
+// from a slow disk. Counting is always on.
+struct iostat {
+  struct diskstat disk;
+  uint64 bhit;             // bread()s that found the block cached
+  uint64 bmiss;            // bread()s that read the disk
+  uint64 ncommit;          // log transactions committed
+  uint64 commitblocks;     // blocks in them
+  uint64 maxcommit;        // blocks in the biggest
+  uint64 commitlat[NLAT];  // commits by time from close to install
+};
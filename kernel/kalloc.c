@@ -1,12 +1,36 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers.
+//
+// All of RAM between the end of the kernel and PHYSTOP is managed
+// by a binary buddy allocator with blocks of 2^order pages, from
+// single 4096-byte pages (order 0) up to 2MB superpages
+// (BUDDY_MAXORDER). kalloc() and kfree() hand out order-0 pages
+// through per-CPU caches; superalloc() and superfree() take whole
+// order-9 blocks from the same pool.
+//
+// Boot puts only the unaligned edges of RAM on the free lists. The
+// superpage-aligned middle stays one untouched range that the
+// buddy allocator carves a 2MB block at a time when its lists run
+// dry, so boot time does not grow with the size of RAM. When no
+// 2MB block is left, uvmcompact() can empty one by moving user
+// pages out of it (see kcompact_begin()).
+//
+// kalloc_zeroed() serves pages that idle harts zeroed ahead of time.
+// Build with -DKALLOC_DEBUG to fill pages with junk on kalloc() and
+// kfree(), which catches uses of uninitialized or freed memory.
 
 #include "kalloc.h"
 
+#include "bio.h"
+#include "meminfo.h"
 #include "memlayout.h"
+#include "pagecache.h"
+#include "param.h"
 #include "printf.h"
+#include "proc.h"
 #include "riscv.h"
+#include "slab.h"
 #include "spinlock.h"
 #include "string.h"
 #include "types.h"
@@ -16,127 +40,691 @@ void freerange(void *pa_start, void *pa_end);
 extern char end[];  // first address after kernel.
                     // defined by kernel.ld.
 
+// A free block. Lives in the first bytes of the block itself.
 struct run {
   struct run *next;
+  struct run *prev;
 };
 
+// Per-page metadata, indexed by physical page number.
+struct page pages[NPAGES];
+
+// Buddy free lists, one per order, protected by kmem.lock.
 struct {
   struct spinlock lock;
-  struct run *freelist;
+  struct run free[BUDDY_MAXORDER + 1];  // list heads (circular)
+  uint64 nfree;                         // free 4K pages, all orders
+  char *start;                          // first managed page
+  char *lazy;     // [lazy, lazyend) is free but on no list yet
+  char *lazyend;
+  uint64 nsuper;  // superpages allocated, not yet freed or split
+  uint64 ncompact;  // 2MB blocks compaction has freed
 } kmem;
 
-// Superpage allocator for 2MB pages
-#define NSUPERPAGES 8  // Number of 2MB superpages to reserve
+// Per-CPU page caches in front of the buddy lists.
+// kalloc() and kfree() normally touch only the local hart's list,
+// moving pages to and from the buddy allocator KMEM_BATCH at a time.
+// Each list has its own lock only so that an empty hart can steal
+// from the others; the owner almost never finds it contended.
+#define KMEM_BATCH 32  // pages moved per refill or drain
+#define KMEM_HIGH 128  // drain to the buddy allocator above this
 
-struct superrun {
-  struct superrun *next;
+struct kmem_pcp {
+  struct spinlock lock;
+  struct run *freelist;  // singly linked through run.next
+  int count;
 };
 
+struct kmem_pcp kmem_pcp[NCPU];
+
+// Pages zeroed by idle harts for kalloc_zeroed().
+#define KZERO_HIGH 64   // pool size idle harts fill up to
+#define KZERO_BATCH 8   // pages zeroed per idle pass
+#define KZERO_MINFREE (4 * KZERO_HIGH)  // leave the pool alone below this
+
 struct {
   struct spinlock lock;
-  struct superrun *freelist;
-  char *superpage_start;  // Start of reserved superpage region
-} supermem;
+  struct run *list;  // singly linked through run.next
+  int count;
+} kzero;
 
-void kinit() {
-  initlock(&kmem.lock, "kmem");
-  initlock(&supermem.lock, "supermem");
+#ifdef KALLOC_DEBUG
+#define junk(pa, c, n) memset((pa), (c), (n))
+#else
+#define junk(pa, c, n) ((void)(pa))
+#endif
+
+struct page *pa2page(void *pa) {
+  return &pages[((uint64)pa - KERNBASE) >> PGSHIFT];
+}
+
+void *page2pa(struct page *pg) {
+  return (void *)(KERNBASE + ((uint64)(pg - pages) << PGSHIFT));
+}
+
+static void list_init(struct run *head) { head->next = head->prev = head; }
+
+static void list_push(struct run *head, struct run *r) {
+  r->next = head->next;
+  r->prev = head;
+  head->next->prev = r;
+  head->next = r;
+}
+
+static void list_del(struct run *r) {
+  r->prev->next = r->next;
+  r->next->prev = r->prev;
+}
+
+// Put a block of 2^order pages on the free lists, merging it with
+// its buddy for as long as the buddy is also free.
+// Caller must hold kmem.lock.
+static void buddy_free_locked(char *pa, int order) {
+  if (pa2page(pa)->flags & PG_BUDDY) panic("buddy_free: double free");
+  kmem.nfree += 1L << order;
+
+  while (order < BUDDY_MAXORDER) {
+    char *buddy = (char *)((uint64)pa ^ ((uint64)PGSIZE << order));
+    if (buddy < kmem.start ||
+        buddy + ((uint64)PGSIZE << order) > (char *)PHYSTOP)
+      break;
+    struct page *bp = pa2page(buddy);
+    if (!(bp->flags & PG_BUDDY) || bp->order != order) break;
+    list_del((struct run *)buddy);
+    bp->flags &= ~PG_BUDDY;
+    if (buddy < pa) pa = buddy;
+    order++;
+  }
+
+  struct page *pg = pa2page(pa);
+  pg->flags |= PG_BUDDY;
+  pg->order = order;
+  list_push(&kmem.free[order], (struct run *)pa);
+}
+
+// Take a block of 2^order pages off the free lists, splitting
+// a larger block if necessary. Returns 0 if none is left.
+// Caller must hold kmem.lock.
+static char *buddy_alloc_locked(int order) {
+  int o;
 
-  // Reserve 2MB-aligned region for superpages
-  // Start from the first 2MB-aligned address after 'end'
-  char *p = (char *)SUPERPGROUNDUP((uint64)end);
-  supermem.superpage_start = p;
-  supermem.freelist = 0;
+  for (o = order; o <= BUDDY_MAXORDER; o++)
+    if (kmem.free[o].next != &kmem.free[o]) break;
+  if (o > BUDDY_MAXORDER) {
+    if (kmem.lazy == kmem.lazyend) return 0;
+    // carve the next block off the untouched range.
+    o = BUDDY_MAXORDER;
+    list_push(&kmem.free[o], (struct run *)kmem.lazy);
+    pa2page(kmem.lazy)->flags |= PG_BUDDY;
+    pa2page(kmem.lazy)->order = o;
+    junk(kmem.lazy, 1, SUPERPGSIZE);
+    kmem.lazy += SUPERPGSIZE;
+  }
+
+  char *pa = (char *)kmem.free[o].next;
+  list_del((struct run *)pa);
+  pa2page(pa)->flags &= ~PG_BUDDY;
+
+  // give back the upper halves until the block is the right size.
+  while (o > order) {
+    o--;
+    char *upper = pa + ((uint64)PGSIZE << o);
+    struct page *up = pa2page(upper);
+    up->flags |= PG_BUDDY;
+    up->order = o;
+    list_push(&kmem.free[o], (struct run *)upper);
+  }
+
+  kmem.nfree -= 1L << order;
+  return pa;
+}
+
+// Take a block of 2^order pages off the free lists, shrinking
+// the buffer and slab caches and retrying once if none is free.
+// Called without any kmem lock held.
+static char *buddy_alloc(int order) {
+  char *pa;
 
-  // Add NSUPERPAGES 2MB pages to superpage freelist
-  for (int i = 0; i < NSUPERPAGES; i++) {
-    struct superrun *r = (struct superrun *)p;
-    r->next = supermem.freelist;
-    supermem.freelist = r;
-    p += SUPERPGSIZE;
+  for (int pass = 0; pass < 2; pass++) {
+    acquire(&kmem.lock);
+    pa = buddy_alloc_locked(order);
+    release(&kmem.lock);
+    if (pa || pass == 1) break;
+    // free buffers go back to their slabs, which may then
+    // be empty.
+    bshrink();
+    if (slab_reclaim() == 0) break;
   }
+  return pa;
+}
+
+void kinit() {
+  initmcslock(&kmem.lock, "kmem");
+  for (int i = 0; i <= BUDDY_MAXORDER; i++) list_init(&kmem.free[i]);
+  for (int i = 0; i < NCPU; i++) initlock(&kmem_pcp[i].lock, "kmem_pcp");
+  initlock(&kzero.lock, "kzero");
 
-  // Free the rest to normal page allocator
-  freerange(p, (void *)PHYSTOP);
+  kmem.start = (char *)PGROUNDUP((uint64)end);
+  kmem.lazy = (char *)SUPERPGROUNDUP((uint64)kmem.start);
+  kmem.lazyend = (char *)SUPERPGROUNDDOWN(PHYSTOP);
+  if (kmem.lazy > kmem.lazyend) kmem.lazy = kmem.lazyend = kmem.start;
+  freerange(kmem.start, kmem.lazy);
+  freerange(kmem.lazyend, (void *)PHYSTOP);
+  kmem.nfree += (kmem.lazyend - kmem.lazy) / PGSIZE;
 }
 
+// Hand [pa_start, pa_end) to the buddy allocator as the largest
+// naturally aligned blocks that fit. The per-CPU caches fill up
+// on demand.
 void freerange(void *pa_start, void *pa_end) {
-  char *p;
-  p = (char *)PGROUNDUP((uint64)pa_start);
-  for (; p + PGSIZE <= (char *)pa_end; p += PGSIZE) kfree(p);
+  char *p = (char *)PGROUNDUP((uint64)pa_start);
+
+  acquire(&kmem.lock);
+  while (p + PGSIZE <= (char *)pa_end) {
+    int order = BUDDY_MAXORDER;
+    while (order > 0 && (((uint64)p % ((uint64)PGSIZE << order)) != 0 ||
+                         p + ((uint64)PGSIZE << order) > (char *)pa_end))
+      order--;
+    junk(p, 1, (uint64)PGSIZE << order);
+    buddy_free_locked(p, order);
+    p += (uint64)PGSIZE << order;
+  }
+  release(&kmem.lock);
+}
+
+// Detach up to n pages from the head of a per-CPU list.
+// Returns the chain and sets *got to its length.
+static struct run *take_pages(struct run **list, int n, int *got) {
+  struct run *head = *list, *r = *list;
+  int i = 0;
+
+  if (r == 0) {
+    *got = 0;
+    return 0;
+  }
+  for (i = 1; i < n && r->next; i++) r = r->next;
+  *list = r->next;
+  r->next = 0;
+  *got = i;
+  return head;
+}
+
+// Take a page off the zeroed pool, or return 0 if it is empty.
+// Only the first word of a pooled page is non-zero.
+static char *kzero_pop(void) {
+  struct run *r;
+
+  acquire(&kzero.lock);
+  r = kzero.list;
+  if (r) {
+    kzero.list = r->next;
+    kzero.count--;
+  }
+  release(&kzero.lock);
+  if (r) r->next = 0;
+  return (char *)r;
+}
+
+// Refill an empty per-CPU list, first from the buddy allocator and
+// then by stealing half of some other hart's cache.
+// Called without any kmem lock held.
+static struct run *refill(int id, int *got) {
+  struct run *chain = 0;
+  char *pa;
+  int n = 0;
+
+  acquire(&kmem.lock);
+  while (n < KMEM_BATCH && (pa = buddy_alloc_locked(0)) != 0) {
+    ((struct run *)pa)->next = chain;
+    chain = (struct run *)pa;
+    n++;
+  }
+  release(&kmem.lock);
+  if (chain) {
+    *got = n;
+    return chain;
+  }
+
+  for (int i = 1; i < NCPU; i++) {
+    struct kmem_pcp *victim = &kmem_pcp[(id + i) % NCPU];
+    if (victim->count == 0) continue;  // racy peek, rechecked below
+    acquire(&victim->lock);
+    chain = take_pages(&victim->freelist, (victim->count + 1) / 2, got);
+    victim->count -= *got;
+    release(&victim->lock);
+    if (chain) return chain;
+  }
+
+  // Cached file pages that nothing maps are freed onto this
+  // hart's list, or past KMEM_HIGH back to the buddy allocator.
+  if (pagecache_reclaim() > 0) {
+    struct kmem_pcp *pcp = &kmem_pcp[id];
+    acquire(&pcp->lock);
+    chain = take_pages(&pcp->freelist, KMEM_BATCH, got);
+    pcp->count -= *got;
+    release(&pcp->lock);
+    if (chain) return chain;
+  }
+
+  // Last resort: buddy_alloc() shrinks the slab caches, and
+  // failing that the pre-zeroed pool gives up a page.
+  if ((pa = buddy_alloc(0)) != 0 || (pa = kzero_pop()) != 0) {
+    ((struct run *)pa)->next = 0;
+    *got = 1;
+    return (struct run *)pa;
+  }
+  *got = 0;
+  return 0;
+}
+
+// Check that pa is a page the allocator hands out.
+static void checkpa(void *pa, uint64 align, char *who) {
+  if (((uint64)pa % align) != 0 || (char *)pa < kmem.start ||
+      (uint64)pa >= PHYSTOP) {
+    printf("%s bad pa=%p end=%p PHYSTOP=0x%x\n", who, pa, end, PHYSTOP);
+    panic(who);
+  }
+}
+
+// Take another reference to an allocated page or superpage,
+// e.g. when fork shares it copy-on-write.
+void kref(void *pa) {
+  checkpa(pa, PGSIZE, "kref");
+  __sync_fetch_and_add(&pa2page(pa)->refcnt, 1);
+}
+
+// Number of references to an allocated page or superpage.
+uint krefcnt(void *pa) { return pa2page(pa)->refcnt; }
+
+// Drop a reference to pa; returns the number left.
+static uint kunref(void *pa, char *who) {
+  uint old = __sync_fetch_and_sub(&pa2page(pa)->refcnt, 1);
+  if (old == 0) panic(who);
+  return old - 1;
 }
 
 // Free the page of physical memory pointed at by pa,
 // which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// call to kalloc(). A shared page is only freed
+// once its last reference is dropped.
 void kfree(void *pa) {
-  struct run *r;
+  struct run *r, *drain = 0;
+  struct kmem_pcp *pcp;
+  int n;
 
-  if (((uint64)pa % PGSIZE) != 0 || (char *)pa < end || (uint64)pa >= PHYSTOP) {
-    printf("kfree bad pa=%p end=%p PHYSTOP=0x%x\n", pa, end, PHYSTOP);
-    panic("kfree");
-  }
+  checkpa(pa, PGSIZE, "kfree");
+  if (kunref(pa, "kfree: refcnt") > 0) return;
 
   // Fill with junk to catch dangling refs.
-  memset(pa, 1, PGSIZE);
+  junk(pa, 1, PGSIZE);
 
   r = (struct run *)pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  push_off();
+  pcp = &kmem_pcp[cpuid()];
+  acquire(&pcp->lock);
+  r->next = pcp->freelist;
+  pcp->freelist = r;
+  pcp->count++;
+  if (pcp->count > KMEM_HIGH) {
+    drain = take_pages(&pcp->freelist, KMEM_BATCH, &n);
+    pcp->count -= n;
+  }
+  release(&pcp->lock);
+  pop_off();
+
+  if (drain) {
+    acquire(&kmem.lock);
+    while (drain) {
+      r = drain;
+      drain = r->next;
+      buddy_free_locked((char *)r, 0);
+    }
+    release(&kmem.lock);
+  }
 }
 
 // Allocate one 4096-byte page of physical memory.
 // Returns a pointer that the kernel can use.
 // Returns 0 if the memory cannot be allocated.
 void *kalloc(void) {
-  struct run *r;
+  struct run *r, *chain;
+  struct kmem_pcp *pcp;
+  int id, n;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if (r) kmem.freelist = r->next;
-  release(&kmem.lock);
+  push_off();
+  id = cpuid();
+  pcp = &kmem_pcp[id];
+  acquire(&pcp->lock);
+  r = pcp->freelist;
+  if (r) {
+    pcp->freelist = r->next;
+    pcp->count--;
+  }
+  release(&pcp->lock);
+
+  if (r == 0 && (chain = refill(id, &n)) != 0) {
+    // keep the first page, cache the rest locally.
+    r = chain;
+    acquire(&pcp->lock);
+    if (r->next) {
+      struct run *t;
+      for (t = r->next; t->next; t = t->next);
+      t->next = pcp->freelist;
+      pcp->freelist = r->next;
+      pcp->count += n - 1;
+    }
+    release(&pcp->lock);
+  }
+  pop_off();
 
-  if (r) memset((char *)r, 5, PGSIZE);  // fill with junk
+  if (r) {
+    pa2page(r)->refcnt = 1;
+    junk((char *)r, 5, PGSIZE);  // fill with junk
+  }
   return (void *)r;
 }
 
+// Allocate one zero-filled 4096-byte page of physical memory.
+// Returns 0 if the memory cannot be allocated.
+void *kalloc_zeroed(void) {
+  char *pa;
+
+  if ((pa = kzero_pop()) != 0) return pa;
+  if ((pa = kalloc()) != 0) memset(pa, 0, PGSIZE);
+  return pa;
+}
+
+// Allocate up to n zero-filled pages into pa[], taking the
+// pre-zeroed pool and this hart's cache a run at a time rather
+// than locking once per page. Returns the number allocated, which
+// is less than n only if memory ran out.
+int kalloc_batch(void **pa, int n) {
+  struct run *r, *chain;
+  struct kmem_pcp *pcp;
+  int got = 0, k, id;
+
+  acquire(&kzero.lock);
+  while (got < n && (r = kzero.list) != 0) {
+    kzero.list = r->next;
+    kzero.count--;
+    r->next = 0;
+    pa[got++] = r;
+  }
+  release(&kzero.lock);
+
+  while (got < n) {
+    push_off();
+    id = cpuid();
+    pcp = &kmem_pcp[id];
+    acquire(&pcp->lock);
+    chain = take_pages(&pcp->freelist, n - got, &k);
+    pcp->count -= k;
+    release(&pcp->lock);
+    if (chain == 0 && (chain = refill(id, &k)) != 0 && k > n - got) {
+      // cache what this call does not need.
+      struct run *t = take_pages(&chain, n - got, &k);
+      struct run *last;
+      int extra = 0;
+      for (last = chain; last->next; last = last->next) extra++;
+      acquire(&pcp->lock);
+      last->next = pcp->freelist;
+      pcp->freelist = chain;
+      pcp->count += extra + 1;
+      release(&pcp->lock);
+      chain = t;
+    }
+    pop_off();
+    if (chain == 0) break;
+
+    for (r = chain; r; r = chain) {
+      chain = r->next;
+      pa2page(r)->refcnt = 1;
+      memset(r, 0, PGSIZE);
+      pa[got++] = r;
+    }
+  }
+  return got;
+}
+
+// Zero a few free pages into the kalloc_zeroed() pool.
+// Called by the scheduler on an idle hart.
+// Returns the number of pages zeroed.
+int kalloc_idle(void) {
+  int n;
+
+  for (n = 0; n < KZERO_BATCH; n++) {
+    // racy peeks; a page too many in the pool does no harm.
+    if (kzero.count >= KZERO_HIGH || kmem.nfree < KZERO_MINFREE) break;
+    struct run *r = (struct run *)kalloc();
+    if (r == 0) break;
+    memset(r, 0, PGSIZE);
+    acquire(&kzero.lock);
+    r->next = kzero.list;
+    kzero.list = r;
+    kzero.count++;
+    release(&kzero.lock);
+  }
+  return n;
+}
+
 // Allocate one 2MB superpage of physical memory.
 // Returns a 2MB-aligned pointer that the kernel can use.
-// Returns 0 if the memory cannot be allocated.
+// Returns 0 if no free 2MB block is left.
 void *superalloc(void) {
-  struct superrun *r;
+  char *pa;
 
-  acquire(&supermem.lock);
-  r = supermem.freelist;
-  if (r) supermem.freelist = r->next;
-  release(&supermem.lock);
+  pa = buddy_alloc(BUDDY_MAXORDER);
 
-  if (r) memset((char *)r, 0, SUPERPGSIZE);  // zero out the superpage
-  return (void *)r;
+  if (pa) {
+    pa2page(pa)->refcnt = 1;
+    memset(pa, 0, SUPERPGSIZE);  // zero out the superpage
+    __sync_fetch_and_add(&kmem.nsuper, 1);
+  }
+  return (void *)pa;
+}
+
+// Make the unshared superpage at pa 512 separately freed pages,
+// for demote_superpage().
+void supersplit(void *pa) {
+  checkpa(pa, SUPERPGSIZE, "supersplit");
+  for (uint64 i = PGSIZE; i < SUPERPGSIZE; i += PGSIZE)
+    pa2page((char *)pa + i)->refcnt = 1;
+  __sync_fetch_and_sub(&kmem.nsuper, 1);
 }
 
-// Free a 2MB superpage of physical memory pointed at by pa.
+// Free a 2MB superpage of physical memory pointed at by pa,
+// once its last reference is dropped.
 // pa must be 2MB-aligned.
 void superfree(void *pa) {
-  struct superrun *r;
+  checkpa(pa, SUPERPGSIZE, "superfree");
+  if (kunref(pa, "superfree: refcnt") > 0) return;
+  __sync_fetch_and_sub(&kmem.nsuper, 1);
 
-  if (((uint64)pa % SUPERPGSIZE) != 0 || (char *)pa < supermem.superpage_start ||
-      (uint64)pa >= (uint64)(supermem.superpage_start + NSUPERPAGES * SUPERPGSIZE)) {
-    printf("superfree bad pa=%p\n", pa);
-    panic("superfree");
+  // Fill with junk to catch dangling refs
+  junk(pa, 1, SUPERPGSIZE);
+
+  acquire(&kmem.lock);
+  buddy_free_locked((char *)pa, BUDDY_MAXORDER);
+  release(&kmem.lock);
+}
+
+// Compaction. kcompact_begin() takes the free pages of a 2MB
+// block off the buddy lists, so that nothing else allocates them
+// while the caller moves the block's other pages elsewhere and
+// hands each back with kcompact_put(). kcompact_end() then frees
+// the block, as a whole if every page came back.
+
+// Put a chain of pages linked through run.next on the buddy lists.
+static void free_chain(struct run *chain) {
+  struct run *r;
+
+  acquire(&kmem.lock);
+  while ((r = chain) != 0) {
+    chain = r->next;
+    buddy_free_locked((char *)r, 0);
   }
+  release(&kmem.lock);
+}
 
-  // Fill with junk to catch dangling refs
-  memset(pa, 1, SUPERPGSIZE);
+// Give the per-CPU lists and the zeroed pool back to the buddy
+// lists, so that kfreein() counts the pages they hold.
+void kdrain(void) {
+  struct run *chain;
+  int n;
+
+  for (int i = 0; i < NCPU; i++) {
+    acquire(&kmem_pcp[i].lock);
+    chain = take_pages(&kmem_pcp[i].freelist, kmem_pcp[i].count, &n);
+    kmem_pcp[i].count -= n;
+    release(&kmem_pcp[i].lock);
+    free_chain(chain);
+  }
+  acquire(&kzero.lock);
+  chain = kzero.list;
+  kzero.list = 0;
+  kzero.count = 0;
+  release(&kzero.lock);
+  free_chain(chain);
+}
+
+// Free pages in the 2MB block at pa. Caller must hold kmem.lock.
+static int freein_locked(char *pa) {
+  int n = 0;
+
+  for (char *p = pa; p < pa + SUPERPGSIZE;) {
+    struct page *pg = pa2page(p);
+    if (pg->flags & PG_BUDDY) {
+      n += 1 << pg->order;
+      p += (uint64)PGSIZE << pg->order;
+    } else {
+      p += PGSIZE;
+    }
+  }
+  return n;
+}
 
-  r = (struct superrun *)pa;
+// Free pages on the buddy lists in the 2MB block at pa, or -1 if
+// the allocator does not manage all of the block.
+int kfreein(void *pa) {
+  int n;
 
-  acquire(&supermem.lock);
-  r->next = supermem.freelist;
-  supermem.freelist = r;
-  release(&supermem.lock);
+  if ((uint64)pa % SUPERPGSIZE || (char *)pa < kmem.start ||
+      (uint64)pa + SUPERPGSIZE > PHYSTOP)
+    return -1;
+  acquire(&kmem.lock);
+  n = freein_locked(pa);
+  release(&kmem.lock);
+  return n;
+}
+
+// Isolate the free pages of the 2MB block at pa, if no more than
+// movable of its pages are in use. Returns 0, or -1 if more are.
+int kcompact_begin(void *pa, int movable) {
+  char *p;
+
+  if (kfreein(pa) < 0) return -1;
+  acquire(&kmem.lock);
+  if (freein_locked(pa) + movable < 512) {
+    release(&kmem.lock);
+    return -1;
+  }
+  for (p = pa; p < (char *)pa + SUPERPGSIZE;) {
+    struct page *pg = pa2page(p);
+    if ((pg->flags & PG_BUDDY) == 0) {
+      p += PGSIZE;
+      continue;
+    }
+    int n = 1 << pg->order;
+    list_del((struct run *)p);
+    kmem.nfree -= n;
+    for (int i = 0; i < n; i++, p += PGSIZE)
+      pa2page(p)->flags = (pa2page(p)->flags & ~PG_BUDDY) | PG_ISOLATED;
+  }
+  release(&kmem.lock);
+  return 0;
+}
+
+// Drop the last reference to a page moved out of the block being
+// compacted, which keeps it.
+void kcompact_put(void *pa) {
+  checkpa(pa, PGSIZE, "kcompact_put");
+  if (kunref(pa, "kcompact_put: refcnt") > 0) panic("kcompact_put: shared");
+  junk(pa, 1, PGSIZE);
+  acquire(&kmem.lock);
+  pa2page(pa)->flags |= PG_ISOLATED;
+  release(&kmem.lock);
+}
+
+// Free the isolated pages of the 2MB block at pa. Returns 0 if
+// that was all of them, which become one free block, or -1.
+int kcompact_end(void *pa) {
+  char *p;
+  int whole = 1;
+
+  acquire(&kmem.lock);
+  for (p = pa; p < (char *)pa + SUPERPGSIZE && whole; p += PGSIZE)
+    if ((pa2page(p)->flags & PG_ISOLATED) == 0) whole = 0;
+  for (p = pa; p < (char *)pa + SUPERPGSIZE; p += PGSIZE) {
+    struct page *pg = pa2page(p);
+    if ((pg->flags & PG_ISOLATED) == 0) continue;
+    pg->flags &= ~PG_ISOLATED;
+    if (!whole) buddy_free_locked(p, 0);
+  }
+  if (whole) {
+    buddy_free_locked(pa, BUDDY_MAXORDER);
+    kmem.ncompact++;
+  }
+  release(&kmem.lock);
+  return whole ? 0 : -1;
+}
+
+// Allocate 2^order physically contiguous pages, aligned to their
+// size. Returns 0 if no such block is free.
+void *kalloc_order(int order) {
+  char *pa;
+
+  if (order == 0) return kalloc();
+  if (order < 0 || order > BUDDY_MAXORDER) return 0;
+  pa = buddy_alloc(order);
+
+  if (pa) junk(pa, 5, (uint64)PGSIZE << order);  // fill with junk
+  return (void *)pa;
+}
+
+// Free a block from kalloc_order(order).
+void kfree_order(void *pa, int order) {
+  if (order == 0) {
+    kfree(pa);
+    return;
+  }
+  if (order < 0 || order > BUDDY_MAXORDER) panic("kfree_order");
+  checkpa(pa, (uint64)PGSIZE << order, "kfree_order");
+
+  junk(pa, 1, (uint64)PGSIZE << order);
+
+  acquire(&kmem.lock);
+  buddy_free_locked((char *)pa, order);
+  release(&kmem.lock);
+}
+
+// Number of free 4K pages in the buddy allocator,
+// not counting the per-CPU caches.
+uint64 kfreepages(void) { return kmem.nfree; }
+
+// Fill in the page allocator's part of mi. The per-CPU and
+// zeroed counts are read without their locks.
+void kmemstat(struct meminfo *mi) {
+  struct run *head = &kmem.free[BUDDY_MAXORDER];
+
+  acquire(&kmem.lock);
+  mi->total = ((char *)PHYSTOP - kmem.start) / PGSIZE;
+  mi->free = kmem.nfree;
+  mi->superfree = (kmem.lazyend - kmem.lazy) / SUPERPGSIZE;
+  for (struct run *r = head->next; r != head; r = r->next) mi->superfree++;
+  release(&kmem.lock);
+  mi->superused = kmem.nsuper;
+  mi->compacted = kmem.ncompact;
+  for (int i = 0; i < NCPU; i++) mi->cached += kmem_pcp[i].count;
+  mi->zeroed = kzero.count;
 }
@@ -1,9 +1,58 @@
 #pragma once
 
+#include "memlayout.h"
+#include "riscv.h"
+#include "types.h"
+
+// Largest buddy block: 2^9 pages = one 2MB superpage.
+#define BUDDY_MAXORDER (SUPERPGSHIFT - PGSHIFT)
+
+// Number of physical pages between KERNBASE and PHYSTOP.
+#define NPAGES ((PHYSTOP - KERNBASE) / PGSIZE)
+
+// page flags
+#define PG_BUDDY (1 << 0)     // head of a free block on a buddy list
+#define PG_ISOLATED (1 << 1)  // free, but kept off the lists by compaction
+
+struct meminfo;
+struct slab;
+
+// Per-physical-page metadata.
+struct page {
+  uchar flags;
+  uchar order;  // block order, valid when PG_BUDDY is set
+  uint refcnt;  // mappings of an allocated page; kfree() drops one
+  struct slab *slab;  // header of the off-slab slab this page starts
+};
+
 void *kalloc(void);
+void *kalloc_zeroed(void);
+int kalloc_batch(void **, int);
 void kfree(void *);
 void kinit(void);
+int kalloc_idle(void);
+uint64 kfreepages(void);
+void kmemstat(struct meminfo *);
+
+// 2^order contiguous pages, naturally aligned
+void *kalloc_order(int);
+void kfree_order(void *, int);
 
 // Superpage (2MB page) allocator
 void *superalloc(void);
 void superfree(void *);
+void supersplit(void *);
+
+// Compaction of one 2MB block, for uvmcompact()
+void kdrain(void);
+int kfreein(void *);
+int kcompact_begin(void *, int);
+void kcompact_put(void *);
+int kcompact_end(void *);
+
+struct page *pa2page(void *);
+void *page2pa(struct page *);
+
+// Shared (copy-on-write) pages
+void kref(void *);
+uint krefcnt(void *);
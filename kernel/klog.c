@@ -0,0 +1,244 @@
+//
+// kernel log -- each hart appends what printf() prints to a
+// ring of its own, without taking a lock, and the klogd kernel
+// thread copies the rings to the console. dmesg() reads them.
+//
+
+#include "klog.h"
+
+#include "console.h"
+#include "dmesg.h"
+#include "param.h"
+#include "printf.h"
+#include "proc.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "types.h"
+#include "uart.h"
+#include "vm.h"
+
+// One hart's log. Only that hart writes it, with interrupts off.
+// Positions count bytes since boot and never wrap; the byte at
+// pos lives in buf[pos % KLOGSIZE]. The writer moves tail past
+// the records it is about to overwrite before it overwrites
+// them, so a reader that copies a record out and then still
+// finds tail at or before it knows the copy is good.
+struct klogring {
+  char buf[KLOGSIZE];
+  uint64 tail;         // oldest record still in buf
+  uint64 head;         // end of the newest finished record
+  uint64 cur;          // next text byte of the record being written
+  struct klogrec rec;  // the record being written
+  uint64 drained;      // klogd has printed the records before this
+} __attribute__((aligned(64)));
+
+static struct {
+  struct spinlock lock;  // for klogd's sleep and wakeup only
+  int sleeping;          // klogd is waiting for records
+  volatile int async;    // klogd is running; printf() may leave it to it
+  struct klogring ring[NCPU];
+} klog;
+
+static void klogd(void);
+
+void klogdinit(void) {
+  initlock(&klog.lock, "klog");
+  if (kthread("klogd", klogd) < 0) panic("klogdinit");
+}
+
+// Is klogd printing the log? Until it is, printf() must write
+// to the console itself.
+int klogasync(void) { return klog.async; }
+
+static void ringread(struct klogring *r, uint64 pos, void *dst, int n) {
+  char *d = dst;
+
+  for (int i = 0; i < n; i++) d[i] = r->buf[(pos + i) % KLOGSIZE];
+}
+
+static void ringwrite(struct klogring *r, uint64 pos, void *src, int n) {
+  char *s = src;
+
+  for (int i = 0; i < n; i++) r->buf[(pos + i) % KLOGSIZE] = s[i];
+}
+
+// Drop the oldest records of r until the bytes up to end fit.
+static void reserve(struct klogring *r, uint64 end) {
+  struct klogrec h;
+
+  if (end - r->tail <= KLOGSIZE) return;
+  while (r->tail < r->head && end - r->tail > KLOGSIZE) {
+    ringread(r, r->tail, &h, sizeof(h));
+    r->tail += KLOGRECSIZE(h.len);
+  }
+  // readers must see the new tail before the bytes change.
+  __sync_synchronize();
+}
+
+// Start a record on this hart's ring, for printf(), which has
+// interrupts off until klogend().
+void klogbegin(void) {
+  struct klogring *r = &klog.ring[cpuid()];
+
+  r->rec.time = r_time();
+  r->rec.len = 0;
+  r->rec.cpu = cpuid();
+  r->rec.flags = 0;
+  r->cur = r->head + sizeof(struct klogrec);
+}
+
+// Append c to the record; text past KLOGLINE bytes is lost.
+void klogputc(int c) {
+  struct klogring *r = &klog.ring[cpuid()];
+
+  if (r->rec.len >= KLOGLINE) return;
+  reserve(r, r->cur + 1);
+  r->buf[r->cur++ % KLOGSIZE] = c;
+  r->rec.len++;
+}
+
+// Finish the record and let readers see it. printed says that
+// printf() wrote it to the console already.
+void klogend(int printed) {
+  struct klogring *r = &klog.ring[cpuid()];
+  struct cpu *c = mycpu();
+  uint64 end = r->head + KLOGRECSIZE(r->rec.len);
+
+  if (printed) r->rec.flags |= KLOG_PRINTED;
+  reserve(r, end);
+  ringwrite(r, r->head, &r->rec, sizeof(r->rec));
+  __sync_synchronize();
+  r->head = end;
+  __sync_synchronize();
+
+  if (printed || !klog.sleeping) return;
+  if (c->noff == 1 && c->intena) {
+    // printf() holds no locks, so it can wake klogd itself.
+    acquire(&klog.lock);
+    wakeup(&klog);
+    release(&klog.lock);
+  } else if (r_stimecmp() > r_time() + TICKCYCLES) {
+    // leave it to klogkick() at the next tick.
+    w_stimecmp(r_time() + TICKCYCLES);
+  }
+}
+
+// Read the record at *pos of r into h and, if text is not 0,
+// its text. Moves *pos up to the oldest record if the writer
+// has dropped the one there. Returns 0 if there is none yet.
+static int readrec(struct klogring *r, uint64 *pos, struct klogrec *h,
+                   char *text) {
+  for (;;) {
+    __sync_synchronize();
+    if (*pos < r->tail) *pos = r->tail;
+    if (*pos >= r->head) return 0;
+    ringread(r, *pos, h, sizeof(*h));
+    if (h->len > KLOGLINE) h->len = KLOGLINE;  // torn; checked below
+    if (text) ringread(r, *pos + sizeof(*h), text, h->len);
+    __sync_synchronize();
+    if (*pos >= r->tail) return 1;
+  }
+}
+
+// The ring whose next record after its position in pos[] is
+// the oldest, with that record's header in h, or 0 if all are
+// read.
+static struct klogring *oldest(uint64 *pos, struct klogrec *h) {
+  struct klogring *r, *best = 0;
+  struct klogrec rh;
+
+  for (r = klog.ring; r < klog.ring + NCPU; r++) {
+    if (readrec(r, &pos[r - klog.ring], &rh, 0) &&
+        (best == 0 || rh.time < h->time)) {
+      best = r;
+      *h = rh;
+    }
+  }
+  return best;
+}
+
+// Print the records klogd has not, oldest first. sync says to
+// print them now, through consputc(), for panic(); klogd lets
+// the uart send them.
+static void drain(int sync) {
+  struct klogring *r;
+  struct klogrec h;
+  uint64 pos[NCPU];
+  char text[KLOGLINE];
+
+  for (int i = 0; i < NCPU; i++) pos[i] = klog.ring[i].drained;
+  while ((r = oldest(pos, &h)) != 0) {
+    uint64 *p = &pos[r - klog.ring];
+    if (readrec(r, p, &h, text) == 0) continue;
+    *p += KLOGRECSIZE(h.len);
+    r->drained = *p;
+    if (h.flags & KLOG_PRINTED) continue;
+    if (sync) {
+      for (int i = 0; i < h.len; i++) consputc(text[i]);
+    } else {
+      uartwrite(text, h.len);
+    }
+  }
+}
+
+static int pending(void) {
+  for (struct klogring *r = klog.ring; r < klog.ring + NCPU; r++)
+    if (r->drained < r->head) return 1;
+  return 0;
+}
+
+static void klogd(void) {
+  klog.async = 1;
+  for (;;) {
+    drain(0);
+    acquire(&klog.lock);
+    klog.sleeping = 1;
+    __sync_synchronize();
+    if (!pending()) sleep(&klog, &klog.lock);
+    klog.sleeping = 0;
+    release(&klog.lock);
+  }
+}
+
+// Is klogd asleep with records to print? Then a printf() could
+// not wake it, and settimer() keeps the tick for klogkick().
+int klogwaiting(void) { return klog.sleeping && pending(); }
+
+// From clockintr(): wake klogd for records written by a
+// printf() that could not.
+void klogkick(void) {
+  if (!klogwaiting()) return;
+  acquire(&klog.lock);
+  wakeup(&klog);
+  release(&klog.lock);
+}
+
+// Print what klogd has yet to, for panic().
+void klogflush(void) { drain(1); }
+
+// Copy the log out to user address addr, as struct klogrecs in
+// time order, dropping the newest if it takes more than n
+// bytes. Returns the bytes copied, or -1.
+int kdmesg(uint64 addr, int n) {
+  uint64 pos[NCPU];
+  struct {
+    struct klogrec h;
+    char text[KLOGLINE + 8];
+  } rec;
+  struct klogring *r;
+  int off = 0;
+
+  for (int i = 0; i < NCPU; i++) pos[i] = 0;
+  while ((r = oldest(pos, &rec.h)) != 0) {
+    uint64 *p = &pos[r - klog.ring];
+    if (readrec(r, p, &rec.h, rec.text) == 0) continue;
+    int size = KLOGRECSIZE(rec.h.len);
+    if (off + size > n) break;
+    for (int i = rec.h.len; i < size - sizeof(rec.h); i++) rec.text[i] = 0;
+    if (copyout(myproc()->pagetable, addr + off, (char *)&rec, size) < 0)
+      return -1;
+    *p += size;
+    off += size;
+  }
+  return off;
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include "types.h"
+
+void klogdinit(void);
+int klogasync(void);
+void klogbegin(void);
+void klogputc(int);
+void klogend(int);
+void klogflush(void);
+int klogwaiting(void);
+void klogkick(void);
+int kdmesg(uint64, int);
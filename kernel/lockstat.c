@@ -0,0 +1,119 @@
+// Lock statistics, for finding contended locks.
+//
+// Locks are counted by class: all the locks of one kind with
+// one name, such as every "proc" lock. initlock() and friends
+// look up (or make) a lock's class once, and while lockstat_on
+// is set each acquisition adds to its class's counters for the
+// acquiring hart, so counting takes no atomics and no lock.
+// Only contended acquisitions read the clock.
+
+#include "lockstat.h"
+
+#include "param.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "string.h"
+#include "types.h"
+#include "vm.h"
+
+#define NLOCKCLASS 64
+
+struct lockclass {
+  char name[16];
+  int kind;
+  struct {
+    uint64 nacquire;
+    uint64 ncontend;
+    uint64 wait;
+    uint64 maxwait;
+  } cpu[NCPU];
+};
+
+static struct lockclass classes[NLOCKCLASS];
+static int nclasses;
+static uint classlock;  // a bare flag: classes can't use locks
+
+int lockstat_on;
+
+// Return the class for locks of kind kind named name, making
+// it if need be, or 0 if the table is full.
+struct lockclass *lockclass(char *name, int kind) {
+  struct lockclass *lc = 0;
+
+  push_off();
+  while (__sync_lock_test_and_set(&classlock, 1));
+  for (int i = 0; i < nclasses; i++) {
+    if (classes[i].kind == kind &&
+        strncmp(classes[i].name, name, sizeof(lc->name) - 1) == 0) {
+      lc = &classes[i];
+      break;
+    }
+  }
+  if (lc == 0 && nclasses < NLOCKCLASS) {
+    lc = &classes[nclasses++];
+    safestrcpy(lc->name, name, sizeof(lc->name));
+    lc->kind = kind;
+  }
+  __sync_lock_release(&classlock);
+  pop_off();
+  return lc;
+}
+
+// Count an acquisition of a lock of class lc that waited for
+// wait cycles if contended. Interrupts must be off.
+void lockstat_record(struct lockclass *lc, int contended, uint64 wait) {
+  if (lc == 0) return;
+  int id = cpuid();
+  lc->cpu[id].nacquire++;
+  if (contended) {
+    lc->cpu[id].ncontend++;
+    lc->cpu[id].wait += wait;
+    if (wait > lc->cpu[id].maxwait) lc->cpu[id].maxwait = wait;
+  }
+}
+
+// Copy out up to n struct lockstats for the classes that were
+// acquired, and return how many; or reset, enable or disable
+// recording. A reset races with harts counting at that moment,
+// which may keep a count or two.
+int klockstat(int op, uint64 addr, int n) {
+  struct lockstat ls;
+  int k = 0;
+
+  switch (op) {
+    case LOCKSTAT_ENABLE:
+      lockstat_on = 1;
+      return 0;
+    case LOCKSTAT_DISABLE:
+      lockstat_on = 0;
+      return 0;
+    case LOCKSTAT_RESET:
+      for (int i = 0; i < NLOCKCLASS; i++)
+        memset(classes[i].cpu, 0, sizeof(classes[i].cpu));
+      return 0;
+    case LOCKSTAT_GET:
+      break;
+    default:
+      return -1;
+  }
+
+  int m = __atomic_load_n(&nclasses, __ATOMIC_ACQUIRE);
+  for (int i = 0; i < m && k < n; i++) {
+    struct lockclass *lc = &classes[i];
+    memset(&ls, 0, sizeof(ls));
+    safestrcpy(ls.name, lc->name, sizeof(ls.name));
+    ls.kind = lc->kind;
+    for (int c = 0; c < NCPU; c++) {
+      ls.nacquire += lc->cpu[c].nacquire;
+      ls.ncontend += lc->cpu[c].ncontend;
+      ls.wait += lc->cpu[c].wait;
+      if (lc->cpu[c].maxwait > ls.maxwait) ls.maxwait = lc->cpu[c].maxwait;
+    }
+    if (ls.nacquire == 0) continue;
+    if (copyout(myproc()->pagetable, addr + k * sizeof(ls), (char *)&ls,
+                sizeof(ls)) < 0)
+      return -1;
+    k++;
+  }
+  return k;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "types.h"
+
+// lockstat() operations
+#define LOCKSTAT_GET 0      // copy out the statistics
+#define LOCKSTAT_RESET 1    // zero them
+#define LOCKSTAT_ENABLE 2   // start recording
+#define LOCKSTAT_DISABLE 3  // stop recording
+
+// kinds of lock
+#define LOCK_SPIN 0
+#define LOCK_RW 1
+#define LOCK_SLEEP 2
+
+// Statistics for all the locks of one kind with one name, from
+// lockstat(). Waits are in cycles of the time CSR.
+struct lockstat {
+  char name[16];
+  int kind;         // LOCK_SPIN, LOCK_RW or LOCK_SLEEP
+  uint64 nacquire;  // acquisitions
+  uint64 ncontend;  // acquisitions that had to spin or sleep
+  uint64 wait;      // total time spent spinning or sleeping
+  uint64 maxwait;   // longest single wait
+};
@@ -3,11 +3,15 @@
 #include "bio.h"
 #include "buf.h"
 #include "fs.h"
+#include "iostat.h"
 #include "param.h"
 #include "printf.h"
 #include "proc.h"
+#include "riscv.h"
+#include "slab.h"
 #include "spinlock.h"
 #include "string.h"
+#include "virtio_disk.h"
 
 // Simple logging that allows concurrent FS system calls.
 //
@@ -21,7 +25,17 @@
 // its start and end. Usually begin_op() just increments
 // the count of in-progress FS system calls and returns.
 // But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// sleeps until the running transaction is closed.
+//
+// Commits are made by the logd kernel thread, not by end_op(),
+// so that system calls don't wait for the disk. logd closes the
+// running transaction once it has no FS system calls left, or
+// once someone waits on it: it holds off begin_op() until the
+// last of its calls ends, copies its blocks aside, and opens a
+// new running transaction. It then writes the closed one while
+// new calls fill the running one, which batches whatever ends
+// during a commit into the next. log_sync() waits until what
+// has been done so far is on disk, for fsync().
 //
 // The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
@@ -30,7 +44,9 @@
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+// mkfs sizes the log by the image, up to LOGBLOCKS blocks after
+// the header. Log appends are synchronous, but go to the disk
+// as one multi-block request.
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
@@ -42,23 +58,51 @@ struct logheader {
 struct log {
   struct spinlock lock;
   int start;
+  int size;         // data blocks in the log
   int outstanding;  // how many FS sys calls are executing.
-  int committing;   // in commit(), please wait.
+  int closing;      // logd is closing the transaction, please wait.
+  int waiting;      // sleeping until it is closed
+  uint seq;         // number of the running transaction
+  uint done;        // transactions up to this one are on disk
   int dev;
-  struct logheader lh;
+  struct logheader lh;   // running transaction
+  struct logheader clh;  // closed transaction logd is writing
+  struct buf *pinned[LOGBLOCKS];  // clh's blocks in the cache
+
+  // commits so far, for iostat(); logd counts them.
+  uint64 ncommit;
+  uint64 commitblocks;
+  uint64 maxcommit;
+  uint64 commitlat[NLAT];
 };
 struct log log;
 
+// Copies of the closed transaction's blocks, taken when it was
+// closed; logd writes from them, since the running transaction
+// may change the cached blocks meanwhile. They are not in the
+// cache, and are only used to talk to the disk.
+static struct buf *copies[LOGBLOCKS];
+static struct buf head;
+
 static void recover_from_log(void);
-static void commit();
+static void logd(void);
 
 void initlog(int dev, struct superblock *sb) {
   if (sizeof(struct logheader) >= BSIZE) panic("initlog: too big logheader");
 
   initlock(&log.lock, "log");
   log.start = sb->logstart;
+  log.size = sb->nlog - 1;
   log.dev = dev;
+  log.seq = 1;
+  if (log.size < MAXOPBLOCKS || log.size > LOGBLOCKS)
+    panic("initlog: bad log size");
+  struct kmem_cache *c =
+      kmem_cache_create("logbuf", sizeof(struct buf), 0, 0, 8);
+  if (c == 0 || kmem_cache_alloc_bulk(c, log.size, (void **)copies) != log.size)
+    panic("initlog: logbuf");
   recover_from_log();
+  if (kthread("logd", logd) < 0) panic("initlog: logd");
 }
 
 // Copy committed blocks from log to their home location
@@ -85,6 +129,7 @@ static void read_head(void) {
   struct logheader *lh = (struct logheader *)(buf->data);
   int i;
   log.lh.n = lh->n;
+  if (log.lh.n < 0 || log.lh.n > log.size) panic("read_head: bad log");
   for (i = 0; i < log.lh.n; i++) {
     log.lh.block[i] = lh->block[i];
   }
@@ -117,11 +162,15 @@ static void recover_from_log(void) {
 void begin_op(void) {
   acquire(&log.lock);
   while (1) {
-    if (log.committing) {
+    if (log.closing) {
       sleep(&log, &log.lock);
-    } else if (log.lh.n + (log.outstanding + 1) * MAXOPBLOCKS > LOGBLOCKS) {
-      // this op might exhaust log space; wait for commit.
+    } else if (log.lh.n + (log.outstanding + 1) * MAXOPBLOCKS > log.size) {
+      // this op might exhaust log space; wait for logd to
+      // close the transaction.
+      log.waiting++;
+      wakeup(&log.clh);
       sleep(&log, &log.lock);
+      log.waiting--;
     } else {
       log.outstanding += 1;
       release(&log.lock);
@@ -131,62 +180,124 @@ void begin_op(void) {
 }
 
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// lets logd commit if this was the last outstanding operation.
 void end_op(void) {
-  int do_commit = 0;
-
   acquire(&log.lock);
   log.outstanding -= 1;
-  if (log.committing) panic("log.committing");
-  if (log.outstanding == 0) {
-    do_commit = 1;
-    log.committing = 1;
-  } else {
-    // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
-    // the amount of reserved space.
-    wakeup(&log);
-  }
+  if (log.outstanding == 0) wakeup(&log.clh);
+  // begin_op() may be waiting for log space,
+  // and decrementing log.outstanding has decreased
+  // the amount of reserved space.
+  wakeup(&log);
   release(&log.lock);
+}
 
-  if (do_commit) {
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
+// Wait until the FS system calls that have ended are on disk.
+// Must not be called inside a transaction. While logd closes
+// the transaction, log.lh.n is already 0 but log.seq is still
+// the closing one's.
+void log_sync(void) {
+  acquire(&log.lock);
+  uint want = log.lh.n > 0 || log.closing ? log.seq : log.seq - 1;
+  while (log.done < want) {
+    log.waiting++;
+    wakeup(&log.clh);
+    sleep(&log, &log.lock);
+    log.waiting--;
   }
+  release(&log.lock);
 }
 
-// Copy modified blocks from cache to log.
+// Write the closed transaction's blocks to the log.
 static void write_log(void) {
-  int tail;
+  for (int tail = 0; tail < log.clh.n; tail++)
+    copies[tail]->blockno = log.start + tail + 1;
+  virtio_disk_write(copies, log.clh.n);
+}
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start + tail + 1);  // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]);  // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
+// Write the header of a transaction of n blocks, or of none.
+static void write_closed_head(int n) {
+  struct logheader *hb = (struct logheader *)head.data;
+
+  hb->n = n;
+  for (int i = 0; i < n; i++) hb->block[i] = log.clh.block[i];
+  head.blockno = log.start;
+  virtio_disk_rw(&head, 1);
+}
+
+// Copy the closed transaction's blocks to their home locations,
+// and let the cache evict them.
+static void install_closed(void) {
+  static struct buf *order[LOGBLOCKS];
+
+  // in block order, so that neighbours go as one request.
+  for (int tail = 0; tail < log.clh.n; tail++) {
+    struct buf *b = copies[tail];
+    int i;
+    b->blockno = log.clh.block[tail];
+    for (i = tail; i > 0 && order[i - 1]->blockno > b->blockno; i--)
+      order[i] = order[i - 1];
+    order[i] = b;
   }
+  virtio_disk_write(order, log.clh.n);
+  for (int tail = 0; tail < log.clh.n; tail++) bunpin(log.pinned[tail]);
 }
 
-static void commit() {
-  if (log.lh.n > 0) {
-    write_log();       // Write modified blocks from cache to log
-    write_head();      // Write header to disk -- the real commit
-    install_trans(0);  // Now install writes to home locations
-    log.lh.n = 0;
-    write_head();  // Erase the transaction from the log
+// Close the running transaction: keep new calls out until its
+// own have ended, then copy its blocks aside and open the next.
+// Returns with log.lock held.
+static void close_trans(void) {
+  log.closing = 1;
+  while (log.outstanding > 0) sleep(&log.clh, &log.lock);
+  release(&log.lock);
+
+  // no call can change the blocks now; they are pinned, so
+  // bread() finds them cached.
+  for (int i = 0; i < log.lh.n; i++) {
+    struct buf *b = bread(log.dev, log.lh.block[i]);
+    memmove(copies[i]->data, b->data, BSIZE);
+    log.pinned[i] = b;
+    brelse(b);
+  }
+  log.clh = log.lh;
+  log.lh.n = 0;
+
+  acquire(&log.lock);
+  log.seq++;
+  log.closing = 0;
+  wakeup(&log);
+}
+
+// The commit daemon.
+static void logd(void) {
+  for (;;) {
+    acquire(&log.lock);
+    while (log.lh.n == 0 || (log.outstanding > 0 && log.waiting == 0))
+      sleep(&log.clh, &log.lock);
+    close_trans();
+    uint seq = log.seq - 1;
+    release(&log.lock);
+
+    uint64 t0 = r_time();
+    write_log();                   // Write copied blocks to log
+    write_closed_head(log.clh.n);  // the real commit
+    install_closed();              // Now install writes to home locations
+    write_closed_head(0);          // Erase the transaction from the log
+
+    acquire(&log.lock);
+    log.ncommit++;
+    log.commitblocks += log.clh.n;
+    if (log.clh.n > log.maxcommit) log.maxcommit = log.clh.n;
+    iohist(log.commitlat, r_time() - t0);
+    log.done = seq;
+    wakeup(&log);
+    release(&log.lock);
   }
 }
 
 // Caller has modified b->data and is done with the buffer.
 // Record the block number and pin in the cache by increasing refcnt.
-// commit()/write_log() will do the disk write.
+// logd will do the disk write.
 //
 // log_write() replaces bwrite(); a typical use is:
 //   bp = bread(...)
@@ -197,7 +308,7 @@ void log_write(struct buf *b) {
   int i;
 
   acquire(&log.lock);
-  if (log.lh.n >= LOGBLOCKS) panic("too big a transaction");
+  if (log.lh.n >= log.size) panic("too big a transaction");
   if (log.outstanding < 1) panic("log_write outside of trans");
 
   for (i = 0; i < log.lh.n; i++) {
@@ -211,3 +322,18 @@ void log_write(struct buf *b) {
   }
   release(&log.lock);
 }
+
+// Copy the log's commit counts into st, or zero them.
+void logstat(struct iostat *st, int reset) {
+  acquire(&log.lock);
+  if (reset) {
+    log.ncommit = log.commitblocks = log.maxcommit = 0;
+    memset(log.commitlat, 0, sizeof(log.commitlat));
+  } else {
+    st->ncommit = log.ncommit;
+    st->commitblocks = log.commitblocks;
+    st->maxcommit = log.maxcommit;
+    memmove(st->commitlat, log.commitlat, sizeof(st->commitlat));
+  }
+  release(&log.lock);
+}
@@ -3,7 +3,11 @@
 #include "buf.h"
 #include "fs.h"
 
+struct iostat;
+
 void initlog(int, struct superblock *);
 void log_write(struct buf *);
 void begin_op(void);
 void end_op(void);
+void log_sync(void);
+void logstat(struct iostat *, int);
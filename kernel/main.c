@@ -1,18 +1,31 @@
 #include "bio.h"
 #include "console.h"
+#include "dcache.h"
 #include "file.h"
 #include "fs.h"
+#include "futex.h"
+#include "hpm.h"
 #include "kalloc.h"
+#include "klog.h"
+#include "pagecache.h"
+#include "pipe.h"
 #include "plic.h"
 #include "printf.h"
 #include "proc.h"
+#include "prof.h"
+#include "rcu.h"
 #include "slab.h"
+#include "slabbench.h"
+#include "syscall.h"
+#include "timer.h"
 #include "trap.h"
 #include "virtio_disk.h"
 #include "vm.h"
+#include "vma.h"
 
-// Compile-time flag to enable slab allocator tests (default: OFF)
+// Compile-time flag to run the slab allocator tests at boot (default: OFF)
 // To enable: add -DENABLE_SLAB_TESTS to CFLAGS in Makefile
+// The single-hart ones also run on demand: see slabbench.c
 #ifdef ENABLE_SLAB_TESTS
 #include "test/slab_test_benchmark.h"
 #include "test/slab_test_multi.h"
@@ -31,18 +44,33 @@ void main() {
     printf("xv6 kernel is booting\n");
     printf("\n");
     kinit();             // physical page allocator
+    slabinit();          // slab cache registry
+    kmallocinit();       // kmalloc size-class caches
+    vmainit();           // VMA cache
+    pagecacheinit();     // shared file page cache
     kvminit();           // create kernel page table
     kvminithart();       // turn on paging
+    rcuinit();           // RCU grace periods
     procinit();          // process table
+    syscallinit();       // system call tracing
+    profinit();          // sampling profiler
+    slabbenchinit();     // slab benchmark on demand
+    futexinit();         // futex wait queues
     trapinit();          // trap vectors
+    timerinit();         // sleep deadline heaps
     trapinithart();      // install kernel trap vector
+    hpminit();           // performance counters
+    hpminithart();       // let user code read them
     plicinit();          // set up interrupt controller
     plicinithart();      // ask PLIC for device interrupts
     binit();             // buffer cache
     iinit();             // inode table
+    dcacheinit();        // directory entry cache
     fileinit();          // file table
+    pipeinit();          // pipe cache
     virtio_disk_init();  // emulated hard disk
     userinit();          // first user process
+    klogdinit();         // kernel log printer
 
 #ifdef ENABLE_SLAB_TESTS
     slab_test_single();
@@ -58,6 +86,7 @@ void main() {
     printf("hart %d starting\n", cpuid());
     kvminithart();   // turn on paging
     trapinithart();  // install kernel trap vector
+    hpminithart();   // let user code read the counters
     plicinithart();  // ask PLIC for device interrupts
 #ifdef ENABLE_SLAB_TESTS
     __sync_fetch_and_add(&prepared_device, 1);
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "types.h"
+
+// meminfo() operations
+#define MEMINFO_GET 0    // copy out a struct meminfo
+#define MEMINFO_SLABS 1  // copy out a struct slabinfo per cache
+
+// Kinds of page fault, for meminfo.fault[].
+#define FAULT_LAZY 0   // first touch of a page sbrk() reserved
+#define FAULT_ANON 1   // first touch of an anonymous mmap() page
+#define FAULT_FILE 2   // file mmap() or executable page read in
+#define FAULT_COW 3    // copy-on-write page copied or taken over
+#define FAULT_SWAP 4   // page read back from the swap area
+#define FAULT_MINOR 5  // already mapped: stale TLB, or A/D bits
+#define NFAULT 6
+
+// System memory, from meminfo(MEMINFO_GET), in 4K pages unless
+// noted. A free page is in exactly one of free, cached and zeroed.
+struct meminfo {
+  uint64 total;      // pages the page allocator manages
+  uint64 free;       // free on the buddy lists, or never touched
+  uint64 cached;     // free in the per-CPU page caches
+  uint64 zeroed;     // free and zeroed ahead of time by idle harts
+  uint64 superfree;  // free 2MB blocks, counted in free
+  uint64 superused;  // superpages allocated, in 2MB blocks
+  uint64 compacted;  // 2MB blocks freed by moving pages out
+  uint64 slab;       // pages holding slabs
+  uint64 fault[NFAULT];  // page faults resolved, by kind
+};
+
+// One kmem_cache, from meminfo(MEMINFO_SLABS).
+struct slabinfo {
+  char name[32];
+  uint objsize;   // bytes per object, with alignment
+  uint order;     // each slab is 2^order pages
+  uint64 active;  // objects allocated
+  uint64 total;   // objects in all its slabs
+  uint64 nslab;
+  uint64 nmag;  // free objects in the per-CPU magazines
+};
@@ -27,6 +27,11 @@
 #define VIRTIO0 0x10001000
 #define VIRTIO0_IRQ 1
 
+// core local interruptor (CLINT), which holds each hart's
+// machine-mode software interrupt (IPI) register.
+#define CLINT 0x2000000L
+#define CLINT_MSIP(hart) (CLINT + 4 * (hart))
+
 // qemu puts platform-level interrupt controller (PLIC) here.
 #define PLIC 0x0c000000L
 #define PLIC_PRIORITY (PLIC + 0x0)
@@ -47,7 +52,8 @@
 
 // map kernel stacks beneath the trampoline,
 // each surrounded by invalid guard pages.
-#define KSTACK(p) (TRAMPOLINE - ((p) + 1) * 2 * PGSIZE)
+// slots 0..NKSTACK-1 are mapped as processes need them.
+#define KSTACK(slot) (TRAMPOLINE - ((slot) + 1) * 2 * PGSIZE)
 
 // User memory layout.
 // Address zero first:
@@ -56,15 +62,26 @@
 //   fixed-size stack
 //   expandable heap
 //   ...
+//   URING (the io ring page, if ringsetup() made one)
+//   THREADFRAME(NTHREAD-1) .. THREADFRAME(1) (other threads' trapframes)
 //   USYSCALL (read-only, contains struct usyscall)
 //   TRAPFRAME (p->trapframe, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
 #define TRAPFRAME (TRAMPOLINE - PGSIZE)
 #define USYSCALL (TRAPFRAME - PGSIZE)
+#define THREADFRAME(t) (USYSCALL - (t) * PGSIZE)
+#define URING THREADFRAME(NTHREAD)
+#define UTOP URING  // end of user memory
 
 #ifndef __ASSEMBLER__
+#include "rusage.h"
+
 // Shared data structure for fast syscalls
 struct usyscall {
-  int pid;  // Process ID
+  int pid;            // Process ID
+  uint seq;           // Odd while the kernel updates ru
+  uint64 timebase;    // time CSR cycles per second
+  uint64 tickcycles;  // time CSR cycles per uptime() tick
+  struct rusage ru;   // Totals of the process's threads
 };
 #endif
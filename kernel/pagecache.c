@@ -0,0 +1,312 @@
+// Page cache for file data and MAP_SHARED mappings.
+//
+// A cached page holds one reference to its physical page and each
+// PTE that maps it holds another, so a file page is in memory once
+// however many processes map it. readi() and writei() of regular
+// files copy to and from cached pages, keeping read() and write()
+// coherent with stores to a shared mapping; dirty pages reach the
+// disk when a mapping is written back (vma_writeback()). A page
+// holding blocks writei() delayed is marked dirty, and stays until
+// iflush() places them. File blocks pass through the buffer cache
+// to and from the disk but are not meant to stay there.
+//
+// An inode's pages are added and looked up with the inode locked,
+// and dropped when its last reference goes away or it is truncated.
+// Shared anonymous mappings keep their pages here too, owned by a
+// struct anon. pagecache.lock protects the hash chains, the owners'
+// page lists and anon reference counts.
+
+#include "pagecache.h"
+
+#include "file.h"
+#include "fs.h"
+#include "kalloc.h"
+#include "printf.h"
+#include "proc.h"
+#include "riscv.h"
+#include "slab.h"
+#include "spinlock.h"
+#include "types.h"
+#include "writeback.h"
+
+#define NPCHASH 127
+
+struct cpage {
+  void *obj;            // the inode or struct anon owning the page
+  int anon;             // obj is a struct anon; the page has no backing
+  int dirty;            // holds delayed blocks; not to be reclaimed
+  uint pgno;            // page index within obj
+  uint64 pa;            // the cached page
+  struct cpage *hnext;  // hash chain
+  struct cpage *inext;  // obj's list of pages
+};
+
+static struct {
+  struct spinlock lock;
+  struct cpage *hash[NPCHASH];
+} pagecache;
+
+static struct kmem_cache *cpage_cache;
+
+static uint pchash(void *obj, uint pgno) {
+  return ((uint64)obj / sizeof(struct inode) + pgno) % NPCHASH;
+}
+
+void pagecacheinit(void) {
+  initlock(&pagecache.lock, "pagecache");
+  cpage_cache = kmem_cache_create("cpage", sizeof(struct cpage), 0, 0,
+                                  sizeof(void *));
+  if (cpage_cache == 0) panic("pagecacheinit");
+}
+
+// Find page pgno of obj. Caller must hold pagecache.lock.
+static uint64 lookup(void *obj, uint pgno) {
+  for (struct cpage *c = pagecache.hash[pchash(obj, pgno)]; c; c = c->hnext)
+    if (c->obj == obj && c->pgno == pgno) return c->pa;
+  return 0;
+}
+
+// Add c to the hash and to obj's list *list.
+// Caller must hold pagecache.lock.
+static void insert(struct cpage *c, struct cpage **list) {
+  uint h = pchash(c->obj, c->pgno);
+  c->hnext = pagecache.hash[h];
+  pagecache.hash[h] = c;
+  c->inext = *list;
+  *list = c;
+}
+
+// Take all of obj's pages, listed at *list, out of the hash.
+// Caller must hold pagecache.lock; it then frees them with
+// freelist() once the lock is released.
+static struct cpage *unhash(void *obj, struct cpage **list) {
+  struct cpage *c, **pp, *l = *list;
+
+  *list = 0;
+  for (c = l; c; c = c->inext) {
+    pp = &pagecache.hash[pchash(obj, c->pgno)];
+    while (*pp != c) pp = &(*pp)->hnext;
+    *pp = c->hnext;
+  }
+  return l;
+}
+
+// Drop the cache's reference to each page on list. Pages still
+// mapped stay allocated until their last mapping goes away.
+static void freelist(struct cpage *list) {
+  struct cpage *c;
+
+  while ((c = list) != 0) {
+    list = c->inext;
+    kfree((void *)c->pa);
+    kmem_cache_free(cpage_cache, c);
+  }
+}
+
+// Return the cached page pgno of ip with a reference the caller
+// drops with kfree(), or 0 if there is none.
+// Caller must hold ip->lock.
+uint64 pagecache_lookup(struct inode *ip, uint pgno) {
+  uint64 pa;
+
+  if (ip->pages == 0) return 0;
+  acquire(&pagecache.lock);
+  if ((pa = lookup(ip, pgno)) != 0) kref((void *)pa);
+  release(&pagecache.lock);
+  return pa;
+}
+
+// Return page pgno of ip, reading it in if it is not cached,
+// with a reference for the caller to map or drop with kfree().
+// Returns 0 if memory is short. Caller must hold ip->lock; when
+// it is held shared, readers may miss on the same page at once,
+// and the loser of the race frees its copy.
+uint64 pagecache_get(struct inode *ip, uint pgno) {
+  uint64 pa = pagecache_lookup(ip, pgno);
+  struct cpage *c;
+  char *mem;
+
+  if (pa) return pa;
+  if ((c = kmem_cache_alloc(cpage_cache)) == 0) return 0;
+  if ((mem = kalloc_zeroed()) == 0) {
+    kmem_cache_free(cpage_cache, c);
+    return 0;
+  }
+  readpage(ip, pgno, mem);
+
+  acquire(&pagecache.lock);
+  if ((pa = lookup(ip, pgno)) == 0) {
+    c->obj = ip;
+    c->anon = 0;
+    c->dirty = 0;
+    c->pgno = pgno;
+    c->pa = pa = (uint64)mem;
+    insert(c, &ip->pages);
+    c = 0;
+    mem = 0;
+  }
+  kref((void *)pa);
+  release(&pagecache.lock);
+
+  if (mem) {
+    kfree(mem);
+    kmem_cache_free(cpage_cache, c);
+  }
+  return pa;
+}
+
+// Mark page pgno of ip, which must be cached, as holding delayed
+// blocks. Caller must hold ip->lock.
+void pagecache_dirty(struct inode *ip, uint pgno) {
+  acquire(&pagecache.lock);
+  for (struct cpage *c = pagecache.hash[pchash(ip, pgno)]; c; c = c->hnext)
+    if (c->obj == ip && c->pgno == pgno) c->dirty = 1;
+  release(&pagecache.lock);
+}
+
+// Let ip's pages be reclaimed again, once it has no delayed
+// blocks. Caller must hold ip->lock.
+void pagecache_clean(struct inode *ip) {
+  acquire(&pagecache.lock);
+  for (struct cpage *c = ip->pages; c; c = c->inext) c->dirty = 0;
+  release(&pagecache.lock);
+}
+
+// Drop all of ip's cached pages.
+// Caller must hold ip->lock or the only reference to ip.
+void pagecache_drop(struct inode *ip) {
+  acquire(&pagecache.lock);
+  struct cpage *list = unhash(ip, &ip->pages);
+  release(&pagecache.lock);
+  freelist(list);
+}
+
+// Shared anonymous memory: zero-filled pages cached under a
+// struct anon instead of an inode.
+
+struct anon *anon_alloc(void) {
+  struct anon *a = kmalloc(sizeof(*a));
+  if (a) {
+    a->ref = 1;
+    a->size = 0;
+    a->pages = 0;
+  }
+  return a;
+}
+
+void anon_dup(struct anon *a) {
+  acquire(&pagecache.lock);
+  a->ref++;
+  release(&pagecache.lock);
+}
+
+// Drop a reference to a, freeing it and its pages with the last.
+void anon_put(struct anon *a) {
+  acquire(&pagecache.lock);
+  if (--a->ref > 0) {
+    release(&pagecache.lock);
+    return;
+  }
+  struct cpage *list = unhash(a, &a->pages);
+  release(&pagecache.lock);
+  freelist(list);
+  kfree_sized(a, sizeof(*a));
+}
+
+// Return page pgno of a, zero-filled on first use, with
+// a reference for the caller to map. Returns 0 if memory is
+// short. Sharers may fault the same page at once, so the loser
+// of the race frees its page.
+uint64 anon_getpage(struct anon *a, uint pgno) {
+  struct cpage *c = 0;
+  char *mem = 0;
+  uint64 pa;
+
+  acquire(&pagecache.lock);
+  if ((pa = lookup(a, pgno)) == 0) {
+    release(&pagecache.lock);
+    if ((c = kmem_cache_alloc(cpage_cache)) == 0) return 0;
+    if ((mem = kalloc_zeroed()) == 0) {
+      kmem_cache_free(cpage_cache, c);
+      return 0;
+    }
+    acquire(&pagecache.lock);
+    if ((pa = lookup(a, pgno)) == 0) {
+      c->obj = a;
+      c->anon = 1;
+      c->dirty = 0;
+      c->pgno = pgno;
+      c->pa = pa = (uint64)mem;
+      insert(c, &a->pages);
+      c = 0;
+      mem = 0;
+    }
+  }
+  kref((void *)pa);
+  release(&pagecache.lock);
+
+  if (mem) {
+    kfree(mem);
+    kmem_cache_free(cpage_cache, c);
+  }
+  return pa;
+}
+
+// Copy up to n bytes between a's memory at off and addr, a user
+// address if user is set: into a if write is set, else out of it.
+// Stops at a->size. Returns the bytes copied, or -1 if none could
+// be for want of memory or a bad addr.
+int anon_rw(struct anon *a, int write, int user, uint64 addr, uint64 off,
+            int n) {
+  int tot = 0;
+
+  if (off >= a->size || n <= 0) return 0;
+  if (n > a->size - off) n = a->size - off;
+  while (tot < n) {
+    uint64 pa = anon_getpage(a, off / PGSIZE);
+    if (pa == 0) break;
+    int m = n - tot;
+    if (m > PGSIZE - off % PGSIZE) m = PGSIZE - off % PGSIZE;
+    char *p = (char *)pa + off % PGSIZE;
+    int r = write ? either_copyin(p, user, addr, m)
+                  : either_copyout(user, addr, p, m);
+    kfree((void *)pa);  // drop anon_getpage()'s reference
+    if (r < 0) break;
+    tot += m;
+    off += m;
+    addr += m;
+  }
+  return tot > 0 ? tot : -1;
+}
+
+// Free cached file pages that nothing maps or is reading, for
+// uvmreclaim(). Stores through a mapping are written back before
+// its PTE goes away. Anonymous pages have nowhere else to live
+// and stay, as do pages of delayed blocks, for which the
+// writeback thread is woken. Returns the pages freed.
+int pagecache_reclaim(void) {
+  struct cpage *c, **pp, *list = 0;
+  int n = 0, dirty = 0;
+
+  acquire(&pagecache.lock);
+  for (int h = 0; h < NPCHASH; h++) {
+    for (pp = &pagecache.hash[h]; (c = *pp) != 0;) {
+      dirty |= c->dirty;
+      if (c->anon || c->dirty || krefcnt((void *)c->pa) > 1) {
+        pp = &c->hnext;
+        continue;
+      }
+      *pp = c->hnext;
+      struct cpage **lp = &((struct inode *)c->obj)->pages;
+      while (*lp != c) lp = &(*lp)->inext;
+      *lp = c->inext;
+      c->inext = list;
+      list = c;
+      n++;
+    }
+  }
+  release(&pagecache.lock);
+  freelist(list);
+  if (dirty) wbkick();
+  return n;
+}
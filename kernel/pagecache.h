@@ -0,0 +1,29 @@
+#pragma once
+
+#include "types.h"
+
+struct cpage;
+struct inode;
+
+// Pages of a MAP_SHARED | MAP_ANONYMOUS mapping, shared by the
+// VMAs fork copies from the one mmap made, or of a memfd(), shared
+// by its files and the VMAs that map it.
+struct anon {
+  int ref;      // VMAs and files using it
+  uint64 size;  // bytes of a memfd(); 0 for an mmap()'s
+  struct cpage *pages;
+};
+
+// pagecache.c APIs
+void pagecacheinit(void);
+uint64 pagecache_get(struct inode *, uint);
+uint64 pagecache_lookup(struct inode *, uint);
+void pagecache_dirty(struct inode *, uint);
+void pagecache_clean(struct inode *);
+void pagecache_drop(struct inode *);
+int pagecache_reclaim(void);
+struct anon *anon_alloc(void);
+void anon_dup(struct anon *);
+void anon_put(struct anon *);
+uint64 anon_getpage(struct anon *, uint);
+int anon_rw(struct anon *, int, int, uint64, uint64, int);
@@ -1,16 +1,39 @@
 #pragma once
 
-#define NPROC 64                     // maximum number of processes
+#define NKSTACK 8192                 // kernel stack slots (bounds processes)
 #define NCPU 8                       // maximum number of CPUs
-#define NOFILE 16                    // open files per process
-#define NFILE 100                    // open files per system
-#define NINODE 50                    // maximum number of active i-nodes
+#define NTHREAD 16                   // maximum threads per process
+#define NPRIO 3                      // scheduling priority levels
+#define BOOSTTICKS 20                // ticks between priority boosts
+#define NOFILE 16                    // open files per process, ungrown
+#define NOFILEMAX 512                // open files per process, at most
+#define NINODE 50                    // unused i-nodes kept cached
 #define NDEV 10                      // maximum major device number
 #define ROOTDEV 1                    // device number of file system root disk
 #define MAXARG 32                    // max exec arguments
-#define MAXOPBLOCKS 10               // max # of blocks any FS op writes
-#define LOGBLOCKS (MAXOPBLOCKS * 3)  // max data blocks in on-disk log
-#define NBUF (MAXOPBLOCKS * 3)       // size of disk block cache
+#define MAXOPBLOCKS 16               // max # of blocks any FS op writes
+#define LOGBLOCKS 254                // max data blocks in on-disk log
+#define LOGDIV 16                    // mkfs gives the log 1/LOGDIV of the disk
+#define NBUF (MAXOPBLOCKS * 3)       // disk block cache buffers at boot
+#define BCACHEDIV 8                  // block cache grows to RAM / BCACHEDIV
+#define NREADAHEAD 8                 // blocks read ahead of sequential reads
+#define NDISKDESC 128                // virtio disk queue depth (descriptors)
+#define NDISKQ NCPU                  // most virtio disk queues
+#ifndef DISKPOLL
+#define DISKPOLL 0                   // us disk reads spin before sleeping
+#endif
+#define NPREALLOC 64                 // most room a new extent is left to grow
+#define NDELAYED 2048                // most file blocks waiting for writeback
+#define NDELAYOP 64                  // delayed blocks one transaction fills
+#define WBDELAY 30                   // ticks before delayed blocks are placed
 #define FSSIZE 2000                  // size of file system in blocks
+#define SWAPSIZE (8 << 20)           // bytes of swap area after the fs
 #define MAXPATH 128                  // maximum file path name
 #define USERSTACK 1                  // user stack pages
+#define TICKCYCLES 1000000           // time CSR cycles per tick
+#define KLOGSIZE 4096                // bytes of kernel log kept per CPU
+#define KLOGLINE 256                 // most bytes one printf() logs
+#define NTRACE 256                   // traced system calls kept for strace
+#define RINGIDLE 100000              // cycles an io ring poller spins idle
+#define NPROF 256                    // profiler samples kept per CPU
+#define NTIMER 128                   // sleepers on each CPU's deadline heap
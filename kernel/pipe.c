@@ -2,33 +2,64 @@
 
 #include "file.h"
 #include "kalloc.h"
+#include "poll.h"
+#include "printf.h"
 #include "proc.h"
+#include "riscv.h"
+#include "slab.h"
 #include "spinlock.h"
+#include "string.h"
 #include "types.h"
+#include "vm.h"
 
-#define PIPESIZE 512
+// A pipe's ring is 2^order pages, PIPESIZE bytes to start with;
+// fcntl(F_SETPIPE_SZ) resizes it up to PIPEMAX. The size being a
+// power of two keeps nread and nwrite % size right as they wrap.
+#define PIPESIZE PGSIZE
+#define PIPEMAX (PGSIZE << 6)
+#define min(a, b) ((a) < (b) ? (a) : (b))
 
 struct pipe {
   struct spinlock lock;
-  char data[PIPESIZE];
+  char *data;     // the ring, 2^order pages
+  uint size;      // bytes in the ring
+  int order;
   uint nread;     // number of bytes read
   uint nwrite;    // number of bytes written
   int readopen;   // read fd is still open
   int writeopen;  // write fd is still open
+  int rwait;      // readers sleeping on nread
+  int wwait;      // writers sleeping on nwrite
+  uint wneed;     // free bytes that are worth waking the writers for
+  int npoll;      // poll()s watching pi; see filepoll()
 };
 
+static struct kmem_cache *pipe_cache;
+
+static void pipector(void *obj) {
+  struct pipe *pi = obj;
+
+  memset(pi, 0, sizeof(*pi));
+  initlock(&pi->lock, "pipe");
+}
+
+void pipeinit(void) {
+  pipe_cache = kmem_cache_create("pipe", sizeof(struct pipe), pipector, 0,
+                                 SLAB_HWCACHE_ALIGN);
+  if (pipe_cache == 0) panic("pipeinit");
+}
+
 int pipealloc(struct file **f0, struct file **f1) {
   struct pipe *pi;
 
   pi = 0;
   *f0 = *f1 = 0;
   if ((*f0 = filealloc()) == 0 || (*f1 = filealloc()) == 0) goto bad;
-  if ((pi = (struct pipe *)kalloc()) == 0) goto bad;
+  if ((pi = kmem_cache_alloc(pipe_cache)) == 0) goto bad;
+  if ((pi->data = kalloc()) == 0) goto bad;
+  pi->size = PIPESIZE;
   pi->readopen = 1;
   pi->writeopen = 1;
-  pi->nwrite = 0;
-  pi->nread = 0;
-  initlock(&pi->lock, "pipe");
   (*f0)->type = FD_PIPE;
   (*f0)->readable = 1;
   (*f0)->writable = 0;
@@ -40,7 +71,7 @@ int pipealloc(struct file **f0, struct file **f1) {
   return 0;
 
 bad:
-  if (pi) kfree((char *)pi);
+  if (pi) kmem_cache_free(pipe_cache, pi);
   if (*f0) fileclose(*f0);
   if (*f1) fileclose(*f1);
   return -1;
@@ -55,14 +86,25 @@ void pipeclose(struct pipe *pi, int writable) {
     pi->readopen = 0;
     wakeup(&pi->nwrite);
   }
+  if (pi->npoll) pollwakeup();
   if (pi->readopen == 0 && pi->writeopen == 0) {
     release(&pi->lock);
-    kfree((char *)pi);
+    kfree_order(pi->data, pi->order);
+    kmem_cache_free(pipe_cache, pi);
   } else
     release(&pi->lock);
 }
 
-int pipewrite(struct pipe *pi, uint64 addr, int n) {
+// Readers are woken when a write ends or fills the ring, and
+// writers only once a read frees as much as they wait for: half
+// the ring, or what is left of the smallest waiting write. A
+// wakeup looks at every process, so none is done for a side
+// with no sleepers.
+
+// Write n bytes at addr to pi, a user address if user_src is set
+// and otherwise a kernel one. Bytes are copied in runs that wrap
+// no later than the end of pi->data.
+int pipewrite(struct pipe *pi, int user_src, uint64 addr, int n) {
   int i = 0;
   struct proc *pr = myproc();
 
@@ -72,41 +114,151 @@ int pipewrite(struct pipe *pi, uint64 addr, int n) {
       release(&pi->lock);
       return -1;
     }
-    if (pi->nwrite == pi->nread + PIPESIZE) {  // DOC: pipewrite-full
-      wakeup(&pi->nread);
+    if (pi->nwrite == pi->nread + pi->size) {  // DOC: pipewrite-full
+      if (pi->rwait) wakeup(&pi->nread);
+      if (pi->npoll) pollwakeup();
+      uint need = min(n - i, pi->size / 2);
+      if (pi->wwait == 0 || need < pi->wneed) pi->wneed = need;
+      pi->wwait++;
       sleep(&pi->nwrite, &pi->lock);
+      pi->wwait--;
     } else {
-      char ch;
-      if (copyin(pr->pagetable, &ch, addr + i, 1) == -1) break;
-      pi->data[pi->nwrite++ % PIPESIZE] = ch;
-      i++;
+      uint m = min(n - i, pi->nread + pi->size - pi->nwrite);
+      m = min(m, pi->size - pi->nwrite % pi->size);
+      char *dst = &pi->data[pi->nwrite % pi->size];
+      if (either_copyin(dst, user_src, addr + i, m) == -1) {
+        // the source must be faulted in, which may sleep, so not
+        // with pi->lock held.
+        release(&pi->lock);
+        int bad =
+            !user_src || userfaultin(pr->pagetable, addr + i, m, 0) < 0;
+        acquire(&pi->lock);
+        if (bad) break;
+        continue;
+      }
+      pi->nwrite += m;
+      i += m;
     }
   }
-  wakeup(&pi->nread);
+  if (pi->rwait) wakeup(&pi->nread);
+  if (pi->npoll && i > 0) pollwakeup();
   release(&pi->lock);
 
   return i;
 }
 
-int piperead(struct pipe *pi, uint64 addr, int n) {
+// Bytes waiting to be read from pi, as of some moment.
+int pipeavail(struct pipe *pi) {
+  acquire(&pi->lock);
+  int n = pi->nwrite - pi->nread;
+  release(&pi->lock);
+  return n;
+}
+
+// Read up to n bytes from pi to addr, a user address if user_dst
+// is set and otherwise a kernel one. Waits while pi is empty and
+// nothing has been read yet.
+int piperead(struct pipe *pi, int user_dst, uint64 addr, int n) {
   int i;
   struct proc *pr = myproc();
-  char ch;
 
   acquire(&pi->lock);
-  while (pi->nread == pi->nwrite && pi->writeopen) {  // DOC: pipe-empty
-    if (killed(pr)) {
-      release(&pi->lock);
-      return -1;
+  for (i = 0; i < n;) {  // DOC: piperead-copy
+    // DOC: pipe-empty
+    while (i == 0 && pi->nread == pi->nwrite && pi->writeopen) {
+      if (killed(pr)) {
+        release(&pi->lock);
+        return -1;
+      }
+      pi->rwait++;
+      sleep(&pi->nread, &pi->lock);  // DOC: piperead-sleep
+      pi->rwait--;
     }
-    sleep(&pi->nread, &pi->lock);  // DOC: piperead-sleep
-  }
-  for (i = 0; i < n; i++) {  // DOC: piperead-copy
     if (pi->nread == pi->nwrite) break;
-    ch = pi->data[pi->nread++ % PIPESIZE];
-    if (copyout(pr->pagetable, addr + i, &ch, 1) == -1) break;
+    uint m = min(n - i, pi->nwrite - pi->nread);
+    m = min(m, pi->size - pi->nread % pi->size);
+    char *src = &pi->data[pi->nread % pi->size];
+    if (either_copyout(user_dst, addr + i, src, m) == -1) {
+      // as in pipewrite(), fault the destination in unlocked;
+      // another reader may take the bytes meanwhile.
+      release(&pi->lock);
+      int bad =
+          !user_dst || userfaultin(pr->pagetable, addr + i, m, 1) < 0;
+      acquire(&pi->lock);
+      if (bad) break;
+      continue;
+    }
+    pi->nread += m;
+    i += m;
   }
-  wakeup(&pi->nwrite);  // DOC: piperead-wakeup
+  if (pi->wwait && pi->size - (pi->nwrite - pi->nread) >= pi->wneed)
+    wakeup(&pi->nwrite);  // DOC: piperead-wakeup
+  if (pi->npoll && i > 0) pollwakeup();
   release(&pi->lock);
   return i;
 }
+
+// Make pi's ring at least n bytes, rounded up to a power of two
+// pages, and return its new size; or return -1 if n is more than
+// PIPEMAX or less than what is waiting to be read.
+int piperesize(struct pipe *pi, int n) {
+  int order = 0;
+  char *data, *old;
+
+  if (n < 0 || n > PIPEMAX) return -1;
+  while ((PGSIZE << order) < n) order++;
+  if ((data = kalloc_order(order)) == 0) return -1;
+
+  acquire(&pi->lock);
+  uint size = PGSIZE << order, len = pi->nwrite - pi->nread;
+  if (len > size) {
+    release(&pi->lock);
+    kfree_order(data, order);
+    return -1;
+  }
+  for (uint i = 0; i < len; i++)
+    data[i] = pi->data[(pi->nread + i) % pi->size];
+  old = pi->data;
+  int oldorder = pi->order;
+  pi->data = data;
+  pi->size = size;
+  pi->order = order;
+  pi->nread = 0;
+  pi->nwrite = len;
+  pi->wneed = min(pi->wneed, size / 2);
+  if (pi->wwait) wakeup(&pi->nwrite);
+  if (pi->npoll) pollwakeup();
+  release(&pi->lock);
+
+  kfree_order(old, oldorder);
+  return size;
+}
+
+// The size of pi's ring.
+int pipesize(struct pipe *pi) {
+  acquire(&pi->lock);
+  int n = pi->size;
+  release(&pi->lock);
+  return n;
+}
+
+// What is ready of pi's read end, or its write end if writable
+// is set, as POLLIN, POLLOUT, POLLERR and POLLHUP; and add arm,
+// 1 or -1 or 0, to the poll()s watching pi.
+int pipepoll(struct pipe *pi, int writable, int arm) {
+  int ev = 0;
+
+  acquire(&pi->lock);
+  pi->npoll += arm;
+  if (writable) {
+    if (!pi->readopen)
+      ev |= POLLERR;
+    else if (pi->nwrite != pi->nread + pi->size)
+      ev |= POLLOUT;
+  } else {
+    if (pi->nread != pi->nwrite) ev |= POLLIN;
+    if (!pi->writeopen) ev |= POLLHUP;
+  }
+  release(&pi->lock);
+  return ev;
+}
@@ -5,7 +5,12 @@
 struct file;
 struct pipe;
 
+void pipeinit(void);
 int pipealloc(struct file **, struct file **);
+int pipeavail(struct pipe *);
 void pipeclose(struct pipe *, int);
-int piperead(struct pipe *, uint64, int);
-int pipewrite(struct pipe *, uint64, int);
+int piperead(struct pipe *, int, uint64, int);
+int pipewrite(struct pipe *, int, uint64, int);
+int pipepoll(struct pipe *, int, int);
+int piperesize(struct pipe *, int);
+int pipesize(struct pipe *);
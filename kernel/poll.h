@@ -0,0 +1,15 @@
+#pragma once
+
+// poll() events
+#define POLLIN 0x01    // can read without waiting
+#define POLLOUT 0x04   // can write without waiting
+#define POLLERR 0x08   // writing to a pipe no one reads; always polled
+#define POLLHUP 0x10   // reading a pipe no one writes; always polled
+#define POLLNVAL 0x20  // fd is not open; always polled
+
+// One descriptor of a poll().
+struct pollfd {
+  int fd;
+  short events;   // what to wait for
+  short revents;  // what is ready, set by poll()
+};
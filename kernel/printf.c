@@ -7,19 +7,60 @@
 #include <stdarg.h>
 
 #include "console.h"
+#include "klog.h"
+#include "param.h"
+#include "proc.h"
 #include "spinlock.h"
 #include "types.h"
 
 volatile int panicking = 0;  // printing a panic message
 volatile int panicked = 0;   // spinning forever at end of a panic
 
-// lock to avoid interleaving concurrent printf's.
+// lock to avoid interleaving concurrent printf's while they
+// write to the console themselves. Once klogd runs, printf()
+// only logs to this hart's ring (see klog.c), which needs none.
 static struct {
   struct spinlock lock;
 } pr;
 
+// where this hart's printf() is sending its output.
+#define TOLOG 1      // the kernel log, for klogd to print
+#define TOCONSOLE 2  // the console, at once
+static int to[NCPU];
+
 static char digits[] = "0123456789abcdef";
 
+static void putc(int c) {
+  int t = panicking ? TOCONSOLE : to[cpuid()];
+
+  if (t & TOLOG) klogputc(c);
+  if (t & TOCONSOLE) consputc(c);
+}
+
+// Start printing a message; returns where it goes, for end().
+static int begin(void) {
+  int t;
+
+  if (panicking) return TOCONSOLE;
+  push_off();
+  if (klogasync()) {
+    t = TOLOG;
+  } else {
+    acquire(&pr.lock);
+    t = TOLOG | TOCONSOLE;
+  }
+  to[cpuid()] = t;
+  klogbegin();
+  return t;
+}
+
+static void end(int t) {
+  if ((t & TOLOG) == 0) return;
+  klogend(t & TOCONSOLE);
+  if (t & TOCONSOLE) release(&pr.lock);
+  pop_off();
+}
+
 static void printint(long long xx, int base, int sign) {
   char buf[20];
   int i;
@@ -37,15 +78,15 @@ static void printint(long long xx, int base, int sign) {
 
   if (sign) buf[i++] = '-';
 
-  while (--i >= 0) consputc(buf[i]);
+  while (--i >= 0) putc(buf[i]);
 }
 
 static void printptr(uint64 x) {
   int i;
-  consputc('0');
-  consputc('x');
+  putc('0');
+  putc('x');
   for (i = 0; i < (sizeof(uint64) * 2); i++, x <<= 4)
-    consputc(digits[x >> (sizeof(uint64) * 8 - 4)]);
+    putc(digits[x >> (sizeof(uint64) * 8 - 4)]);
 }
 
 // Print to the console.
@@ -53,13 +94,14 @@ int printf(char *fmt, ...) {
   va_list ap;
   int i, cx, c0, c1, c2;
   char *s;
+  int t;
 
-  if (panicking == 0) acquire(&pr.lock);
+  t = begin();
 
   va_start(ap, fmt);
   for (i = 0; (cx = fmt[i] & 0xff) != 0; i++) {
     if (cx != '%') {
-      consputc(cx);
+      putc(cx);
       continue;
     }
     i++;
@@ -94,29 +136,30 @@ int printf(char *fmt, ...) {
     } else if (c0 == 'p') {
       printptr(va_arg(ap, uint64));
     } else if (c0 == 'c') {
-      consputc(va_arg(ap, uint));
+      putc(va_arg(ap, uint));
     } else if (c0 == 's') {
       if ((s = va_arg(ap, char *)) == 0) s = "(null)";
-      for (; *s; s++) consputc(*s);
+      for (; *s; s++) putc(*s);
     } else if (c0 == '%') {
-      consputc('%');
+      putc('%');
     } else if (c0 == 0) {
       break;
     } else {
       // Print unknown % sequence to draw attention.
-      consputc('%');
-      consputc(c0);
+      putc('%');
+      putc(c0);
     }
   }
   va_end(ap);
 
-  if (panicking == 0) release(&pr.lock);
+  end(t);
 
   return 0;
 }
 
 void panic(char *s) {
   panicking = 1;
+  klogflush();
   printf("panic: ");
   printf("%s\n", s);
   panicked = 1;  // freeze uart output from other CPUs
@@ -130,14 +173,16 @@ void printfinit(void) { initlock(&pr.lock, "pr"); }
 void print_percent(uint64 percent_x100) {
   uint64 whole = percent_x100 / 100;
   uint64 frac = percent_x100 % 100;
+  int t = begin();
 
   printint(whole, 10, 0);
-  consputc('.');
+  putc('.');
 
   // Ensure two digits for fractional part
   if (frac < 10) {
-    consputc('0');
+    putc('0');
   }
   printint(frac, 10, 0);
-  consputc('%');
+  putc('%');
+  end(t);
 }
@@ -8,7 +8,9 @@
 #include "memlayout.h"
 #include "param.h"
 #include "printf.h"
+#include "rcu.h"
 #include "riscv.h"
+#include "slab.h"
 #include "spinlock.h"
 #include "string.h"
 #include "trap.h"
@@ -19,15 +21,79 @@
 
 struct cpu cpus[NCPU];
 
-struct proc proc[NPROC];
+// struct procs come from this cache as processes are created,
+// so the number of processes is limited by memory (and by the
+// NKSTACK kernel stack slots).
+static struct kmem_cache *proc_cache;
+
+// Per-hart queues of RUNNABLE processes. A process goes on the
+// queue of the hart it last ran on, and an idle hart steals from
+// the others. Each lock nests inside p->lock.
+//
+// Each queue has one FIFO per priority level, and the scheduler
+// runs the highest level first (multi-level feedback queue). A
+// process that uses up its level's quantum of timer ticks moves
+// down a level; each level down doubles the quantum. Every
+// BOOSTTICKS ticks, all processes go back up to their base
+// level, which setpriority() chooses, so nothing starves.
+//
+// p->affinity limits the harts p may run on: it is queued only
+// on one of them, and the others do not steal it.
+#define QUANTUM(prio) (1 << (prio))  // ticks per turn at level prio
+
+struct runq {
+  struct spinlock lock;
+  struct proc *head[NPRIO], *tail[NPRIO];  // linked through p->rqnext
+  int n;
+  int nany;  // of the n, how many may run on any hart
+};
+
+static struct runq runqs[NCPU];
+
+// Harts that have entered scheduler().
+static volatile uint64 onlineharts;
+
+// Sleeping processes are kept in a hash table of wait queues
+// keyed by channel, so that wakeup() looks only at processes
+// that may be waiting on its channel. A bucket's lock is taken
+// before p->lock.
+#define WAITQSHIFT 6
+#define NWAITQ (1 << WAITQSHIFT)
+#define WAITQ(chan) \
+  (&waitqs[((uint64)(chan) * 0x9E3779B97F4A7C15UL) >> (64 - WAITQSHIFT)])
+
+struct waitq {
+  struct spinlock lock;
+  struct proc *head;  // linked through p->wqnext
+};
+
+static struct waitq waitqs[NWAITQ];
+
+// Harts waiting in wfi with nothing to run. Their timers are off,
+// so setrunnable() must interrupt one to have it run new work.
+static volatile uint64 idleharts;
+
+// Incremented by each boost; a process that missed one because
+// it was running or asleep catches up when it is next queued or
+// charged a tick.
+static uint boostgen;
 
 struct proc *initproc;
 
 int nextpid = 1;
 struct spinlock pid_lock;
 
+// Allocated processes by pid; the only list of all processes.
+// pid_lock must be held when changing the table or p->pidnext,
+// and is taken before p->lock. findproc() walks the chains
+// under rcu_read_lock() instead, so freeproc() frees a process
+// only once no hart can still be walking past it.
+#define NPIDHASH 64
+static struct proc *pidhash[NPIDHASH];
+
 extern void forkret(void);
 static void freeproc(struct proc *p);
+static void procfree(struct rcuhead *h);
 
 extern char trampoline[];  // trampoline.S
 
@@ -37,31 +103,22 @@ extern char trampoline[];  // trampoline.S
 // must be acquired before any p->lock.
 struct spinlock wait_lock;
 
-// Allocate a page for each process's kernel stack.
-// Map it high in memory, followed by an invalid
-// guard page.
-void proc_mapstacks(pagetable_t kpgtbl) {
-  struct proc *p;
+static void procctor(void *obj) {
+  struct proc *p = obj;
 
-  for (p = proc; p < &proc[NPROC]; p++) {
-    char *pa = kalloc();
-    if (pa == 0) panic("kalloc");
-    uint64 va = KSTACK((int)(p - proc));
-    kvmmap(kpgtbl, va, (uint64)pa, PGSIZE, PTE_R | PTE_W);
-  }
+  memset(p, 0, sizeof(*p));
+  initlock(&p->lock, "proc");
 }
 
 // initialize the proc table.
 void procinit(void) {
-  struct proc *p;
-
-  initlock(&pid_lock, "nextpid");
-  initlock(&wait_lock, "wait_lock");
-  for (p = proc; p < &proc[NPROC]; p++) {
-    initlock(&p->lock, "proc");
-    p->state = UNUSED;
-    p->kstack = KSTACK((int)(p - proc));
-  }
+  initmcslock(&pid_lock, "nextpid");
+  initmcslock(&wait_lock, "wait_lock");
+  for (int i = 0; i < NCPU; i++) initlock(&runqs[i].lock, "runq");
+  for (int i = 0; i < NWAITQ; i++) initlock(&waitqs[i].lock, "waitq");
+  proc_cache = kmem_cache_create("proc", sizeof(struct proc), procctor, 0,
+                                 SLAB_HWCACHE_ALIGN);
+  if (proc_cache == 0) panic("procinit");
 }
 
 // Must be called with interrupts disabled,
@@ -89,94 +146,128 @@ struct proc *myproc(void) {
   return p;
 }
 
-int allocpid() {
-  int pid;
-
-  acquire(&pid_lock);
-  pid = nextpid;
-  nextpid = nextpid + 1;
-  release(&pid_lock);
-
-  return pid;
-}
-
-// Look in the process table for an UNUSED proc.
-// If found, initialize state required to run in the kernel,
-// and return with p->lock held.
-// If there are no free procs, or a memory allocation fails, return 0.
-static struct proc *allocproc(void) {
+// Allocate a struct proc and its kernel stack, and give it a
+// pid. If that works, initialize state required to run in the
+// kernel, and return with p->lock held. A new thread of group g
+// shares g's page table; kclone() maps its trapframe. If g is 0,
+// p is a new process with an empty user page table.
+// If a memory allocation fails, return 0.
+static struct proc *allocproc(struct proc *g) {
   struct proc *p;
 
-  for (p = proc; p < &proc[NPROC]; p++) {
-    acquire(&p->lock);
-    if (p->state == UNUSED) {
-      goto found;
-    } else {
-      release(&p->lock);
-    }
+  if ((p = kmem_cache_alloc(proc_cache)) == 0) return 0;
+  if ((p->kstack = kstackalloc()) == 0) {
+    kmem_cache_free(proc_cache, p);
+    return 0;
   }
-  return 0;
 
-found:
-  p->pid = allocpid();
+  // p is UNUSED until it holds p->lock, so findproc() skips it.
+  acquire(&pid_lock);
+  p->pid = nextpid++;
+  p->pidnext = pidhash[p->pid % NPIDHASH];
+  __atomic_store_n(&pidhash[p->pid % NPIDHASH], p, __ATOMIC_RELEASE);
+  release(&pid_lock);
+
+  acquire(&p->lock);
   p->state = USED;
+  p->cpu = cpuid();  // first runs on the creating hart's queue
+  p->prio = p->baseprio = 0;
+  p->affinity = ~0UL;
+  p->tracemask = 0;
+  p->ring = 0;
+  p->slice = 0;
+  p->boostgen = boostgen;
+  p->leader = g ? g : p;
+  p->kstackstale = ~0UL;
 
   // Allocate a trapframe page.
   if ((p->trapframe = (struct trapframe *)kalloc()) == 0) {
     freeproc(p);
-    release(&p->lock);
     return 0;
   }
 
+  // Set up new context to start executing at forkret,
+  // which returns to user space.
+  memset(&p->context, 0, sizeof(p->context));
+  p->context.ra = (uint64)forkret;
+  p->context.sp = p->kstack + PGSIZE;
+
+  if (g) {
+    p->pagetable = g->pagetable;
+    return p;
+  }
+  initsleeplock(&p->vmlock, "vm");
+  initlock(&p->fdlock, "files");
+  p->ofile = p->ofile0;
+  p->nofile = NOFILE;
+  p->trapframeva = TRAPFRAME;
+
   // Allocate a usyscall page.
   if ((p->usyscall = (struct usyscall *)kalloc()) == 0) {
     freeproc(p);
-    release(&p->lock);
     return 0;
   }
-  // Initialize usyscall with the process PID
+  // Initialize usyscall with the process PID and the clock
+  memset(p->usyscall, 0, PGSIZE);
   p->usyscall->pid = p->pid;
+  p->usyscall->timebase = TIMEBASE;
+  p->usyscall->tickcycles = TICKCYCLES;
+
+  // Another process may have left TLB entries with this ASID.
+  p->asid = asidalloc();
+  p->tlbstale = ~0UL;
 
   // An empty user page table.
   p->pagetable = proc_pagetable(p);
   if (p->pagetable == 0) {
     freeproc(p);
-    release(&p->lock);
     return 0;
   }
 
-  // Set up new context to start executing at forkret,
-  // which returns to user space.
-  memset(&p->context, 0, sizeof(p->context));
-  p->context.ra = (uint64)forkret;
-  p->context.sp = p->kstack + PGSIZE;
-
-  // Initialize VMAs
-  for (int i = 0; i < NVMA; i++) {
-    p->vmas[i].used = 0;
-  }
-
   return p;
 }
 
 // free a proc structure and the data hanging from it,
-// including user pages.
-// p->lock must be held.
+// including user pages unless p is a thread sharing them.
+// p->lock must be held; freeproc releases it, before freeing
+// the user pages so that a big exit can cond_resched().
 static void freeproc(struct proc *p) {
+  pagetable_t pagetable = 0;
+
   if (p->trapframe) kfree((void *)p->trapframe);
   p->trapframe = 0;
-  if (p->usyscall) kfree((void *)p->usyscall);
-  p->usyscall = 0;
-  if (p->pagetable) proc_freepagetable(p->pagetable, p->sz);
+  if (p->leader == p) {
+    if (p->usyscall) kfree((void *)p->usyscall);
+    p->usyscall = 0;
+    pagetable = p->pagetable;
+    ringfree(p);
+    asidfree(p->asid);
+    p->asid = 0;
+    fdfree(p);
+  }
+  uint64 sz = p->sz;
   p->pagetable = 0;
-  p->sz = 0;
-  p->pid = 0;
-  p->parent = 0;
-  p->name[0] = 0;
-  p->chan = 0;
-  p->killed = 0;
-  p->xstate = 0;
   p->state = UNUSED;
+  release(&p->lock);
+
+  if (pagetable) proc_freepagetable(pagetable, sz);
+
+  // findproc() may still find p until it is unhashed, and
+  // still be looking at it for a while after, but will see
+  // that it is UNUSED.
+  struct proc **pp = &pidhash[p->pid % NPIDHASH];
+  acquire(&pid_lock);
+  while (*pp != p) pp = &(*pp)->pidnext;
+  __atomic_store_n(pp, p->pidnext, __ATOMIC_RELEASE);
+  release(&pid_lock);
+
+  kstackfree(p->kstack);
+  call_rcu(&p->rcu, procfree);
+}
+
+// Free an unhashed proc once findproc() is done with it.
+static void procfree(struct rcuhead *h) {
+  kmem_cache_free(proc_cache, (char *)h - __builtin_offsetof(struct proc, rcu));
 }
 
 // Create a user page table for a given process, with no user memory,
@@ -226,19 +317,180 @@ void proc_freepagetable(pagetable_t pagetable, uint64 sz) {
   uvmunmap(pagetable, TRAMPOLINE, 1, 0);
   uvmunmap(pagetable, TRAPFRAME, 1, 0);
   uvmunmap(pagetable, USYSCALL, 1, 0);
+  if (walkaddr(pagetable, URING)) uvmunmap(pagetable, URING, 1, 0);
   uvmfree(pagetable, sz);
 }
 
+// Put p back at its base level if it missed a boost.
+static void catchup(struct proc *p) {
+  if (p->boostgen != boostgen) {
+    p->boostgen = boostgen;
+    p->prio = p->baseprio;
+    p->slice = 0;
+  }
+}
+
+// Append p to its level's list on rq. Caller holds rq->lock.
+static void runq_push(struct runq *rq, struct proc *p) {
+  p->rqnext = 0;
+  if (rq->tail[p->prio])
+    rq->tail[p->prio]->rqnext = p;
+  else
+    rq->head[p->prio] = p;
+  rq->tail[p->prio] = p;
+  rq->n++;
+  if ((p->rqany = p->affinity == ~0UL) != 0) rq->nany++;
+}
+
+// Ask hart to look at its run queue again, so that it takes
+// timer ticks or leaves wfi. Interrupts must be off.
+static void kick(int hart) {
+  if (hart == cpuid())
+    settimer(1);
+  else
+    ipi(hart);
+}
+
+// Mark p RUNNABLE and queue it on the hart it last ran on, or
+// the first one it may run on if that is not allowed.
+// Caller must hold p->lock.
+static void setrunnable(struct proc *p) {
+  struct runq *rq;
+  uint64 idle;
+  int was;
+
+  if ((p->affinity & (1UL << p->cpu)) == 0)
+    p->cpu = __builtin_ctzl(p->affinity);
+  rq = &runqs[p->cpu];
+  p->state = RUNNABLE;
+  p->readyat = r_time();
+  catchup(p);
+  acquire(&rq->lock);
+  was = rq->n;
+  runq_push(rq, p);
+  release(&rq->lock);
+
+  // the hart is idle, or was running its one process without
+  // ticks; otherwise let an idle hart steal.
+  idle = idleharts & p->affinity;
+  if (was == 0 || (idle & (1UL << p->cpu)))
+    kick(p->cpu);
+  else if (idle)
+    kick(__builtin_ctzl(idle));
+}
+
+// Does this hart's current process share it with anyone, and
+// so need timer ticks to be preempted?
+int runq_needtick(void) { return runqs[cpuid()].n > 0; }
+
+// Take the first process of the highest non-empty level off
+// runqs[id] whose affinity meets allow, or return 0. The
+// affinity is read without p->lock; the scheduler rechecks it.
+static struct proc *runq_pop(int id, uint64 allow) {
+  struct runq *rq = &runqs[id];
+  struct proc *p, *prev, **pp;
+
+  if (rq->n == 0) return 0;  // racy peek, rechecked below
+  acquire(&rq->lock);
+  for (int l = 0; l < NPRIO; l++) {
+    prev = 0;
+    for (pp = &rq->head[l]; (p = *pp) != 0; prev = p, pp = &p->rqnext) {
+      if (p->affinity & allow) {
+        *pp = p->rqnext;
+        if (rq->tail[l] == p) rq->tail[l] = prev;
+        rq->n--;
+        if (p->rqany) rq->nany--;
+        release(&rq->lock);
+        return p;
+      }
+    }
+  }
+  release(&rq->lock);
+  return 0;
+}
+
+// Move every queued process back to its base level.
+// Called by tickupdate() every BOOSTTICKS ticks.
+void mlfqboost(void) {
+  boostgen++;
+  for (struct runq *rq = runqs; rq < &runqs[NCPU]; rq++) {
+    struct proc *list = 0, **tailp = &list;
+    acquire(&rq->lock);
+    for (int l = 0; l < NPRIO; l++) {
+      *tailp = rq->head[l];
+      if (rq->tail[l]) tailp = &rq->tail[l]->rqnext;
+      rq->head[l] = rq->tail[l] = 0;
+    }
+    rq->n = rq->nany = 0;
+    for (struct proc *p = list, *next; p; p = next) {
+      next = p->rqnext;
+      catchup(p);
+      runq_push(rq, p);
+    }
+    release(&rq->lock);
+  }
+}
+
+// Charge a timer tick to the current process. It yields if its
+// quantum at this level is used up, moving down a level, or if
+// a higher-priority process is waiting on this hart.
+void clockyield(void) {
+  struct proc *p = myproc();
+  struct runq *rq;
+  int preempt = 0;
+
+  acquire(&p->lock);
+  catchup(p);
+  if (++p->slice >= QUANTUM(p->prio)) {
+    if (p->prio < NPRIO - 1) p->prio++;
+    p->slice = 0;
+    preempt = 1;
+  } else {
+    rq = &runqs[p->cpu];
+    for (int l = 0; l < p->prio; l++)
+      if (rq->head[l]) preempt = 1;  // racy peek is enough
+  }
+  if (preempt) {
+    p->ru.nivcsw++;
+    setrunnable(p);
+    sched();
+  }
+  release(&p->lock);
+}
+
+// A preemption point for long kernel loops. The timer preempts a
+// process for a higher-priority one only once a tick, so one woken
+// onto this hart could wait up to a tick behind a big fork() or
+// unlink(). Yields if one is waiting; does nothing with interrupts
+// off, as under a spinlock.
+void cond_resched(void) {
+  struct proc *p = myproc();
+  struct runq *rq;
+  int preempt = 0;
+
+  if (p == 0 || !intr_get()) return;
+  rq = &runqs[p->cpu];
+  for (int l = 0; l < p->prio; l++)
+    if (rq->head[l]) preempt = 1;  // racy peek is enough
+  if (preempt) {
+    acquire(&p->lock);
+    p->ru.nivcsw++;
+    setrunnable(p);
+    sched();
+    release(&p->lock);
+  }
+}
+
 // Set up first user process.
 void userinit(void) {
   struct proc *p;
 
-  p = allocproc();
+  p = allocproc(0);
   initproc = p;
 
   p->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  setrunnable(p);
 
   release(&p->lock);
 }
@@ -247,7 +499,7 @@ void userinit(void) {
 // Return 0 on success, -1 on failure.
 int growproc(int n) {
   uint64 sz;
-  struct proc *p = myproc();
+  struct proc *p = myproc()->leader;
 
   sz = p->sz;
   if (n > 0) {
@@ -263,23 +515,35 @@ int growproc(int n) {
 
 // Create a new process, copying the parent.
 // Sets up child kernel stack to return as if from fork() system call.
+// When a thread forks, the child gets a copy of the whole
+// address space and a single thread, the caller's.
 int kfork(void) {
-  int i, pid;
+  int i, pid, locked;
   struct proc *np;
   struct proc *p = myproc();
+  struct proc *g = p->leader;
+
+  // keep the other threads from changing what is copied.
+  locked = lockvm();
 
   // Allocate process.
-  if ((np = allocproc()) == 0) {
+  if ((np = allocproc(0)) == 0) {
+    unlockvm(locked);
     return -1;
   }
+  // copying a big address space takes a while, and should be
+  // able to cond_resched(). np is USED, so nothing else
+  // touches it.
+  release(&np->lock);
 
   // Copy user memory from parent to child.
-  if (uvmcopy(p->pagetable, np->pagetable, p->sz) < 0) {
+  if (uvmcopy(g->pagetable, np->pagetable, g->sz) < 0) {
+    acquire(&np->lock);
     freeproc(np);
-    release(&np->lock);
+    unlockvm(locked);
     return -1;
   }
-  np->sz = p->sz;
+  np->sz = g->sz;
 
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
@@ -288,47 +552,392 @@ int kfork(void) {
   np->trapframe->a0 = 0;
 
   // increment reference counts on open file descriptors.
-  for (i = 0; i < NOFILE; i++)
-    if (p->ofile[i]) np->ofile[i] = filedup(p->ofile[i]);
-  np->cwd = idup(p->cwd);
-
-  // Copy VMAs from parent to child
-  for (i = 0; i < NVMA; i++) {
-    if (p->vmas[i].used) {
-      np->vmas[i] = p->vmas[i];
-      // Increment file reference count
-      np->vmas[i].file = filedup(p->vmas[i].file);
+  acquire(&g->fdlock);
+  if (fdgrow(np, g->nofile) < 0) {
+    release(&g->fdlock);
+    acquire(&np->lock);
+    freeproc(np);
+    unlockvm(locked);
+    return -1;
+  }
+  for (i = 0; i < g->nofile; i++)
+    if (g->ofile[i]) fdset(np, i, filedup(g->ofile[i]));
+  np->cwd = idup(g->cwd);
+  release(&g->fdlock);
+
+  // Copy VMAs from parent to child. Shared mappings fault their
+  // pages in again from the file or anon cache; private ones
+  // above g->sz, which uvmcopy() skipped, are copied on write.
+  for (struct vma *v = vma_find(&g->vmas, 0); v;
+       v = vma_find(&g->vmas, v->addr + v->len)) {
+    struct vma *nv = vma_dup(v);
+    if (nv == 0 ||
+        (!(v->flags & MAP_SHARED) && v->addr >= g->sz &&
+         uvmcopyrange(g->pagetable, np->pagetable, v->addr,
+                      PGROUNDUP(v->addr + v->len)) < 0)) {
+      // The parent still holds every file and anon, so
+      // this neither sleeps nor frees shared pages.
+      if (nv) vma_put(nv);
+      while ((v = vma_find(&np->vmas, 0)) != 0) {
+        vma_remove(&np->vmas, v);
+        if (v->addr >= np->sz)
+          uvmunmap(np->pagetable, v->addr, PGROUNDUP(v->len) / PGSIZE, 1);
+        vma_put(v);
+      }
+      acquire(&np->lock);
+      freeproc(np);
+      unlockvm(locked);
+      return -1;
     }
+    vma_insert(&np->vmas, nv);
   }
+  unlockvm(locked);
 
   safestrcpy(np->name, p->name, sizeof(p->name));
+  np->prio = np->baseprio = p->baseprio;
+  np->affinity = p->affinity;
+  np->tracemask = p->tracemask;
 
   pid = np->pid;
 
+  acquire(&wait_lock);
+  np->parent = p;
+  np->sibling = p->children;
+  p->children = np;
+  release(&wait_lock);
+
+  acquire(&np->lock);
+  setrunnable(np);
   release(&np->lock);
 
+  return pid;
+}
+
+// Create a new process running the program at path, as fork()
+// followed by exec() would, without copying the caller's memory.
+// The child inherits the caller's open files, except that for
+// i < nfd its fd i is the caller's fd fdmap[i], or closed if
+// fdmap[i] is -1. Returns the child's pid, or -1.
+int kspawn(char *path, char **argv, int *fdmap, int nfd) {
+  int i, pid, argc;
+  struct proc *np;
+  struct proc *p = myproc();
+  struct proc *g = p->leader;
+
+  if ((np = allocproc(0)) == 0) {
+    return -1;
+  }
+  // kexec sleeps. np is USED, so nothing else touches it.
+  release(&np->lock);
+
+  acquire(&g->fdlock);
+  if (fdgrow(np, nfd > g->nofile ? nfd : g->nofile) < 0) {
+    release(&g->fdlock);
+    acquire(&np->lock);
+    freeproc(np);
+    return -1;
+  }
+  for (i = 0; i < np->nofile; i++) {
+    struct file *f = i < g->nofile ? g->ofile[i] : 0;
+    if (i < nfd)
+      f = fdmap[i] >= 0 && fdmap[i] < g->nofile ? g->ofile[fdmap[i]] : 0;
+    if (f) fdset(np, i, filedup(f));
+  }
+  np->cwd = idup(g->cwd);
+  release(&g->fdlock);
+  safestrcpy(np->name, p->name, sizeof(p->name));
+  np->prio = np->baseprio = p->baseprio;
+  np->affinity = p->affinity;
+  np->tracemask = p->tracemask;
+
+  if ((argc = kexecproc(np, path, argv)) < 0) {
+    for (i = 0; i < np->nofile; i++) {
+      if (np->ofile[i]) fileclose(np->ofile[i]);
+      fdset(np, i, 0);
+    }
+    begin_op();
+    iput(np->cwd);
+    end_op();
+    np->cwd = 0;
+    acquire(&np->lock);
+    freeproc(np);
+    return -1;
+  }
+  np->trapframe->a0 = argc;
+
+  pid = np->pid;
+
   acquire(&wait_lock);
   np->parent = p;
+  np->sibling = p->children;
+  p->children = np;
   release(&wait_lock);
 
   acquire(&np->lock);
-  np->state = RUNNABLE;
+  setrunnable(np);
   release(&np->lock);
 
   return pid;
 }
 
+// Lock the calling thread's address space against changes by
+// the group's other threads, unless it has none or the caller
+// holds the lock already. Returns whether it locked, for
+// unlockvm(). A process with one thread cannot gain another
+// while that thread is busy in here.
+int lockvm(void) {
+  struct proc *p = myproc(), *g = p->leader;
+
+  if ((p == g && g->threads == 0) || holdingsleep(&g->vmlock)) return 0;
+  acquiresleep(&g->vmlock);
+  return 1;
+}
+
+void unlockvm(int locked) {
+  if (locked) releasesleep(&myproc()->leader->vmlock);
+}
+
+// Free thread t of its group, which is off the group's list and
+// ZOMBIE or has never run: unmap its trapframe from the shared
+// page table and release its slot.
+static void freethread(struct proc *t) {
+  struct proc *g = t->leader;
+
+  acquiresleep(&g->vmlock);
+  uvmunmap(g->pagetable, t->trapframeva, 1, 0);
+  g->tslots &= ~(1 << t->tslot);
+  releasesleep(&g->vmlock);
+  acquire(&t->lock);
+  freeproc(t);
+}
+
+// A kernel thread starts here, like forkret(), but stays in
+// the kernel.
+static void kthreadret(void) {
+  struct proc *p = myproc();
+
+  // Still holding p->lock from scheduler.
+  release(&p->lock);
+  p->kfn();
+  panic("kthread returned");
+}
+
+// Create a process that runs fn() in the kernel and never goes
+// to user space, for daemons. It has no parent, files or cwd,
+// and fn must not return. Returns its pid, or -1.
+int kthread(char *name, void (*fn)(void)) {
+  struct proc *p;
+  int pid;
+
+  if ((p = allocproc(0)) == 0) return -1;
+  safestrcpy(p->name, name, sizeof(p->name));
+  p->kfn = fn;
+  p->context.ra = (uint64)kthreadret;
+  pid = p->pid;
+  setrunnable(p);
+  release(&p->lock);
+  return pid;
+}
+
+// Create a thread of the caller's process, sharing its page
+// table, VMAs and open files. It runs kfn() in the kernel if
+// kfn is set, and otherwise starts at fn(arg) in user space with
+// stack pointer sp and the caller's other registers. Returns the
+// new thread's id, a pid, or -1.
+static int newthread(void (*kfn)(void), uint64 fn, uint64 arg, uint64 sp) {
+  int slot, tid;
+  struct proc *np;
+  struct proc *p = myproc();
+  struct proc *g = p->leader;
+
+  if ((np = allocproc(g)) == 0) return -1;
+  release(&np->lock);
+
+  // map its trapframe where trampoline.S will look for it.
+  acquiresleep(&g->vmlock);
+  for (slot = 1; slot < NTHREAD && (g->tslots & (1 << slot)); slot++);
+  if (slot == NTHREAD || mappages(g->pagetable, THREADFRAME(slot), PGSIZE,
+                                  (uint64)np->trapframe, PTE_R | PTE_W) < 0) {
+    releasesleep(&g->vmlock);
+    acquire(&np->lock);
+    freeproc(np);
+    return -1;
+  }
+  g->tslots |= 1 << slot;
+  releasesleep(&g->vmlock);
+  np->tslot = slot;
+  np->trapframeva = THREADFRAME(slot);
+
+  if (kfn) {
+    np->kfn = kfn;
+    np->context.ra = (uint64)kthreadret;
+  } else {
+    *(np->trapframe) = *(p->trapframe);
+    np->trapframe->epc = fn;
+    np->trapframe->a0 = arg;
+    np->trapframe->sp = sp;
+    np->trapframe->ra = 0;
+  }
+
+  safestrcpy(np->name, p->name, sizeof(p->name));
+  np->prio = np->baseprio = p->baseprio;
+  np->affinity = p->affinity;
+  np->tracemask = p->tracemask;
+  tid = np->pid;
+
+  // a leader that is exiting reaps the threads it finds on its
+  // list under wait_lock, so it must not get another.
+  acquire(&wait_lock);
+  if (killed(g)) {
+    release(&wait_lock);
+    freethread(np);
+    return -1;
+  }
+  np->tnext = g->threads;
+  g->threads = np;
+  release(&wait_lock);
+
+  acquire(&np->lock);
+  setrunnable(np);
+  release(&np->lock);
+
+  return tid;
+}
+
+// Create a thread of the caller's process at fn(arg) in user
+// space; fn must not return, and the thread ends by calling
+// exit(). Returns its id, or -1.
+int kclone(uint64 fn, uint64 arg, uint64 sp) {
+  return newthread(0, fn, arg, sp);
+}
+
+// Create a thread of the caller's process that runs fn() in the
+// kernel, with the process's page table and files. fn must not
+// return; it should kexit() once the thread is killed(), as it
+// is when the process exits. Returns its id, or -1.
+int kthreadclone(void (*fn)(void)) { return newthread(fn, 0, 0, 0); }
+
+// Wait for thread tid of the caller's process to exit, and
+// free it. Stores its exit status at addr if addr is not 0.
+// Returns tid, or -1 if there is no such thread.
+int kjoin(int tid, uint64 addr) {
+  struct proc *t, **link;
+  struct proc *p = myproc();
+  struct proc *g = p->leader;
+  int xstate;
+
+  acquire(&wait_lock);
+  for (;;) {
+    for (link = &g->threads; (t = *link) != 0; link = &t->tnext)
+      if (t->pid == tid) break;
+    if (t == 0 || t == p || killed(p)) {
+      release(&wait_lock);
+      return -1;
+    }
+    acquire(&t->lock);
+    if (t->state == ZOMBIE) {
+      xstate = t->xstate;
+      *link = t->tnext;
+      release(&t->lock);
+      release(&wait_lock);
+      freethread(t);
+      if (addr != 0 &&
+          copyout(p->pagetable, addr, (char *)&xstate, sizeof(xstate)) < 0)
+        return -1;
+      return tid;
+    }
+    release(&t->lock);
+
+    // thread exits and leader exits wake g.
+    sleep(g, &wait_lock);
+  }
+}
+
+// Mark p killed and get it moving, so it notices: out of sleep(),
+// or into the kernel if it is running user code on a hart that
+// has no timer ticks. Caller must hold p->lock.
+static void killlocked(struct proc *p) {
+  p->killed = 1;
+  if (p->state == SLEEPING) {
+    // Wake process from sleep().
+    setrunnable(p);
+  } else if (p->state == RUNNING && p->cpu != cpuid()) {
+    ipi(p->cpu);
+  }
+}
+
 // Pass p's abandoned children to init.
 // Caller must hold wait_lock.
 void reparent(struct proc *p) {
   struct proc *pp;
 
-  for (pp = proc; pp < &proc[NPROC]; pp++) {
-    if (pp->parent == p) {
-      pp->parent = initproc;
-      wakeup(initproc);
+  if (p->children == 0) return;
+  for (pp = p->children;; pp = pp->sibling) {
+    pp->parent = initproc;
+    if (pp->sibling == 0) break;
+  }
+  pp->sibling = initproc->children;
+  initproc->children = p->children;
+  p->children = 0;
+  wakeup(initproc);
+}
+
+// Unmap all of p's VMAs from p->pagetable, writing back
+// MAP_SHARED regions, and close their files.
+// Must not be called inside a file system transaction.
+void proc_freevmas(struct proc *p) {
+  struct vma *v, *done[16];
+  int n = 0;
+
+  while ((v = vma_find(&p->vmas, 0)) != 0) {
+    vma_remove(&p->vmas, v);
+    vma_writeback(p->pagetable, v, v->addr, v->len);
+
+    // Unmap pages (only if they've been allocated)
+    uvmunmap(p->pagetable, v->addr, v->len / PGSIZE, 1);
+
+    done[n++] = v;
+    if (n == NELEM(done)) {
+      vma_put_bulk(n, done);
+      n = 0;
     }
   }
+  vma_put_bulk(n, done);
+}
+
+// Kill the other threads of leader g, wait for them to exit,
+// and free them.
+static void reapthreads(struct proc *g) {
+  struct proc *t;
+  int busy;
+
+  acquire(&wait_lock);
+  // stops kclone() adding threads.
+  acquire(&g->lock);
+  g->killed = 1;
+  release(&g->lock);
+  for (;;) {
+    busy = 0;
+    for (t = g->threads; t; t = t->tnext) {
+      acquire(&t->lock);
+      if (t->state != ZOMBIE) {
+        killlocked(t);
+        busy = 1;
+      }
+      release(&t->lock);
+    }
+    if (!busy) break;
+    sleep(g, &wait_lock);
+  }
+  t = g->threads;
+  g->threads = 0;
+  release(&wait_lock);
+
+  while (t) {
+    struct proc *next = t->tnext;
+    freethread(t);
+    t = next;
+  }
 }
 
 // Exit the current process.  Does not return.
@@ -339,66 +948,33 @@ void kexit(int status) {
 
   if (p == initproc) panic("init exiting");
 
+  if (p != p->leader) {
+    // a thread leaves the shared state to its leader.
+    acquire(&wait_lock);
+    reparent(p);
+    if (p->parent) wakeup(p->parent);
+    wakeup(p->leader);  // kjoin() or reapthreads()
+    acquire(&p->lock);
+    p->xstate = status;
+    p->state = ZOMBIE;
+    release(&wait_lock);
+    sched();
+    panic("zombie exit");
+  }
+
+  reapthreads(p);
+
   // Close all open files.
-  for (int fd = 0; fd < NOFILE; fd++) {
+  for (int fd = 0; fd < p->nofile; fd++) {
     if (p->ofile[fd]) {
       struct file *f = p->ofile[fd];
       fileclose(f);
-      p->ofile[fd] = 0;
+      fdset(p, fd, 0);
     }
   }
 
   // Unmap all VMAs and write back MAP_SHARED regions
-  for (int i = 0; i < NVMA; i++) {
-    if (p->vmas[i].used) {
-      struct vma *v = &p->vmas[i];
-
-      // Write back if MAP_SHARED (only allocated pages)
-      if (v->flags & MAP_SHARED) {
-        struct inode *ip = v->file->ip;
-
-        // Get file size
-        ilock(ip);
-        uint file_size = ip->size;
-        iunlock(ip);
-
-        for (uint64 va = v->addr; va < v->addr + v->len; va += PGSIZE) {
-          if (ismapped(p->pagetable, va)) {
-            uint64 offset_in_vma = va - v->addr;
-            uint64 file_offset = v->offset + offset_in_vma;
-
-            // Don't write beyond file size
-            if (file_offset >= file_size) {
-              continue;
-            }
-
-            // Calculate bytes to write
-            uint64 bytes_to_write = PGSIZE;
-            if (file_offset + bytes_to_write > file_size) {
-              bytes_to_write = file_size - file_offset;
-            }
-
-            if (bytes_to_write > 0) {
-              begin_op();
-              ilock(ip);
-              writei(ip, 1, va, file_offset, bytes_to_write);
-              iunlock(ip);
-              end_op();
-            }
-          }
-        }
-      }
-
-      // Unmap pages (only if they've been allocated)
-      uvmunmap(p->pagetable, v->addr, v->len / PGSIZE, 1);
-
-      // Close file
-      fileclose(v->file);
-
-      // Mark as unused
-      v->used = 0;
-    }
-  }
+  proc_freevmas(p);
 
   begin_op();
   iput(p->cwd);
@@ -428,41 +1004,44 @@ void kexit(int status) {
 // Wait for a child process to exit and return its pid.
 // Return -1 if this process has no children.
 int kwait(uint64 addr) {
-  struct proc *pp;
-  int havekids, pid;
+  struct proc *pp, **link;
+  int pid;
   struct proc *p = myproc();
 
+retry:
   acquire(&wait_lock);
 
   for (;;) {
-    // Scan through table looking for exited children.
-    havekids = 0;
-    for (pp = proc; pp < &proc[NPROC]; pp++) {
-      if (pp->parent == p) {
-        // make sure the child isn't still in exit() or swtch().
-        acquire(&pp->lock);
-
-        havekids = 1;
-        if (pp->state == ZOMBIE) {
-          // Found one.
-          pid = pp->pid;
-          if (addr != 0 && copyout(p->pagetable, addr, (char *)&pp->xstate,
-                                   sizeof(pp->xstate)) < 0) {
-            release(&pp->lock);
-            release(&wait_lock);
-            return -1;
-          }
-          freeproc(pp);
+    // Scan through our children looking for exited ones.
+    for (link = &p->children; (pp = *link) != 0; link = &pp->sibling) {
+      // make sure the child isn't still in exit() or swtch().
+      acquire(&pp->lock);
+
+      if (pp->state == ZOMBIE) {
+        // Found one.
+        pid = pp->pid;
+        if (addr != 0 && copyout(p->pagetable, addr, (char *)&pp->xstate,
+                                 sizeof(pp->xstate)) < 0) {
+          // fault addr in, which may sleep, without the locks.
           release(&pp->lock);
           release(&wait_lock);
-          return pid;
+          if (userfaultin(p->pagetable, addr, sizeof(pp->xstate), 1) < 0)
+            return -1;
+          goto retry;
         }
-        release(&pp->lock);
+        *link = pp->sibling;
+        hpmreap(p, pp);
+        // off the tree, nothing else can reach pp; free it
+        // without wait_lock, since that can take a while.
+        release(&wait_lock);
+        freeproc(pp);
+        return pid;
       }
+      release(&pp->lock);
     }
 
     // No point waiting if we don't have any children.
-    if (!havekids || killed(p)) {
+    if (p->children == 0 || killed(p)) {
       release(&wait_lock);
       return -1;
     }
@@ -484,6 +1063,7 @@ void scheduler(void) {
   struct cpu *c = mycpu();
 
   c->proc = 0;
+  __sync_fetch_and_or(&onlineharts, 1UL << cpuid());
   for (;;) {
     // The most recent process to run may have had interrupts
     // turned off; enable them to avoid a deadlock if all
@@ -492,17 +1072,51 @@ void scheduler(void) {
     // and wfi.
     intr_on();
     intr_off();
+    rcu_quiescent();
+
+    // Take the next process from this hart's queue, or
+    // steal one from the busiest other hart.
+    int id = cpuid();
+    if ((p = runq_pop(id, ~0UL)) == 0) {
+      int victim = -1;
+      for (int i = 1; i < NCPU; i++) {
+        int v = (id + i) % NCPU;
+        if (runqs[v].n > 0 && (victim < 0 || runqs[v].n > runqs[victim].n))
+          victim = v;
+      }
+      if (victim >= 0) p = runq_pop(victim, 1UL << id);
+    }
 
     int found = 0;
-    for (p = proc; p < &proc[NPROC]; p++) {
+    if (p) {
+      // A yielding process is queued before it has switched
+      // away; its lock is held until then.
       acquire(&p->lock);
-      if (p->state == RUNNABLE) {
+      if (p->state == RUNNABLE && (p->affinity & (1UL << id)) == 0) {
+        // its affinity changed while it was queued.
+        setrunnable(p);
+      } else if (p->state == RUNNABLE) {
         // Switch to chosen process.  It is the process's job
         // to release its lock and then reacquire it
         // before jumping back to us.
         p->state = RUNNING;
+        p->cpu = id;
         c->proc = p;
+        if (p->kstackstale & (1UL << id)) {
+          // the stack's slot may have mapped another page.
+          sfence_vma_va(p->kstack);
+          p->kstackstale &= ~(1UL << id);
+        }
+        // uvmflush() shoots down the harts running the group.
+        __sync_fetch_and_or(&p->leader->runharts, 1UL << id);
+        settimer(runq_needtick());
+        p->stamp = r_time();
+        p->ru.wtime += p->stamp - p->readyat;
+        hpmstart();
         swtch(&c->context, &p->context);
+        hpmstop(p);
+        p->ru.stime += r_time() - p->stamp;
+        __sync_fetch_and_and(&p->leader->runharts, ~(1UL << id));
 
         // Process is done running for now.
         // It should have changed its p->state before coming back.
@@ -511,9 +1125,25 @@ void scheduler(void) {
       }
       release(&p->lock);
     }
-    if (found == 0) {
-      // nothing to run; stop running on this core until an interrupt.
-      asm volatile("wfi");
+    if (found == 0 && kalloc_idle() == 0) {
+      // nothing to run and no pages to zero;
+      // stop running on this core until an interrupt.
+      // with the timer off unless pause() needs it,
+      // that may be a device or a kick from setrunnable().
+      // recheck the queues after going idle, since a
+      // process queued before then did not kick us. a
+      // process pinned elsewhere kicks its own hart.
+      __sync_fetch_and_or(&idleharts, 1UL << id);
+      int busy = runqs[id].n > 0;
+      for (int i = 0; i < NCPU; i++)
+        if (runqs[i].nany > 0) busy = 1;
+      if (!busy) {
+        settimer(0);
+        rcu_setquiet(1);
+        asm volatile("wfi");
+        rcu_setquiet(0);
+      }
+      __sync_fetch_and_and(&idleharts, ~(1UL << id));
     }
   }
 }
@@ -543,7 +1173,7 @@ void sched(void) {
 void yield(void) {
   struct proc *p = myproc();
   acquire(&p->lock);
-  p->state = RUNNABLE;
+  setrunnable(p);
   sched();
   release(&p->lock);
 }
@@ -578,11 +1208,19 @@ void forkret(void) {
 
   // return to user space, mimicing usertrap()'s return.
   prepare_return();
-  uint64 satp = MAKE_SATP(p->pagetable);
+  uint64 satp = MAKE_SATP(p->pagetable) | SATP_ASID(p->leader->asid);
   uint64 trampoline_userret = TRAMPOLINE + (userret - trampoline);
   ((void (*)(uint64))trampoline_userret)(satp);
 }
 
+// Remove p from its wait queue. Caller holds the queue's lock.
+static void waitq_unlink(struct proc *p) {
+  *p->wqpprev = p->wqnext;
+  if (p->wqnext) p->wqnext->wqpprev = p->wqpprev;
+  p->wqnext = 0;
+  p->wqpprev = 0;
+}
+
 // Sleep on channel chan, releasing condition lock lk.
 // Re-acquires lk when awakened.
 void sleep(void *chan, struct spinlock *lk) {
@@ -595,37 +1233,95 @@ void sleep(void *chan, struct spinlock *lk) {
   // (wakeup locks p->lock),
   // so it's okay to release lk.
 
+  struct waitq *wq = WAITQ(chan);
+  void *linked;
+
+  acquire(&wq->lock);
   acquire(&p->lock);  // DOC: sleeplock1
+  p->chan = chan;
+  p->wqnext = wq->head;
+  if (wq->head) wq->head->wqpprev = &p->wqnext;
+  p->wqpprev = &wq->head;
+  wq->head = p;
+  release(&wq->lock);
   release(lk);
 
   // Go to sleep.
-  p->chan = chan;
   p->state = SLEEPING;
+  p->ru.nvcsw++;
 
   sched();
 
-  // Tidy up.
+  // Tidy up. wakeup() unlinks and clears p->chan; if something
+  // else woke us, such as kkill(), we are still on the queue.
+  // Nothing wakes us now that we are RUNNING, so it is safe to
+  // drop p->lock before taking the bucket's lock.
+  linked = p->chan;
   p->chan = 0;
 
   // Reacquire original lock.
   release(&p->lock);
+  if (linked) {
+    acquire(&wq->lock);
+    waitq_unlink(p);
+    release(&wq->lock);
+  }
   acquire(lk);
 }
 
 // Wake up all processes sleeping on channel chan.
 // Caller should hold the condition lock.
-void wakeup(void *chan) {
-  struct proc *p;
+void wakeup(void *chan) { wakeupn(chan, ~0U); }
 
-  for (p = proc; p < &proc[NPROC]; p++) {
+// Wake up at most n processes sleeping on channel chan, the
+// most recent sleepers first. Returns how many.
+// Caller should hold the condition lock.
+int wakeupn(void *chan, uint n) {
+  struct waitq *wq = WAITQ(chan);
+  struct proc *p, *next;
+  uint woken = 0;
+
+  // a sleeper is on the queue before it releases the condition
+  // lock, so an unlocked peek cannot miss it.
+  if (wq->head == 0) return 0;
+  acquire(&wq->lock);
+  for (p = wq->head; p && woken < n; p = next) {
+    next = p->wqnext;
     if (p != myproc()) {
       acquire(&p->lock);
       if (p->state == SLEEPING && p->chan == chan) {
-        p->state = RUNNABLE;
+        waitq_unlink(p);
+        p->chan = 0;
+        setrunnable(p);
+        woken++;
       }
       release(&p->lock);
     }
   }
+  release(&wq->lock);
+  return woken;
+}
+
+// Find the process with the given pid and return it with
+// p->lock held, or return 0.
+struct proc *findproc(int pid) {
+  struct proc *p;
+
+  rcu_read_lock();
+  p = __atomic_load_n(&pidhash[(uint)pid % NPIDHASH], __ATOMIC_ACQUIRE);
+  for (; p; p = __atomic_load_n(&p->pidnext, __ATOMIC_ACQUIRE))
+    if (p->pid == pid) break;
+  // an UNUSED p is being freed, and only the read side keeps
+  // it from going away; anything else is pinned by p->lock.
+  if (p) {
+    acquire(&p->lock);
+    if (p->state == UNUSED) {
+      release(&p->lock);
+      p = 0;
+    }
+  }
+  rcu_read_unlock();
+  return p;
 }
 
 // Kill the process with the given pid.
@@ -634,20 +1330,122 @@ void wakeup(void *chan) {
 int kkill(int pid) {
   struct proc *p;
 
-  for (p = proc; p < &proc[NPROC]; p++) {
-    acquire(&p->lock);
-    if (p->pid == pid) {
-      p->killed = 1;
-      if (p->state == SLEEPING) {
-        // Wake process from sleep().
-        p->state = RUNNABLE;
-      }
-      release(&p->lock);
-      return 0;
-    }
-    release(&p->lock);
+  if ((p = findproc(pid)) == 0) return -1;
+  killlocked(p);
+  release(&p->lock);
+  return 0;
+}
+
+// Set the base scheduling level of process pid to prio, where 0
+// is the highest. Takes effect right away unless pid is queued,
+// otherwise when it is next queued. Returns the old base level,
+// or -1.
+int ksetpriority(int pid, int prio) {
+  struct proc *p;
+  int old;
+
+  if (prio < 0 || prio >= NPRIO) return -1;
+  if ((p = findproc(pid)) == 0) return -1;
+  old = p->baseprio;
+  p->baseprio = prio;
+  if (p->state != RUNNABLE) {
+    p->prio = prio;
+    p->slice = 0;
+  }
+  release(&p->lock);
+  return old;
+}
+
+// Restrict process pid (the caller if 0) to the harts in mask,
+// of those running. A caller that may no longer run on its hart
+// moves off it now; another process moves when it is next
+// queued. Returns 0, or -1.
+int ksetaffinity(int pid, uint64 mask) {
+  struct proc *p;
+
+  mask &= onlineharts;
+  if (mask == 0) return -1;
+  if (mask == onlineharts) mask = ~0UL;
+  if (pid == 0) pid = myproc()->pid;
+  if ((p = findproc(pid)) == 0) return -1;
+  p->affinity = mask;
+  if (p == myproc() && (mask & (1UL << p->cpu)) == 0) {
+    p->ru.nvcsw++;
+    setrunnable(p);
+    sched();
   }
-  return -1;
+  release(&p->lock);
+  return 0;
+}
+
+// Copy the resource usage of process pid (the caller if 0) to
+// user address addr. Returns 0, or -1.
+int kgetrusage(int pid, uint64 addr) {
+  struct proc *p;
+  struct rusage ru;
+
+  if (pid == 0) pid = myproc()->pid;
+  if ((p = findproc(pid)) == 0) return -1;
+  ru = p->ru;
+  if (p == myproc()) ru.stime += r_time() - p->stamp;
+  release(&p->lock);
+  return copyout(myproc()->pagetable, addr, (char *)&ru, sizeof(ru));
+}
+
+// Copy a struct pinfo for the process with the lowest pid that
+// is at least pid to user address addr. Returns that pid, or -1
+// if there is none.
+int kpinfo(int pid, uint64 addr) {
+  struct proc *p, *best = 0;
+  struct pinfo pi;
+
+  // wait_lock pins p->parent.
+  acquire(&wait_lock);
+  acquire(&pid_lock);
+  for (int i = 0; i < NPIDHASH; i++)
+    for (p = pidhash[i]; p; p = p->pidnext)
+      if (p->pid >= pid && p->state != UNUSED &&
+          (best == 0 || p->pid < best->pid))
+        best = p;
+  if (best == 0) {
+    release(&pid_lock);
+    release(&wait_lock);
+    return -1;
+  }
+  p = best;
+  acquire(&p->lock);
+  release(&pid_lock);
+  memset(&pi, 0, sizeof(pi));
+  pi.pid = p->pid;
+  pi.tgid = p->leader->pid;
+  pi.ppid = p->parent ? p->parent->pid : 0;
+  pi.state = p->state;
+  pi.prio = p->prio;
+  pi.cpu = p->cpu;
+  safestrcpy(pi.name, p->name, sizeof(pi.name));
+  pi.ru = p->ru;
+  // a thread reports its group's address space.
+  pi.sz = p->leader->sz;
+  if (p->leader->pagetable)
+    pi.rss = uvmresident(p->leader->pagetable, &pi.nswap);
+  release(&p->lock);
+  release(&wait_lock);
+  p = myproc();
+  if (copyout(p->pagetable, addr, (char *)&pi, sizeof(pi)) < 0) return -1;
+  return pi.pid;
+}
+
+// Return the harts process pid (the caller if 0) may run on,
+// or 0.
+uint64 kgetaffinity(int pid) {
+  struct proc *p;
+  uint64 mask;
+
+  if (pid == 0) pid = myproc()->pid;
+  if ((p = findproc(pid)) == 0) return 0;
+  mask = p->affinity & onlineharts;
+  release(&p->lock);
+  return mask;
 }
 
 void setkilled(struct proc *p) {
@@ -702,13 +1500,17 @@ void procdump(void) {
   char *state;
 
   printf("\n");
-  for (p = proc; p < &proc[NPROC]; p++) {
-    if (p->state == UNUSED) continue;
-    if (p->state >= 0 && p->state < NELEM(states) && states[p->state])
-      state = states[p->state];
-    else
-      state = "???";
-    printf("%d %s %s", p->pid, state, p->name);
-    printf("\n");
+  acquire(&pid_lock);
+  for (int i = 0; i < NPIDHASH; i++) {
+    for (p = pidhash[i]; p; p = p->pidnext) {
+      if (p->state == UNUSED) continue;
+      if (p->state >= 0 && p->state < NELEM(states) && states[p->state])
+        state = states[p->state];
+      else
+        state = "???";
+      printf("%d %s %s", p->pid, state, p->name);
+      printf("\n");
+    }
   }
+  release(&pid_lock);
 }
@@ -1,12 +1,18 @@
 #pragma once
 
+#include "hpm.h"
 #include "param.h"
+#include "rcu.h"
 #include "riscv.h"
+#include "rusage.h"
+#include "sleeplock.h"
 #include "spinlock.h"
 #include "types.h"
+#include "vma.h"
 
 struct file;
 struct inode;
+struct kring;
 
 // Saved registers for kernel context switches.
 struct context {
@@ -34,6 +40,8 @@ struct cpu {
   struct context context;  // swtch() here to enter scheduler().
   int noff;                // Depth of push_off() nesting.
   int intena;              // Were interrupts enabled before push_off()?
+  uint64 rcuqs;            // Quiescent states passed, for rcu.c
+  int rcuquiet;            // In user mode or wfi, so in no RCU reader
 };
 
 extern struct cpu cpus[NCPU];
@@ -91,18 +99,6 @@ struct trapframe {
 
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
-// Virtual Memory Area - tracks memory-mapped regions
-#define NVMA 16  // Maximum number of VMAs per process
-struct vma {
-  int used;              // Is this VMA slot in use?
-  uint64 addr;           // Starting virtual address
-  uint64 len;            // Length in bytes
-  int prot;              // Protection flags (PROT_READ, PROT_WRITE, etc.)
-  int flags;             // MAP_SHARED or MAP_PRIVATE
-  struct file *file;     // Mapped file
-  uint64 offset;         // Offset in file
-};
-
 // Per-process state
 struct proc {
   struct spinlock lock;
@@ -113,30 +109,88 @@ struct proc {
   int killed;            // If non-zero, have been killed
   int xstate;            // Exit status to be returned to parent's wait
   int pid;               // Process ID
+  int cpu;               // Hart whose run queue p goes on
+  int baseprio;          // Scheduling level boosts return p to
+  int prio;              // Current level, 0 highest; see proc.c
+  uint64 affinity;       // Harts p may run on, ~0 for any
+  int slice;             // Timer ticks used at prio
+  uint boostgen;         // Last boost p has caught up with
+  uint64 readyat;        // r_time() when p last became RUNNABLE
+
+  // the run queue's lock must be held when using this:
+  struct proc *rqnext;  // Next RUNNABLE process on the queue
+  int rqany;            // Counted in the queue's nany
 
-  // wait_lock must be held when using this:
-  struct proc *parent;  // Parent process
+  // chan's wait queue lock must be held when using these:
+  struct proc *wqnext;    // Next process on the wait queue
+  struct proc **wqpprev;  // Link that points to p
 
-  // these are private to the process, so p->lock need not be held.
+  // wait_lock must be held when using these:
+  struct proc *parent;    // Parent process
+  struct proc *children;  // Most recent child
+  struct proc *sibling;   // Next child of parent
+  struct proc *threads;   // Leader: the group's other threads
+  struct proc *tnext;     // Next thread of the leader's group
+
+  // pid_lock must be held when changing these; findproc()
+  // reads pidnext under rcu_read_lock().
+  struct proc *pidnext;  // Next process in pid's hash chain
+  struct rcuhead rcu;    // freeproc() frees p after a grace period
+
+  // these are private to the thread, so p->lock need not be held.
+  struct proc *leader;          // Thread group leader; p for a process
   uint64 kstack;                // Virtual address of kernel stack
-  uint64 sz;                    // Size of process memory (bytes)
-  pagetable_t pagetable;        // User page table
+  pagetable_t pagetable;        // User page table, the leader's
   struct trapframe *trapframe;  // data page for trampoline.S
-  struct usyscall *usyscall;    // shared read-only page for fast syscalls
+  uint64 trapframeva;           // User address of trapframe
+  int tslot;                    // THREADFRAME() slot, 0 for the leader
   struct context context;       // swtch() here to run process
-  struct file *ofile[NOFILE];   // Open files
-  struct inode *cwd;            // Current directory
   char name[16];                // Process name (debugging)
-  struct vma vmas[NVMA];        // Memory-mapped regions
+  void (*kfn)(void);            // What a kernel thread runs
+  uint64 kstackstale;           // Harts that must flush kstack before running
+  struct rusage ru;             // Read by others under p->lock, racily
+  uint64 stamp;                 // r_time() up to which ru is charged
+  struct rusage rupub;          // ru as last added to the usyscall page
+  uint64 tracemask;             // System calls to log to the trace ring
+  uint64 hpm[NHPMCOUNT];        // Hardware counts while it ran (hpm.c)
+  uint64 hpmchild[NHPMCOUNT];   // Those of its reaped children
+  uint hpmgen;                  // The HPM_SELECT hpm[] counts for
+
+  // the rest is shared by a thread group and used only in the
+  // leader. vmlock serializes the threads' address space
+  // changes (see lockvm()); fdlock guards the fd table and cwd.
+  struct sleeplock vmlock;
+  uint64 sz;                  // Size of process memory (bytes)
+  struct vmatree vmas;        // Memory-mapped regions
+  uint64 swaphand;            // Where uvmreclaim() resumes its sweep
+  uint tslots;                // THREADFRAME() slots in use
+  struct usyscall *usyscall;  // shared read-only page for fast syscalls
+  struct kring *ring;         // io ring at URING, or 0
+  int asid;                   // Tags this process's TLB entries
+  uint64 tlbstale;            // Harts that must flush asid before running
+  uint64 runharts;            // Harts running one of the threads
+  struct spinlock fdlock;
+  struct file **ofile;            // Open files: ofile0, or a grown table
+  int nofile;                     // Descriptors ofile has room for
+  uint64 fdused[NOFILEMAX / 64];  // Bitmap of descriptors in use
+  struct file *ofile0[NOFILE];    // The table a process starts with
+  struct inode *cwd;              // Current directory
 };
 
 int cpuid(void);
 void kexit(int);
 int kfork(void);
+int kspawn(char *, char **, int *, int);
+int kclone(uint64, uint64, uint64);
+int kjoin(int, uint64);
+int kthread(char *, void (*)(void));
+int kthreadclone(void (*)(void));
+int lockvm(void);
+void unlockvm(int);
 int growproc(int);
-void proc_mapstacks(pagetable_t);
 pagetable_t proc_pagetable(struct proc *);
 void proc_freepagetable(pagetable_t, uint64);
+void proc_freevmas(struct proc *);
 int kkill(int);
 int killed(struct proc *);
 void setkilled(struct proc *);
@@ -149,7 +203,18 @@ void sleep(void *, struct spinlock *);
 void userinit(void);
 int kwait(uint64);
 void wakeup(void *);
+int wakeupn(void *, uint);
 void yield(void);
+void clockyield(void);
+void cond_resched(void);
+void mlfqboost(void);
+int runq_needtick(void);
+int ksetpriority(int, int);
+int ksetaffinity(int, uint64);
+uint64 kgetaffinity(int);
+int kgetrusage(int, uint64);
+struct proc *findproc(int);
+int kpinfo(int, uint64);
 int either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int either_copyin(void *dst, int user_src, uint64 src, uint64 len);
 void procdump(void);
@@ -0,0 +1,160 @@
+//
+// sampling profiler: while it is on, each hart takes a timer
+// interrupt every period and records where it was, with a short
+// frame-pointer backtrace, in a sample ring of its own.
+//
+
+#include "prof.h"
+
+#include "param.h"
+#include "proc.h"
+#include "riscv.h"
+#include "rusage.h"
+#include "sleeplock.h"
+#include "string.h"
+#include "trap.h"
+#include "types.h"
+#include "vm.h"
+
+// One hart's samples. Only that hart adds them, from its timer
+// interrupt; prof() takes them under prof.lock.
+struct profring {
+  struct profsample s[NPROF];
+  uint head;    // samples added
+  uint tail;    // samples taken
+  uint64 lost;  // samples dropped because the ring was full
+} __attribute__((aligned(64)));
+
+static struct {
+  struct sleeplock lock;  // serializes prof() calls
+  volatile int on;
+  uint64 period;  // cycles between samples
+  struct profring ring[NCPU];
+} prof;
+
+void profinit(void) { initsleeplock(&prof.lock, "prof"); }
+
+// Cycles until this hart should next take a sample, or 0 if the
+// profiler is off; settimer() keeps the timer that close.
+uint64 profperiod(void) { return prof.on ? prof.period : 0; }
+
+// Read the user word at va in pagetable to *v, without faulting
+// it in. Returns -1 if it is not there.
+static int peek(pagetable_t pagetable, uint64 va, uint64 *v) {
+  uint64 pa;
+
+  if (va % sizeof(uint64) || (pa = walkaddr(pagetable, va)) == 0) return -1;
+  *v = *(uint64 *)(pa + va % PGSIZE);
+  return 0;
+}
+
+// Follow the frame pointer chain from fp, the interrupted code's
+// s0, for the return addresses of its callers. A kernel chain
+// stays on one stack page.
+static int backtrace(struct profsample *s, int user, uint64 fp) {
+  struct proc *p = myproc();
+  uint64 lo = PGROUNDDOWN(fp), ra, next;
+  int d = 1;
+
+  for (; d < NPROFPC && fp > lo + 16 && fp % sizeof(uint64) == 0; d++) {
+    if (user) {
+      if (peek(p->pagetable, fp - 8, &ra) < 0 ||
+          peek(p->pagetable, fp - 16, &next) < 0)
+        break;
+    } else {
+      if (fp > lo + PGSIZE) break;
+      ra = ((uint64 *)fp)[-1];
+      next = ((uint64 *)fp)[-2];
+    }
+    if (ra == 0) break;
+    s->pc[d] = ra;
+    if (next <= fp) {
+      d++;
+      break;
+    }
+    fp = next;
+  }
+  return d;
+}
+
+// Take a sample of code interrupted at pc with frame pointer fp,
+// from a timer interrupt; user says it was in user space.
+void profsample(int user, uint64 pc, uint64 fp) {
+  struct profring *r = &prof.ring[cpuid()];
+  struct proc *p = myproc();
+  struct profsample *s;
+
+  if (r->head - r->tail >= NPROF) {
+    r->lost++;
+    return;
+  }
+  s = &r->s[r->head % NPROF];
+  memset(s, 0, sizeof(*s));
+  s->pc[0] = pc;
+  s->pid = p ? p->pid : 0;
+  s->cpu = cpuid();
+  s->user = user;
+  s->depth = backtrace(s, user, fp);
+  __sync_synchronize();
+  r->head++;
+}
+
+// prof(): PROF_START takes a sample every n us (1000 if n is 0),
+// PROF_STOP stops, PROF_GET copies out up to n struct
+// profsamples and returns how many, and PROF_LOST returns how
+// many samples were dropped.
+int kprof(int op, uint64 addr, int n) {
+  struct profring *r;
+  struct profsample s;
+  uint64 lost = 0;
+  int k = 0;
+
+  acquiresleep(&prof.lock);
+  switch (op) {
+    case PROF_START:
+      if (n < 0) {
+        k = -1;
+        break;
+      }
+      prof.on = 0;
+      __sync_synchronize();
+      for (r = prof.ring; r < prof.ring + NCPU; r++) {
+        r->tail = r->head;
+        r->lost = 0;
+      }
+      prof.period = (n ? n : 1000) * (TIMEBASE / 1000000);
+      __sync_synchronize();
+      prof.on = 1;
+      // make the harts reprogram their timers.
+      for (int i = 0; i < NCPU; i++) ipi(i);
+      break;
+    case PROF_STOP:
+      prof.on = 0;
+      break;
+    case PROF_GET:
+      for (r = prof.ring; r < prof.ring + NCPU && k < n; r++) {
+        while (k < n) {
+          __sync_synchronize();
+          if (r->tail == r->head) break;
+          s = r->s[r->tail % NPROF];
+          __sync_synchronize();
+          r->tail++;
+          if (copyout(myproc()->pagetable, addr + k * sizeof(s), (char *)&s,
+                      sizeof(s)) < 0) {
+            releasesleep(&prof.lock);
+            return -1;
+          }
+          k++;
+        }
+      }
+      break;
+    case PROF_LOST:
+      for (r = prof.ring; r < prof.ring + NCPU; r++) lost += r->lost;
+      k = lost;
+      break;
+    default:
+      k = -1;
+  }
+  releasesleep(&prof.lock);
+  return k;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "types.h"
+
+// prof() operations
+#define PROF_START 0  // drop old samples and take one every n us
+#define PROF_STOP 1   // stop sampling
+#define PROF_GET 2    // take up to n samples, oldest first per hart
+#define PROF_LOST 3   // how many samples full rings dropped since start
+
+#define NPROFPC 6  // most pcs in a sample's backtrace
+
+// One sample, from prof(PROF_GET).
+struct profsample {
+  uint64 pc[NPROFPC];  // where the hart was, then return addresses
+  int pid;             // 0 if the hart was idle in the scheduler
+  uchar cpu;
+  uchar user;          // the pcs are user addresses of pid
+  uchar depth;         // pcs in pc[]
+  uchar pad;
+};
+
+void profinit(void);
+uint64 profperiod(void);
+void profsample(int, uint64, uint64);
+int kprof(int, uint64, int);
@@ -0,0 +1,139 @@
+// Read-copy-update, for read-mostly structures whose readers
+// should take no lock at all.
+//
+// A reader runs between rcu_read_lock() and rcu_read_unlock()
+// with interrupts off, and must not sleep. A writer, holding
+// whatever lock orders it against other writers, unlinks an
+// object so that no new reader can find it, then frees it with
+// call_rcu() once a grace period has passed: a time in which
+// every hart has been seen in a quiescent state, where it cannot
+// be inside a reader. The quiescent states are a pass through
+// the scheduler loop, a return to user space, and user mode or
+// wfi themselves.
+//
+// Each hart counts its quiescent states in c->rcuqs. A grace
+// period starts by noting all the counts, and ends once each
+// hart has counted another or is quiet (c->rcuquiet). Harts
+// check for the end at their quiescent states, so callbacks run
+// there, with interrupts off and no locks held.
+
+#include "rcu.h"
+
+#include "param.h"
+#include "proc.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "types.h"
+
+static struct {
+  struct spinlock lock;
+  int busy;              // Is a grace period running?
+  uint64 snap[NCPU];     // The harts' rcuqs when it began
+  struct rcuhead *cur;   // Callbacks waiting for it to end
+  struct rcuhead *next;  // Callbacks queued since it began
+} rcu;
+
+void rcuinit(void) { initlock(&rcu.lock, "rcu"); }
+
+// A reader may not sleep or be preempted, so a hart in one
+// reaches no quiescent state.
+void rcu_read_lock(void) { push_off(); }
+
+void rcu_read_unlock(void) { pop_off(); }
+
+// Start a grace period for the queued callbacks.
+// Caller must hold rcu.lock.
+static void gpstart(void) {
+  rcu.cur = rcu.next;
+  rcu.next = 0;
+  rcu.busy = 1;
+  for (int i = 0; i < NCPU; i++) rcu.snap[i] = cpus[i].rcuqs;
+}
+
+// Has every hart been quiescent since gpstart()? A hart that
+// has not reached the scheduler yet (rcuqs 0) runs no reader.
+// Caller must hold rcu.lock.
+static int gpdone(void) {
+  for (int i = 0; i < NCPU; i++) {
+    struct cpu *c = &cpus[i];
+    if (c->rcuqs != 0 && !c->rcuquiet && c->rcuqs == rcu.snap[i]) return 0;
+  }
+  return 1;
+}
+
+// Run func(h) after a grace period. Caller must not be
+// inside a reader.
+void call_rcu(struct rcuhead *h, void (*func)(struct rcuhead *)) {
+  h->func = func;
+  acquire(&rcu.lock);
+  h->next = rcu.next;
+  rcu.next = h;
+  if (!rcu.busy) gpstart();
+  release(&rcu.lock);
+}
+
+// End the grace period if it is over, and run its callbacks.
+static void gpadvance(void) {
+  struct rcuhead *done = 0, *h;
+
+  acquire(&rcu.lock);
+  if (rcu.busy && gpdone()) {
+    done = rcu.cur;
+    rcu.cur = 0;
+    rcu.busy = 0;
+    if (rcu.next) gpstart();
+  }
+  release(&rcu.lock);
+
+  while ((h = done) != 0) {
+    done = h->next;
+    h->func(h);
+  }
+}
+
+// Called by a hart outside any reader, with interrupts off:
+// from the scheduler loop, and on the way back to user space.
+void rcu_quiescent(void) {
+  struct cpu *c = mycpu();
+
+  // order this hart's reads before the count, and its
+  // next reads after it.
+  __sync_synchronize();
+  c->rcuqs++;
+  __sync_synchronize();
+  if (rcu.busy) gpadvance();
+}
+
+// Mark this hart as in user mode or wfi, or back in the kernel.
+// Interrupts must be off.
+void rcu_setquiet(int quiet) {
+  __sync_synchronize();
+  mycpu()->rcuquiet = quiet;
+  __sync_synchronize();
+}
+
+struct rcuwait {
+  struct rcuhead h;
+  int done;
+};
+
+static void rcuwake(struct rcuhead *h) {
+  struct rcuwait *w = (struct rcuwait *)h;
+
+  acquire(&rcu.lock);
+  w->done = 1;
+  wakeup(w);
+  release(&rcu.lock);
+}
+
+// Wait for a grace period, for a writer that must know no
+// reader still sees what it unlinked. May sleep.
+void synchronize_rcu(void) {
+  struct rcuwait w;
+
+  w.done = 0;
+  call_rcu(&w.h, rcuwake);
+  acquire(&rcu.lock);
+  while (!w.done) sleep(&w, &rcu.lock);
+  release(&rcu.lock);
+}
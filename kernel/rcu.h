@@ -0,0 +1,19 @@
+#pragma once
+
+#include "types.h"
+
+// A callback that call_rcu() runs after a grace period,
+// embedded in the object it frees.
+struct rcuhead {
+  struct rcuhead *next;
+  void (*func)(struct rcuhead *);
+};
+
+// rcu.c APIs
+void rcuinit(void);
+void rcu_read_lock(void);
+void rcu_read_unlock(void);
+void call_rcu(struct rcuhead *, void (*)(struct rcuhead *));
+void synchronize_rcu(void);
+void rcu_quiescent(void);
+void rcu_setquiet(int);
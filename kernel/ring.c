@@ -0,0 +1,157 @@
+//
+// io rings: a page shared with user space that holds a ring of
+// submissions and a ring of completions (see ring.h), so that a
+// process can make a batch of read, write, open and close calls
+// in one trap, or in none with a polling thread.
+//
+
+#include "file.h"
+#include "kalloc.h"
+#include "memlayout.h"
+#include "param.h"
+#include "printf.h"
+#include "proc.h"
+#include "riscv.h"
+#include "ring.h"
+#include "sleeplock.h"
+#include "slab.h"
+#include "spinlock.h"
+#include "string.h"
+#include "types.h"
+#include "vm.h"
+
+// The kernel's side of a process's ring.
+struct kring {
+  struct ring *r;          // the shared page
+  struct sleeplock lock;   // serializes ringenter()'s takers
+  struct spinlock wait;    // for the polling thread's sleep
+  int poll;                // a polling thread takes submissions
+};
+
+static void ringpoller(void);
+
+// Take up to n submissions from g's ring and complete them.
+// Returns how many.
+static int ringrun(struct proc *g, int n) {
+  struct ring *r = g->ring->r;
+  struct sqe e;
+  struct cqe *c;
+  int k;
+
+  for (k = 0; k < n; k++) {
+    __sync_synchronize();
+    if (r->sqhead == r->sqtail || r->cqtail - r->cqhead >= NCQE) break;
+    e = r->sq[r->sqhead % NSQE];
+    __sync_synchronize();
+    r->sqhead++;  // user space may reuse the entry now
+    int res = ringop(&e);
+    c = &r->cq[r->cqtail % NCQE];
+    c->data = e.data;
+    c->res = res;
+    __sync_synchronize();
+    r->cqtail++;
+  }
+  return k;
+}
+
+// Map a ring page at URING for the caller's process. With
+// RING_SQPOLL a kernel thread of the process takes submissions
+// as they appear, so none needs a trap; the process cannot exec()
+// while it has the thread. Returns URING, or -1.
+uint64 kringsetup(int flags) {
+  struct proc *g = myproc()->leader;
+  struct kring *kr;
+  struct ring *r = 0;
+
+  if ((kr = kmalloc(sizeof(*kr))) == 0) return -1;
+  acquiresleep(&g->vmlock);
+  if (g->ring != 0 || (r = kalloc()) == 0) goto bad;
+  memset(r, 0, PGSIZE);
+  if (mappages(g->pagetable, URING, PGSIZE, (uint64)r,
+               PTE_R | PTE_W | PTE_U) < 0)
+    goto bad;
+  kr->r = r;
+  initsleeplock(&kr->lock, "ring");
+  initlock(&kr->wait, "ringwait");
+  kr->poll = (flags & RING_SQPOLL) != 0;
+  g->ring = kr;
+  releasesleep(&g->vmlock);
+
+  if (kr->poll && kthreadclone(ringpoller) < 0) {
+    acquiresleep(&g->vmlock);
+    uvmunmap(g->pagetable, URING, 1, 0);
+    uvmflush(g->pagetable);
+    ringfree(g);
+    releasesleep(&g->vmlock);
+    return -1;
+  }
+  return URING;
+
+bad:
+  releasesleep(&g->vmlock);
+  if (r) kfree(r);
+  kfree_sized(kr, sizeof(*kr));
+  return -1;
+}
+
+// Take up to n submissions from the caller's ring and complete
+// them. If a polling thread takes them instead, only wake it, as
+// flags may ask. Returns how many were taken, or -1.
+int kringenter(int n, int flags) {
+  struct proc *g = myproc()->leader;
+  struct kring *kr = g->ring;
+  int k;
+
+  if (kr == 0) return -1;
+  if (kr->poll) {
+    if (flags & RING_ENTER_WAKEUP) {
+      acquire(&kr->wait);
+      wakeup(kr);
+      release(&kr->wait);
+    }
+    return 0;
+  }
+  acquiresleep(&kr->lock);
+  k = ringrun(g, n);
+  releasesleep(&kr->lock);
+  return k;
+}
+
+// A RING_SQPOLL process's polling thread. While submissions keep
+// coming it spins, yielding to anything else runnable, so an
+// otherwise idle hart serves the ring; after RINGIDLE cycles with
+// none it sets RING_NEED_WAKEUP and sleeps until ringenter().
+static void ringpoller(void) {
+  struct proc *p = myproc();
+  struct kring *kr = p->leader->ring;
+  struct ring *r = kr->r;
+  uint64 last = r_time();
+
+  while (!killed(p)) {
+    if (ringrun(p->leader, NSQE) > 0) {
+      last = r_time();
+      continue;
+    }
+    if (r_time() - last < RINGIDLE) {
+      yield();
+      continue;
+    }
+    acquire(&kr->wait);
+    r->flags |= RING_NEED_WAKEUP;
+    __sync_synchronize();
+    if (r->sqhead == r->sqtail && !killed(p)) sleep(kr, &kr->wait);
+    r->flags &= ~RING_NEED_WAKEUP;
+    release(&kr->wait);
+    last = r_time();
+  }
+  kexit(0);
+}
+
+// Free g's ring, whose page its page table no longer maps,
+// when the process exits or execs.
+void ringfree(struct proc *g) {
+  if (g->ring == 0) return;
+  kfree(g->ring->r);
+  kfree_sized(g->ring, sizeof(*g->ring));
+  g->ring = 0;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "types.h"
+
+// ringsetup() flags
+#define RING_SQPOLL 1  // a kernel thread takes submissions as they come
+
+// ringenter() flags
+#define RING_ENTER_WAKEUP 1  // wake the polling thread
+
+// struct ring flags, set by the kernel
+#define RING_NEED_WAKEUP 1  // the polling thread sleeps; ringenter() it
+
+// submission opcodes; each does what the system call would,
+// and its return value is the completion's res.
+#define RING_NOP 0
+#define RING_READ 1    // read(fd, addr, len)
+#define RING_WRITE 2   // write(fd, addr, len)
+#define RING_PREAD 3   // pread(fd, addr, len, off)
+#define RING_PWRITE 4  // pwrite(fd, addr, len, off)
+#define RING_OPEN 5    // open(addr, len), len being the mode
+#define RING_CLOSE 6   // close(fd)
+
+#define NSQE 64  // submission ring entries
+#define NCQE 64  // completion ring entries
+
+struct sqe {
+  uchar op;  // RING_*
+  uchar pad[3];
+  int fd;
+  uint64 addr;
+  uint len;
+  uint off;
+  uint64 data;  // passed through to the completion
+};
+
+struct cqe {
+  uint64 data;  // the submission's
+  int res;
+  uint pad;
+};
+
+// The page ringsetup() maps at URING. User space fills in
+// sq[sqtail % NSQE] and then advances sqtail; the kernel takes
+// submissions from sqhead in order and, for each, appends a
+// completion at cq[cqtail % NCQE]. User space takes completions
+// from cqhead; the kernel stops taking submissions while the
+// completion ring is full. Each side writes only its own
+// indexes, and should fence between an entry and its index.
+struct ring {
+  uint sqhead;  // kernel
+  uint sqtail;  // user
+  uint cqhead;  // user
+  uint cqtail;  // kernel
+  uint flags;   // kernel
+  uint pad[11];
+  struct sqe sq[NSQE];
+  struct cqe cq[NCQE];
+};
@@ -53,6 +53,12 @@ static inline void w_sstatus(uint64 x) {
   asm volatile("csrw sstatus, %0" : : "r"(x));
 }
 
+// Supervisor Scratch register, holds the user address of the
+// current thread's trapframe for trampoline.S.
+static inline void w_sscratch(uint64 x) {
+  asm volatile("csrw sscratch, %0" : : "r"(x));
+}
+
 // Supervisor Interrupt Pending
 static inline uint64 r_sip() {
   uint64 x;
@@ -65,6 +71,7 @@ static inline void w_sip(uint64 x) { asm volatile("csrw sip, %0" : : "r"(x)); }
 // Supervisor Interrupt Enable
 #define SIE_SEIE (1L << 9)  // external
 #define SIE_STIE (1L << 5)  // timer
+#define SIE_SSIE (1L << 1)  // software
 static inline uint64 r_sie() {
   uint64 x;
   asm volatile("csrr %0, sie" : "=r"(x));
@@ -75,6 +82,7 @@ static inline void w_sie(uint64 x) { asm volatile("csrw sie, %0" : : "r"(x)); }
 
 // Machine-mode Interrupt Enable
 #define MIE_STIE (1L << 5)  // supervisor timer
+#define MIE_MSIE (1L << 3)  // machine software
 static inline uint64 r_mie() {
   uint64 x;
   asm volatile("csrr %0, mie" : "=r"(x));
@@ -83,6 +91,15 @@ static inline uint64 r_mie() {
 
 static inline void w_mie(uint64 x) { asm volatile("csrw mie, %0" : : "r"(x)); }
 
+// Machine-mode interrupt vector
+static inline void w_mtvec(uint64 x) {
+  asm volatile("csrw mtvec, %0" : : "r"(x));
+}
+
+static inline void w_mscratch(uint64 x) {
+  asm volatile("csrw mscratch, %0" : : "r"(x));
+}
+
 // supervisor exception program counter, holds the
 // instruction address to which a return from
 // exception will go.
@@ -170,6 +187,10 @@ static inline void w_pmpaddr0(uint64 x) {
 
 #define MAKE_SATP(pagetable) (SATP_SV39 | (((uint64)pagetable) >> 12))
 
+// the address-space ID field, which tags TLB entries.
+#define SATP_ASID(asid) ((uint64)(asid) << 44)
+#define SATP2ASID(satp) (((satp) >> 44) & 0xFFFF)
+
 // supervisor address translation and protection;
 // holds the address of the page table.
 static inline void w_satp(uint64 x) {
@@ -207,6 +228,18 @@ static inline uint64 r_mcounteren() {
   return x;
 }
 
+// Supervisor-mode Counter-Enable
+#define SCOUNTEREN_TM (1L << 1)  // user mode may read time
+static inline void w_scounteren(uint64 x) {
+  asm volatile("csrw scounteren, %0" : : "r"(x));
+}
+
+static inline uint64 r_scounteren() {
+  uint64 x;
+  asm volatile("csrr %0, scounteren" : "=r"(x));
+  return x;
+}
+
 // machine-mode cycle counter
 static inline uint64 r_time() {
   uint64 x;
@@ -214,6 +247,13 @@ static inline uint64 r_time() {
   return x;
 }
 
+// this hart's clock cycles
+static inline uint64 r_cycle() {
+  uint64 x;
+  asm volatile("csrr %0, cycle" : "=r"(x));
+  return x;
+}
+
 // enable device interrupts
 static inline void intr_on() { w_sstatus(r_sstatus() | SSTATUS_SIE); }
 
@@ -248,12 +288,30 @@ static inline uint64 r_ra() {
   return x;
 }
 
+// read s0, the frame pointer: the caller's fp is saved at
+// fp-16 and the return address at fp-8.
+static inline uint64 r_fp() {
+  uint64 x;
+  asm volatile("mv %0, s0" : "=r"(x));
+  return x;
+}
+
 // flush the TLB.
 static inline void sfence_vma() {
   // the zero, zero means flush all TLB entries.
   asm volatile("sfence.vma zero, zero");
 }
 
+// flush the TLB entries tagged with asid.
+static inline void sfence_vma_asid(uint64 asid) {
+  asm volatile("sfence.vma zero, %0" : : "r"(asid));
+}
+
+// flush the TLB entries for virtual address va.
+static inline void sfence_vma_va(uint64 va) {
+  asm volatile("sfence.vma %0, zero" : : "r"(va));
+}
+
 typedef uint64 pte_t;
 typedef uint64 *pagetable_t;  // 512 PTEs
 
@@ -270,12 +328,17 @@ typedef uint64 *pagetable_t;  // 512 PTEs
 #define SUPERPGSHIFT 21                // bits of offset within a superpage
 #define SUPERPGROUNDUP(sz) (((sz) + SUPERPGSIZE - 1) & ~(SUPERPGSIZE - 1))
 #define SUPERPGROUNDDOWN(a) (((a)) & ~(SUPERPGSIZE - 1))
+#define GIGAPGSIZE (1L << 30)          // 1GB level-2 leaf
 
 #define PTE_V (1L << 0)  // valid
 #define PTE_R (1L << 1)
 #define PTE_W (1L << 2)
 #define PTE_X (1L << 3)
-#define PTE_U (1L << 4)  // user can access
+#define PTE_U (1L << 4)     // user can access
+#define PTE_A (1L << 6)     // accessed
+#define PTE_D (1L << 7)     // dirty
+#define PTE_COW (1L << 8)   // copy-on-write (RSW bit)
+#define PTE_SWAP (1L << 9)  // swapped out; PPN is the slot (RSW bit)
 
 // shift a physical address to the right place for a PTE.
 #define PA2PTE(pa) ((((uint64)pa) >> 12) << 10)
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "types.h"
+
+#define TIMEBASE 10000000  // time CSR cycles per second (qemu virt)
+
+// Resource usage of one thread, from getrusage().
+// Times are in cycles of the time CSR.
+struct rusage {
+  uint64 utime;     // running in user mode
+  uint64 stime;     // running in the kernel
+  uint64 wtime;     // waiting RUNNABLE on a run queue
+  uint64 nvcsw;     // switches away to sleep
+  uint64 nivcsw;    // preemptions
+  uint64 nfault;    // page faults taken or resolved for it
+  uint64 nsyscall;  // system calls made
+};
+
+// clock_gettime() clocks
+#define CLOCK_MONOTONIC 1           // time since boot
+#define CLOCK_PROCESS_CPUTIME_ID 2  // CPU time of the process's threads
+
+struct timespec {
+  uint64 tv_sec;
+  uint64 tv_nsec;
+};
+
+// One process or thread, from pinfo().
+struct pinfo {
+  int pid;
+  int tgid;   // pid of its thread group's leader
+  int ppid;   // 0 for a thread or init
+  int state;  // UNUSED .. ZOMBIE, in enum procstate order
+  int prio;
+  int cpu;  // hart it last ran on
+  char name[16];
+  uint64 sz;     // bytes below the break, faulted in or not
+  uint64 rss;    // 4K pages resident, shared ones included
+  uint64 nswap;  // pages out in the swap area
+  struct rusage ru;
+};
@@ -1,7 +1,9 @@
 #include "slab.h"
 
 #include "kalloc.h"
+#include "meminfo.h"
 #include "printf.h"
+#include "proc.h"
 #include "riscv.h"
 #include "string.h"
 
@@ -11,47 +13,69 @@ static uint align_size(uint size, uint align) {
   return (size + align - 1) & ~(align - 1);
 }
 
+// Bytes in one slab of the cache.
+static uint64 slab_bytes(struct kmem_cache *cache) {
+  return (uint64)PGSIZE << cache->order;
+}
+
 // Helper function to remove slab from list
 static void slab_remove(struct slab **list, struct slab *slab) {
-  if (*list == slab) {
+  if (slab->prev)
+    slab->prev->next = slab->next;
+  else
     *list = slab->next;
-    return;
-  }
-
-  struct slab *prev = *list;
-  while (prev && prev->next != slab) {
-    prev = prev->next;
-  }
-  if (prev) {
-    prev->next = slab->next;
-  }
+  if (slab->next) slab->next->prev = slab->prev;
+  slab->next = slab->prev = 0;
 }
 
 // Helper function to add slab to list head
 static void slab_add_head(struct slab **list, struct slab *slab) {
+  slab->prev = 0;
   slab->next = *list;
+  if (*list) (*list)->prev = slab;
   *list = slab;
 }
 
+// The list a slab belongs on, given its free count.
+static struct slab **slab_list(struct kmem_cache *cache, struct slab *slab) {
+  if (slab->nr_free == 0) return &cache->full;
+  if (slab->nr_free == slab->nr_objs) return &cache->empty;
+  return &cache->partial;
+}
+
+// Headers of slabs in offslab caches.
+static struct kmem_cache *slab_desc;
+
 // Create a new slab for the given cache
 static struct slab *slab_create(struct kmem_cache *cache) {
-  // Allocate a page from kalloc
-  char *page = (char *)kalloc();
+  // Allocate the slab's pages from kalloc
+  char *page = (char *)kalloc_order(cache->order);
   if (!page) {
     return 0;
   }
 
-  uint slab_offset = align_size(sizeof(struct slab), cache->align);
-
   // Allocate slab structure
   struct slab *slab = (struct slab *)page;
+  if (cache->offslab) {
+    if ((slab = kmem_cache_alloc(slab_desc)) == 0) {
+      kfree_order(page, cache->order);
+      return 0;
+    }
+    pa2page(page)->slab = slab;
+  }
+
+  // Successive slabs start their objects at different offsets in
+  // the space left over, so that objects with the same index do
+  // not all fall in the same cache sets.
+  uint unit = cache->align > SLAB_CACHELINE ? cache->align : SLAB_CACHELINE;
+  uint color = __sync_fetch_and_add(&cache->color, 1) % cache->ncolor;
 
   // Initialize slab
   slab->cache = cache;
-  slab->mem = page + slab_offset;
-  slab->nr_objs = (PGSIZE - slab_offset) / cache->objsize;
+  slab->mem = page + cache->offset + color * unit;
+  slab->nr_objs = cache->nr_objs;
   slab->nr_free = slab->nr_objs;
-  slab->next = 0;
+  slab->next = slab->prev = 0;
 
   // Build freelist as a single linked list
   // Each object's first 8 bytes store pointer to next free object
@@ -76,13 +100,31 @@ static struct slab *slab_create(struct kmem_cache *cache) {
 static void slab_destroy(struct slab *slab) {
   if (!slab) return;
 
+  struct kmem_cache *cache = slab->cache;
+  void *page = (void *)((uint64)slab->mem & ~(slab_bytes(cache) - 1));
+
   // Free the slab structure
-  kfree(slab);
+  if (cache->offslab) {
+    pa2page(page)->slab = 0;
+    kmem_cache_free(slab_desc, slab);
+  }
+  kfree_order(page, cache->order);
+}
+
+// The slab holding obj. Slabs are aligned to their size, so the
+// header, or the page that points to it, is at the start of the
+// block containing obj.
+static struct slab *slab_of(struct kmem_cache *cache, void *obj) {
+  void *page = (void *)((uint64)obj & ~(slab_bytes(cache) - 1));
+
+  if (cache->offslab) return pa2page(page)->slab;
+  return (struct slab *)page;
 }
 
 static inline void free_push(struct slab *s, void *obj) {
   // Validate that obj is within slab bounds
-  if (!obj || (char *)obj < s->mem || (char *)obj >= s->mem + PGSIZE) {
+  if (!obj || (char *)obj < s->mem ||
+      (char *)obj >= s->mem + s->nr_objs * s->cache->objsize) {
     panic("free_push: object out of bounds");
   }
 
@@ -104,6 +146,20 @@ static inline void *free_pop(struct slab *s) {
   return obj;
 }
 
+// All live caches, for the shrinker.
+// Lock order: slab_caches.lock, then cache->lock, then kmem locks.
+static struct {
+  struct spinlock lock;
+  struct kmem_cache *head;
+} slab_caches;
+
+void slabinit(void) {
+  initlock(&slab_caches.lock, "slab_caches");
+  slab_desc = kmem_cache_create("slab", sizeof(struct slab), 0, 0,
+                                sizeof(void *));
+  if (!slab_desc) panic("slabinit");
+}
+
 // Create a cache for objects of given size
 struct kmem_cache *kmem_cache_create(const char *name, uint objsize,
                                      void (*ctor)(void *), void (*dtor)(void *),
@@ -112,18 +168,50 @@ struct kmem_cache *kmem_cache_create(const char *name, uint objsize,
     return 0;
   }
 
+  if (align == SLAB_HWCACHE_ALIGN) {
+    align = SLAB_CACHELINE;
+    while (align > sizeof(void *) && objsize <= align / 2) align /= 2;
+  }
+
   // Align the object size first
   uint aligned_size = align_size(objsize, align);
+  uint slab_offset = align_size(sizeof(struct slab), align);
+
+  // Ensure object is large enough to hold a freelist pointer
+  if (aligned_size < sizeof(void *)) {
+    aligned_size = sizeof(void *);
+  }
+
+  // Use the smallest slab that wastes at most 1/8 of its space,
+  // or the largest slab if none does.
+  uint order = 0;
+  for (; order < SLAB_MAXORDER; order++) {
+    uint64 bytes = (uint64)PGSIZE << order;
+    if (aligned_size > bytes - slab_offset) continue;
+    if ((bytes - slab_offset) % aligned_size <= bytes / 8) break;
+  }
 
   // Ensure the aligned size is valid
-  if (aligned_size > PGSIZE - align_size(sizeof(struct slab), align)) {
+  uint64 bytes = (uint64)PGSIZE << order;
+  if (aligned_size > bytes - slab_offset) {
     return 0;
   }
 
-  // Ensure object is large enough to hold a freelist pointer
-  if (aligned_size < sizeof(void *)) {
-    aligned_size = sizeof(void *);
+  // Big objects get the whole slab, their headers coming from
+  // slab_desc. Otherwise the header gets a cache line of its own
+  // if that costs no object, so that object 0 does not share it.
+  uint nr_objs = (bytes - slab_offset) / aligned_size;
+  int offslab = 0;
+  if (aligned_size >= SLAB_OFFSLAB_MIN && slab_desc) {
+    offslab = 1;
+    slab_offset = 0;
+    nr_objs = bytes / aligned_size;
+  } else {
+    uint lined = align_size(slab_offset, SLAB_CACHELINE);
+    if ((bytes - lined) / aligned_size == nr_objs) slab_offset = lined;
   }
+  uint unit = align > SLAB_CACHELINE ? align : SLAB_CACHELINE;
+  uint left = bytes - slab_offset - nr_objs * aligned_size;
 
   // Allocate cache structure
   struct kmem_cache *cache = (struct kmem_cache *)kalloc();
@@ -136,12 +224,25 @@ struct kmem_cache *kmem_cache_create(const char *name, uint objsize,
   cache->name[sizeof(cache->name) - 1] = '\0';
   cache->objsize = aligned_size;
   cache->align = align;
+  cache->order = order;
+  cache->offset = slab_offset;
+  cache->nr_objs = nr_objs;
+  cache->ncolor = left / unit + 1;
+  cache->color = 0;
+  cache->offslab = offslab;
   cache->ctor = ctor;
   cache->dtor = dtor;
   cache->partial = 0;
   cache->full = 0;
   cache->empty = 0;
+  cache->min_empty = SLAB_MIN_EMPTY;
   initlock(&cache->lock, cache->name);
+  for (int i = 0; i < NCPU; i++) cache->mag[i].count = 0;
+
+  acquire(&slab_caches.lock);
+  cache->next_cache = slab_caches.head;
+  slab_caches.head = cache;
+  release(&slab_caches.lock);
 
   return cache;
 }
@@ -150,8 +251,17 @@ struct kmem_cache *kmem_cache_create(const char *name, uint objsize,
 void kmem_cache_destroy(struct kmem_cache *cache) {
   if (!cache) return;
 
+  acquire(&slab_caches.lock);
+  struct kmem_cache **pp = &slab_caches.head;
+  while (*pp && *pp != cache) pp = &(*pp)->next_cache;
+  if (*pp) *pp = cache->next_cache;
+  release(&slab_caches.lock);
+
   acquire(&cache->lock);
 
+  // Objects cached in magazines live in the slabs freed below.
+  for (int i = 0; i < NCPU; i++) cache->mag[i].count = 0;
+
   // Destroy all slabs in all lists
   struct slab *slab;
 
@@ -179,59 +289,180 @@ void kmem_cache_destroy(struct kmem_cache *cache) {
   kfree(cache);
 }
 
-// Allocate an object from the cache
-void *kmem_cache_alloc(struct kmem_cache *cache) {
-  if (!cache) return 0;
+// Take n objects off the slab lists into ptrs, a run from each
+// slab's freelist in turn, growing the cache when they run out.
+// Returns how many it got, fewer than n only if memory is short.
+// Caller must hold cache->lock, which is dropped while growing
+// so that kalloc() may ask this cache to shrink.
+static int slab_alloc_bulk_locked(struct kmem_cache *cache, int n,
+                                  void **ptrs) {
+  int got = 0;
+
+  while (got < n) {
+    // Prefer partial slabs, then empty ones
+    struct slab *slab = cache->partial ? cache->partial : cache->empty;
+    if (!slab) {
+      release(&cache->lock);
+      slab = slab_create(cache);
+      acquire(&cache->lock);
+      if (!slab) break;
+      slab_add_head(&cache->empty, slab);
+      continue;
+    }
 
-  acquire(&cache->lock);
+    struct slab **from = slab_list(cache, slab);
+    while (got < n && slab->nr_free > 0) ptrs[got++] = free_pop(slab);
+    struct slab **to = slab_list(cache, slab);
+    if (from != to) {
+      slab_remove(from, slab);
+      slab_add_head(to, slab);
+    }
+  }
+  return got;
+}
 
-  struct slab *slab = 0;
-  void *obj = 0;
+// Return n objects to the slabs they came from, a run at a time
+// for neighbours in ptrs from the same slab.
+// Caller must hold cache->lock.
+static void slab_free_bulk_locked(struct kmem_cache *cache, int n,
+                                  void **ptrs) {
+  for (int i = 0; i < n;) {
+    struct slab *slab = slab_of(cache, ptrs[i]);
 
-  // Fast path: try partial slabs first
-  if (cache->partial) {
-    slab = cache->partial;
-    obj = free_pop(slab);
+    if (!slab || slab->cache != cache) {
+      // Object doesn't belong to any slab - this is an error
+      release(&cache->lock);
+      panic("kmem_cache_free: object not found in any slab");
+      return;
+    }
 
-    // If slab is now full, move to full list
-    if (slab->nr_free == 0) {
-      slab_remove(&cache->partial, slab);
-      slab_add_head(&cache->full, slab);
+    // Add the run back to the freelist (insert at head)
+    struct slab **from = slab_list(cache, slab);
+    do {
+      free_push(slab, ptrs[i++]);
+    } while (i < n && slab_of(cache, ptrs[i]) == slab);
+    struct slab **to = slab_list(cache, slab);
+
+    // Move slab between lists based on its state
+    if (from != to) {
+      slab_remove(from, slab);
+      slab_add_head(to, slab);
     }
   }
-  // Try empty slabs
-  else if (cache->empty) {
-    slab = cache->empty;
-    obj = free_pop(slab);
-
-    // Remove from empty regardless
-    slab_remove(&cache->empty, slab);
-    // Place based on remaining free count
-    if (slab->nr_free == 0) {
-      slab_add_head(&cache->full, slab);
-    } else {
-      slab_add_head(&cache->partial, slab);
-    }
+}
+
+// Keep at least n empty slabs in the cache when shrinking.
+void kmem_cache_set_min_empty(struct kmem_cache *cache, uint n) {
+  acquire(&cache->lock);
+  cache->min_empty = n;
+  release(&cache->lock);
+}
+
+// Give the cache's empty slabs beyond its minimum back to the
+// page allocator. Objects held in per-CPU magazines keep their
+// slabs in use. Returns the number of pages freed.
+uint64 kmem_cache_shrink(struct kmem_cache *cache) {
+  struct slab *s, *next, *victims = 0;
+  uint64 freed = 0;
+  uint keep = 0;
+
+  acquire(&cache->lock);
+  for (s = cache->empty; s && keep < cache->min_empty; s = s->next) keep++;
+  for (; s; s = next) {
+    next = s->next;
+    slab_remove(&cache->empty, s);
+    s->next = victims;
+    victims = s;
   }
-  // Create new slab
-  else {
-    slab = slab_create(cache);
-    if (!slab) {
-      release(&cache->lock);
-      return 0;
-    }
+  release(&cache->lock);
 
-    obj = free_pop(slab);
+  while ((s = victims)) {
+    victims = s->next;
+    slab_destroy(s);
+    freed += 1L << cache->order;
+  }
+  return freed;
+}
 
-    // Place new slab based on remaining free count
-    if (slab->nr_free == 0) {
-      slab_add_head(&cache->full, slab);
-    } else {
-      slab_add_head(&cache->partial, slab);
+// Shrink every cache. Called by the page allocator when it runs
+// out of pages, with no slab locks held.
+uint64 slab_reclaim(void) {
+  uint64 freed = 0;
+
+  acquire(&slab_caches.lock);
+  for (struct kmem_cache *c = slab_caches.head; c; c = c->next_cache)
+    freed += kmem_cache_shrink(c);
+  release(&slab_caches.lock);
+  return freed;
+}
+
+static void cache_info(struct kmem_cache *c, struct slabinfo *si) {
+  struct slab *lists[] = {c->partial, c->full, c->empty};
+  uint64 nfree = 0;
+
+  memset(si, 0, sizeof(*si));
+  safestrcpy(si->name, c->name, sizeof(si->name));
+  si->objsize = c->objsize;
+  si->order = c->order;
+  acquire(&c->lock);
+  for (int i = 0; i < NELEM(lists); i++) {
+    for (struct slab *s = lists[i]; s; s = s->next) {
+      si->nslab++;
+      si->total += s->nr_objs;
+      nfree += s->nr_free;
     }
   }
+  release(&c->lock);
+  // other harts' magazines change under us.
+  for (int i = 0; i < NCPU; i++) si->nmag += c->mag[i].count;
+  nfree += si->nmag;
+  si->active = si->total > nfree ? si->total - nfree : 0;
+}
 
-  release(&cache->lock);
+// Add the pages every cache's slabs hold to mi->slab, if mi is
+// set, and describe the first n caches in si. Returns the number
+// of slabinfos filled in.
+int slabstat(struct meminfo *mi, struct slabinfo *si, int n) {
+  struct slabinfo tmp;
+  int k = 0;
+
+  acquire(&slab_caches.lock);
+  for (struct kmem_cache *c = slab_caches.head; c; c = c->next_cache) {
+    struct slabinfo *p = k < n ? &si[k++] : &tmp;
+    cache_info(c, p);
+    if (mi) mi->slab += p->nslab << p->order;
+  }
+  release(&slab_caches.lock);
+  return k;
+}
+
+// Allocate an object from the cache
+void *kmem_cache_alloc(struct kmem_cache *cache) {
+  if (!cache) return 0;
+
+  void *obj = 0;
+
+  // Fast path: pop from this hart's magazine.
+  push_off();
+  struct kmem_magazine *mag = &cache->mag[cpuid()];
+  if (mag->count == 0) {
+    // Slow path: refill half a magazine under the cache lock,
+    // keeping one object for this call. Growing the cache may
+    // shrink it, freeing into this magazine meanwhile, so add
+    // to what it holds then, and give back what does not fit.
+    void *objs[SLAB_MAG_SIZE / 2];
+    acquire(&cache->lock);
+    int got = slab_alloc_bulk_locked(cache, SLAB_MAG_SIZE / 2, objs);
+    int fit = SLAB_MAG_SIZE - mag->count;
+    if (fit > got) fit = got;
+    slab_free_bulk_locked(cache, got - fit, objs + fit);
+    release(&cache->lock);
+    for (int i = 0; i < fit; i++) mag->objs[mag->count++] = objs[i];
+  }
+  if (mag->count > 0) obj = mag->objs[--mag->count];
+  pop_off();
+
+  if (!obj) return 0;
 
   // Call constructor if provided
   if (cache->ctor) {
@@ -250,61 +481,97 @@ void kmem_cache_free(struct kmem_cache *cache, void *obj) {
     cache->dtor(obj);
   }
 
+  push_off();
+  struct kmem_magazine *mag = &cache->mag[cpuid()];
+  if (mag->count == SLAB_MAG_SIZE) {
+    // Magazine full: flush the older half back to the slabs.
+    acquire(&cache->lock);
+    slab_free_bulk_locked(cache, SLAB_MAG_SIZE / 2, mag->objs);
+    release(&cache->lock);
+    for (uint i = SLAB_MAG_SIZE / 2; i < SLAB_MAG_SIZE; i++)
+      mag->objs[i - SLAB_MAG_SIZE / 2] = mag->objs[i];
+    mag->count -= SLAB_MAG_SIZE / 2;
+  }
+  mag->objs[mag->count++] = obj;
+  pop_off();
+}
+
+// Allocate n objects into ptrs, topping up what this hart's
+// magazine holds from the slabs under one hold of the cache lock
+// (more only if the cache must grow). Returns how many it got,
+// fewer than n only if memory is short.
+int kmem_cache_alloc_bulk(struct kmem_cache *cache, int n, void **ptrs) {
+  int got = 0;
+
+  if (!cache || n <= 0) return 0;
+
+  push_off();
+  struct kmem_magazine *mag = &cache->mag[cpuid()];
+  while (got < n && mag->count > 0) ptrs[got++] = mag->objs[--mag->count];
+  if (got < n) {
+    acquire(&cache->lock);
+    got += slab_alloc_bulk_locked(cache, n - got, ptrs + got);
+    release(&cache->lock);
+  }
+  pop_off();
+
+  if (cache->ctor)
+    for (int i = 0; i < got; i++) cache->ctor(ptrs[i]);
+  return got;
+}
+
+// Free n objects, none of them 0, straight back to their slabs
+// under one hold of the cache lock.
+void kmem_cache_free_bulk(struct kmem_cache *cache, int n, void **ptrs) {
+  if (!cache || n <= 0) return;
+
+  if (cache->dtor)
+    for (int i = 0; i < n; i++) cache->dtor(ptrs[i]);
+
   acquire(&cache->lock);
+  slab_free_bulk_locked(cache, n, ptrs);
+  release(&cache->lock);
+}
 
-  // Find which slab this object belongs to
-  // We'll use a simple approach: check all slabs
-  struct slab *slab = 0;
+// kmalloc size classes: KMALLOC_MIN << i for i in [0, KMALLOC_NCLASS).
+#define KMALLOC_NCLASS 8
 
-  // Check partial slabs
-  for (struct slab *s = cache->partial; s; s = s->next) {
-    if ((char *)obj >= s->mem && (char *)obj < s->mem + PGSIZE) {
-      slab = s;
-      break;
-    }
-  }
+static struct kmem_cache *kmalloc_caches[KMALLOC_NCLASS];
+static const char *kmalloc_names[KMALLOC_NCLASS] = {
+    "kmalloc-16",  "kmalloc-32",  "kmalloc-64",   "kmalloc-128",
+    "kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048",
+};
 
-  // Check full slabs
-  if (!slab) {
-    for (struct slab *s = cache->full; s; s = s->next) {
-      if ((char *)obj >= s->mem && (char *)obj < s->mem + PGSIZE) {
-        slab = s;
-        break;
-      }
-    }
-  }
+// Index of the smallest size class that holds size bytes.
+static int kmalloc_class(uint size) {
+  int i = 0;
+  while ((KMALLOC_MIN << i) < size) i++;
+  return i;
+}
 
-  // Check empty slabs
-  if (!slab) {
-    for (struct slab *s = cache->empty; s; s = s->next) {
-      if ((char *)obj >= s->mem && (char *)obj < s->mem + PGSIZE) {
-        slab = s;
-        break;
-      }
-    }
+void kmallocinit(void) {
+  for (int i = 0; i < KMALLOC_NCLASS; i++) {
+    kmalloc_caches[i] = kmem_cache_create(kmalloc_names[i], KMALLOC_MIN << i,
+                                          0, 0, sizeof(void *));
+    if (!kmalloc_caches[i]) panic("kmallocinit");
   }
+}
 
-  if (!slab) {
-    // Object doesn't belong to any slab - this is an error
-    release(&cache->lock);
-    panic("kmem_cache_free: object not found in any slab");
-    return;
-  }
+// Allocate size bytes of kernel memory.
+// Returns 0 if size is 0, larger than a page, or memory is short.
+void *kmalloc(uint size) {
+  if (size == 0 || size > PGSIZE) return 0;
+  if (size > KMALLOC_MAX) return kalloc();
+  return kmem_cache_alloc(kmalloc_caches[kmalloc_class(size)]);
+}
 
-  // Add object back to freelist (insert at head)
-  free_push(slab, obj);
-
-  // Move slab between lists based on its state
-  if (slab->nr_free == slab->nr_objs) {
-    // Now empty
-    slab_remove(&cache->full, slab);
-    slab_remove(&cache->partial, slab);
-    slab_add_head(&cache->empty, slab);
-  } else if (slab->nr_free == 1) {
-    // Was full, now partial
-    slab_remove(&cache->full, slab);
-    slab_add_head(&cache->partial, slab);
+// Free memory from kmalloc(size).
+void kfree_sized(void *obj, uint size) {
+  if (!obj) return;
+  if (size == 0 || size > PGSIZE) panic("kfree_sized: bad size");
+  if (size > KMALLOC_MAX) {
+    kfree(obj);
+    return;
   }
-
-  release(&cache->lock);
+  kmem_cache_free(kmalloc_caches[kmalloc_class(size)], obj);
 }
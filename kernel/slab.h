@@ -1,15 +1,36 @@
 #pragma once
 
+#include "param.h"
 #include "spinlock.h"
 #include "types.h"
 
 // Forward declaration
 struct kmem_cache;
+struct meminfo;
 struct slab;
+struct slabinfo;
 
-// Slab structure for managing objects within a page
+// Largest slab: 2^SLAB_MAXORDER contiguous pages.
+#define SLAB_MAXORDER 3
+
+// Data cache line size, for SLAB_HWCACHE_ALIGN and slab colors.
+#define SLAB_CACHELINE 64
+
+// kmem_cache_create() align that puts objects on cache lines: a
+// line or more each, or an equal share of one if they are small.
+#define SLAB_HWCACHE_ALIGN ((uint)-1)
+
+// Caches of objects this big keep slab headers off the slab.
+#define SLAB_OFFSLAB_MIN (PGSIZE / 8)
+
+// Slab structure for managing objects within a block of pages.
+// Slabs are naturally aligned, so the header of the slab holding
+// an object is found by rounding the object's address down, or,
+// if the cache keeps headers off the slab, in the struct page of
+// that address.
 struct slab {
   struct slab *next;
+  struct slab *prev;
   struct kmem_cache *cache;
   char *mem;       // slab object area start address
   uint nr_objs;    // total number of objects
@@ -17,20 +38,42 @@ struct slab {
   void *freelist;  // free object list (single linked list)
 };
 
+// Per-CPU stack of free objects in front of a cache's slab lists.
+// Only the owning hart touches it, with interrupts off, so the
+// alloc/free fast path takes no lock.
+#define SLAB_MAG_SIZE 16
+struct kmem_magazine {
+  uint count;
+  void *objs[SLAB_MAG_SIZE];
+};
+
+// Empty slabs a cache keeps when the shrinker runs, by default.
+#define SLAB_MIN_EMPTY 1
+
 // Cache structure for each object type
 struct kmem_cache {
   char name[32];
   uint objsize;  // object size (including alignment/metadata overhead)
   uint align;    // alignment (usually cacheline aligned)
+  uint order;    // each slab is 2^order pages
+  uint offset;   // bytes before the first object; 0 if offslab
+  uint nr_objs;  // objects in each slab
+  uint ncolor;   // first-object offsets, SLAB_CACHELINE or align apart
+  uint color;    // the next slab's, counting up mod ncolor
+  int offslab;   // headers come from a cache of their own
   void (*ctor)(void *);
   void (*dtor)(void *);
   struct slab *partial;  // partially available slab list
   struct slab *full;     // full slab list
   struct slab *empty;    // empty slab list
+  uint min_empty;        // empty slabs kept by kmem_cache_shrink()
+  struct kmem_cache *next_cache;  // on the list of all caches
   struct spinlock lock;
+  struct kmem_magazine mag[NCPU];  // per-CPU object caches
 };
 
 // API functions
+void slabinit(void);
 struct kmem_cache *kmem_cache_create(const char *name, uint objsize,
                                      void (*ctor)(void *), void (*dtor)(void *),
                                      uint align);
@@ -38,3 +81,23 @@ void kmem_cache_destroy(struct kmem_cache *cache);
 
 void *kmem_cache_alloc(struct kmem_cache *cache);
 void kmem_cache_free(struct kmem_cache *cache, void *obj);
+int kmem_cache_alloc_bulk(struct kmem_cache *cache, int n, void **ptrs);
+void kmem_cache_free_bulk(struct kmem_cache *cache, int n, void **ptrs);
+
+// Reclaim: release empty slabs beyond each cache's minimum.
+void kmem_cache_set_min_empty(struct kmem_cache *cache, uint n);
+uint64 kmem_cache_shrink(struct kmem_cache *cache);
+uint64 slab_reclaim(void);
+
+// Statistics for meminfo().
+int slabstat(struct meminfo *mi, struct slabinfo *si, int n);
+
+// General-purpose allocator on power-of-two size-class caches.
+// Requests larger than KMALLOC_MAX get a whole page from kalloc().
+// kfree_sized() must be passed the size given to kmalloc().
+#define KMALLOC_MIN 16
+#define KMALLOC_MAX 2048
+
+void kmallocinit(void);
+void *kmalloc(uint size);
+void kfree_sized(void *obj, uint size);
@@ -0,0 +1,121 @@
+//
+// slab benchmark on demand: processes pinned to different harts
+// call slabbench(SLABBENCH_RUN) at once, and each times every
+// kmem_cache_alloc() and kmem_cache_free() on one shared cache.
+// The user program sums their histograms into latency
+// percentiles, and reads the cache lock's contention from
+// lockstat().
+//
+
+#include "slabbench.h"
+
+#include "proc.h"
+#include "riscv.h"
+#include "slab.h"
+#include "sleeplock.h"
+#include "spinlock.h"
+#include "string.h"
+#include "test/slab_test_benchmark.h"
+#include "test/slab_test_single.h"
+#include "types.h"
+#include "vm.h"
+
+#define MAXROUNDS 100000
+
+static struct {
+  struct spinlock lock;   // guards cache and nrun
+  struct sleeplock test;  // one SLABBENCH_SELFTEST at a time
+  struct kmem_cache *cache;
+  int nrun;  // SLABBENCH_RUNs using cache
+} bench;
+
+static int setup(int size) {
+  struct kmem_cache *c, *old;
+
+  if (size < 1 || size > KMALLOC_MAX) return -1;
+  c = kmem_cache_create("slabbench", size, 0, 0, sizeof(void *));
+  if (c == 0) return -1;
+  acquire(&bench.lock);
+  if (bench.nrun > 0) {
+    release(&bench.lock);
+    kmem_cache_destroy(c);
+    return -1;
+  }
+  old = bench.cache;
+  bench.cache = c;
+  release(&bench.lock);
+  if (old) kmem_cache_destroy(old);
+  return 0;
+}
+
+static int run(uint64 addr, int rounds) {
+  struct slabbench *r;
+  struct kmem_cache *c;
+  void *objs[SLABBENCH_BURST];
+  uint64 t;
+  int ok = 0;
+
+  if (rounds < 1 || rounds > MAXROUNDS) return -1;
+  if ((r = kmalloc(sizeof(*r))) == 0) return -1;
+  memset(r, 0, sizeof(*r));
+  acquire(&bench.lock);
+  if ((c = bench.cache) != 0) bench.nrun++;
+  release(&bench.lock);
+  if (c == 0) {
+    kfree_sized(r, sizeof(*r));
+    return -1;
+  }
+
+  r->start = r_time();
+  for (int i = 0; i < rounds && !killed(myproc()); i++) {
+    int n;
+    for (n = 0; n < SLABBENCH_BURST; n++) {
+      t = r_cycle();
+      objs[n] = kmem_cache_alloc(c);
+      r->hist[slabbench_bucket(r_cycle() - t)]++;
+      if (objs[n] == 0) break;
+    }
+    r->ops += n;
+    while (n > 0) {
+      t = r_cycle();
+      kmem_cache_free(c, objs[--n]);
+      r->hist[slabbench_bucket(r_cycle() - t)]++;
+      r->ops++;
+    }
+  }
+  r->end = r_time();
+
+  acquire(&bench.lock);
+  bench.nrun--;
+  release(&bench.lock);
+  if (copyout(myproc()->pagetable, addr, (char *)r, sizeof(*r)) == 0) ok = 1;
+  kfree_sized(r, sizeof(*r));
+  return ok ? 0 : -1;
+}
+
+// The boot-time suites that need no other hart: slab_test_multi()
+// runs in step on every hart, so only at boot.
+static int selftest(void) {
+  acquiresleep(&bench.test);
+  slab_test_single();
+  slab_test_benchmark();
+  releasesleep(&bench.test);
+  return 0;
+}
+
+void slabbenchinit(void) {
+  initlock(&bench.lock, "bench");
+  initsleeplock(&bench.test, "slabtest");
+}
+
+int kslabbench(int op, uint64 addr, int n) {
+  switch (op) {
+    case SLABBENCH_SETUP:
+      return setup(n);
+    case SLABBENCH_RUN:
+      return run(addr, n);
+    case SLABBENCH_SELFTEST:
+      return selftest();
+  }
+  return -1;
+}
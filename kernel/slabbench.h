@@ -0,0 +1,40 @@
+#pragma once
+
+#include "types.h"
+
+// slabbench() operations
+#define SLABBENCH_SETUP 0     // make the bench cache, of n-byte objects
+#define SLABBENCH_RUN 1       // n rounds on this hart; results to addr
+#define SLABBENCH_SELFTEST 2  // run the slab tests and pool benchmark
+
+// Objects a round allocates and then frees: more than a
+// magazine holds, so each round reaches the shared slab lists.
+#define SLABBENCH_BURST 32
+
+// Latencies are counted in buckets, four to each power of two:
+// bucket b holds the values from slabbench_low(b) up to
+// slabbench_low(b + 1).
+#define SLABBENCH_NBUCKET 256
+
+// One hart's run, from slabbench(SLABBENCH_RUN).
+struct slabbench {
+  uint64 ops;    // kmem_cache_alloc() and kmem_cache_free() calls
+  uint64 start;  // time CSR at the start and end of the run
+  uint64 end;
+  uint hist[SLABBENCH_NBUCKET];  // call latencies, in cycles
+};
+
+static inline int slabbench_bucket(uint64 v) {
+  int e = 63 - __builtin_clzl(v | 1);
+
+  if (v < 4) return v;
+  return 4 * (e - 1) + ((v >> (e - 2)) & 3);
+}
+
+static inline uint64 slabbench_low(int b) {
+  if (b < 4) return b;
+  return (uint64)(4 | (b & 3)) << (b / 4 - 1);
+}
+
+void slabbenchinit(void);
+int kslabbench(int, uint64, int);
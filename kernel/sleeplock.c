@@ -2,34 +2,113 @@
 
 #include "sleeplock.h"
 
+#include "lockstat.h"
+#include "printf.h"
 #include "proc.h"
+#include "rcu.h"
+#include "rusage.h"
 #include "spinlock.h"
 
+// How long a locker spins while the holder runs, in time-CSR
+// cycles: several cached bget() or ilock() critical sections,
+// and less than the two context switches sleeping costs.
+#define SPINCYCLES (TIMEBASE / 100000)  // 10us
+
+// If lk's holder is running on another hart, release lk->lk
+// and spin until the holder lets go, stops running, or
+// SPINCYCLES pass. Returns whether it spun. Caller holds lk->lk;
+// it is held again on return.
+static int spinowner(struct sleeplock *lk) {
+  struct proc *o = lk->owner;
+
+  if (o == 0 || o->state != RUNNING) return 0;
+  // o may release lk, exit and be freed while we look at it;
+  // enter the read section before release() turns interrupts
+  // back on and lets this hart pass a quiescent state.
+  rcu_read_lock();
+  release(&lk->lk);
+  uint64 end = r_time() + SPINCYCLES;
+  while (__atomic_load_n(&lk->owner, __ATOMIC_RELAXED) == o &&
+         __atomic_load_n(&o->state, __ATOMIC_RELAXED) == RUNNING &&
+         r_time() < end);
+  rcu_read_unlock();
+  acquire(&lk->lk);
+  return 1;
+}
+
 void initsleeplock(struct sleeplock *lk, char *name) {
   initlock(&lk->lk, "sleep lock");
   lk->name = name;
   lk->locked = 0;
+  lk->readers = 0;
+  lk->wanted = 0;
+  lk->owner = 0;
   lk->pid = 0;
+  lk->class = lockclass(name, LOCK_SLEEP);
 }
 
 void acquiresleep(struct sleeplock *lk) {
+  int contended = 0, spun = 0, stat = lockstat_on;
+  uint64 t0 = stat ? r_time() : 0;
+
   acquire(&lk->lk);
-  while (lk->locked) {
+  lk->wanted++;
+  while (lk->locked || lk->readers) {
+    contended = 1;
+    if (!spun && (spun = spinowner(lk))) continue;
     sleep(lk, &lk->lk);
   }
+  lk->wanted--;
   lk->locked = 1;
-  lk->pid = myproc()->pid;
+  lk->owner = myproc();
+  lk->pid = lk->owner->pid;
+  if (stat) lockstat_record(lk->class, contended, r_time() - t0);
   release(&lk->lk);
 }
 
 void releasesleep(struct sleeplock *lk) {
   acquire(&lk->lk);
   lk->locked = 0;
+  lk->owner = 0;
   lk->pid = 0;
   wakeup(lk);
   release(&lk->lk);
 }
 
+// Lock lk shared with other readers. Only holdingsleep() tells
+// an exclusive holder; readers are not recorded.
+void acquiresleepread(struct sleeplock *lk) {
+  int contended = 0, spun = 0, stat = lockstat_on;
+  uint64 t0 = stat ? r_time() : 0;
+
+  acquire(&lk->lk);
+  while (lk->locked || lk->wanted) {
+    contended = 1;
+    if (!spun && (spun = spinowner(lk))) continue;
+    sleep(lk, &lk->lk);
+  }
+  lk->readers++;
+  if (stat) lockstat_record(lk->class, contended, r_time() - t0);
+  release(&lk->lk);
+}
+
+void releasesleepread(struct sleeplock *lk) {
+  acquire(&lk->lk);
+  if (lk->readers < 1) panic("releasesleepread");
+  if (--lk->readers == 0) wakeup(lk);
+  release(&lk->lk);
+}
+
+// Stop owning exclusively held lk without releasing it, so that
+// another context, such as a disk interrupt handler, may later
+// release it on the holder's behalf.
+void disownsleep(struct sleeplock *lk) {
+  acquire(&lk->lk);
+  lk->owner = 0;
+  lk->pid = 0;
+  release(&lk->lk);
+}
+
 int holdingsleep(struct sleeplock *lk) {
   int r;
 
@@ -3,17 +3,30 @@
 #include "spinlock.h"
 #include "types.h"
 
-// Long-term locks for processes
+struct proc;
+
+// Long-term locks for processes. Held exclusively by
+// acquiresleep(), or shared by any number of acquiresleepread()
+// holders; a waiting exclusive locker holds off new readers.
+// A locker spins for a while before sleeping if the exclusive
+// holder is running, since it is then likely to let go soon.
 struct sleeplock {
-  uint locked;         // Is the lock held?
+  uint locked;         // Is the lock held exclusively?
+  int readers;         // Number of shared holders
+  int wanted;          // Processes waiting to lock it exclusively
+  struct proc *owner;  // Process holding it exclusively
   struct spinlock lk;  // spinlock protecting this sleep lock
 
   // For debugging:
-  char *name;  // Name of lock.
-  int pid;     // Process holding lock
+  char *name;               // Name of lock.
+  int pid;                  // Process holding lock
+  struct lockclass *class;  // Statistics for lockstat.c
 };
 
 void acquiresleep(struct sleeplock *);
 void releasesleep(struct sleeplock *);
+void acquiresleepread(struct sleeplock *);
+void releasesleepread(struct sleeplock *);
+void disownsleep(struct sleeplock *);
 int holdingsleep(struct sleeplock *);
 void initsleeplock(struct sleeplock *, char *);
@@ -2,27 +2,97 @@
 
 #include "spinlock.h"
 
+#include "lockstat.h"
+#include "param.h"
 #include "printf.h"
 #include "proc.h"
 #include "riscv.h"
 
+// MCS queue nodes, NMCSNODE per hart for the MCS locks it holds
+// or waits for at once. Interrupts are off meanwhile, so only
+// the hart itself uses its nodes.
+#define NMCSNODE 8
+
+static struct mcsnode mcsnodes[NCPU][NMCSNODE];
+static uint mcsused[NCPU];
+
 void initlock(struct spinlock *lk, char *name) {
   lk->name = name;
   lk->locked = 0;
+  lk->mcs = 0;
+  lk->next = 0;
+  lk->owner = 0;
+  lk->tail = 0;
+  lk->node = 0;
   lk->cpu = 0;
+  lk->class = lockclass(name, LOCK_SPIN);
+}
+
+void initmcslock(struct spinlock *lk, char *name) {
+  initlock(lk, name);
+  lk->mcs = 1;
+}
+
+// Queue on MCS lock lk and spin until the holder before us
+// hands it over. Returns whether there was one.
+static int mcs_acquire(struct spinlock *lk) {
+  int id = cpuid();
+  struct mcsnode *n, *prev;
+  int i;
+
+  if ((i = __builtin_ctz(~mcsused[id])) >= NMCSNODE) panic("mcs_acquire");
+  mcsused[id] |= 1 << i;
+  n = &mcsnodes[id][i];
+  n->next = 0;
+  n->wait = 1;
+
+  prev = __atomic_exchange_n(&lk->tail, n, __ATOMIC_ACQ_REL);
+  if (prev) {
+    __atomic_store_n(&prev->next, n, __ATOMIC_RELEASE);
+    while (__atomic_load_n(&n->wait, __ATOMIC_ACQUIRE));
+  }
+  lk->node = n;
+  return prev != 0;
+}
+
+// Hand MCS lock lk to the next waiter, if any.
+static void mcs_release(struct spinlock *lk) {
+  struct mcsnode *n = lk->node, *next, *self = n;
+  int id = cpuid();
+
+  lk->node = 0;
+  if ((next = __atomic_load_n(&n->next, __ATOMIC_ACQUIRE)) == 0) {
+    if (__atomic_compare_exchange_n(&lk->tail, &self, 0, 0, __ATOMIC_RELEASE,
+                                    __ATOMIC_RELAXED))
+      goto done;
+    // a waiter has swapped itself in but not linked yet.
+    while ((next = __atomic_load_n(&n->next, __ATOMIC_ACQUIRE)) == 0);
+  }
+  __atomic_store_n(&next->wait, 0, __ATOMIC_RELEASE);
+done:
+  mcsused[id] &= ~(1 << (n - mcsnodes[id]));
 }
 
 // Acquire the lock.
 // Loops (spins) until the lock is acquired.
 void acquire(struct spinlock *lk) {
+  int contended = 0, stat = lockstat_on;
+  uint64 t0 = 0;
+
   push_off();  // disable interrupts to avoid deadlock.
   if (holding(lk)) panic("acquire");
 
-  // On RISC-V, sync_lock_test_and_set turns into an atomic swap:
-  //   a5 = 1
-  //   s1 = &lk->locked
-  //   amoswap.w.aq a5, a5, (s1)
-  while (__sync_lock_test_and_set(&lk->locked, 1) != 0);
+  if (stat) t0 = r_time();
+  if (lk->mcs) {
+    contended = mcs_acquire(lk);
+  } else {
+    // take a ticket, then wait for it to be served. On RISC-V,
+    // sync_fetch_and_add turns into amoadd.w.
+    uint ticket = __sync_fetch_and_add(&lk->next, 1);
+    while (__atomic_load_n(&lk->owner, __ATOMIC_ACQUIRE) != ticket)
+      contended = 1;
+  }
+  if (stat) lockstat_record(lk->class, contended, r_time() - t0);
 
   // Tell the C compiler and the processor to not move loads or stores
   // past this point, to ensure that the critical section's memory
@@ -31,6 +101,7 @@ void acquire(struct spinlock *lk) {
   __sync_synchronize();
 
   // Record info about lock acquisition for holding() and debugging.
+  lk->locked = 1;
   lk->cpu = mycpu();
 }
 
@@ -39,6 +110,7 @@ void release(struct spinlock *lk) {
   if (!holding(lk)) panic("release");
 
   lk->cpu = 0;
+  lk->locked = 0;
 
   // Tell the C compiler and the CPU to not move loads or stores
   // past this point, to ensure that all the stores in the critical
@@ -48,14 +120,12 @@ void release(struct spinlock *lk) {
   // On RISC-V, this emits a fence instruction.
   __sync_synchronize();
 
-  // Release the lock, equivalent to lk->locked = 0.
-  // This code doesn't use a C assignment, since the C standard
-  // implies that an assignment might be implemented with
-  // multiple store instructions.
-  // On RISC-V, sync_lock_release turns into an atomic swap:
-  //   s1 = &lk->locked
-  //   amoswap.w zero, zero, (s1)
-  __sync_lock_release(&lk->locked);
+  // Pass the lock on. Only the holder writes owner, so a plain
+  // (single-instruction) store of the next ticket will do.
+  if (lk->mcs)
+    mcs_release(lk);
+  else
+    __atomic_store_n(&lk->owner, lk->owner + 1, __ATOMIC_RELEASE);
 
   pop_off();
 }
@@ -68,6 +138,81 @@ int holding(struct spinlock *lk) {
   return r;
 }
 
+#define RW_WRITER (1U << 31)
+#define RW_WAITING (1U << 30)  // a writer is spinning
+
+void initrwlock(struct rwspinlock *lk, char *name) {
+  lk->name = name;
+  lk->state = 0;
+  lk->cpu = 0;
+  lk->class = lockclass(name, LOCK_RW);
+}
+
+// Acquire lk shared with other readers.
+void acquireread(struct rwspinlock *lk) {
+  int tries = 0, stat = lockstat_on;
+  uint64 t0 = 0;
+
+  push_off();
+  if (holdingwrite(lk)) panic("acquireread");
+  if (stat) t0 = r_time();
+  for (;; tries++) {
+    uint s = __atomic_load_n(&lk->state, __ATOMIC_RELAXED);
+    if ((s & (RW_WRITER | RW_WAITING)) == 0 &&
+        __atomic_compare_exchange_n(&lk->state, &s, s + 1, 0,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      break;
+  }
+  __sync_synchronize();
+  if (stat) lockstat_record(lk->class, tries > 0, r_time() - t0);
+}
+
+void releaseread(struct rwspinlock *lk) {
+  __sync_synchronize();
+  __atomic_fetch_sub(&lk->state, 1, __ATOMIC_RELEASE);
+  pop_off();
+}
+
+// Acquire lk exclusively. Announce the wait so that no new
+// reader gets in, then wait for the readers to leave.
+void acquirewrite(struct rwspinlock *lk) {
+  int tries = 0, stat = lockstat_on;
+  uint64 t0 = 0;
+
+  push_off();
+  if (holdingwrite(lk)) panic("acquirewrite");
+  if (stat) t0 = r_time();
+  for (;; tries++) {
+    uint s = __atomic_load_n(&lk->state, __ATOMIC_RELAXED);
+    if ((s & ~RW_WAITING) == 0) {
+      if (__atomic_compare_exchange_n(&lk->state, &s, RW_WRITER, 0,
+                                      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        break;
+    } else if ((s & RW_WAITING) == 0) {
+      // set again if another writer took the lock and cleared it.
+      __atomic_fetch_or(&lk->state, RW_WAITING, __ATOMIC_RELAXED);
+    }
+  }
+  __sync_synchronize();
+  lk->cpu = mycpu();
+  if (stat) lockstat_record(lk->class, tries > 0, r_time() - t0);
+}
+
+void releasewrite(struct rwspinlock *lk) {
+  if (!holdingwrite(lk)) panic("releasewrite");
+  lk->cpu = 0;
+  __sync_synchronize();
+  // keep RW_WAITING, which other writers may have set.
+  __atomic_fetch_and(&lk->state, ~RW_WRITER, __ATOMIC_RELEASE);
+  pop_off();
+}
+
+// Check whether this cpu holds lk for writing.
+// Interrupts must be off.
+int holdingwrite(struct rwspinlock *lk) {
+  return (lk->state & RW_WRITER) && lk->cpu == mycpu();
+}
+
 // push_off/pop_off are like intr_off()/intr_on() except that they are matched:
 // it takes two pop_off()s to undo two push_off()s.  Also, if interrupts
 // are initially off, then push_off, pop_off leaves them off.
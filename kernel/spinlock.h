@@ -2,18 +2,66 @@
 
 #include "types.h"
 
-// Mutual exclusion lock.
+struct lockclass;
+
+// A waiter's place in an MCS lock's queue.
+struct mcsnode {
+  struct mcsnode *next;  // Next waiter, once it has linked itself
+  uint wait;             // Spun on until the previous holder clears it
+};
+
+// Mutual exclusion lock. initlock() makes a ticket lock, which
+// hands the lock to waiters in the order they arrived.
+// initmcslock() makes an MCS lock, also fair, whose waiters each
+// spin on their own node instead of all on the lock; it suits
+// hot global locks that many harts wait for at once.
 struct spinlock {
   uint locked;  // Is the lock held?
+  uint mcs;     // An MCS lock rather than a ticket lock?
+
+  // ticket lock:
+  uint next;   // Ticket the next acquire() takes
+  uint owner;  // Ticket now allowed to hold the lock
+
+  // MCS lock:
+  struct mcsnode *tail;  // Last in the queue, or 0 if free
+  struct mcsnode *node;  // The holder's node
 
   // For debugging:
-  char *name;       // Name of lock.
-  struct cpu *cpu;  // The cpu holding the lock.
+  char *name;               // Name of lock.
+  struct cpu *cpu;          // The cpu holding the lock.
+  struct lockclass *class;  // Statistics for lockstat.c
+};
+
+// Reader-writer spin lock: held by any number of readers at once,
+// or by one writer. A waiting writer holds off new readers, so
+// readers cannot starve it; a reader must not take the lock twice,
+// since a writer may arrive in between.
+struct rwspinlock {
+  uint state;  // RW_WRITER | RW_WAITING | number of readers
+
+  // For debugging:
+  char *name;               // Name of lock.
+  struct cpu *cpu;          // The cpu holding the lock for writing.
+  struct lockclass *class;  // Statistics for lockstat.c
 };
 
 void acquire(struct spinlock *);
 int holding(struct spinlock *);
 void initlock(struct spinlock *, char *);
+void initmcslock(struct spinlock *, char *);
 void release(struct spinlock *);
+void initrwlock(struct rwspinlock *, char *);
+void acquireread(struct rwspinlock *);
+void releaseread(struct rwspinlock *);
+void acquirewrite(struct rwspinlock *);
+void releasewrite(struct rwspinlock *);
+int holdingwrite(struct rwspinlock *);
 void push_off(void);
 void pop_off(void);
+
+// lockstat.c APIs
+extern int lockstat_on;
+struct lockclass *lockclass(char *, int);
+void lockstat_record(struct lockclass *, int, uint64);
+int klockstat(int, uint64, int);
@@ -1,13 +1,21 @@
+#include "memlayout.h"
 #include "param.h"
 #include "riscv.h"
 #include "types.h"
 
 void main();
 void timerinit();
+void ipiinit();
 
 // entry.S needs one stack per CPU.
 __attribute__((aligned(16))) char stack0[4096 * NCPU];
 
+// a scratch area per CPU for machine-mode software interrupts.
+uint64 msip_scratch[NCPU][3];
+
+// in kernelvec.S, forwards IPIs to supervisor mode.
+extern void mipivec();
+
 // entry.S jumps here in machine mode on stack0.
 void start() {
   // set M Previous Privilege mode to Supervisor, for mret.
@@ -23,10 +31,11 @@ void start() {
   // disable paging for now.
   w_satp(0);
 
-  // delegate all interrupts and exceptions to supervisor mode.
-  w_medeleg(0xffff);
+  // delegate all interrupts and exceptions to supervisor mode,
+  // except its own ecalls, with which it sets counter events.
+  w_medeleg(0xffff & ~(1 << 9));
   w_mideleg(0xffff);
-  w_sie(r_sie() | SIE_SEIE | SIE_STIE);
+  w_sie(r_sie() | SIE_SEIE | SIE_STIE | SIE_SSIE);
 
   // configure Physical Memory Protection to give supervisor mode
   // access to all of physical memory.
@@ -36,6 +45,9 @@ void start() {
   // ask for clock interrupts.
   timerinit();
 
+  // let other harts interrupt this one.
+  ipiinit();
+
   // keep each CPU's hartid in its tp register, for cpuid().
   int id = r_mhartid();
   w_tp(id);
@@ -52,9 +64,23 @@ void timerinit() {
   // enable the sstc extension (i.e. stimecmp).
   w_menvcfg(r_menvcfg() | (1L << 63));
 
-  // allow supervisor to use stimecmp and time.
-  w_mcounteren(r_mcounteren() | 2);
+  // allow supervisor to use stimecmp and time, and to read cycle,
+  // instret and hpmcounter3-6.
+  w_mcounteren(r_mcounteren() | 0x7f);
 
   // ask for the very first timer interrupt.
   w_stimecmp(r_time() + 1000000);
 }
+
+// take machine-mode software interrupts in mipivec,
+// which hands them to supervisor mode.
+void ipiinit() {
+  int id = r_mhartid();
+
+  uint64 *scratch = msip_scratch[id];
+  scratch[2] = CLINT_MSIP(id);
+  w_mscratch((uint64)scratch);
+
+  w_mtvec((uint64)mipivec);
+  w_mie(r_mie() | MIE_MSIE);
+}
@@ -0,0 +1,84 @@
+// Swap area: page-sized slots in the blocks mkfs reserves after
+// the file system (sb.swapstart, sb.nswap).
+//
+// Each slot has a reference count, one per swap PTE naming it, so
+// fork can share a swapped-out page the way it shares resident
+// ones. Slot I/O goes straight between the page and the disk,
+// as one request, with neither the buffer cache nor the log:
+// swap contents do not need to survive a crash.
+
+#include "swap.h"
+
+#include "fs.h"
+#include "param.h"
+#include "printf.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "types.h"
+#include "virtio_disk.h"
+
+#define BPP (PGSIZE / BSIZE)  // blocks per page
+#define NSWAPSLOT (SWAPSIZE / PGSIZE)
+
+extern struct superblock sb;
+
+static struct {
+  struct spinlock lock;
+  uint nslot;
+  uint hint;  // where the next search for a free slot starts
+  uchar ref[NSWAPSLOT];
+} swap;
+
+// Called by fsinit() once sb has been read.
+void swapinit(void) {
+  initlock(&swap.lock, "swap");
+  swap.nslot = sb.nswap / BPP;
+  if (swap.nslot > NSWAPSLOT) swap.nslot = NSWAPSLOT;
+}
+
+// Allocate a swap slot with one reference.
+// Returns -1 if swap is full or the disk has none.
+int swapalloc(void) {
+  acquire(&swap.lock);
+  for (uint i = 0; i < swap.nslot; i++) {
+    uint s = (swap.hint + i) % swap.nslot;
+    if (swap.ref[s] == 0) {
+      swap.ref[s] = 1;
+      swap.hint = s + 1;
+      release(&swap.lock);
+      return s;
+    }
+  }
+  release(&swap.lock);
+  return -1;
+}
+
+void swapdup(uint slot) {
+  acquire(&swap.lock);
+  if (slot >= swap.nslot || swap.ref[slot] == 0) panic("swapdup");
+  if (swap.ref[slot] == 255) panic("swapdup: overflow");
+  swap.ref[slot]++;
+  release(&swap.lock);
+}
+
+// Drop a reference to slot.
+void swapfree(uint slot) {
+  acquire(&swap.lock);
+  if (slot >= swap.nslot || swap.ref[slot] == 0) panic("swapfree");
+  swap.ref[slot]--;
+  release(&swap.lock);
+}
+
+// Transfer the page at pa to or from slot.
+static void swaprw(uint slot, void *pa, int write) {
+  uint64 blk[BPP];
+
+  for (int i = 0; i < BPP; i++) blk[i] = (uint64)pa + i * BSIZE;
+  virtio_disk_rwpa(sb.swapstart + slot * BPP, blk, BPP, write);
+}
+
+// Write the page at pa to slot.
+void swapwrite(uint slot, void *pa) { swaprw(slot, pa, 1); }
+
+// Read slot into the page at pa.
+void swapread(uint slot, void *pa) { swaprw(slot, pa, 0); }
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "riscv.h"
+#include "types.h"
+
+// A swapped-out page's PTE: not valid, PTE_SWAP set, the swap
+// slot in the PPN field and the page's other flags kept.
+#define SLOT2PTE(slot, flags) \
+  (((uint64)(slot) << 10) | ((flags) & ~PTE_V & 0x3FF) | PTE_SWAP)
+#define PTE2SLOT(pte) ((uint)((pte) >> 10))
+
+// swap.c APIs
+void swapinit(void);
+int swapalloc(void);
+void swapdup(uint);
+void swapfree(uint);
+void swapwrite(uint, void *);
+void swapread(uint, void *);
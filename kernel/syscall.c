@@ -1,16 +1,22 @@
 #include "syscall.h"
 
+#include "param.h"
 #include "printf.h"
 #include "proc.h"
+#include "riscv.h"
+#include "spinlock.h"
 #include "string.h"
+#include "sysstat.h"
 #include "types.h"
+#include "virtio_disk.h"
 #include "vm.h"
 
 // Fetch the uint64 at addr from the current process.
 int fetchaddr(uint64 addr, uint64 *ip) {
   struct proc *p = myproc();
-  if (addr >= p->sz ||
-      addr + sizeof(uint64) > p->sz)  // both tests needed, in case of overflow
+  uint64 sz = p->leader->sz;
+  if (addr >= sz ||
+      addr + sizeof(uint64) > sz)  // both tests needed, in case of overflow
     return -1;
   if (copyin(p->pagetable, (char *)ip, addr, sizeof(*ip)) != 0) return -1;
   return 0;
@@ -85,35 +91,230 @@ extern uint64 sys_mkdir(void);
 extern uint64 sys_close(void);
 extern uint64 sys_mmap(void);
 extern uint64 sys_munmap(void);
+extern uint64 sys_spawn(void);
+extern uint64 sys_madvise(void);
+extern uint64 sys_msync(void);
+extern uint64 sys_setpriority(void);
+extern uint64 sys_clone(void);
+extern uint64 sys_join(void);
+extern uint64 sys_futex(void);
+extern uint64 sys_setaffinity(void);
+extern uint64 sys_getaffinity(void);
+extern uint64 sys_getrusage(void);
+extern uint64 sys_pinfo(void);
+extern uint64 sys_lockstat(void);
+extern uint64 sys_fsync(void);
+extern uint64 sys_sendfile(void);
+extern uint64 sys_splice(void);
+extern uint64 sys_pread(void);
+extern uint64 sys_pwrite(void);
+extern uint64 sys_readv(void);
+extern uint64 sys_writev(void);
+extern uint64 sys_diskstat(void);
+extern uint64 sys_iostat(void);
+extern uint64 sys_fcntl(void);
+extern uint64 sys_memfd(void);
+extern uint64 sys_poll(void);
+extern uint64 sys_dmesg(void);
+extern uint64 sys_trace(void);
+extern uint64 sys_sysstat(void);
+extern uint64 sys_ringsetup(void);
+extern uint64 sys_ringenter(void);
+extern uint64 sys_prof(void);
+extern uint64 sys_hpm(void);
+extern uint64 sys_slabbench(void);
+extern uint64 sys_nanosleep(void);
+extern uint64 sys_meminfo(void);
 
 // An array mapping syscall numbers from syscall.h
 // to the function that handles the system call.
 static uint64 (*syscalls[])(void) = {
-    [SYS_fork] sys_fork,     [SYS_exit] sys_exit,
-    [SYS_wait] sys_wait,     [SYS_pipe] sys_pipe,
-    [SYS_read] sys_read,     [SYS_kill] sys_kill,
-    [SYS_exec] sys_exec,     [SYS_fstat] sys_fstat,
-    [SYS_chdir] sys_chdir,   [SYS_dup] sys_dup,
-    [SYS_getpid] sys_getpid, [SYS_sbrk] sys_sbrk,
-    [SYS_pause] sys_pause,   [SYS_uptime] sys_uptime,
-    [SYS_open] sys_open,     [SYS_write] sys_write,
-    [SYS_mknod] sys_mknod,   [SYS_unlink] sys_unlink,
-    [SYS_link] sys_link,     [SYS_mkdir] sys_mkdir,
-    [SYS_close] sys_close,   [SYS_mmap] sys_mmap,
-    [SYS_munmap] sys_munmap,
+    [SYS_fork] sys_fork,               [SYS_exit] sys_exit,
+    [SYS_wait] sys_wait,               [SYS_pipe] sys_pipe,
+    [SYS_read] sys_read,               [SYS_kill] sys_kill,
+    [SYS_exec] sys_exec,               [SYS_fstat] sys_fstat,
+    [SYS_chdir] sys_chdir,             [SYS_dup] sys_dup,
+    [SYS_getpid] sys_getpid,           [SYS_sbrk] sys_sbrk,
+    [SYS_pause] sys_pause,             [SYS_uptime] sys_uptime,
+    [SYS_open] sys_open,               [SYS_write] sys_write,
+    [SYS_mknod] sys_mknod,             [SYS_unlink] sys_unlink,
+    [SYS_link] sys_link,               [SYS_mkdir] sys_mkdir,
+    [SYS_close] sys_close,             [SYS_mmap] sys_mmap,
+    [SYS_munmap] sys_munmap,           [SYS_spawn] sys_spawn,
+    [SYS_madvise] sys_madvise,         [SYS_msync] sys_msync,
+    [SYS_setpriority] sys_setpriority, [SYS_clone] sys_clone,
+    [SYS_join] sys_join,               [SYS_futex] sys_futex,
+    [SYS_setaffinity] sys_setaffinity, [SYS_getaffinity] sys_getaffinity,
+    [SYS_getrusage] sys_getrusage,     [SYS_pinfo] sys_pinfo,
+    [SYS_lockstat] sys_lockstat,       [SYS_fsync] sys_fsync,
+    [SYS_sendfile] sys_sendfile,       [SYS_splice] sys_splice,
+    [SYS_pread] sys_pread,             [SYS_pwrite] sys_pwrite,
+    [SYS_readv] sys_readv,             [SYS_writev] sys_writev,
+    [SYS_diskstat] sys_diskstat,       [SYS_iostat] sys_iostat,
+    [SYS_fcntl] sys_fcntl,             [SYS_memfd] sys_memfd,
+    [SYS_poll] sys_poll,               [SYS_dmesg] sys_dmesg,
+    [SYS_trace] sys_trace,             [SYS_sysstat] sys_sysstat,
+    [SYS_ringsetup] sys_ringsetup,     [SYS_ringenter] sys_ringenter,
+    [SYS_prof] sys_prof,               [SYS_hpm] sys_hpm,
+    [SYS_slabbench] sys_slabbench,     [SYS_nanosleep] sys_nanosleep,
+    [SYS_meminfo] sys_meminfo,
 };
 
+static char *names[] = {
+    [SYS_fork] "fork",               [SYS_exit] "exit",
+    [SYS_wait] "wait",               [SYS_pipe] "pipe",
+    [SYS_read] "read",               [SYS_kill] "kill",
+    [SYS_exec] "exec",               [SYS_fstat] "fstat",
+    [SYS_chdir] "chdir",             [SYS_dup] "dup",
+    [SYS_getpid] "getpid",           [SYS_sbrk] "sbrk",
+    [SYS_pause] "pause",             [SYS_uptime] "uptime",
+    [SYS_open] "open",               [SYS_write] "write",
+    [SYS_mknod] "mknod",             [SYS_unlink] "unlink",
+    [SYS_link] "link",               [SYS_mkdir] "mkdir",
+    [SYS_close] "close",             [SYS_mmap] "mmap",
+    [SYS_munmap] "munmap",           [SYS_spawn] "spawn",
+    [SYS_madvise] "madvise",         [SYS_msync] "msync",
+    [SYS_setpriority] "setpriority", [SYS_clone] "clone",
+    [SYS_join] "join",               [SYS_futex] "futex",
+    [SYS_setaffinity] "setaffinity", [SYS_getaffinity] "getaffinity",
+    [SYS_getrusage] "getrusage",     [SYS_pinfo] "pinfo",
+    [SYS_lockstat] "lockstat",       [SYS_fsync] "fsync",
+    [SYS_sendfile] "sendfile",       [SYS_splice] "splice",
+    [SYS_pread] "pread",             [SYS_pwrite] "pwrite",
+    [SYS_readv] "readv",             [SYS_writev] "writev",
+    [SYS_diskstat] "diskstat",       [SYS_iostat] "iostat",
+    [SYS_fcntl] "fcntl",             [SYS_memfd] "memfd",
+    [SYS_poll] "poll",               [SYS_dmesg] "dmesg",
+    [SYS_trace] "trace",             [SYS_sysstat] "sysstat",
+    [SYS_ringsetup] "ringsetup",     [SYS_ringenter] "ringenter",
+    [SYS_prof] "prof",               [SYS_hpm] "hpm",
+    [SYS_slabbench] "slabbench",     [SYS_nanosleep] "nanosleep",
+    [SYS_meminfo] "meminfo",
+};
+
+#define NSYSCALL NELEM(syscalls)
+
+// Per-CPU, so counting takes no lock; sysstat() adds them up.
+static struct {
+  uint64 ncall;
+  uint64 time;
+  uint64 maxtime;
+  uint64 lat[NLAT];
+} stats[NCPU][NSYSCALL];
+
+// Calls selected by their processes' trace() masks, oldest
+// first; a new record overwrites the oldest when the ring is
+// full.
+static struct {
+  struct spinlock lock;
+  uint64 seq;    // records logged so far
+  uint64 taken;  // records before this are taken or overwritten
+  struct tracerec rec[NTRACE];
+} trace;
+
+void syscallinit(void) { initlock(&trace.lock, "trace"); }
+
+// Count a call to num that took cycles.
+static void account(int num, uint64 cycles) {
+  push_off();
+  int id = cpuid();
+  stats[id][num].ncall++;
+  stats[id][num].time += cycles;
+  if (cycles > stats[id][num].maxtime) stats[id][num].maxtime = cycles;
+  iohist(stats[id][num].lat, cycles);
+  pop_off();
+}
+
+static void logtrace(struct proc *p, int num, uint64 *arg, uint64 t0,
+                     uint64 t1, uint64 ret) {
+  struct tracerec *r;
+
+  acquire(&trace.lock);
+  r = &trace.rec[trace.seq % NTRACE];
+  r->seq = trace.seq++;
+  r->time = t0;
+  r->cycles = t1 - t0;
+  memmove(r->arg, arg, sizeof(r->arg));
+  r->ret = ret;
+  r->pid = p->pid;
+  r->num = num;
+  if (trace.seq - trace.taken > NTRACE) trace.taken = trace.seq - NTRACE;
+  release(&trace.lock);
+}
+
 void syscall(void) {
   int num;
   struct proc *p = myproc();
+  uint64 t0, t1, arg[3];
 
   num = p->trapframe->a7;
   if (num > 0 && num < NELEM(syscalls) && syscalls[num]) {
+    t0 = r_time();
+    arg[0] = p->trapframe->a0;
+    arg[1] = p->trapframe->a1;
+    arg[2] = p->trapframe->a2;
+    p->ru.nsyscall++;
     // Use num to lookup the system call function for num, call it,
     // and store its return value in p->trapframe->a0
     p->trapframe->a0 = syscalls[num]();
+    t1 = r_time();
+    account(num, t1 - t0);
+    if (p->tracemask & (1UL << num))
+      logtrace(p, num, arg, t0, t1, p->trapframe->a0);
   } else {
     printf("%d %s: unknown sys call %d\n", p->pid, p->name, num);
     p->trapframe->a0 = -1;
   }
 }
+
+// sysstat(): SYSSTAT_GET copies out a struct sysstat for each
+// system call, at most n, counting since boot or the last
+// SYSSTAT_RESET, and SYSSTAT_TRACE takes up to n of the oldest struct
+// tracerecs from the trace ring. Both return how many.
+int ksysstat(int op, uint64 addr, int n) {
+  struct sysstat st;
+  struct tracerec r;
+  int k = 0;
+
+  switch (op) {
+    case SYSSTAT_RESET:
+      memset(stats, 0, sizeof(stats));
+      return 0;
+    case SYSSTAT_TRACE:
+      for (; k < n; k++) {
+        acquire(&trace.lock);
+        if (trace.taken == trace.seq) {
+          release(&trace.lock);
+          break;
+        }
+        r = trace.rec[trace.taken++ % NTRACE];
+        release(&trace.lock);
+        if (copyout(myproc()->pagetable, addr + k * sizeof(r), (char *)&r,
+                    sizeof(r)) < 0)
+          return -1;
+      }
+      return k;
+    case SYSSTAT_GET:
+      break;
+    default:
+      return -1;
+  }
+
+  for (int i = 1; i < NSYSCALL && k < n; i++) {
+    if (syscalls[i] == 0) continue;
+    memset(&st, 0, sizeof(st));
+    safestrcpy(st.name, names[i], sizeof(st.name));
+    st.num = i;
+    for (int c = 0; c < NCPU; c++) {
+      st.ncall += stats[c][i].ncall;
+      st.time += stats[c][i].time;
+      if (stats[c][i].maxtime > st.maxtime) st.maxtime = stats[c][i].maxtime;
+      for (int b = 0; b < NLAT; b++) st.lat[b] += stats[c][i].lat[b];
+    }
+    if (copyout(myproc()->pagetable, addr + k * sizeof(st), (char *)&st,
+                sizeof(st)) < 0)
+      return -1;
+    k++;
+  }
+  return k;
+}
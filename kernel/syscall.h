@@ -24,6 +24,40 @@
 #define SYS_close 21
 #define SYS_mmap 22
 #define SYS_munmap 23
+#define SYS_spawn 24
+#define SYS_madvise 25
+#define SYS_msync 26
+#define SYS_setpriority 27
+#define SYS_clone 28
+#define SYS_join 29
+#define SYS_futex 30
+#define SYS_setaffinity 31
+#define SYS_getaffinity 32
+#define SYS_getrusage 33
+#define SYS_pinfo 34
+#define SYS_lockstat 35
+#define SYS_fsync 36
+#define SYS_sendfile 37
+#define SYS_splice 38
+#define SYS_pread 39
+#define SYS_pwrite 40
+#define SYS_readv 41
+#define SYS_writev 42
+#define SYS_diskstat 43
+#define SYS_iostat 44
+#define SYS_fcntl 45
+#define SYS_memfd 46
+#define SYS_poll 47
+#define SYS_dmesg 48
+#define SYS_trace 49
+#define SYS_sysstat 50
+#define SYS_ringsetup 51
+#define SYS_ringenter 52
+#define SYS_prof 53
+#define SYS_hpm 54
+#define SYS_slabbench 55
+#define SYS_nanosleep 56
+#define SYS_meminfo 57
 
 // Declarations for syscall argument helpers and dispatcher
 #ifndef __ASSEMBLER__
@@ -35,4 +69,6 @@ void argaddr(int, uint64 *);
 int fetchstr(uint64, char *, int);
 int fetchaddr(uint64, uint64 *);
 void syscall(void);
+void syscallinit(void);
+int ksysstat(int, uint64, int);
 #endif
@@ -4,103 +4,371 @@
 // user code, and calls into file.c and fs.c.
 //
 
+#include "bio.h"
+#include "dcache.h"
 #include "exec.h"
 #include "fcntl.h"
 #include "file.h"
 #include "fs.h"
+#include "iostat.h"
 
 // Forward declaration for fs.c internal function
 struct inode *ialloc(uint, short);
 #include "kalloc.h"
 #include "log.h"
+#include "pagecache.h"
 #include "param.h"
 #include "pipe.h"
+#include "poll.h"
 #include "printf.h"
 #include "proc.h"
 #include "riscv.h"
+#include "ring.h"
+#include "slab.h"
 #include "stat.h"
 #include "string.h"
 #include "syscall.h"
 #include "types.h"
+#include "uio.h"
+#include "virtio_disk.h"
+
+// Return the struct file of the caller's descriptor fd.
+// Another thread may close the descriptor meanwhile, so a
+// multithreaded process gets its own reference to the file; then
+// fdget() returns 1 and the caller must fileclose() it.
+static int fdget(int fd, struct file **pf) {
+  struct file *f;
+  struct proc *p = myproc();
+  struct proc *g = p->leader;
+
+  if (fd < 0) return -1;
+  if (p == g && g->threads == 0) {
+    if (fd >= g->nofile || (f = g->ofile[fd]) == 0) return -1;
+    if (pf) *pf = f;
+    return 0;
+  }
+  acquire(&g->fdlock);
+  f = fd < g->nofile ? g->ofile[fd] : 0;
+  if (f) filedup(f);
+  release(&g->fdlock);
+  if (f == 0) return -1;
+  *pf = f;
+  return 1;
+}
 
 // Fetch the nth word-sized system call argument as a file descriptor
-// and return both the descriptor and the corresponding struct file.
+// and return both the descriptor and the corresponding struct file,
+// as fdget() does.
 static int argfd(int n, int *pfd, struct file **pf) {
-  int fd;
-  struct file *f;
+  int fd, ref;
 
   argint(n, &fd);
-  if (fd < 0 || fd >= NOFILE || (f = myproc()->ofile[fd]) == 0) return -1;
+  if ((ref = fdget(fd, pf)) < 0) return -1;
   if (pfd) *pfd = fd;
-  if (pf) *pf = f;
-  return 0;
+  return ref;
 }
 
-// Allocate a file descriptor for the given file.
+// Allocate the lowest free file descriptor for the given file,
+// growing the table if need be.
 // Takes over file reference from caller on success.
 static int fdalloc(struct file *f) {
   int fd;
-  struct proc *p = myproc();
+  struct proc *g = myproc()->leader;
 
-  for (fd = 0; fd < NOFILE; fd++) {
-    if (p->ofile[fd] == 0) {
-      p->ofile[fd] = f;
-      return fd;
-    }
+  acquire(&g->fdlock);
+  if ((fd = fdfirstfree(g)) < 0 || fdgrow(g, fd + 1) < 0) {
+    release(&g->fdlock);
+    return -1;
   }
-  return -1;
+  fdset(g, fd, f);
+  release(&g->fdlock);
+  return fd;
+}
+
+// Clear descriptor fd, which fdalloc() returned.
+static void fdclear(int fd) {
+  struct proc *g = myproc()->leader;
+
+  acquire(&g->fdlock);
+  fdset(g, fd, 0);
+  release(&g->fdlock);
 }
 
 uint64 sys_dup(void) {
   struct file *f;
-  int fd;
+  int fd, ref;
 
-  if (argfd(0, 0, &f) < 0) return -1;
-  if ((fd = fdalloc(f)) < 0) return -1;
-  filedup(f);
+  if ((ref = argfd(0, 0, &f)) < 0) return -1;
+  if ((fd = fdalloc(f)) < 0) {
+    if (ref) fileclose(f);
+    return -1;
+  }
+  if (!ref) filedup(f);
   return fd;
 }
 
 uint64 sys_read(void) {
   struct file *f;
-  int n;
+  int n, ref, r;
   uint64 p;
 
   argaddr(1, &p);
   argint(2, &n);
-  if (argfd(0, 0, &f) < 0) return -1;
-  return fileread(f, p, n);
+  if ((ref = argfd(0, 0, &f)) < 0) return -1;
+  r = fileread(f, p, n);
+  if (ref) fileclose(f);
+  return r;
 }
 
 uint64 sys_write(void) {
   struct file *f;
-  int n;
+  int n, ref, r;
   uint64 p;
 
   argaddr(1, &p);
   argint(2, &n);
-  if (argfd(0, 0, &f) < 0) return -1;
+  if ((ref = argfd(0, 0, &f)) < 0) return -1;
 
-  return filewrite(f, p, n);
+  r = filewrite(f, p, n);
+  if (ref) fileclose(f);
+  return r;
 }
 
-uint64 sys_close(void) {
-  int fd;
+static int kclose(int fd) {
   struct file *f;
+  struct proc *g = myproc()->leader;
 
-  if (argfd(0, &fd, &f) < 0) return -1;
-  myproc()->ofile[fd] = 0;
+  if (fd < 0) return -1;
+  acquire(&g->fdlock);
+  if (fd >= g->nofile || (f = g->ofile[fd]) == 0) {
+    release(&g->fdlock);
+    return -1;
+  }
+  fdset(g, fd, 0);
+  release(&g->fdlock);
   fileclose(f);
   return 0;
 }
 
+uint64 sys_close(void) {
+  int fd;
+
+  argint(0, &fd);
+  return kclose(fd);
+}
+
 uint64 sys_fstat(void) {
   struct file *f;
   uint64 st;  // user pointer to struct stat
+  int ref, r;
 
   argaddr(1, &st);
-  if (argfd(0, 0, &f) < 0) return -1;
-  return filestat(f, st);
+  if ((ref = argfd(0, 0, &f)) < 0) return -1;
+  r = filestat(f, st);
+  if (ref) fileclose(f);
+  return r;
+}
+
+// Place fd's delayed blocks, and wait until the file system
+// calls that have returned are on disk, fd's among them.
+uint64 sys_fsync(void) {
+  struct file *f;
+  int ref;
+
+  if ((ref = argfd(0, 0, &f)) < 0) return -1;
+  if (f->type == FD_INODE) iflush(f->ip);
+  if (ref) fileclose(f);
+  log_sync();
+  return 0;
+}
+
+// Wait for events on any of nfds descriptors, for at most
+// timeout ticks, or forever if timeout is -1; see kpoll().
+// Negative fds are ignored.
+uint64 sys_poll(void) {
+  uint64 addr;
+  int nfds, timeout, r = -1;
+  struct pollfd *pfds = 0;
+  struct file **fs = 0;
+  struct proc *p = myproc(), *g = p->leader;
+
+  argaddr(0, &addr);
+  argint(1, &nfds);
+  argint(2, &timeout);
+  if (nfds < 0 || nfds > NOFILEMAX || timeout < -1) return -1;
+  if (nfds > 0 && ((pfds = kmalloc(nfds * sizeof(*pfds))) == 0 ||
+                   (fs = kmalloc(nfds * sizeof(*fs))) == 0))
+    goto done;
+  if (copyin(p->pagetable, (char *)pfds, addr, nfds * sizeof(*pfds)) < 0)
+    goto done;
+
+  // hold the files, which may be closed meanwhile.
+  acquire(&g->fdlock);
+  for (int i = 0; i < nfds; i++) {
+    int fd = pfds[i].fd;
+    fs[i] = fd >= 0 && fd < g->nofile ? g->ofile[fd] : 0;
+    if (fs[i]) filedup(fs[i]);
+  }
+  release(&g->fdlock);
+
+  r = kpoll(pfds, fs, nfds, timeout);
+  for (int i = 0; i < nfds; i++)
+    if (fs[i]) fileclose(fs[i]);
+  if (r >= 0 &&
+      copyout(p->pagetable, addr, (char *)pfds, nfds * sizeof(*pfds)) < 0)
+    r = -1;
+
+done:
+  if (fs) kfree_sized(fs, nfds * sizeof(*fs));
+  if (pfds) kfree_sized(pfds, nfds * sizeof(*pfds));
+  return r;
+}
+
+// Get or set a pipe's buffer size.
+uint64 sys_fcntl(void) {
+  struct file *f;
+  int cmd, arg, ref, r = -1;
+
+  argint(1, &cmd);
+  argint(2, &arg);
+  if ((ref = argfd(0, 0, &f)) < 0) return -1;
+  if (f->type == FD_PIPE) {
+    if (cmd == F_GETPIPE_SZ)
+      r = pipesize(f->pipe);
+    else if (cmd == F_SETPIPE_SZ)
+      r = piperesize(f->pipe, arg);
+  }
+  if (ref) fileclose(f);
+  return r;
+}
+
+// Copy out block I/O statistics, or zero them.
+uint64 sys_iostat(void) {
+  struct iostat st;
+  int op;
+  uint64 addr;
+
+  argint(0, &op);
+  argaddr(1, &addr);
+  memset(&st, 0, sizeof(st));
+  switch (op) {
+    case IOSTAT_GET:
+      virtio_disk_stat(&st.disk);
+      bstat(&st, 0);
+      logstat(&st, 0);
+      return copyout(myproc()->pagetable, addr, (char *)&st, sizeof(st));
+    case IOSTAT_RESET:
+      virtio_disk_resetstat();
+      bstat(&st, 1);
+      logstat(&st, 1);
+      return 0;
+  }
+  return -1;
+}
+
+// Fetch the cnt user iovecs at syscall argument n into iov,
+// checking that their lengths add up to an int.
+static int argiov(int n, int cnt, struct iovec *iov) {
+  uint64 addr, tot = 0;
+
+  argaddr(n, &addr);
+  if (cnt < 0 || cnt > IOV_MAX) return -1;
+  if (copyin(myproc()->pagetable, (char *)iov, addr, cnt * sizeof(*iov)) < 0)
+    return -1;
+  for (int i = 0; i < cnt; i++)
+    if (iov[i].iov_len > 0x7fffffff || (tot += iov[i].iov_len) > 0x7fffffff)
+      return -1;
+  return 0;
+}
+
+// Read or write one buffer of a file at the offset given, leaving
+// the file's own offset alone.
+static uint64 prw(int write) {
+  struct file *f;
+  struct iovec v;
+  int n, ref, r = -1;
+  uint64 p;
+  uint off;
+
+  argaddr(1, &p);
+  argint(2, &n);
+  argint(3, (int *)&off);
+  if (n < 0) return -1;
+  if ((ref = argfd(0, 0, &f)) < 0) return -1;
+  v.iov_base = (void *)p;
+  v.iov_len = n;
+  if (f->type == FD_INODE)
+    r = write ? filewritev(f, &v, 1, &off) : filereadv(f, &v, 1, &off);
+  if (ref) fileclose(f);
+  return r;
+}
+
+uint64 sys_pread(void) { return prw(0); }
+
+uint64 sys_pwrite(void) { return prw(1); }
+
+// Read or write the buffers of an iovec array in order, in one
+// call. A file is read under one hold of its lock and written in
+// as few log transactions as the buffers fit.
+static uint64 rwv(int write) {
+  struct iovec iov[IOV_MAX];
+  struct file *f;
+  int cnt, ref, r;
+
+  argint(2, &cnt);
+  if (argiov(1, cnt, iov) < 0) return -1;
+  if ((ref = argfd(0, 0, &f)) < 0) return -1;
+  r = write ? filewritev(f, iov, cnt, 0) : filereadv(f, iov, cnt, 0);
+  if (ref) fileclose(f);
+  return r;
+}
+
+uint64 sys_readv(void) { return rwv(0); }
+
+uint64 sys_writev(void) { return rwv(1); }
+
+// Copy n bytes of file in_fd to out_fd within the kernel, from
+// *off if off is not null, advancing it, and from the file's own
+// offset otherwise.
+uint64 sys_sendfile(void) {
+  struct proc *p = myproc();
+  struct file *out, *in;
+  int n, r = -1, rout, rin = 0;
+  uint64 offp;
+  uint off;
+
+  argaddr(2, &offp);
+  argint(3, &n);
+  if ((rout = argfd(0, 0, &out)) < 0) return -1;
+  if ((rin = argfd(1, 0, &in)) < 0) goto done;
+  if (in->type != FD_INODE) goto done;
+  if (offp == 0) {
+    r = filesplice(out, in, &in->off, n);
+  } else if (copyin(p->pagetable, (char *)&off, offp, sizeof(off)) == 0) {
+    r = filesplice(out, in, &off, n);
+    if (copyout(p->pagetable, offp, (char *)&off, sizeof(off)) < 0) r = -1;
+  }
+done:
+  if (rin > 0) fileclose(in);
+  if (rout > 0) fileclose(out);
+  return r;
+}
+
+// Move up to n bytes from in_fd to out_fd within the kernel;
+// one of them must be a pipe.
+uint64 sys_splice(void) {
+  struct file *out, *in;
+  int n, r = -1, rout, rin;
+
+  argint(2, &n);
+  if ((rin = argfd(0, 0, &in)) < 0) return -1;
+  if ((rout = argfd(1, 0, &out)) < 0) goto done;
+  if (in->type == FD_PIPE || out->type == FD_PIPE)
+    r = filesplice(out, in, &in->off, n);
+  if (rout > 0) fileclose(out);
+done:
+  if (rin > 0) fileclose(in);
+  return r;
 }
 
 // Create the path new as a link to the same inode as old.
@@ -150,14 +418,18 @@ bad:
 }
 
 // Is the directory dp empty except for "." and ".." ?
+// In an indexed directory they need not come first, and the
+// index blocks read as free entries.
 static int isdirempty(struct inode *dp) {
   int off;
   struct dirent de;
 
-  for (off = 2 * sizeof(de); off < dp->size; off += sizeof(de)) {
+  for (off = 0; off < dp->size; off += sizeof(de)) {
     if (readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
       panic("isdirempty: readi");
-    if (de.inum != 0) return 0;
+    if (de.inum != 0 && namecmp(de.name, ".") != 0 &&
+        namecmp(de.name, "..") != 0)
+      return 0;
   }
   return 1;
 }
@@ -193,6 +465,7 @@ uint64 sys_unlink(void) {
   memset(&de, 0, sizeof(de));
   if (writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     panic("unlink: writei");
+  dcache_enter(dp, name, 0, 0);
   if (ip->type == T_DIR) {
     dp->nlink--;
     iupdate(dp);
@@ -268,15 +541,10 @@ fail:
   return 0;
 }
 
-uint64 sys_open(void) {
-  char path[MAXPATH];
-  int fd, omode;
+static int kopen(char *path, int omode) {
+  int fd;
   struct file *f;
   struct inode *ip;
-  int n;
-
-  argint(1, &omode);
-  if ((n = argstr(0, path, MAXPATH)) < 0) return -1;
 
   begin_op();
 
@@ -322,6 +590,7 @@ uint64 sys_open(void) {
   f->ip = ip;
   f->readable = !(omode & O_WRONLY);
   f->writable = (omode & O_WRONLY) || (omode & O_RDWR);
+  f->direct = (omode & O_DIRECT) && ip->type == T_FILE;
 
   if ((omode & O_TRUNC) && ip->type == T_FILE) {
     itrunc(ip);
@@ -333,6 +602,15 @@ uint64 sys_open(void) {
   return fd;
 }
 
+uint64 sys_open(void) {
+  char path[MAXPATH];
+  int omode;
+
+  argint(1, &omode);
+  if (argstr(0, path, MAXPATH) < 0) return -1;
+  return kopen(path, omode);
+}
+
 uint64 sys_mkdir(void) {
   char path[MAXPATH];
   struct inode *ip;
@@ -367,8 +645,8 @@ uint64 sys_mknod(void) {
 
 uint64 sys_chdir(void) {
   char path[MAXPATH];
-  struct inode *ip;
-  struct proc *p = myproc();
+  struct inode *ip, *old;
+  struct proc *g = myproc()->leader;
 
   begin_op();
   if (argstr(0, path, MAXPATH) < 0 || (ip = namei(path)) == 0) {
@@ -382,24 +660,35 @@ uint64 sys_chdir(void) {
     return -1;
   }
   iunlock(ip);
-  iput(p->cwd);
+  acquire(&g->fdlock);
+  old = g->cwd;
+  g->cwd = ip;
+  release(&g->fdlock);
+  iput(old);
   end_op();
-  p->cwd = ip;
   return 0;
 }
 
-uint64 sys_exec(void) {
-  char path[MAXPATH], *argv[MAXARG];
-  int i;
-  uint64 uargv, uarg;
+// Free an argument vector from fetchargv().
+static void freeargv(char **argv) {
+  for (int i = 0; i < MAXARG && argv[i] != 0; i++)
+    kfree_sized(argv[i], strlen(argv[i]) + 1);
+}
 
-  argaddr(1, &uargv);
-  if (argstr(0, path, MAXPATH) < 0) {
-    return -1;
-  }
-  memset(argv, 0, sizeof(argv));
+// Copy the null-terminated user argument vector at uargv into
+// argv[MAXARG], in kmalloc'ed strings. Returns 0, or -1 with
+// nothing left allocated.
+static int fetchargv(uint64 uargv, char **argv) {
+  char *buf;
+  int i, n;
+  uint64 uarg;
+
+  memset(argv, 0, MAXARG * sizeof(char *));
+  // fetch each argument into one staging page, then keep
+  // only as many bytes as it needs.
+  if ((buf = kalloc()) == 0) return -1;
   for (i = 0;; i++) {
-    if (i >= NELEM(argv)) {
+    if (i >= MAXARG) {
       goto bad;
     }
     if (fetchaddr(uargv + sizeof(uint64) * i, (uint64 *)&uarg) < 0) {
@@ -409,20 +698,74 @@ uint64 sys_exec(void) {
       argv[i] = 0;
       break;
     }
-    argv[i] = kalloc();
+    if ((n = fetchstr(uarg, buf, PGSIZE)) < 0) goto bad;
+    argv[i] = kmalloc(n + 1);
     if (argv[i] == 0) goto bad;
-    if (fetchstr(uarg, argv[i], PGSIZE) < 0) goto bad;
+    memmove(argv[i], buf, n + 1);
+  }
+  kfree(buf);
+  return 0;
+
+bad:
+  kfree(buf);
+  freeargv(argv);
+  return -1;
+}
+
+uint64 sys_exec(void) {
+  char path[MAXPATH], *argv[MAXARG];
+  uint64 uargv;
+
+  argaddr(1, &uargv);
+  if (argstr(0, path, MAXPATH) < 0) {
+    return -1;
   }
+  if (fetchargv(uargv, argv) < 0) return -1;
 
   int ret = kexec(path, argv);
 
-  for (i = 0; i < NELEM(argv) && argv[i] != 0; i++) kfree(argv[i]);
+  freeargv(argv);
 
   return ret;
+}
 
-bad:
-  for (i = 0; i < NELEM(argv) && argv[i] != 0; i++) kfree(argv[i]);
-  return -1;
+// spawn(path, argv, fdmap, nfd): start path in a new child
+// process, without fork's copy of the caller. The child's fd i
+// is the caller's fd fdmap[i] (-1 for closed), for i < nfd.
+uint64 sys_spawn(void) {
+  char path[MAXPATH], *argv[MAXARG];
+  int *fdmap = 0, nfd, i, ret = -1;
+  uint64 uargv, ufdmap;
+  struct proc *p = myproc(), *g = p->leader;
+
+  argaddr(1, &uargv);
+  argaddr(2, &ufdmap);
+  argint(3, &nfd);
+  if (argstr(0, path, MAXPATH) < 0) {
+    return -1;
+  }
+  if (nfd < 0 || nfd > NOFILEMAX) return -1;
+  if (nfd > 0 && ((fdmap = kmalloc(nfd * sizeof(int))) == 0 ||
+                  copyin(p->pagetable, (char *)fdmap, ufdmap,
+                         nfd * sizeof(int)) < 0))
+    goto done;
+  // kspawn() skips descriptors closed since.
+  acquire(&g->fdlock);
+  for (i = 0; i < nfd; i++) {
+    if (fdmap[i] == -1) continue;
+    if (fdmap[i] < 0 || fdmap[i] >= g->nofile || g->ofile[fdmap[i]] == 0)
+      break;
+  }
+  release(&g->fdlock);
+  if (i < nfd || fetchargv(uargv, argv) < 0) goto done;
+
+  ret = kspawn(path, argv, fdmap, nfd);
+
+  freeargv(argv);
+
+done:
+  if (fdmap) kfree_sized(fdmap, nfd * sizeof(int));
+  return ret;
 }
 
 uint64 sys_pipe(void) {
@@ -435,7 +778,7 @@ uint64 sys_pipe(void) {
   if (pipealloc(&rf, &wf) < 0) return -1;
   fd0 = -1;
   if ((fd0 = fdalloc(rf)) < 0 || (fd1 = fdalloc(wf)) < 0) {
-    if (fd0 >= 0) p->ofile[fd0] = 0;
+    if (fd0 >= 0) fdclear(fd0);
     fileclose(rf);
     fileclose(wf);
     return -1;
@@ -443,11 +786,88 @@ uint64 sys_pipe(void) {
   if (copyout(p->pagetable, fdarray, (char *)&fd0, sizeof(fd0)) < 0 ||
       copyout(p->pagetable, fdarray + sizeof(fd0), (char *)&fd1, sizeof(fd1)) <
           0) {
-    p->ofile[fd0] = 0;
-    p->ofile[fd1] = 0;
+    fdclear(fd0);
+    fdclear(fd1);
     fileclose(rf);
     fileclose(wf);
     return -1;
   }
   return 0;
 }
+
+// Make size bytes of zeroed memory, shared by whoever has the
+// returned descriptor: through read() and write(), and mmap()
+// with MAP_SHARED, which fork() children keep.
+uint64 sys_memfd(void) {
+  int size, fd;
+  struct file *f;
+  struct anon *a;
+
+  argint(0, &size);
+  if (size <= 0) return -1;
+  if ((a = anon_alloc()) == 0) return -1;
+  a->size = size;
+  if ((f = filealloc()) == 0) {
+    anon_put(a);
+    return -1;
+  }
+  f->type = FD_MEM;
+  f->anon = a;
+  f->off = 0;
+  f->readable = 1;
+  f->writable = 1;
+  if ((fd = fdalloc(f)) < 0) {
+    fileclose(f);
+    return -1;
+  }
+  return fd;
+}
+
+// Carry out io ring submission e for the calling process, as
+// the system call it names would, and return what that would.
+int ringop(struct sqe *e) {
+  char path[MAXPATH];
+  struct file *f;
+  struct iovec v;
+  int ref, r = -1;
+  uint off = e->off;
+
+  if (e->op == RING_NOP) return 0;
+  if (e->op == RING_OPEN)
+    return fetchstr(e->addr, path, MAXPATH) < 0 ? -1 : kopen(path, e->len);
+  if (e->op == RING_CLOSE) return kclose(e->fd);
+  if (e->len > 0x7fffffff || (ref = fdget(e->fd, &f)) < 0) return -1;
+  v.iov_base = (void *)e->addr;
+  v.iov_len = e->len;
+  switch (e->op) {
+    case RING_READ:
+      r = fileread(f, e->addr, e->len);
+      break;
+    case RING_WRITE:
+      r = filewrite(f, e->addr, e->len);
+      break;
+    case RING_PREAD:
+      if (f->type == FD_INODE) r = filereadv(f, &v, 1, &off);
+      break;
+    case RING_PWRITE:
+      if (f->type == FD_INODE) r = filewritev(f, &v, 1, &off);
+      break;
+  }
+  if (ref) fileclose(f);
+  return r;
+}
+
+uint64 sys_ringsetup(void) {
+  int flags;
+
+  argint(0, &flags);
+  return kringsetup(flags);
+}
+
+uint64 sys_ringenter(void) {
+  int n, flags;
+
+  argint(0, &n);
+  argint(1, &flags);
+  return kringenter(n, flags);
+}
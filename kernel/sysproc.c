@@ -10,6 +10,19 @@
 #include "sleeplock.h"
 #include "memlayout.h"
 #include "log.h"
+#include "pagecache.h"
+#include "futex.h"
+#include "hpm.h"
+#include "kalloc.h"
+#include "klog.h"
+#include "meminfo.h"
+#include "prof.h"
+#include "rusage.h"
+#include "slab.h"
+#include "slabbench.h"
+#include "string.h"
+#include "timer.h"
+#include "virtio_disk.h"
 
 uint64 sys_exit(void) {
   int n;
@@ -18,7 +31,7 @@ uint64 sys_exit(void) {
   return 0;  // not reached
 }
 
-uint64 sys_getpid(void) { return myproc()->pid; }
+uint64 sys_getpid(void) { return myproc()->leader->pid; }
 
 uint64 sys_fork(void) { return kfork(); }
 
@@ -32,42 +45,59 @@ uint64 sys_sbrk(void) {
   uint64 addr;
   int t;
   int n;
+  int locked;
 
   argint(0, &n);
   argint(1, &t);
-  addr = myproc()->sz;
+  locked = lockvm();
+  addr = myproc()->leader->sz;
 
   if (t == SBRK_EAGER || n < 0) {
     if (growproc(n) < 0) {
-      return -1;
+      addr = -1;
     }
+  } else if (addr + n < addr) {
+    addr = -1;
   } else {
     // Lazily allocate memory for this process: increase its memory
     // size but don't allocate memory. If the processes uses the
     // memory, vmfault() will allocate it.
-    if (addr + n < addr) return -1;
-    myproc()->sz += n;
+    myproc()->leader->sz += n;
   }
+  unlockvm(locked);
   return addr;
 }
 
 uint64 sys_pause(void) {
   int n;
-  uint ticks0;
 
   argint(0, &n);
   if (n < 0) n = 0;
-  acquire(&tickslock);
-  ticks0 = ticks;
-  while (ticks - ticks0 < n) {
-    if (killed(myproc())) {
-      release(&tickslock);
-      return -1;
-    }
-    sleep(&ticks, &tickslock);
+  return timersleep((r_time() / TICKCYCLES + n) * TICKCYCLES);
+}
+
+// Sleep for a timespec's worth of time CSR cycles, rounded up.
+// If killed first, say in rem how long was left.
+uint64 sys_nanosleep(void) {
+  struct proc *p = myproc();
+  struct timespec ts;
+  uint64 req, rem, when;
+
+  argaddr(0, &req);
+  argaddr(1, &rem);
+  if (copyin(p->pagetable, (char *)&ts, req, sizeof(ts)) < 0 ||
+      ts.tv_nsec >= 1000000000 || ts.tv_sec > 1000000000)
+    return -1;
+  when = r_time() + ts.tv_sec * TIMEBASE +
+         (ts.tv_nsec + (1000000000 / TIMEBASE) - 1) / (1000000000 / TIMEBASE);
+  if (timersleep(when) == 0) return 0;
+  if (rem) {
+    uint64 left = when > r_time() ? when - r_time() : 0;
+    ts.tv_sec = left / TIMEBASE;
+    ts.tv_nsec = left % TIMEBASE * (1000000000 / TIMEBASE);
+    copyout(p->pagetable, rem, (char *)&ts, sizeof(ts));
   }
-  release(&tickslock);
-  return 0;
+  return -1;
 }
 
 uint64 sys_kill(void) {
@@ -77,92 +107,199 @@ uint64 sys_kill(void) {
   return kkill(pid);
 }
 
-// return how many clock tick interrupts have occurred
-// since start.
-uint64 sys_uptime(void) {
-  uint xticks;
+uint64 sys_setpriority(void) {
+  int pid, prio;
 
-  acquire(&tickslock);
-  xticks = ticks;
-  release(&tickslock);
-  return xticks;
+  argint(0, &pid);
+  argint(1, &prio);
+  return ksetpriority(pid, prio);
 }
 
-// Find an unused VMA slot
-static struct vma* vma_alloc(struct proc *p) {
-  for (int i = 0; i < NVMA; i++) {
-    if (!p->vmas[i].used) {
-      return &p->vmas[i];
-    }
-  }
+uint64 sys_setaffinity(void) {
+  int pid;
+  uint64 mask;
+
+  argint(0, &pid);
+  argaddr(1, &mask);
+  return ksetaffinity(pid, mask);
+}
+
+uint64 sys_getaffinity(void) {
+  int pid;
+
+  argint(0, &pid);
+  return kgetaffinity(pid);
+}
+
+uint64 sys_getrusage(void) {
+  int pid;
+  uint64 addr;
+
+  argint(0, &pid);
+  argaddr(1, &addr);
+  return kgetrusage(pid, addr);
+}
+
+uint64 sys_pinfo(void) {
+  int pid;
+  uint64 addr;
+
+  argint(0, &pid);
+  argaddr(1, &addr);
+  return kpinfo(pid, addr);
+}
+
+uint64 sys_lockstat(void) {
+  int op, n;
+  uint64 addr;
+
+  argint(0, &op);
+  argaddr(1, &addr);
+  argint(2, &n);
+  return klockstat(op, addr, n);
+}
+
+uint64 sys_diskstat(void) {
+  int op, n;
+  uint64 addr;
+
+  argint(0, &op);
+  argaddr(1, &addr);
+  argint(2, &n);
+  return kdiskstat(op, addr, n);
+}
+
+// Log the calling thread's system calls whose numbers are set
+// in mask to the trace ring; its children, threads and spawned
+// processes inherit the mask.
+uint64 sys_trace(void) {
+  uint64 mask;
+
+  argaddr(0, &mask);
+  myproc()->tracemask = mask;
   return 0;
 }
 
-// Find an unused region in process address space for mmap
-// Returns address or 0 on failure
-static uint64 vma_find_addr(struct proc *p, uint64 len) {
-  uint64 addr = PGROUNDUP(p->sz);
-
-  // Check each VMA to avoid overlaps
-  for (int i = 0; i < NVMA; i++) {
-    if (p->vmas[i].used) {
-      uint64 vma_end = p->vmas[i].addr + p->vmas[i].len;
-      if (addr < vma_end) {
-        addr = PGROUNDUP(vma_end);
-      }
-    }
-  }
+uint64 sys_sysstat(void) {
+  int op, n;
+  uint64 addr;
 
-  // Make sure we don't overlap with USYSCALL or TRAPFRAME
-  if (addr + len > USYSCALL) {
-    return 0;  // No space
-  }
+  argint(0, &op);
+  argaddr(1, &addr);
+  argint(2, &n);
+  return ksysstat(op, addr, n);
+}
 
-  return addr;
+uint64 sys_prof(void) {
+  int op, n;
+  uint64 addr;
+
+  argint(0, &op);
+  argaddr(1, &addr);
+  argint(2, &n);
+  return kprof(op, addr, n);
 }
 
-// Write back allocated pages in a VMA region to file
-// Only writes pages that have been allocated (lazy allocation)
-static void vma_writeback(struct vma *v, uint64 addr, uint64 len) {
-  if (!(v->flags & MAP_SHARED)) {
-    return;  // Only write back MAP_SHARED
-  }
+uint64 sys_hpm(void) {
+  int op, n;
+  uint64 addr;
 
-  struct proc *p = myproc();
-  struct inode *ip = v->file->ip;
-
-  // Lock inode to read size
-  ilock(ip);
-  uint file_size = ip->size;
-  iunlock(ip);
-
-  for (uint64 va = addr; va < addr + len; va += PGSIZE) {
-    // Check if this page is allocated
-    if (ismapped(p->pagetable, va)) {
-      // Calculate offset in file
-      uint64 offset_in_vma = va - v->addr;
-      uint64 file_offset = v->offset + offset_in_vma;
-
-      // Don't write beyond the current file size
-      if (file_offset >= file_size) {
-        continue;
-      }
-
-      // Calculate how many bytes to write
-      uint64 bytes_to_write = PGSIZE;
-      if (file_offset + bytes_to_write > file_size) {
-        bytes_to_write = file_size - file_offset;
-      }
-
-      if (bytes_to_write > 0) {
-        begin_op();
-        ilock(ip);
-        writei(ip, 1, va, file_offset, bytes_to_write);
-        iunlock(ip);
-        end_op();
-      }
-    }
+  argint(0, &op);
+  argaddr(1, &addr);
+  argint(2, &n);
+  return khpm(op, addr, n);
+}
+
+uint64 sys_slabbench(void) {
+  int op, n;
+  uint64 addr;
+
+  argint(0, &op);
+  argaddr(1, &addr);
+  argint(2, &n);
+  return kslabbench(op, addr, n);
+}
+
+// meminfo(MEMINFO_GET, addr, 0) copies out a struct meminfo.
+// meminfo(MEMINFO_SLABS, addr, n) copies out a struct slabinfo
+// for each of up to n caches and returns how many it copied.
+uint64 sys_meminfo(void) {
+  struct meminfo mi;
+  struct slabinfo *si;
+  int op, n;
+  uint64 addr;
+
+  argint(0, &op);
+  argaddr(1, &addr);
+  argint(2, &n);
+  switch (op) {
+    case MEMINFO_GET:
+      memset(&mi, 0, sizeof(mi));
+      kmemstat(&mi);
+      vmstat(&mi);
+      slabstat(&mi, 0, 0);
+      return copyout(myproc()->pagetable, addr, (char *)&mi, sizeof(mi));
+    case MEMINFO_SLABS:
+      // gather first: copyout() may fault, and faults may shrink
+      // the caches.
+      if (n < 0) return -1;
+      if (n > PGSIZE / sizeof(*si)) n = PGSIZE / sizeof(*si);
+      if ((si = kalloc()) == 0) return -1;
+      n = slabstat(0, si, n);
+      if (copyout(myproc()->pagetable, addr, (char *)si, n * sizeof(*si)) < 0)
+        n = -1;
+      kfree(si);
+      return n;
   }
+  return -1;
+}
+
+uint64 sys_dmesg(void) {
+  uint64 addr;
+  int n;
+
+  argaddr(0, &addr);
+  argint(1, &n);
+  return kdmesg(addr, n);
+}
+
+uint64 sys_clone(void) {
+  uint64 fn, arg, stack;
+
+  argaddr(0, &fn);
+  argaddr(1, &arg);
+  argaddr(2, &stack);
+  return kclone(fn, arg, stack);
+}
+
+uint64 sys_join(void) {
+  int tid;
+  uint64 p;
+
+  argint(0, &tid);
+  argaddr(1, &p);
+  return kjoin(tid, p);
+}
+
+uint64 sys_futex(void) {
+  uint64 addr;
+  int op, val;
+
+  argaddr(0, &addr);
+  argint(1, &op);
+  argint(2, &val);
+  return kfutex(addr, op, val);
+}
+
+// return how many clock ticks have passed since start.
+uint64 sys_uptime(void) {
+  uint xticks;
+
+  acquire(&tickslock);
+  tickupdate();
+  xticks = ticks;
+  release(&tickslock);
+  return xticks;
 }
 
 uint64 sys_mmap(void) {
@@ -170,8 +307,9 @@ uint64 sys_mmap(void) {
   int len, prot, flags, fd;
   uint64 offset;
   struct file *f;
-  struct proc *p = myproc();
+  struct proc *p = myproc()->leader;
   struct vma *v;
+  int locked;
 
   // Get arguments
   argaddr(0, &addr);
@@ -188,42 +326,78 @@ uint64 sys_mmap(void) {
   if (len <= 0) {
     return -1;
   }
-  if (fd < 0 || fd >= NOFILE || (f = p->ofile[fd]) == 0) {
-    return -1;  // Invalid file descriptor
-  }
-  if (!f->readable && (prot & PROT_READ)) {
-    return -1;  // Can't map unreadable file as readable
-  }
-  if (!f->writable && (prot & PROT_WRITE) && (flags & MAP_SHARED)) {
-    return -1;  // Can't map unwritable file as MAP_SHARED writable
-  }
-
-  // Find unused VMA slot
-  if ((v = vma_alloc(p)) == 0) {
-    return -1;  // No free VMA slots
+  f = 0;
+  if (flags & MAP_ANONYMOUS) {
+    if (!(flags & (MAP_SHARED | MAP_PRIVATE))) {
+      return -1;
+    }
+  } else {
+    if ((flags & MAP_SHARED) && offset % PGSIZE != 0) {
+      return -1;  // shared mappings map whole cached pages
+    }
+    // the VMA keeps this reference.
+    acquire(&p->fdlock);
+    if (fd >= 0 && fd < p->nofile && (f = p->ofile[fd]) != 0) filedup(f);
+    release(&p->fdlock);
+    if (f == 0) {
+      return -1;  // Invalid file descriptor
+    }
+    if ((!f->readable && (prot & PROT_READ)) ||
+        (!f->writable && (prot & PROT_WRITE) && (flags & MAP_SHARED))) {
+      // Can't map unreadable file as readable, or unwritable
+      // file as MAP_SHARED writable
+      fileclose(f);
+      return -1;
+    }
+    if (f->type == FD_MEM && (!(flags & MAP_SHARED) || offset > f->anon->size ||
+                              len > f->anon->size - offset)) {
+      fileclose(f);
+      return -1;  // a memfd is only shared, and no bigger than made
+    }
   }
 
-  // Find address space for mapping
-  if ((addr = vma_find_addr(p, len)) == 0) {
-    return -1;  // No space in address space
+  // Find address space for mapping, above the heap and
+  // below UTOP. Huge mappings start on a superpage so
+  // that whole 2MB ranges can be backed by superpages.
+  uint64 align = (flags & MAP_HUGE) ? SUPERPGSIZE : PGSIZE;
+  locked = lockvm();
+  if ((addr = vma_gap(&p->vmas, p->sz, len, UTOP, align)) == 0 ||
+      (v = vma_alloc()) == 0) {
+    unlockvm(locked);
+    if (f) fileclose(f);
+    return -1;  // No space in address space, or out of memory
   }
 
   // Set up VMA
-  v->used = 1;
   v->addr = addr;
-  v->len = len;
+  v->len = PGROUNDUP(len);
   v->prot = prot;
   v->flags = flags;
-  v->file = filedup(f);  // Increment file reference count
-  v->offset = offset;
+  if (f && f->type == FD_MEM) {
+    // the VMA maps the memfd's pages, without its file.
+    anon_dup(f->anon);
+    v->anon = f->anon;
+    v->offset = offset;
+  } else if (f) {
+    v->file = f;
+    v->offset = offset;
+    v->filesz = PGROUNDUP(len);
+  } else if ((flags & MAP_SHARED) && (v->anon = anon_alloc()) == 0) {
+    vma_free(v);
+    unlockvm(locked);
+    return -1;
+  }
+  vma_insert(&p->vmas, v);
+  unlockvm(locked);
+  if (f && f->type == FD_MEM) fileclose(f);
 
   return addr;
 }
 
 uint64 sys_munmap(void) {
   uint64 addr;
-  int len;
-  struct proc *p = myproc();
+  int len, locked;
+  struct proc *p = myproc()->leader;
 
   argaddr(0, &addr);
   argint(1, &len);
@@ -231,37 +405,31 @@ uint64 sys_munmap(void) {
   if (len <= 0 || addr % PGSIZE != 0) {
     return -1;
   }
+  len = PGROUNDUP(len);
+  locked = lockvm();
 
-  // Find and unmap the VMA(s)
-  for (int i = 0; i < NVMA; i++) {
-    struct vma *v = &p->vmas[i];
-    if (!v->used) continue;
-
+  // Find and unmap the VMA(s) overlapping [addr, addr+len)
+  uint64 unmap_end = addr + len;
+  struct vma *v, *next;
+  for (v = vma_find(&p->vmas, addr); v && v->addr < unmap_end; v = next) {
     uint64 vma_end = v->addr + v->len;
-    uint64 unmap_end = addr + len;
-
-    // Check if this VMA overlaps with the unmap region
-    if (addr >= vma_end || unmap_end <= v->addr) {
-      continue;  // No overlap
-    }
+    next = vma_find(&p->vmas, vma_end);
 
     // Handle different unmap scenarios
     if (addr <= v->addr && unmap_end >= vma_end) {
       // Unmapping entire VMA
       // Write back dirty pages if MAP_SHARED
-      vma_writeback(v, v->addr, v->len);
+      vma_writeback(p->pagetable, v, v->addr, v->len);
 
       // Unmap all pages
       uvmunmap(p->pagetable, v->addr, v->len / PGSIZE, 1);
 
-      // Release file reference
-      fileclose(v->file);
-
-      // Mark VMA as free
-      v->used = 0;
+      // Release the file or anonymous pages
+      vma_remove(&p->vmas, v);
+      vma_put(v);
     } else if (addr == v->addr) {
       // Unmapping from start
-      vma_writeback(v, v->addr, len);
+      vma_writeback(p->pagetable, v, v->addr, len);
 
       uvmunmap(p->pagetable, v->addr, len / PGSIZE, 1);
 
@@ -269,10 +437,11 @@ uint64 sys_munmap(void) {
       v->addr += len;
       v->len -= len;
       v->offset += len;
+      v->filesz = v->filesz > len ? v->filesz - len : 0;
     } else if (unmap_end == vma_end) {
       // Unmapping from end
       uint64 write_addr = v->addr + v->len - len;
-      vma_writeback(v, write_addr, len);
+      vma_writeback(p->pagetable, v, write_addr, len);
 
       uvmunmap(p->pagetable, write_addr, len / PGSIZE, 1);
 
@@ -282,6 +451,107 @@ uint64 sys_munmap(void) {
     // Note: We don't handle unmapping from middle (punching holes)
     // as the lab says we can assume this won't happen
   }
+  unlockvm(locked);
+
+  return 0;
+}
+
+// Check that VMAs cover [addr, end) without a hole.
+static int vma_covered(struct proc *p, uint64 addr, uint64 end) {
+  while (addr < end) {
+    struct vma *v = vma_find(&p->vmas, addr);
+    if (v == 0 || v->addr > addr) return 0;
+    addr = v->addr + v->len;
+  }
+  return 1;
+}
+
+uint64 sys_madvise(void) {
+  uint64 addr;
+  int len, advice, locked;
+  struct proc *p = myproc()->leader;
+
+  argaddr(0, &addr);
+  argint(1, &len);
+  argint(2, &advice);
+
+  if (len <= 0 || addr % PGSIZE != 0) {
+    return -1;
+  }
+  if (advice < MADV_NORMAL || advice > MADV_DONTNEED) {
+    return -1;
+  }
+  uint64 end = addr + PGROUNDUP(len);
+  locked = lockvm();
+  if (!vma_covered(p, addr, end)) {
+    unlockvm(locked);
+    return -1;
+  }
+
+  struct vma *v;
+  for (v = vma_find(&p->vmas, addr); v && v->addr < end;
+       v = vma_find(&p->vmas, v->addr + v->len)) {
+    uint64 s = v->addr > addr ? v->addr : addr;
+    uint64 e = v->addr + v->len < end ? v->addr + v->len : end;
+
+    switch (advice) {
+      case MADV_NORMAL:
+      case MADV_RANDOM:
+      case MADV_SEQUENTIAL:
+        // A hint for the whole VMA, as the fault-around
+        // state is kept per VMA.
+        v->advice = advice;
+        v->window = 0;
+        break;
+      case MADV_WILLNEED:
+        vma_prefault(p->pagetable, v, s, e);
+        break;
+      case MADV_DONTNEED:
+        // Shared pages stay cached; write them back first,
+        // since unmapping forgets their PTE_D. Private ones
+        // come back zeroed or freshly read from the file.
+        vma_writeback(p->pagetable, v, s, e - s);
+        uvmunmap(p->pagetable, s, (e - s) / PGSIZE, 1);
+        break;
+    }
+  }
+  unlockvm(locked);
+
+  return 0;
+}
+
+uint64 sys_msync(void) {
+  uint64 addr;
+  int len, flags, locked;
+  struct proc *p = myproc()->leader;
+
+  argaddr(0, &addr);
+  argint(1, &len);
+  argint(2, &flags);
+
+  if (len <= 0 || addr % PGSIZE != 0) {
+    return -1;
+  }
+  if (flags & ~(MS_ASYNC | MS_SYNC)) {
+    return -1;
+  }
+  uint64 end = addr + PGROUNDUP(len);
+  locked = lockvm();
+  if (!vma_covered(p, addr, end)) {
+    unlockvm(locked);
+    return -1;
+  }
+
+  // The log commits each page's write before vma_writeback()
+  // moves on, so MS_ASYNC is as synchronous as MS_SYNC.
+  struct vma *v;
+  for (v = vma_find(&p->vmas, addr); v && v->addr < end;
+       v = vma_find(&p->vmas, v->addr + v->len)) {
+    uint64 s = v->addr > addr ? v->addr : addr;
+    uint64 e = v->addr + v->len < end ? v->addr + v->len : end;
+    vma_writeback(p->pagetable, v, s, e - s);
+  }
+  unlockvm(locked);
 
   return 0;
 }
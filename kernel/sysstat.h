@@ -0,0 +1,32 @@
+#pragma once
+
+#include "diskstat.h"
+#include "types.h"
+
+// sysstat() operations
+#define SYSSTAT_GET 0    // copy out the per-call statistics
+#define SYSSTAT_RESET 1  // zero them
+#define SYSSTAT_TRACE 2  // take the oldest records from the trace ring
+
+// Statistics for one system call, from sysstat(). Counting is
+// always on; times are in cycles of the time CSR.
+struct sysstat {
+  char name[12];
+  int num;
+  uint64 ncall;      // calls that returned
+  uint64 time;       // total time from entry to return
+  uint64 maxtime;    // longest single call
+  uint64 lat[NLAT];  // calls by latency, bucketed as diskstat's
+};
+
+// A call made by a process whose trace() mask selects it, from
+// sysstat(SYSSTAT_TRACE).
+struct tracerec {
+  uint64 seq;     // numbers the traced calls; a gap means some were lost
+  uint64 time;    // time CSR at entry
+  uint64 cycles;  // time from entry to return
+  uint64 arg[3];  // the first arguments
+  uint64 ret;     // the return value
+  int pid;
+  int num;
+};
@@ -4,6 +4,7 @@
 #include "../printf.h"
 #include "../riscv.h"
 #include "../slab.h"
+#include "../string.h"
 
 int slab_test_single_basic_alloc(void) {
   struct kmem_cache *cache = kmem_cache_create("test", 1024, 0, 0, 0);
@@ -678,9 +679,9 @@ int slab_test_single_error_handling(void) {
   }
 
   // Test object size too large
-  bad_cache = kmem_cache_create("bad", PGSIZE + 1, 0, 0, 0);
+  bad_cache = kmem_cache_create("bad", PGSIZE << SLAB_MAXORDER, 0, 0, 0);
   if (bad_cache) {
-    printf("ERROR: Cache creation should fail with object size > PGSIZE\n");
+    printf("ERROR: Cache creation should fail with object size > slab\n");
     kmem_cache_destroy(bad_cache);
   }
 
@@ -1046,6 +1047,276 @@ int slab_test_single_boundary_conditions(void) {
   return 1;
 }
 
+// Magazine behaviour: a freed object is the next one handed out on the
+// same hart, and overflowing/underflowing the magazine keeps objects
+// distinct.
+int slab_test_single_magazine(void) {
+  struct kmem_cache *cache = kmem_cache_create("mag", 96, 0, 0, 0);
+  if (!cache) {
+    printf("Failed to create cache\n");
+    return 0;
+  }
+
+  void *a = kmem_cache_alloc(cache);
+  kmem_cache_free(cache, a);
+  void *b = kmem_cache_alloc(cache);
+  if (a != b) {
+    printf("Magazine did not return the just-freed object\n");
+    return 0;
+  }
+  kmem_cache_free(cache, b);
+
+  const int N = SLAB_MAG_SIZE * 3;
+  void **objs = (void **)kalloc();
+  if (!objs) {
+    printf("Failed to allocate temp array\n");
+    return 0;
+  }
+  for (int i = 0; i < N; i++) {
+    objs[i] = kmem_cache_alloc(cache);
+    if (!objs[i]) {
+      printf("Failed to allocate object %d\n", i);
+      kfree((void *)objs);
+      return 0;
+    }
+    *(uint64 *)objs[i] = i;
+  }
+  for (int i = 0; i < N; i++) {
+    if (*(uint64 *)objs[i] != i) {
+      printf("Object %d aliased another allocation\n", i);
+      kfree((void *)objs);
+      return 0;
+    }
+  }
+  for (int i = 0; i < N; i++) kmem_cache_free(cache, objs[i]);
+  kfree((void *)objs);
+
+  kmem_cache_destroy(cache);
+  return 1;
+}
+
+// kmalloc: every size from 1 byte to a page, including the
+// page-sized fallback, gets a distinct and writable buffer.
+int slab_test_single_kmalloc(void) {
+  static const uint sizes[] = {1,   16,  17,   100,  512,
+                               513, 2048, 2049, PGSIZE};
+  const int N = sizeof(sizes) / sizeof(sizes[0]);
+  char *bufs[sizeof(sizes) / sizeof(sizes[0])];
+
+  if (kmalloc(0) != 0 || kmalloc(PGSIZE + 1) != 0) {
+    printf("kmalloc accepted a bad size\n");
+    return 0;
+  }
+
+  for (int i = 0; i < N; i++) {
+    bufs[i] = kmalloc(sizes[i]);
+    if (!bufs[i]) {
+      printf("kmalloc(%d) failed\n", sizes[i]);
+      return 0;
+    }
+    for (uint j = 0; j < sizes[i]; j++) bufs[i][j] = (char)i;
+  }
+  for (int i = 0; i < N; i++) {
+    for (uint j = 0; j < sizes[i]; j++) {
+      if (bufs[i][j] != (char)i) {
+        printf("kmalloc(%d) buffer overlaps another\n", sizes[i]);
+        return 0;
+      }
+    }
+  }
+  for (int i = 0; i < N; i++) kfree_sized(bufs[i], sizes[i]);
+  return 1;
+}
+
+// Objects larger than a page live in multi-page slabs.
+int slab_test_single_multipage(void) {
+  const uint SIZE = 2 * PGSIZE;
+  const int N = 16;
+  void *objs[16];
+
+  struct kmem_cache *cache = kmem_cache_create("multipage", SIZE, 0, 0, 0);
+  if (!cache) {
+    printf("Failed to create multi-page cache\n");
+    return 0;
+  }
+
+  for (int i = 0; i < N; i++) {
+    objs[i] = kmem_cache_alloc(cache);
+    if (!objs[i]) {
+      printf("Failed to allocate multi-page object %d\n", i);
+      return 0;
+    }
+    for (uint j = 0; j < SIZE / sizeof(uint64); j++)
+      ((uint64 *)objs[i])[j] = ((uint64)i << 32) | j;
+  }
+
+  for (int i = 0; i < N; i++) {
+    for (uint j = 0; j < SIZE / sizeof(uint64); j++) {
+      if (((uint64 *)objs[i])[j] != (((uint64)i << 32) | j)) {
+        printf("Multi-page object %d corrupted at word %d\n", i, j);
+        return 0;
+      }
+    }
+  }
+
+  // free in an interleaved order to move slabs between all lists
+  for (int i = 0; i < N; i += 2) kmem_cache_free(cache, objs[i]);
+  for (int i = 1; i < N; i += 2) kmem_cache_free(cache, objs[i]);
+
+  kmem_cache_destroy(cache);
+  return 1;
+}
+
+// Shrinker: empty slabs beyond the cache's minimum go back to the
+// page allocator, and a second shrink has nothing left to free.
+int slab_test_single_shrink(void) {
+  const int N = 128;
+  struct kmem_cache *cache = kmem_cache_create("shrink", 1024, 0, 0, 0);
+  if (!cache) {
+    printf("Failed to create cache\n");
+    return 0;
+  }
+  kmem_cache_set_min_empty(cache, 1);
+
+  void **objs = (void **)kalloc();
+  if (!objs) {
+    printf("Failed to allocate temp array\n");
+    return 0;
+  }
+  for (int i = 0; i < N; i++) {
+    objs[i] = kmem_cache_alloc(cache);
+    if (!objs[i]) {
+      printf("Failed to allocate object %d\n", i);
+      kfree((void *)objs);
+      return 0;
+    }
+  }
+  for (int i = 0; i < N; i++) kmem_cache_free(cache, objs[i]);
+  kfree((void *)objs);
+
+  if (kmem_cache_shrink(cache) == 0) {
+    printf("Shrink released no slabs\n");
+    return 0;
+  }
+  if (kmem_cache_shrink(cache) != 0) {
+    printf("Second shrink released slabs below the minimum\n");
+    return 0;
+  }
+  if (!cache->empty) {
+    printf("Shrink did not keep the minimum empty slab\n");
+    return 0;
+  }
+
+  kmem_cache_destroy(cache);
+  return 1;
+}
+
+// Successive slabs start their objects at different colors,
+// SLAB_HWCACHE_ALIGN puts objects on lines, and big objects get
+// the whole slab, with the header kept elsewhere.
+int slab_test_single_coloring(void) {
+  const int N = 60;
+  void *objs[60];
+  uint64 seen = 0;
+
+  struct kmem_cache *cache = kmem_cache_create("color", 256, 0, 0, 8);
+  if (!cache || cache->ncolor < 2 || cache->offset % SLAB_CACHELINE) {
+    printf("Colored cache has no colors or a shared header line\n");
+    return 0;
+  }
+  for (int i = 0; i < N; i++) {
+    if ((objs[i] = kmem_cache_alloc(cache)) == 0) {
+      printf("Failed to allocate colored object %d\n", i);
+      return 0;
+    }
+    seen |= 1UL << ((uint64)objs[i] % PGSIZE % 256 / SLAB_CACHELINE);
+  }
+  for (int i = 0; i < N; i++) kmem_cache_free(cache, objs[i]);
+  kmem_cache_destroy(cache);
+  if ((seen & (seen - 1)) == 0) {
+    printf("All slabs used the same color\n");
+    return 0;
+  }
+
+  // a 100-byte object gets two lines, a 20-byte one half a line
+  uint sizes[] = {100, 20};
+  uint objsizes[] = {128, 32};
+  uint aligns[] = {SLAB_CACHELINE, 32};
+  for (int i = 0; i < 2; i++) {
+    cache = kmem_cache_create("hwalign", sizes[i], 0, 0, SLAB_HWCACHE_ALIGN);
+    void *o = cache ? kmem_cache_alloc(cache) : 0;
+    if (!o || cache->objsize != objsizes[i] || (uint64)o % aligns[i]) {
+      printf("SLAB_HWCACHE_ALIGN put a %d-byte object at %p\n", sizes[i], o);
+      return 0;
+    }
+    kmem_cache_free(cache, o);
+    kmem_cache_destroy(cache);
+  }
+
+  cache = kmem_cache_create("offslab", 1024, 0, 0, 0);
+  if (!cache || !cache->offslab || cache->nr_objs != PGSIZE / 1024) {
+    printf("1024-byte objects do not fill an off-slab slab\n");
+    return 0;
+  }
+  for (int i = 0; i < 8; i++) {
+    objs[i] = kmem_cache_alloc(cache);
+    if (!objs[i]) {
+      printf("Failed to allocate off-slab object %d\n", i);
+      return 0;
+    }
+    memset(objs[i], i, 1024);
+  }
+  for (int i = 0; i < 8; i++) kmem_cache_free(cache, objs[i]);
+  kmem_cache_destroy(cache);
+  return 1;
+}
+
+static int bulk_ctors;
+static void bulk_ctor(void *obj) {
+  bulk_ctors++;
+  *(uint64 *)obj = 0;
+}
+
+// Bulk allocation spans slabs and runs the constructor for each
+// object; bulk free takes objects in any order.
+int slab_test_single_bulk(void) {
+  const int N = 100;
+  void **objs = (void **)kalloc();
+
+  struct kmem_cache *cache = kmem_cache_create("bulk", 128, bulk_ctor, 0, 8);
+  if (!cache || !objs) {
+    printf("Failed to create cache\n");
+    return 0;
+  }
+  if (kmem_cache_alloc_bulk(cache, 0, objs) != 0) {
+    printf("Bulk allocation of nothing returned objects\n");
+    return 0;
+  }
+  for (int round = 0; round < 3; round++) {
+    bulk_ctors = 0;
+    if (kmem_cache_alloc_bulk(cache, N, objs) != N || bulk_ctors != N) {
+      printf("Bulk allocation came up short\n");
+      return 0;
+    }
+    for (int i = 0; i < N; i++) *(uint64 *)objs[i] = i + 1;
+    for (int i = 0; i < N; i++) {
+      if (*(uint64 *)objs[i] != i + 1) {
+        printf("Bulk object %d handed out twice\n", i);
+        return 0;
+      }
+    }
+    // free the odd half, then the rest
+    void *odd[50];
+    for (int i = 0; i < N / 2; i++) odd[i] = objs[2 * i + 1];
+    for (int i = 0; i < N / 2; i++) objs[i] = objs[2 * i];
+    kmem_cache_free_bulk(cache, N / 2, odd);
+    kmem_cache_free_bulk(cache, N / 2, objs);
+  }
+  kmem_cache_destroy(cache);
+  kfree((void *)objs);
+  return 1;
+}
+
 int (*slab_single_core_test[])(void) = {
     slab_test_single_basic_alloc,
     slab_test_single_batch_alloc,
@@ -1066,6 +1337,12 @@ int (*slab_single_core_test[])(void) = {
     slab_test_single_corruption_detection,
     slab_test_single_fragmentation,
     slab_test_single_boundary_conditions,
+    slab_test_single_magazine,
+    slab_test_single_kmalloc,
+    slab_test_single_multipage,
+    slab_test_single_shrink,
+    slab_test_single_coloring,
+    slab_test_single_bulk,
 };
 
 const int slab_single_core_test_num =
@@ -23,3 +23,9 @@ int slab_test_single_extreme_alloc(void);
 int slab_test_single_corruption_detection(void);
 int slab_test_single_fragmentation(void);
 int slab_test_single_boundary_conditions(void);
+int slab_test_single_magazine(void);
+int slab_test_single_kmalloc(void);
+int slab_test_single_multipage(void);
+int slab_test_single_shrink(void);
+int slab_test_single_coloring(void);
+int slab_test_single_bulk(void);
@@ -0,0 +1,140 @@
+//
+// high-resolution sleeps: each hart keeps a min-heap of the
+// deadlines of threads sleeping in timersleep(), and settimer()
+// programs stimecmp for the earliest one. The timer interrupt
+// then wakes exactly the threads whose deadlines have passed.
+//
+
+#include "timer.h"
+
+#include "param.h"
+#include "proc.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "trap.h"
+#include "types.h"
+
+static struct timerheap {
+  struct spinlock lock;
+  struct timer *t[NTIMER];
+  int n;
+  uint64 first;  // t[0]->when, or ~0; read without the lock
+} heaps[NCPU];
+
+void timerinit(void) {
+  for (int i = 0; i < NCPU; i++) {
+    initlock(&heaps[i].lock, "timer");
+    heaps[i].first = ~0UL;
+  }
+}
+
+static void put(struct timerheap *h, int i, struct timer *t) {
+  h->t[i] = t;
+  t->idx = i;
+}
+
+// Move the timer at i up or down until the heap is in order.
+static void fix(struct timerheap *h, int i) {
+  struct timer *t = h->t[i];
+
+  for (int up; i > 0 && h->t[up = (i - 1) / 2]->when > t->when; i = up)
+    put(h, i, h->t[up]);
+  for (int c; (c = 2 * i + 1) < h->n; i = c) {
+    if (c + 1 < h->n && h->t[c + 1]->when < h->t[c]->when) c++;
+    if (h->t[c]->when >= t->when) break;
+    put(h, i, h->t[c]);
+  }
+  put(h, i, t);
+}
+
+// Caller must hold h->lock.
+static void removetimer(struct timerheap *h, struct timer *t) {
+  struct timer *last = h->t[--h->n];
+
+  if (last != t) {
+    put(h, t->idx, last);
+    fix(h, last->idx);
+  }
+  h->first = h->n ? h->t[0]->when : ~0UL;
+}
+
+// All heaps are full: sleep a tick at a time.
+static int ticksleep(uint64 when) {
+  acquire(&tickslock);
+  while (r_time() < when) {
+    if (killed(myproc())) {
+      release(&tickslock);
+      return -1;
+    }
+    tickwakeat((when + TICKCYCLES - 1) / TICKCYCLES);
+    sleep(&ticks, &tickslock);
+    tickupdate();
+  }
+  release(&tickslock);
+  return 0;
+}
+
+// Sleep until the time CSR reaches when. Returns 0, or -1 if
+// the caller was killed first.
+int timersleep(uint64 when) {
+  struct timerheap *h = 0;
+  struct timer t;
+  int id;
+
+  if (r_time() >= when) return 0;
+  push_off();
+  id = cpuid();
+  pop_off();
+  for (int i = 0; i < NCPU && h == 0; i++) {
+    h = &heaps[(id + i) % NCPU];
+    acquire(&h->lock);
+    if (h->n == NTIMER) {
+      release(&h->lock);
+      h = 0;
+    }
+  }
+  if (h == 0) return ticksleep(when);
+
+  t.when = when;
+  t.hart = h - heaps;
+  t.fired = 0;
+  put(h, h->n++, &t);
+  fix(h, t.idx);
+  if (h->t[0] == &t) {
+    h->first = when;
+    // this hart reprograms its timer when we sleep; another
+    // must be told.
+    if (t.hart != cpuid()) ipi(t.hart);
+  }
+  while (!t.fired) {
+    if (killed(myproc())) {
+      removetimer(h, &t);
+      release(&h->lock);
+      return -1;
+    }
+    sleep(&t, &h->lock);
+  }
+  release(&h->lock);
+  return 0;
+}
+
+// The earliest deadline on this hart's heap, for settimer().
+// Interrupts must be off.
+uint64 timernext(void) { return heaps[cpuid()].first; }
+
+// From the timer interrupt: wake the sleepers on this hart's
+// heap whose deadlines have passed.
+void timerexpire(void) {
+  struct timerheap *h = &heaps[cpuid()];
+  uint64 now = r_time();
+
+  if (h->first > now) return;  // racy peek, rechecked below
+  acquire(&h->lock);
+  while (h->n > 0 && h->t[0]->when <= now) {
+    struct timer *t = h->t[0];
+    removetimer(h, t);
+    t->fired = 1;
+    wakeup(t);
+  }
+  release(&h->lock);
+}
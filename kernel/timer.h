@@ -0,0 +1,16 @@
+#pragma once
+
+#include "types.h"
+
+// A sleeping thread's deadline, on its stack while it sleeps.
+struct timer {
+  uint64 when;  // time CSR value to wake at
+  int hart;     // whose heap it is on
+  int idx;      // where in that heap
+  int fired;
+};
+
+void timerinit(void);
+int timersleep(uint64);
+uint64 timernext(void);
+void timerexpire(void);
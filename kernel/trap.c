@@ -1,19 +1,35 @@
 #include "trap.h"
 
+#include "hpm.h"
+#include "klog.h"
 #include "memlayout.h"
+#include "param.h"
 #include "plic.h"
 #include "printf.h"
 #include "proc.h"
+#include "prof.h"
+#include "rcu.h"
 #include "riscv.h"
 #include "spinlock.h"
 #include "syscall.h"
+#include "timer.h"
 #include "types.h"
 #include "uart.h"
 #include "virtio_disk.h"
 #include "vm.h"
 
+// A tick is TICKCYCLES cycles of the time CSR, about a tenth of
+// a second. Timers are not periodic: each hart programs stimecmp
+// for its next event, which is the end of the current tick if
+// another process is waiting for this hart, or else the earliest
+// deadline of a sleeper on its heap (see timer.c) or in poll(),
+// or else nothing at all. ticks is brought up to date from the
+// time CSR whenever someone looks at it, and user mode reads the
+// CSR itself for ugetuptime().
+
 struct spinlock tickslock;
 uint ticks;
+static uint wakeat;  // earliest poll() deadline, or 0
 
 extern char trampoline[], uservec[];
 
@@ -22,10 +38,27 @@ void kernelvec();
 
 extern int devintr();
 
-void trapinit(void) { initlock(&tickslock, "time"); }
+void trapinit(void) { initmcslock(&tickslock, "time"); }
 
 // set up to take exceptions and traps while in the kernel.
-void trapinithart(void) { w_stvec((uint64)kernelvec); }
+void trapinithart(void) {
+  w_stvec((uint64)kernelvec);
+  // for clock_gettime() and ugetuptime() in user space.
+  w_scounteren(r_scounteren() | SCOUNTEREN_TM);
+}
+
+// Handle a page fault from user space, serialized with faults
+// and mapping changes by p's other threads.
+static uint64 userfault(struct proc *p) {
+  // read the CSRs first: lockvm() may sleep.
+  uint64 va = r_stval();
+  int write = r_scause() == 15;
+  int locked = lockvm();
+  uint64 pa = vmfault(p->pagetable, va, write);
+  unlockvm(locked);
+  p->ru.nfault++;
+  return pa;
+}
 
 //
 // handle an interrupt, exception, or system call from user space.
@@ -41,8 +74,16 @@ uint64 usertrap(void) {
   // since we're now in the kernel.
   w_stvec((uint64)kernelvec);  // DOC: kernelvec
 
+  // this hart may run RCU readers again.
+  rcu_setquiet(0);
+
   struct proc *p = myproc();
 
+  // charge the time since prepare_return() to user mode.
+  uint64 now = r_time();
+  p->ru.utime += now - p->stamp;
+  p->stamp = now;
+
   // save user program counter.
   p->trapframe->epc = r_sepc();
 
@@ -62,30 +103,55 @@ uint64 usertrap(void) {
     syscall();
   } else if ((which_dev = devintr()) != 0) {
     // ok
-  } else if ((r_scause() == 15 || r_scause() == 13) &&
-             vmfault(p->pagetable, r_stval(), (r_scause() == 13) ? 1 : 0) !=
-                 0) {
-    // page fault on lazily-allocated page
+  } else if ((r_scause() == 15 || r_scause() == 13 || r_scause() == 12) &&
+             userfault(p) != 0) {
+    // page fault on lazily-allocated, demand-paged or
+    // copy-on-write page
   } else {
     printf("usertrap(): unexpected scause 0x%lx pid=%d\n", r_scause(), p->pid);
     printf("            sepc=0x%lx stval=0x%lx\n", r_sepc(), r_stval());
     setkilled(p);
   }
 
+  if (which_dev == 2 && profperiod())
+    profsample(1, p->trapframe->epc, p->trapframe->s0);
+
   if (killed(p)) kexit(-1);
 
-  // give up the CPU if this is a timer interrupt.
-  if (which_dev == 2) yield();
+  // on a timer interrupt, give up the CPU if p's quantum is over.
+  if (which_dev == 2) clockyield();
 
   prepare_return();
 
   // the user page table to switch to, for trampoline.S
-  uint64 satp = MAKE_SATP(p->pagetable);
+  uint64 satp = MAKE_SATP(p->pagetable) | SATP_ASID(p->leader->asid);
 
   // return to trampoline.S; satp value in a0.
   return satp;
 }
 
+// Add what p used since it last got here to its group's totals
+// on the usyscall page, for ugetrusage(). The page's seq is odd
+// while it changes; if another thread holds it, p publishes on
+// a later return.
+static void publishru(struct proc *p) {
+  struct usyscall *u = p->leader->usyscall;
+  uint seq = u->seq;
+
+  if ((seq & 1) || !__sync_bool_compare_and_swap(&u->seq, seq, seq + 1))
+    return;
+  u->ru.utime += p->ru.utime - p->rupub.utime;
+  u->ru.stime += p->ru.stime - p->rupub.stime;
+  u->ru.wtime += p->ru.wtime - p->rupub.wtime;
+  u->ru.nvcsw += p->ru.nvcsw - p->rupub.nvcsw;
+  u->ru.nivcsw += p->ru.nivcsw - p->rupub.nivcsw;
+  u->ru.nfault += p->ru.nfault - p->rupub.nfault;
+  u->ru.nsyscall += p->ru.nsyscall - p->rupub.nsyscall;
+  p->rupub = p->ru;
+  __sync_synchronize();
+  u->seq = seq + 2;
+}
+
 //
 // set up trapframe and control registers for a return to user space
 //
@@ -108,6 +174,26 @@ void prepare_return(void) {
   p->trapframe->kernel_trap = (uint64)usertrap;
   p->trapframe->kernel_hartid = r_tp();  // hartid for cpuid()
 
+  // where trampoline.S finds the trapframe in user space.
+  w_sscratch(p->trapframeva);
+
+  // from here on, p's time is user time.
+  uint64 now = r_time();
+  p->ru.stime += now - p->stamp;
+  p->stamp = now;
+  publishru(p);
+
+  // user mode is quiescent for RCU.
+  rcu_quiescent();
+  rcu_setquiet(1);
+
+  // drop TLB entries left from before p's page table last changed.
+  struct proc *g = p->leader;
+  if (g->tlbstale & (1UL << cpuid())) {
+    sfence_vma_asid(g->asid);
+    __sync_fetch_and_and(&g->tlbstale, ~(1UL << cpuid()));
+  }
+
   // set up the registers that trampoline.S's sret will use
   // to get to user space.
 
@@ -140,8 +226,13 @@ void kerneltrap() {
     panic("kerneltrap");
   }
 
-  // give up the CPU if this is a timer interrupt.
-  if (which_dev == 2 && myproc() != 0) yield();
+  // kernelvec left the interrupted code's s0 alone, so this
+  // function saved it as its caller's frame pointer.
+  if (which_dev == 2 && profperiod())
+    profsample(0, sepc, ((uint64 *)r_fp())[-2]);
+
+  // on a timer interrupt, give up the CPU if the quantum is over.
+  if (which_dev == 2 && myproc() != 0) clockyield();
 
   // the yield() may have caused some traps to occur,
   // so restore trap registers for use by kernelvec.S's sepc instruction.
@@ -149,18 +240,86 @@ void kerneltrap() {
   w_sstatus(sstatus);
 }
 
-void clockintr() {
-  if (cpuid() == 0) {
-    acquire(&tickslock);
-    ticks++;
+// Bring ticks up to date, wake sleepers in poll() whose
+// deadline has passed, and boost the scheduler every BOOSTTICKS
+// ticks. Caller must hold tickslock.
+void tickupdate(void) {
+  uint now = r_time() / TICKCYCLES;
+
+  if (now == ticks) return;
+  if (now / BOOSTTICKS != ticks / BOOSTTICKS) mlfqboost();
+  ticks = now;
+  if (wakeat != 0 && (int)(ticks - wakeat) >= 0) {
+    wakeat = 0;
     wakeup(&ticks);
-    release(&tickslock);
   }
+}
+
+// Note that a process in poll() wants to run again at tick t.
+// The scheduler programs the timer for it once the process
+// sleeps. Caller must hold tickslock.
+void tickwakeat(uint t) {
+  if (wakeat == 0 || (int)(t - wakeat) < 0) wakeat = t;
+}
+
+// Program this hart's next timer interrupt: the next tick if
+// tick is set or klogd needs a kick, the next profiler sample if
+// it is on, and no later than the earliest sleeper's deadline.
+// Writing stimecmp also clears a pending timer interrupt.
+void settimer(int tick) {
+  uint64 next = tick || klogwaiting() ? r_time() + TICKCYCLES : ~0UL;
+  uint64 period = profperiod();
+  uint w = wakeat;  // racy read; a stale deadline only wakes us early
+
+  if (period && r_time() + period < next) next = r_time() + period;
+  if (timernext() < next) next = timernext();
+  if (w != 0 && (uint64)w * TICKCYCLES < next) next = (uint64)w * TICKCYCLES;
+  w_stimecmp(next);
+}
+
+// Interrupt hart, so that it reprograms its timer or leaves wfi.
+void ipi(int hart) { *(volatile uint32 *)CLINT_MSIP(hart) = 1; }
+
+// Harts that tlbshootdown() has asked to flush their TLBs.
+static volatile int tlbflushreq[NCPU];
+
+// Flush this hart's TLB if another hart has asked it to.
+void tlbflushpoll(void) {
+  push_off();
+  int id = cpuid();
+  if (tlbflushreq[id]) {
+    sfence_vma();
+    __sync_synchronize();
+    tlbflushreq[id] = 0;
+  }
+  pop_off();
+}
+
+// Flush the TLBs of the harts in the mask harts, and wait until
+// they have, answering any requests made of this hart meanwhile.
+// The caller must not hold a spinlock that a target may be
+// spinning on with interrupts off.
+void tlbshootdown(uint64 harts) {
+  for (int h = 0; h < NCPU; h++) {
+    if (harts & (1UL << h)) {
+      tlbflushreq[h] = 1;
+      __sync_synchronize();
+      ipi(h);
+    }
+  }
+  for (int h = 0; h < NCPU; h++)
+    while ((harts & (1UL << h)) && tlbflushreq[h]) tlbflushpoll();
+}
 
-  // ask for the next timer interrupt. this also clears
-  // the interrupt request. 1000000 is about a tenth
-  // of a second.
-  w_stimecmp(r_time() + 1000000);
+void clockintr() {
+  acquire(&tickslock);
+  tickupdate();
+  release(&tickslock);
+  timerexpire();
+  klogkick();
+
+  // ask for the next timer interrupt.
+  settimer(runq_needtick());
 }
 
 // check if it's an external interrupt or software interrupt,
@@ -195,6 +354,15 @@ int devintr() {
     // timer interrupt.
     clockintr();
     return 2;
+  } else if (scause == 0x8000000000000001L) {
+    // software interrupt from another hart's ipi(), forwarded
+    // by mipivec in kernelvec.S: this hart's run queue changed,
+    // its TLB must be flushed, or its counters reprogrammed.
+    w_sip(r_sip() & ~2);
+    tlbflushpoll();
+    hpmsync();
+    settimer(runq_needtick());
+    return 1;
   } else {
     return 0;
   }
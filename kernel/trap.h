@@ -9,3 +9,9 @@ void trapinit(void);
 void trapinithart(void);
 void prepare_return(void);
 int devintr(void);
+void tickupdate(void);
+void tickwakeat(unsigned int);
+void settimer(int);
+void ipi(int);
+void tlbflushpoll(void);
+void tlbshootdown(uint64);
@@ -8,6 +8,8 @@
 #include "memlayout.h"
 #include "proc.h"
 #include "spinlock.h"
+#include "string.h"
+#include "types.h"
 
 // the UART control registers are memory-mapped
 // at address UART0. this macro returns the
@@ -37,10 +39,17 @@
 #define ReadReg(reg) (*(Reg(reg)))
 #define WriteReg(reg, v) (*(Reg(reg)) = (v))
 
-// for transmission.
+#define FIFOSIZE 16  // bytes the transmit FIFO holds
+
+// for transmission. uartwrite() puts bytes in tx_buf and
+// returns, unless it is full; uartstart() moves them to the
+// UART's FIFO whenever it empties.
+#define TX_BUF_SIZE 1024
 static struct spinlock tx_lock;
-static int tx_busy;  // is the UART busy sending?
-static int tx_chan;  // &tx_chan is the "wait channel"
+static char tx_buf[TX_BUF_SIZE];
+static uint64 tx_w;  // write next to tx_buf[tx_w % TX_BUF_SIZE]
+static uint64 tx_r;  // read next from tx_buf[tx_r % TX_BUF_SIZE]
+static int tx_wait;  // writers sleeping on &tx_r for room
 
 extern volatile int panicking;  // from printf.c
 extern volatile int panicked;   // from printf.c
@@ -71,24 +80,42 @@ void uartinit(void) {
   initlock(&tx_lock, "uart");
 }
 
-// transmit buf[] to the uart. it blocks if the
-// uart is busy, so it cannot be called from
-// interrupts, only from write() system calls.
+// If the UART's transmit FIFO is empty, fill it from tx_buf.
+// The transmit interrupt, when it has sent them, calls again.
+// Caller must hold tx_lock.
+static void uartstart(void) {
+  if (tx_r == tx_w || (ReadReg(LSR) & LSR_TX_IDLE) == 0) return;
+  for (int i = 0; i < FIFOSIZE && tx_r != tx_w; i++)
+    WriteReg(THR, tx_buf[tx_r++ % TX_BUF_SIZE]);
+  if (tx_wait) wakeup(&tx_r);
+}
+
+// transmit buf[] to the uart. it returns once
+// buf[] is in tx_buf, and only blocks while tx_buf
+// is full, so it cannot be called from interrupts,
+// only from write() system calls.
 void uartwrite(char buf[], int n) {
   acquire(&tx_lock);
 
   int i = 0;
   while (i < n) {
-    while (tx_busy != 0) {
-      // wait for a UART transmit-complete interrupt
-      // to set tx_busy to 0.
-      sleep(&tx_chan, &tx_lock);
+    if (tx_w == tx_r + TX_BUF_SIZE) {
+      uartstart();
+      tx_wait++;
+      sleep(&tx_r, &tx_lock);
+      tx_wait--;
+      continue;
     }
-
-    WriteReg(THR, buf[i]);
-    i += 1;
-    tx_busy = 1;
+    // copy a run that stops at the end of tx_buf.
+    int m = n - i;
+    if (m > tx_r + TX_BUF_SIZE - tx_w) m = tx_r + TX_BUF_SIZE - tx_w;
+    if (m > TX_BUF_SIZE - tx_w % TX_BUF_SIZE)
+      m = TX_BUF_SIZE - tx_w % TX_BUF_SIZE;
+    memmove(&tx_buf[tx_w % TX_BUF_SIZE], buf + i, m);
+    tx_w += m;
+    i += m;
   }
+  uartstart();
 
   release(&tx_lock);
 }
@@ -129,11 +156,7 @@ void uartintr(void) {
   ReadReg(ISR);  // acknowledge the interrupt
 
   acquire(&tx_lock);
-  if (ReadReg(LSR) & LSR_TX_IDLE) {
-    // UART finished transmitting; wake up sending thread.
-    tx_busy = 0;
-    wakeup(&tx_chan);
-  }
+  uartstart();  // the UART may have finished sending
   release(&tx_lock);
 
   // read and process incoming characters.
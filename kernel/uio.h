@@ -0,0 +1,11 @@
+#pragma once
+
+#include "types.h"
+
+#define IOV_MAX 16  // buffers one readv() or writev() takes
+
+// One buffer of a readv() or writev().
+struct iovec {
+  void *iov_base;
+  uint64 iov_len;
+};
@@ -9,6 +9,9 @@
 // https://docs.oasis-open.org/virtio/virtio/v1.1/virtio-v1.1.pdf
 //
 
+#include "param.h"
+#include "types.h"
+
 // virtio mmio control registers, mapped starting at 0x10001000.
 // from qemu virtio_mmio.h
 #define VIRTIO_MMIO_MAGIC_VALUE 0x000  // 0x74726976
@@ -34,6 +37,10 @@
 #define VIRTIO_MMIO_DEVICE_DESC_LOW \
   0x0a0  // physical address for used ring, write-only
 #define VIRTIO_MMIO_DEVICE_DESC_HIGH 0x0a4
+#define VIRTIO_MMIO_CONFIG 0x100  // device-specific configuration
+
+// struct virtio_blk_config's num_queues, valid with VIRTIO_BLK_F_MQ.
+#define VIRTIO_BLK_CONFIG_NUMQ (VIRTIO_MMIO_CONFIG + 34)
 
 // status register bits, from qemu virtio_config.h
 #define VIRTIO_CONFIG_S_ACKNOWLEDGE 1
@@ -50,9 +57,17 @@
 #define VIRTIO_RING_F_INDIRECT_DESC 28
 #define VIRTIO_RING_F_EVENT_IDX 29
 
-// this many virtio descriptors.
-// must be a power of two.
-#define NUM 8
+// this many virtio descriptors: one per request in flight, or
+// with no indirect descriptors two more than its blocks. must be
+// a power of two, and no more than 256, the most qemu allows and
+// a page of descriptors.
+#define NUM NDISKDESC
+#if (NUM & (NUM - 1)) != 0 || NUM > 256
+#error "NDISKDESC must be a power of two, at most 256"
+#endif
+
+// most blocks in one request, each with a data descriptor.
+#define MAXSEG 16
 
 // a single descriptor, from the spec.
 struct virtq_desc {
@@ -61,15 +76,29 @@ struct virtq_desc {
   uint16 flags;
   uint16 next;
 };
-#define VRING_DESC_F_NEXT 1   // chained with another descriptor
-#define VRING_DESC_F_WRITE 2  // device writes (vs read)
+#define VRING_DESC_F_NEXT 1      // chained with another descriptor
+#define VRING_DESC_F_WRITE 2     // device writes (vs read)
+#define VRING_DESC_F_INDIRECT 4  // addr is a table of descriptors
+
+// with VIRTIO_RING_F_INDIRECT_DESC, a request is one descriptor
+// pointing to a table of this many, chained as ring ones are.
+#define NINDESC (MAXSEG + 2)
+
+#define VRING_USED_F_NO_NOTIFY 1  // device: no need to notify it
+
+// with VIRTIO_RING_F_EVENT_IDX, whether a side that last saw
+// index old and has moved it to new should signal the other,
+// which wants a signal once event is passed.
+static inline int vring_need_event(uint16 event, uint16 new, uint16 old) {
+  return (uint16)(new - event - 1) < (uint16)(new - old);
+}
 
 // the (entire) avail ring, from the spec.
 struct virtq_avail {
-  uint16 flags;      // always zero
-  uint16 idx;        // driver will write ring[idx] next
-  uint16 ring[NUM];  // descriptor numbers of chain heads
-  uint16 unused;
+  uint16 flags;       // always zero
+  uint16 idx;         // driver will write ring[idx] next
+  uint16 ring[NUM];   // descriptor numbers of chain heads
+  uint16 used_event;  // with EVENT_IDX: interrupt once used idx passes it
 };
 
 // one entry in the "used" ring, with which the
@@ -83,6 +112,7 @@ struct virtq_used {
   uint16 flags;  // always zero
   uint16 idx;    // device increments when it adds a ring[] entry
   struct virtq_used_elem ring[NUM];
+  uint16 avail_event;  // with EVENT_IDX: notify once avail idx passes it
 };
 
 // these are specific to virtio block devices, e.g. disks,
@@ -10,21 +10,29 @@
 
 #include "bio.h"
 #include "buf.h"
+#include "diskstat.h"
 #include "fs.h"
 #include "kalloc.h"
 #include "memlayout.h"
 #include "printf.h"
 #include "proc.h"
 #include "riscv.h"
+#include "rusage.h"
 #include "spinlock.h"
 #include "string.h"
 #include "types.h"
 #include "virtio.h"
+#include "vm.h"
 
 // the address of virtio mmio register r.
 #define R(r) ((volatile uint32 *)(VIRTIO0 + (r)))
 
-static struct disk {
+// one virtqueue. with VIRTIO_BLK_F_MQ there is one per hart,
+// or per group of harts, each with its own lock, so that harts
+// doing I/O at once need not share a lock or a ring.
+struct vq {
+  struct spinlock lock;
+
   // a set (not a ring) of DMA descriptors, with which the
   // driver tells the device where to read and write individual
   // disk operations. there are NUM descriptors.
@@ -46,6 +54,11 @@ static struct disk {
   // our own book-keeping.
   char free[NUM];   // is a descriptor free?
   uint16 used_idx;  // we've looked this far in used[2..NUM].
+  uint16 kicked;    // avail->idx when the device was last notified
+
+  // with indirect descriptors, the table of NINDESC descriptors
+  // each ring descriptor may point to.
+  struct virtq_desc *itab[NUM];
 
   // track info about in-flight operations,
   // for use when completion interrupt arrives.
@@ -53,21 +66,92 @@ static struct disk {
   struct {
     struct buf *b;
     char status;
+    char done;     // a request with no buf has finished
+    uint64 start;  // r_time() when it was started
   } info[NUM];
 
+  // buffers waiting for descriptors, sorted by block.
+  struct buf *queue;
+  int nqueue;  // buffers in queue
+  uint next;   // block after the last request dispatch() started
+
   // disk command headers.
   // one-for-one with descriptors, for convenience.
   struct virtio_blk_req ops[NUM];
 
-  struct spinlock vdisk_lock;
+  struct diskstat stat;  // this queue's counts
+};
 
+static struct disk {
+  struct vq q[NDISKQ];
+  int nq;         // queues in use
+  char indirect;  // negotiated VIRTIO_RING_F_INDIRECT_DESC
+  char eventidx;  // negotiated VIRTIO_RING_F_EVENT_IDX
+
+  // virtio_disk_rw() spins this long for its request before it
+  // sleeps; see vpoll().
+  uint64 pollcycles;
+  int pollus;
 } disk;
 
+// Set up queue i.
+static void vqinit(int i) {
+  struct vq *q = &disk.q[i];
+
+  initlock(&q->lock, "virtio_disk");
+
+  // initialize queue i.
+  *R(VIRTIO_MMIO_QUEUE_SEL) = i;
+
+  // ensure queue i is not in use.
+  if (*R(VIRTIO_MMIO_QUEUE_READY)) panic("virtio disk should not be ready");
+
+  // check maximum queue size.
+  uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
+  if (max == 0) panic("virtio disk has no queue");
+  if (max < NUM) panic("virtio disk max queue too short");
+
+  // allocate and zero queue memory.
+  q->desc = kalloc();
+  q->avail = kalloc();
+  q->used = kalloc();
+  if (!q->desc || !q->avail || !q->used) panic("virtio disk kalloc");
+  memset(q->desc, 0, PGSIZE);
+  memset(q->avail, 0, PGSIZE);
+  memset(q->used, 0, PGSIZE);
+
+  // set queue size.
+  *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
+
+  // write physical addresses.
+  *R(VIRTIO_MMIO_QUEUE_DESC_LOW) = (uint64)q->desc;
+  *R(VIRTIO_MMIO_QUEUE_DESC_HIGH) = (uint64)q->desc >> 32;
+  *R(VIRTIO_MMIO_DRIVER_DESC_LOW) = (uint64)q->avail;
+  *R(VIRTIO_MMIO_DRIVER_DESC_HIGH) = (uint64)q->avail >> 32;
+  *R(VIRTIO_MMIO_DEVICE_DESC_LOW) = (uint64)q->used;
+  *R(VIRTIO_MMIO_DEVICE_DESC_HIGH) = (uint64)q->used >> 32;
+
+  // queue is ready.
+  *R(VIRTIO_MMIO_QUEUE_READY) = 0x1;
+
+  // all NUM descriptors start out unused.
+  for (int i = 0; i < NUM; i++) q->free[i] = 1;
+
+  // carve the indirect tables out of pages.
+  char *pg = 0;
+  for (int i = 0, left = 0; disk.indirect && i < NUM; i++, left--) {
+    if (left == 0) {
+      if ((pg = kalloc()) == 0) panic("virtio disk kalloc");
+      left = PGSIZE / (NINDESC * sizeof(struct virtq_desc));
+    }
+    q->itab[i] = (struct virtq_desc *)pg;
+    pg += NINDESC * sizeof(struct virtq_desc);
+  }
+}
+
 void virtio_disk_init(void) {
   uint32 status = 0;
 
-  initlock(&disk.vdisk_lock, "virtio_disk");
-
   if (*R(VIRTIO_MMIO_MAGIC_VALUE) != 0x74726976 ||
       *R(VIRTIO_MMIO_VERSION) != 2 || *R(VIRTIO_MMIO_DEVICE_ID) != 2 ||
       *R(VIRTIO_MMIO_VENDOR_ID) != 0x554d4551) {
@@ -90,11 +174,10 @@ void virtio_disk_init(void) {
   features &= ~(1 << VIRTIO_BLK_F_RO);
   features &= ~(1 << VIRTIO_BLK_F_SCSI);
   features &= ~(1 << VIRTIO_BLK_F_CONFIG_WCE);
-  features &= ~(1 << VIRTIO_BLK_F_MQ);
   features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
-  features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
-  features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
   *R(VIRTIO_MMIO_DRIVER_FEATURES) = features;
+  disk.indirect = (features >> VIRTIO_RING_F_INDIRECT_DESC) & 1;
+  disk.eventidx = (features >> VIRTIO_RING_F_EVENT_IDX) & 1;
 
   // tell device that feature negotiation is complete.
   status |= VIRTIO_CONFIG_S_FEATURES_OK;
@@ -105,42 +188,16 @@ void virtio_disk_init(void) {
   if (!(status & VIRTIO_CONFIG_S_FEATURES_OK))
     panic("virtio disk FEATURES_OK unset");
 
-  // initialize queue 0.
-  *R(VIRTIO_MMIO_QUEUE_SEL) = 0;
-
-  // ensure queue 0 is not in use.
-  if (*R(VIRTIO_MMIO_QUEUE_READY)) panic("virtio disk should not be ready");
-
-  // check maximum queue size.
-  uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
-  if (max == 0) panic("virtio disk has no queue 0");
-  if (max < NUM) panic("virtio disk max queue too short");
+  // one queue per hart, as far as the device and NDISKQ allow.
+  disk.nq = 1;
+  if (features & (1 << VIRTIO_BLK_F_MQ))
+    disk.nq = *(volatile uint16 *)(VIRTIO0 + VIRTIO_BLK_CONFIG_NUMQ);
+  if (disk.nq > NDISKQ) disk.nq = NDISKQ;
+  if (disk.nq < 1) panic("virtio disk has no queues");
+  for (int i = 0; i < disk.nq; i++) vqinit(i);
 
-  // allocate and zero queue memory.
-  disk.desc = kalloc();
-  disk.avail = kalloc();
-  disk.used = kalloc();
-  if (!disk.desc || !disk.avail || !disk.used) panic("virtio disk kalloc");
-  memset(disk.desc, 0, PGSIZE);
-  memset(disk.avail, 0, PGSIZE);
-  memset(disk.used, 0, PGSIZE);
-
-  // set queue size.
-  *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
-
-  // write physical addresses.
-  *R(VIRTIO_MMIO_QUEUE_DESC_LOW) = (uint64)disk.desc;
-  *R(VIRTIO_MMIO_QUEUE_DESC_HIGH) = (uint64)disk.desc >> 32;
-  *R(VIRTIO_MMIO_DRIVER_DESC_LOW) = (uint64)disk.avail;
-  *R(VIRTIO_MMIO_DRIVER_DESC_HIGH) = (uint64)disk.avail >> 32;
-  *R(VIRTIO_MMIO_DEVICE_DESC_LOW) = (uint64)disk.used;
-  *R(VIRTIO_MMIO_DEVICE_DESC_HIGH) = (uint64)disk.used >> 32;
-
-  // queue is ready.
-  *R(VIRTIO_MMIO_QUEUE_READY) = 0x1;
-
-  // all NUM descriptors start out unused.
-  for (int i = 0; i < NUM; i++) disk.free[i] = 1;
+  disk.pollus = DISKPOLL;
+  disk.pollcycles = DISKPOLL * (TIMEBASE / 1000000);
 
   // tell device we're completely ready.
   status |= VIRTIO_CONFIG_S_DRIVER_OK;
@@ -149,11 +206,32 @@ void virtio_disk_init(void) {
   // plic.c and trap.c arrange for interrupts from VIRTIO0_IRQ.
 }
 
+// Count in histogram h, of NLAT buckets, something that took
+// cycles.
+void iohist(uint64 *h, uint64 cycles) {
+  uint64 us = cycles / (TIMEBASE / 1000000);
+  int i = 0;
+
+  while (us > 1 && i < NLAT - 1) {
+    us >>= 1;
+    i++;
+  }
+  __atomic_fetch_add(&h[i], 1, __ATOMIC_RELAXED);
+}
+
+// The queue for this hart's requests.
+static struct vq *myq(void) {
+  push_off();
+  struct vq *q = &disk.q[cpuid() % disk.nq];
+  pop_off();
+  return q;
+}
+
 // find a free descriptor, mark it non-free, return its index.
-static int alloc_desc() {
+static int alloc_desc(struct vq *q) {
   for (int i = 0; i < NUM; i++) {
-    if (disk.free[i]) {
-      disk.free[i] = 0;
+    if (q->free[i]) {
+      q->free[i] = 0;
       return i;
     }
   }
@@ -161,23 +239,23 @@ static int alloc_desc() {
 }
 
 // mark a descriptor as free.
-static void free_desc(int i) {
+static void free_desc(struct vq *q, int i) {
   if (i >= NUM) panic("free_desc 1");
-  if (disk.free[i]) panic("free_desc 2");
-  disk.desc[i].addr = 0;
-  disk.desc[i].len = 0;
-  disk.desc[i].flags = 0;
-  disk.desc[i].next = 0;
-  disk.free[i] = 1;
-  wakeup(&disk.free[0]);
+  if (q->free[i]) panic("free_desc 2");
+  q->desc[i].addr = 0;
+  q->desc[i].len = 0;
+  q->desc[i].flags = 0;
+  q->desc[i].next = 0;
+  q->free[i] = 1;
+  wakeup(&q->free[0]);
 }
 
 // free a chain of descriptors.
-static void free_chain(int i) {
+static void free_chain(struct vq *q, int i) {
   while (1) {
-    int flag = disk.desc[i].flags;
-    int nxt = disk.desc[i].next;
-    free_desc(i);
+    int flag = q->desc[i].flags;
+    int nxt = q->desc[i].next;
+    free_desc(q, i);
     if (flag & VRING_DESC_F_NEXT)
       i = nxt;
     else
@@ -185,41 +263,63 @@ static void free_chain(int i) {
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
-static int alloc3_desc(int *idx) {
-  for (int i = 0; i < 3; i++) {
-    idx[i] = alloc_desc();
+// allocate n descriptors (they need not be contiguous).
+static int alloc_descs(struct vq *q, int *idx, int n) {
+  for (int i = 0; i < n; i++) {
+    idx[i] = alloc_desc(q);
     if (idx[i] < 0) {
-      for (int j = 0; j < i; j++) free_desc(idx[j]);
+      for (int j = 0; j < i; j++) free_desc(q, idx[j]);
       return -1;
     }
   }
   return 0;
 }
 
-void virtio_disk_rw(struct buf *b, int write) {
-  uint64 sector = b->blockno * (BSIZE / 512);
+// Start a transfer of n blocks from blockno on, to or from the
+// BSIZE bytes of memory at each of pa[0..n-1], as one request, and
+// return the index of its first descriptor; or, if nowait is set
+// and too few descriptors are free, return -1. b, if not 0, stands
+// for the whole request; otherwise vwaitpa() waits for it. The
+// device is not told until kick().
+// Caller must hold q->lock.
+static int vstartpa(struct vq *q, uint blockno, uint64 *pa, int n,
+                    int write, struct buf *b, int nowait) {
+  uint64 sector = blockno * (BSIZE / 512);
 
-  acquire(&disk.vdisk_lock);
+  if (n < 1 || n > MAXSEG) panic("vstart");
 
   // the spec's Section 5.2 says that legacy block operations use
   // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
+  // data, one for a 1-byte status result. the data may be split
+  // across several descriptors, one per block here. with indirect
+  // descriptors, they go in a table that one ring descriptor
+  // points to.
 
-  // allocate the three descriptors.
-  int idx[3];
+  // allocate the descriptors.
+  int idx[NINDESC];
   while (1) {
-    if (alloc3_desc(idx) == 0) {
+    if (alloc_descs(q, idx, disk.indirect ? 1 : n + 2) == 0) {
       break;
     }
-    sleep(&disk.free[0], &disk.vdisk_lock);
+    if (nowait) return -1;
+    sleep(&q->free[0], &q->lock);
   }
 
-  // format the three descriptors.
+  int head = idx[0];
+  struct virtq_desc *d = q->desc;
+  if (disk.indirect) {
+    d = q->itab[head];
+    for (int i = 0; i < n + 2; i++) idx[i] = i;
+    q->desc[head].addr = (uint64)d;
+    q->desc[head].len = (n + 2) * sizeof(struct virtq_desc);
+    q->desc[head].flags = VRING_DESC_F_INDIRECT;
+    q->desc[head].next = 0;
+  }
+
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
-  struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
+  struct virtio_blk_req *buf0 = &q->ops[head];
 
   if (write)
     buf0->type = VIRTIO_BLK_T_OUT;  // write the disk
@@ -228,56 +328,303 @@ void virtio_disk_rw(struct buf *b, int write) {
   buf0->reserved = 0;
   buf0->sector = sector;
 
-  disk.desc[idx[0]].addr = (uint64)buf0;
-  disk.desc[idx[0]].len = sizeof(struct virtio_blk_req);
-  disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
-  disk.desc[idx[0]].next = idx[1];
+  d[idx[0]].addr = (uint64)buf0;
+  d[idx[0]].len = sizeof(struct virtio_blk_req);
+  d[idx[0]].flags = VRING_DESC_F_NEXT;
+  d[idx[0]].next = idx[1];
 
-  disk.desc[idx[1]].addr = (uint64)b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if (write)
-    disk.desc[idx[1]].flags = 0;  // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE;  // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  for (int i = 1; i <= n; i++) {
+    d[idx[i]].addr = pa[i - 1];
+    d[idx[i]].len = BSIZE;
+    if (write)
+      d[idx[i]].flags = 0;  // device reads the memory
+    else
+      d[idx[i]].flags = VRING_DESC_F_WRITE;  // device writes it
+    d[idx[i]].flags |= VRING_DESC_F_NEXT;
+    d[idx[i]].next = idx[i + 1];
+  }
 
-  disk.info[idx[0]].status = 0xff;  // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64)&disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE;  // device writes the status
-  disk.desc[idx[2]].next = 0;
+  int st = idx[n + 1];
+  q->info[head].status = 0xff;  // device writes 0 on success
+  d[st].addr = (uint64)&q->info[head].status;
+  d[st].len = 1;
+  d[st].flags = VRING_DESC_F_WRITE;  // device writes the status
+  d[st].next = 0;
 
   // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  if (b) b->disk = 1;
+  q->info[head].b = b;
+  q->info[head].done = 0;
 
   // tell the device the first index in our chain of descriptors.
-  disk.avail->ring[disk.avail->idx % NUM] = idx[0];
+  q->avail->ring[q->avail->idx % NUM] = head;
 
   __sync_synchronize();
 
-  // tell the device another avail ring entry is available.
-  disk.avail->idx += 1;  // not % NUM ...
+  // another avail ring entry is available.
+  q->avail->idx += 1;  // not % NUM ...
+
+  q->info[head].start = r_time();
+  q->stat.nreq++;
+  if (write) {
+    q->stat.nwrite++;
+    q->stat.wblocks += n;
+  } else {
+    q->stat.rblocks += n;
+  }
+  if (++q->stat.inflight > q->stat.maxinflight)
+    q->stat.maxinflight = q->stat.inflight;
+
+  return head;
+}
+
+// Tell the device about the requests vstartpa() has added since
+// the last time, unless it has said it will see them anyway.
+// Caller must hold q->lock.
+static void kick(struct vq *q) {
+  uint16 old = q->kicked, new = q->avail->idx;
 
+  if (old == new) return;
+  // the new avail->idx must be visible before reading whether
+  // the device wants to hear of it.
   __sync_synchronize();
+  q->kicked = new;
+  if (disk.eventidx ? vring_need_event(q->used->avail_event, new, old)
+                    : !(q->used->flags & VRING_USED_F_NO_NOTIFY))
+    *R(VIRTIO_MMIO_QUEUE_NOTIFY) = q - disk.q;  // value is queue number
+}
 
-  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0;  // value is queue number
+// Start a transfer of the n buffers in bs, which must be of
+// consecutive blocks, as one request, as vstartpa() does, or
+// return -1 if too few descriptors are free.
+// Caller must hold q->lock.
+static int vstart(struct vq *q, struct buf **bs, int n, int write) {
+  uint64 pa[MAXSEG];
+
+  if (n < 1 || n > MAXSEG) panic("vstart");
+  for (int i = 0; i < n; i++) {
+    if (bs[i]->blockno != bs[0]->blockno + i) panic("vstart: not contiguous");
+    pa[i] = (uint64)bs[i]->data;
+  }
+  return vstartpa(q, bs[0]->blockno, pa, n, write, bs[0], 1);
+}
 
-  // Wait for virtio_disk_intr() to say request has finished.
-  while (b->disk == 1) {
-    sleep(b, &disk.vdisk_lock);
+// Requests for buffers wait in q->queue, sorted by block, until
+// dispatch() finds descriptors for them. It takes them in sweeps
+// across the disk, on from the block where the last request
+// ended and then from the lowest again, and merges queued
+// buffers of consecutive blocks, all reads or all writes, into
+// one request of up to MAXSEG blocks. Buffers of the same block
+// keep the order they were queued in.
+
+// Queue b for the disk. b->disk stays set until the disk is done
+// with it; then virtio_disk_intr() calls iodone(b), if not 0, or
+// wakes up sleepers on b.
+// Caller must hold q->lock.
+static void enqueue(struct vq *q, struct buf *b, int write,
+                    void (*iodone)(struct buf *)) {
+  struct buf **pp = &q->queue;
+
+  while (*pp && (*pp)->blockno <= b->blockno) pp = &(*pp)->qnext;
+  b->disk = 1;
+  b->qwrite = write;
+  b->iodone = iodone;
+  b->qnext = *pp;
+  *pp = b;
+  q->nqueue++;
+}
+
+// Start requests for queued buffers while there are descriptors.
+// Caller must hold q->lock.
+static void dispatch(struct vq *q) {
+  struct buf *bs[MAXSEG], **pp, *b;
+  int n;
+
+  while (q->queue) {
+    for (pp = &q->queue; *pp && (*pp)->blockno < q->next;)
+      pp = &(*pp)->qnext;
+    if (*pp == 0) pp = &q->queue;  // wrap around
+    bs[0] = *pp;
+    for (n = 1, b = bs[0]->qnext; n < MAXSEG && b; n++, b = b->qnext) {
+      if (b->blockno != bs[n - 1]->blockno + 1 || b->qwrite != bs[0]->qwrite)
+        break;
+      bs[n] = b;
+    }
+    if (vstart(q, bs, n, bs[0]->qwrite) < 0) break;  // called again on free
+    *pp = b;
+    q->nqueue -= n;
+    q->next = bs[n - 1]->blockno + 1;
   }
+  kick(q);
+}
+
+// Finish the requests the device has added to the used ring.
+// Called from the interrupt and by pollers.
+// Caller must hold q->lock, which this may drop.
+static void reap(struct vq *q) {
+  // the device increments q->used->idx when it
+  // adds an entry to the used ring.
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+again:
+  while (q->used_idx != q->used->idx) {
+    __sync_synchronize();
+    int id = q->used->ring[q->used_idx % NUM].id;
+    q->used_idx += 1;
+
+    if (q->info[id].status != 0) panic("virtio_disk_intr status");
+    iohist(q->stat.lat, r_time() - q->info[id].start);
+    q->stat.inflight--;
+
+    if (q->info[id].b == 0) {
+      // a transfer straight to memory, from virtio_disk_rwpa().
+      q->info[id].done = 1;
+      wakeup(&q->info[id]);
+      continue;
+    }
+
+    // the request's data descriptors point into its buffers.
+    struct virtq_desc *d = q->desc;
+    struct buf *async[MAXSEG];
+    int n = 0, i = id;
+    if (d[id].flags & VRING_DESC_F_INDIRECT) {
+      d = q->itab[id];
+      i = 0;
+    }
+    for (i = d[i].next; d[i].flags & VRING_DESC_F_NEXT; i = d[i].next) {
+      struct buf *b =
+          (struct buf *)(d[i].addr - __builtin_offsetof(struct buf, data));
+      b->disk = 0;  // disk is done with buf
+      if (b->iodone)
+        async[n++] = b;
+      else
+        wakeup(b);
+    }
+    q->info[id].b = 0;
+    free_chain(q, id);
+    dispatch(q);
+
+    // iodone(), such as bdone(), takes buffer cache locks; keep
+    // them from nesting inside the queue's lock.
+    if (n > 0) {
+      release(&q->lock);
+      for (int i = 0; i < n; i++) async[i]->iodone(async[i]);
+      acquire(&q->lock);
+    }
+  }
 
-  release(&disk.vdisk_lock);
+  // with event indexes the device interrupts only once used->idx
+  // passes used_event, so completions that come while this runs
+  // share the interrupt. ask for one at the next completion, then
+  // look again for any the device added before it saw that.
+  if (disk.eventidx) {
+    q->avail->used_event = q->used_idx;
+    __sync_synchronize();
+    if (q->used_idx != q->used->idx) goto again;
+  }
 }
 
-void virtio_disk_intr() {
-  acquire(&disk.vdisk_lock);
+// Spin for up to disk.pollcycles while the disk works on b,
+// finishing requests as the interrupt would, so that a request
+// the disk is quick with costs no sleep and wakeup. The lock is
+// dropped while spinning, for other harts to queue requests
+// and for the interrupt, should it come first.
+// Caller must hold q->lock.
+static void vpoll(struct vq *q, struct buf *b) {
+  uint64 t0 = r_time(), budget = disk.pollcycles;
+
+  q->stat.npoll++;
+  for (;;) {
+    reap(q);
+    if (!b->disk || r_time() - t0 >= budget) break;
+    uint16 seen = q->used_idx;
+    release(&q->lock);
+    while (__atomic_load_n(&q->used->idx, __ATOMIC_ACQUIRE) == seen &&
+           __atomic_load_n(&b->disk, __ATOMIC_RELAXED) &&
+           r_time() - t0 < budget)
+      ;
+    acquire(&q->lock);
+  }
+  q->stat.pollwait += r_time() - t0;
+  if (!b->disk) q->stat.nhit++;
+}
+
+// Wait for the request started by vstartpa() at id without a
+// struct buf, and free its descriptors, starting buffers that
+// were queued for want of them.
+// Caller must hold q->lock.
+static void vwaitpa(struct vq *q, int id) {
+  while (!q->info[id].done) {
+    sleep(&q->info[id], &q->lock);
+  }
+
+  free_chain(q, id);
+  dispatch(q);
+}
+
+void virtio_disk_rw(struct buf *b, int write) {
+  struct vq *q = myq();
+
+  acquire(&q->lock);
+  enqueue(q, b, write, 0);
+  dispatch(q);
+  if (disk.pollcycles) vpoll(q, b);
+  while (b->disk) sleep(b, &q->lock);
+  release(&q->lock);
+}
 
+// Read or write n consecutive blocks from blockno on straight
+// to or from memory, BSIZE bytes at each of pa[0..n-1], such as
+// a user's pages, and return when the transfer is done.
+void virtio_disk_rwpa(uint blockno, uint64 *pa, int n, int write) {
+  struct vq *q = myq();
+
+  acquire(&q->lock);
+  for (int i = 0; i < n; i += MAXSEG) {
+    int m = n - i < MAXSEG ? n - i : MAXSEG;
+    int id = vstartpa(q, blockno + i, pa + i, m, write, 0, 0);
+    kick(q);
+    vwaitpa(q, id);
+  }
+  release(&q->lock);
+}
+
+// Write the n buffers in bs, each to its own block, and return
+// when all are on disk. They are all queued before any is
+// started, so that neighbours go as one request.
+void virtio_disk_write(struct buf **bs, int n) {
+  struct vq *q = myq();
+
+  acquire(&q->lock);
+  for (int i = 0; i < n; i++) enqueue(q, bs[i], 1, 0);
+  dispatch(q);
+  for (int i = 0; i < n; i++)
+    while (bs[i]->disk) sleep(bs[i], &q->lock);
+  release(&q->lock);
+}
+
+// Queue the n buffers in bs for the disk, as virtio_disk_write()
+// does, and return without waiting for them. When the disk is
+// done with each, virtio_disk_intr() calls iodone() on it, without
+// the queue's lock held. Returns -1, queueing nothing, if the
+// queue already holds NUM buffers.
+int virtio_disk_submit(struct buf **bs, int n, int write,
+                       void (*iodone)(struct buf *)) {
+  struct vq *q = myq();
+
+  acquire(&q->lock);
+  if (q->nqueue + n > NUM) {
+    release(&q->lock);
+    return -1;
+  }
+  for (int i = 0; i < n; i++) enqueue(q, bs[i], write, iodone);
+  dispatch(q);
+  release(&q->lock);
+  return 0;
+}
+
+// virtio-mmio has one interrupt for all the queues, which the
+// PLIC hands to whichever hart claims it first, so look at each.
+void virtio_disk_intr() {
   // the device won't raise another interrupt until we tell it
   // we've seen this interrupt, which the following line does.
   // this may race with the device writing new entries to
@@ -288,21 +635,70 @@ void virtio_disk_intr() {
 
   __sync_synchronize();
 
-  // the device increments disk.used->idx when it
-  // adds an entry to the used ring.
-
-  while (disk.used_idx != disk.used->idx) {
-    __sync_synchronize();
-    int id = disk.used->ring[disk.used_idx % NUM].id;
-
-    if (disk.info[id].status != 0) panic("virtio_disk_intr status");
+  for (int i = 0; i < disk.nq; i++) {
+    struct vq *q = &disk.q[i];
+    if (q->used_idx == q->used->idx) continue;
+    acquire(&q->lock);
+    q->stat.nintr++;
+    reap(q);
+    release(&q->lock);
+  }
+}
 
-    struct buf *b = disk.info[id].b;
-    b->disk = 0;  // disk is done with buf
-    wakeup(b);
+// The disk's statistics, summed over its queues.
+void virtio_disk_stat(struct diskstat *st) {
+  memset(st, 0, sizeof(*st));
+  for (int i = 0; i < disk.nq; i++) {
+    struct vq *q = &disk.q[i];
+    acquire(&q->lock);
+    st->nreq += q->stat.nreq;
+    st->nwrite += q->stat.nwrite;
+    st->rblocks += q->stat.rblocks;
+    st->wblocks += q->stat.wblocks;
+    st->inflight += q->stat.inflight;
+    if (q->stat.maxinflight > st->maxinflight)
+      st->maxinflight = q->stat.maxinflight;
+    st->nintr += q->stat.nintr;
+    st->npoll += q->stat.npoll;
+    st->nhit += q->stat.nhit;
+    st->pollwait += q->stat.pollwait;
+    for (int j = 0; j < NLAT; j++) st->lat[j] += q->stat.lat[j];
+    release(&q->lock);
+  }
+  st->pollus = disk.pollus;
+  st->nqueue = disk.nq;
+}
 
-    disk.used_idx += 1;
+// Zero the disk's counts, but not what is in flight.
+void virtio_disk_resetstat(void) {
+  for (int i = 0; i < disk.nq; i++) {
+    struct vq *q = &disk.q[i];
+    acquire(&q->lock);
+    uint64 inflight = q->stat.inflight;
+    memset(&q->stat, 0, sizeof(q->stat));
+    q->stat.inflight = q->stat.maxinflight = inflight;
+    release(&q->lock);
   }
+}
 
-  release(&disk.vdisk_lock);
+// Copy out the disk's statistics to addr, zero them, or set the
+// polling budget to n microseconds.
+int kdiskstat(int op, uint64 addr, int n) {
+  struct diskstat st;
+
+  switch (op) {
+    case DISKSTAT_GET:
+      virtio_disk_stat(&st);
+      return copyout(myproc()->pagetable, addr, (char *)&st, sizeof(st));
+    case DISKSTAT_RESET:
+      virtio_disk_resetstat();
+      return 0;
+    case DISKSTAT_POLL:
+      if (n < 0 || n > 1000000) return -1;
+      disk.pollus = n;
+      disk.pollcycles = (uint64)n * (TIMEBASE / 1000000);
+      return 0;
+    default:
+      return -1;
+  }
 }
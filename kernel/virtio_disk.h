@@ -1,7 +1,17 @@
 #pragma once
 
+#include "types.h"
+
 struct buf;
+struct diskstat;
 
 void virtio_disk_init(void);
 void virtio_disk_rw(struct buf *, int);
+void virtio_disk_write(struct buf **, int);
+void virtio_disk_rwpa(uint, uint64 *, int, int);
+int virtio_disk_submit(struct buf **, int, int, void (*)(struct buf *));
 void virtio_disk_intr(void);
+int kdiskstat(int, uint64, int);
+void virtio_disk_stat(struct diskstat *);
+void virtio_disk_resetstat(void);
+void iohist(uint64 *, uint64);
@@ -1,11 +1,18 @@
 #include "vm.h"
 
+#include "futex.h"
 #include "kalloc.h"
+#include "log.h"
+#include "meminfo.h"
 #include "memlayout.h"
+#include "pagecache.h"
 #include "printf.h"
 #include "proc.h"
 #include "riscv.h"
+#include "spinlock.h"
 #include "string.h"
+#include "swap.h"
+#include "trap.h"
 #include "types.h"
 #include "file.h"
 #include "fs.h"
@@ -21,12 +28,35 @@ extern char etext[];  // kernel.ld sets this to end of kernel code.
 
 extern char trampoline[];  // trampoline.S
 
+// Pages vmfault() maps around a sequential file mapping fault.
+#define FAULTAROUND_MIN 16
+#define FAULTAROUND_MAX 64
+
+// Pages uvmreclaim() tries to free per call.
+#define RECLAIM_BATCH 32
+
+// Page faults resolved, by kind, for meminfo().
+static uint64 nfaults[NFAULT];
+
+static void countfault(int kind) { __sync_fetch_and_add(&nfaults[kind], 1); }
+
+// Each process's TLB entries are tagged with its ASID, so traps
+// and context switches need not flush them. ASID 0 is the
+// kernel's; a process gets 0 as well if none is free, and then
+// trampoline.S flushes the TLB whenever it switches satp.
+#define NASID 1024
+
+static struct {
+  struct spinlock lock;
+  uint max;  // largest ASID the hardware implements
+  uchar used[NASID / 8];
+} asids;
+
 // Make a direct-map page table for the kernel.
 pagetable_t kvmmake(void) {
   pagetable_t kpgtbl;
 
-  kpgtbl = (pagetable_t)kalloc();
-  memset(kpgtbl, 0, PGSIZE);
+  kpgtbl = (pagetable_t)kalloc_zeroed();
 
   // uart registers
   kvmmap(kpgtbl, UART0, UART0, PGSIZE, PTE_R | PTE_W);
@@ -34,6 +64,9 @@ pagetable_t kvmmake(void) {
   // virtio mmio disk interface
   kvmmap(kpgtbl, VIRTIO0, VIRTIO0, PGSIZE, PTE_R | PTE_W);
 
+  // CLINT
+  kvmmap(kpgtbl, CLINT, CLINT, 0x10000, PTE_R | PTE_W);
+
   // PLIC
   kvmmap(kpgtbl, PLIC, PLIC, 0x4000000, PTE_R | PTE_W);
 
@@ -49,20 +82,57 @@ pagetable_t kvmmake(void) {
   kvmmap(kpgtbl, TRAMPOLINE, (uint64)trampoline, PGSIZE, PTE_R | PTE_X);
 
   // allocate and map a kernel stack for each process.
-  proc_mapstacks(kpgtbl);
 
   return kpgtbl;
 }
 
-// add a mapping to the kernel page table.
+// add a mapping to the kernel page table, with 1GB or 2MB leaf
+// PTEs wherever va, pa and the size left allow, and 4KB pages
+// only at the unaligned edges.
 // only used when booting.
 // does not flush TLB or enable paging.
 void kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm) {
-  if (mappages(kpgtbl, va, sz, pa, perm) != 0) panic("kvmmap");
+  uint64 end = va + sz;
+
+  while (va < end) {
+    if (va % GIGAPGSIZE == 0 && pa % GIGAPGSIZE == 0 &&
+        end - va >= GIGAPGSIZE) {
+      pte_t *pte = &kpgtbl[PX(2, va)];
+      if (*pte & PTE_V) panic("kvmmap: remap");
+      *pte = PA2PTE(pa) | perm | PTE_V;
+      va += GIGAPGSIZE;
+      pa += GIGAPGSIZE;
+    } else if (va % SUPERPGSIZE == 0 && pa % SUPERPGSIZE == 0 &&
+               end - va >= SUPERPGSIZE) {
+      if (map_superpage(kpgtbl, va, pa, perm) != 0) panic("kvmmap");
+      va += SUPERPGSIZE;
+      pa += SUPERPGSIZE;
+    } else {
+      if (mappages(kpgtbl, va, PGSIZE, pa, perm) != 0) panic("kvmmap");
+      va += PGSIZE;
+      pa += PGSIZE;
+    }
+  }
 }
 
+// Kernel stack slots in use; see KSTACK() in memlayout.h.
+static struct {
+  struct spinlock lock;  // also guards kernel_pagetable changes
+  uint64 used[NKSTACK / 64];
+} kstacks;
+
+// Read faults on memory nothing has written yet map this page,
+// copy-on-write. Its allocation is a reference never dropped, so
+// cowfault() always copies it.
+static char *zeropage;
+
 // Initialize the kernel_pagetable, shared by all CPUs.
-void kvminit(void) { kernel_pagetable = kvmmake(); }
+void kvminit(void) {
+  initlock(&asids.lock, "asid");
+  initlock(&kstacks.lock, "kstack");
+  kernel_pagetable = kvmmake();
+  if ((zeropage = kalloc_zeroed()) == 0) panic("kvminit: zero page");
+}
 
 // Switch the current CPU's h/w page table register to
 // the kernel's page table, and enable paging.
@@ -70,12 +140,104 @@ void kvminithart() {
   // wait for any previous writes to the page table memory to finish.
   sfence_vma();
 
+  // the ASID bits that stick are the ones the hardware has.
+  w_satp(MAKE_SATP(kernel_pagetable) | SATP_ASID(0xFFFF));
+  asids.max = SATP2ASID(r_satp());
   w_satp(MAKE_SATP(kernel_pagetable));
 
   // flush stale entries from the TLB.
   sfence_vma();
 }
 
+// Allocate a page for a new kernel stack and map it in a free
+// slot, below an invalid guard page. Returns the stack's virtual
+// address, or 0. A hart may still hold a TLB entry for the slot's
+// previous page, so it must sfence_vma_va() before using the stack.
+uint64 kstackalloc(void) {
+  char *pa;
+  pte_t *pte;
+
+  if ((pa = kalloc()) == 0) return 0;
+  acquire(&kstacks.lock);
+  for (int w = 0; w < NKSTACK / 64; w++) {
+    if (kstacks.used[w] == ~0UL) continue;
+    int slot = w * 64 + __builtin_ctzl(~kstacks.used[w]);
+    uint64 va = KSTACK(slot);
+    if ((pte = walk(kernel_pagetable, va, 1)) == 0) break;
+    *pte = PA2PTE(pa) | PTE_R | PTE_W | PTE_V;
+    kstacks.used[w] |= 1UL << (slot % 64);
+    release(&kstacks.lock);
+    return va;
+  }
+  release(&kstacks.lock);
+  kfree(pa);
+  return 0;
+}
+
+// Unmap the kernel stack at va and free its page.
+void kstackfree(uint64 va) {
+  int slot = (TRAMPOLINE - va) / (2 * PGSIZE) - 1;
+  pte_t *pte;
+  uint64 pa;
+
+  acquire(&kstacks.lock);
+  pte = walk(kernel_pagetable, va, 0);
+  if (pte == 0 || (*pte & PTE_V) == 0) panic("kstackfree");
+  pa = PTE2PA(*pte);
+  *pte = 0;
+  kstacks.used[slot / 64] &= ~(1UL << (slot % 64));
+  release(&kstacks.lock);
+  kfree((void *)pa);
+}
+
+// Allocate an ASID for a new process.
+// Returns 0, the kernel's ASID, if none is free.
+int asidalloc(void) {
+  acquire(&asids.lock);
+  for (uint a = 1; a < NASID && a <= asids.max; a++) {
+    if ((asids.used[a / 8] & (1 << (a % 8))) == 0) {
+      asids.used[a / 8] |= 1 << (a % 8);
+      release(&asids.lock);
+      return a;
+    }
+  }
+  release(&asids.lock);
+  return 0;
+}
+
+void asidfree(int asid) {
+  if (asid == 0) return;
+  acquire(&asids.lock);
+  asids.used[asid / 8] &= ~(1 << (asid % 8));
+  release(&asids.lock);
+}
+
+// Flush stale TLB entries after changing PTEs of pagetable.
+// Only the current process's page table can be in a TLB: others
+// are new or dying, and will be flushed before they next run
+// (see prepare_return()). This hart flushes p's ASID now; other
+// harts that ran p flush it when p next runs there, except that
+// harts running p's other threads right now are shot down.
+void uvmflush(pagetable_t pagetable) {
+  struct proc *p = myproc();
+  struct proc *g;
+  uint64 others;
+
+  if (p == 0 || p->pagetable != pagetable) return;
+  g = p->leader;
+  push_off();
+  if (g->asid == 0) {
+    sfence_vma();
+  } else {
+    sfence_vma_asid(g->asid);
+    g->tlbstale = ~(1UL << cpuid());
+  }
+  __sync_synchronize();
+  others = g->runharts & ~(1UL << cpuid());
+  pop_off();
+  if (others) tlbshootdown(others);
+}
+
 // Return the address of the PTE in page table pagetable
 // that corresponds to virtual address va.  If alloc!=0,
 // create any required page-table pages.
@@ -96,8 +258,7 @@ pte_t *walk(pagetable_t pagetable, uint64 va, int alloc) {
     if (*pte & PTE_V) {
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
-      if (!alloc || (pagetable = (pde_t *)kalloc()) == 0) return 0;
-      memset(pagetable, 0, PGSIZE);
+      if (!alloc || (pagetable = (pde_t *)kalloc_zeroed()) == 0) return 0;
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
@@ -115,8 +276,7 @@ pte_t *walk_superpage(pagetable_t pagetable, uint64 va, int alloc) {
   if (*pte & PTE_V) {
     pagetable = (pagetable_t)PTE2PA(*pte);
   } else {
-    if (!alloc || (pagetable = (pde_t *)kalloc()) == 0) return 0;
-    memset(pagetable, 0, PGSIZE);
+    if (!alloc || (pagetable = (pde_t *)kalloc_zeroed()) == 0) return 0;
     *pte = PA2PTE(pagetable) | PTE_V;
   }
   return &pagetable[PX(1, va)];
@@ -127,6 +287,22 @@ int is_superpage(pte_t pte) {
   return (pte & PTE_V) && (pte & (PTE_R | PTE_W | PTE_X));
 }
 
+// Return the leaf PTE that maps va: the level-1 PTE if va lies in
+// a superpage (and set *super), otherwise the level-0 PTE.
+// Returns 0 if no page-table page covers va.
+static pte_t *walkleaf(pagetable_t pagetable, uint64 va, int *super) {
+  pte_t *pte = walk_superpage(pagetable, va, 0);
+
+  *super = 0;
+  if (pte == 0 || (*pte & PTE_V) == 0) return 0;
+  if (is_superpage(*pte)) {
+    *super = 1;
+    return pte;
+  }
+  pagetable = (pagetable_t)PTE2PA(*pte);
+  return &pagetable[PX(0, va)];
+}
+
 // Map a single 2MB superpage.
 // va and pa must be 2MB-aligned.
 // Returns 0 on success, -1 on failure.
@@ -150,14 +326,17 @@ int map_superpage(pagetable_t pagetable, uint64 va, uint64 pa, int perm) {
 uint64 walkaddr(pagetable_t pagetable, uint64 va) {
   pte_t *pte;
   uint64 pa;
+  int super;
 
   if (va >= MAXVA) return 0;
 
-  pte = walk(pagetable, va, 0);
+  pte = walkleaf(pagetable, va, &super);
   if (pte == 0) return 0;
   if ((*pte & PTE_V) == 0) return 0;
   if ((*pte & PTE_U) == 0) return 0;
   pa = PTE2PA(*pte);
+  // the 4K page within a superpage
+  if (super) pa += PGROUNDDOWN(va) - SUPERPGROUNDDOWN(va);
   return pa;
 }
 
@@ -180,26 +359,121 @@ int mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa,
   a = va;
   last = va + size - PGSIZE;
   for (;;) {
+    // walk once per leaf page-table page, then fill its PTEs.
     if ((pte = walk(pagetable, a, 1)) == 0) return -1;
-    if (*pte & PTE_V) panic("mappages: remap");
-    *pte = PA2PTE(pa) | perm | PTE_V;
-    if (a == last) break;
-    a += PGSIZE;
-    pa += PGSIZE;
+    do {
+      if (*pte & PTE_V) panic("mappages: remap");
+      *pte = PA2PTE(pa) | perm | PTE_V;
+      if (a == last) return 0;
+      a += PGSIZE;
+      pa += PGSIZE;
+    } while ((uint64)++pte % PGSIZE != 0);
   }
-  return 0;
 }
 
 // create an empty user page table.
 // returns 0 if out of memory.
 pagetable_t uvmcreate() {
   pagetable_t pagetable;
-  pagetable = (pagetable_t)kalloc();
+  pagetable = (pagetable_t)kalloc_zeroed();
   if (pagetable == 0) return 0;
-  memset(pagetable, 0, PGSIZE);
   return pagetable;
 }
 
+// 2MB blocks of RAM, for uvmcompact().
+#define NBLOCK (NPAGES / 512)
+
+static struct {
+  int busy;                // a uvmcompact() is running
+  ushort movable[NBLOCK];  // the current process's movable pages
+} compact;
+
+// Whether the 4KB page pte maps can move: private, and not
+// being waited on or pinned for I/O.
+static int movable(pte_t pte) {
+  uint64 pa = PTE2PA(pte);
+
+  return (pte & (PTE_V | PTE_U)) == (PTE_V | PTE_U) && pa >= KERNBASE &&
+         pa < PHYSTOP && krefcnt((void *)pa) == 1 && !futex_busy(pa);
+}
+
+// Count the movable 4KB pages of level-level table pt, which maps
+// from va, in each 2MB block, or move those in block target to
+// other pages. Pages at and above UTOP, such as the usyscall page
+// and the io ring, are ones the kernel also writes through its own
+// pointer, so they stay put. Returns -1 if memory to move to ran
+// out.
+static int compactwalk(pagetable_t pt, int level, uint64 va, char *target) {
+  for (int i = 0; i < 512; i++) {
+    pte_t *pte = &pt[i];
+    uint64 a = va + ((uint64)i << PXSHIFT(level));
+    if (a >= UTOP) break;
+    if ((*pte & PTE_V) == 0) continue;
+    if ((*pte & (PTE_R | PTE_W | PTE_X)) == 0) {
+      if (level > 0 &&
+          compactwalk((pagetable_t)PTE2PA(*pte), level - 1, a, target) < 0)
+        return -1;
+      continue;
+    }
+    if (level > 0 || !movable(*pte)) continue;
+    char *pa = (char *)PTE2PA(*pte);
+    if (target == 0) {
+      compact.movable[(pa - (char *)KERNBASE) / SUPERPGSIZE]++;
+    } else if (SUPERPGROUNDDOWN((uint64)pa) == (uint64)target) {
+      char *mem = kalloc();
+      if (mem == 0) return -1;
+      memmove(mem, pa, PGSIZE);
+      *pte = PA2PTE(mem) | PTE_FLAGS(*pte);
+      kcompact_put(pa);
+    }
+  }
+  return 0;
+}
+
+// Make a free 2MB block for superalloc() when none is left, by
+// moving the current process's private pages out of a block that
+// only they and free pages share. As in uvmreclaim(), only the
+// current process is scanned, so no reverse map is needed. One
+// with other threads is left alone, since they could store to a
+// page while it is copied. Returns 0 if a block came free.
+int uvmcompact(void) {
+  struct proc *p = myproc();
+  char *target = 0;
+  int best = 513, r = -1;
+
+  if (p == 0 || p != p->leader || p->threads > 0) return -1;
+  if (__sync_lock_test_and_set(&compact.busy, 1)) return -1;
+
+  memset(compact.movable, 0, sizeof(compact.movable));
+  compactwalk(p->pagetable, 2, 0, 0);
+  kdrain();
+  // the block with least to move.
+  for (int b = 0; b < NBLOCK; b++) {
+    char *pa = (char *)KERNBASE + (uint64)b * SUPERPGSIZE;
+    int n = compact.movable[b];
+    if (n > 0 && n < best && kfreein(pa) + n == 512) {
+      target = pa;
+      best = n;
+    }
+  }
+  if (target && kcompact_begin(target, best) == 0) {
+    compactwalk(p->pagetable, 2, 0, target);
+    uvmflush(p->pagetable);
+    r = kcompact_end(target);
+  }
+  __sync_lock_release(&compact.busy);
+  return r;
+}
+
+// superalloc(), compacting memory for a free 2MB block if it
+// has to.
+static void *superalloc_compact(void) {
+  void *mem = superalloc();
+
+  if (mem == 0 && uvmcompact() == 0) mem = superalloc();
+  return mem;
+}
+
 // Demote a superpage to regular 4KB pages.
 // This is needed when partially freeing a superpage.
 // va must be 2MB-aligned and point to a valid superpage.
@@ -223,6 +497,7 @@ int demote_superpage(pagetable_t pagetable, uint64 va) {
   // Get the physical address and flags
   pa = PTE2PA(*pte_l1);
   flags = PTE_FLAGS(*pte_l1);
+  if (krefcnt((void *)pa) > 1) panic("demote_superpage: shared");
 
   // Clear the level-1 PTE
   *pte_l1 = 0;
@@ -238,20 +513,119 @@ int demote_superpage(pagetable_t pagetable, uint64 va) {
 
   // The physical memory is still there, mapped as 512 individual 4KB pages
   // The caller is responsible for freeing pages as needed
+  supersplit((void *)pa);
+  return 0;
+}
+
+// Collapse the 512 4KB pages mapping the 2MB-aligned region at va
+// into one superpage, if all of them are resident, private, and
+// mapped with the same permissions. The pages are copied into a
+// new superpage and freed, along with their leaf page table.
+// Returns 0 if the region is now a superpage, -1 otherwise.
+int promote_superpage(pagetable_t pagetable, uint64 va) {
+  pte_t *pte_l1;
+  pagetable_t pt;
+  uint flags;
+  char *mem;
+
+  if ((va % SUPERPGSIZE) != 0) panic("promote_superpage: va not aligned");
+
+  pte_l1 = walk_superpage(pagetable, va, 0);
+  if (pte_l1 == 0 || (*pte_l1 & PTE_V) == 0) return -1;
+  if (is_superpage(*pte_l1)) return 0;
+  pt = (pagetable_t)PTE2PA(*pte_l1);
+
+  // Scan from the top: a heap grows upward, so the last
+  // page is the one most likely still missing.
+  flags = PTE_FLAGS(pt[511]) & ~(PTE_A | PTE_D);
+  if ((flags & (PTE_V | PTE_U)) != (PTE_V | PTE_U) || (flags & PTE_COW))
+    return -1;
+  for (int i = 511; i >= 0; i--) {
+    if ((PTE_FLAGS(pt[i]) & ~(PTE_A | PTE_D)) != flags) return -1;
+    if (krefcnt((void *)PTE2PA(pt[i])) != 1) return -1;
+  }
+
+  if ((mem = superalloc_compact()) == 0) return -1;
+  for (int i = 0; i < 512; i++)
+    memmove(mem + (uint64)i * PGSIZE, (char *)PTE2PA(pt[i]), PGSIZE);
+  *pte_l1 = PA2PTE(mem) | flags;
+  uvmflush(pagetable);
+
+  for (int i = 0; i < 512; i++) kfree((void *)PTE2PA(pt[i]));
+  kfree(pt);
+  return 0;
+}
+
+// Give this page table a private copy of the shared superpage
+// mapped by the level-1 PTE pte_l1, writable if it was
+// copy-on-write. Copies into a new superpage if one is free,
+// otherwise into 512 4KB pages under a new level-0 page table.
+// Returns 0 on success, -1 if out of memory.
+static int superpage_unshare(pte_t *pte_l1) {
+  uint64 pa = PTE2PA(*pte_l1);
+  uint flags = PTE_FLAGS(*pte_l1);
+  char *mem;
+
+  if (flags & PTE_COW) flags = (flags & ~PTE_COW) | PTE_W;
+
+  if ((mem = superalloc()) != 0) {
+    memmove(mem, (char *)pa, SUPERPGSIZE);
+    *pte_l1 = PA2PTE(mem) | flags;
+  } else {
+    pagetable_t pt = (pagetable_t)kalloc_zeroed();
+    if (pt == 0) return -1;
+    for (int i = 0; i < 512; i++) {
+      if ((mem = kalloc()) == 0) {
+        for (int j = 0; j < i; j++) kfree((void *)PTE2PA(pt[j]));
+        kfree(pt);
+        return -1;
+      }
+      memmove(mem, (char *)pa + (uint64)i * PGSIZE, PGSIZE);
+      pt[i] = PA2PTE(mem) | flags;
+    }
+    *pte_l1 = PA2PTE(pt) | PTE_V;
+  }
+  superfree((void *)pa);
   return 0;
 }
 
+// Pages uvmunmap() has unmapped, freed only once no TLB can
+// still reach them through pagetable: another thread of the
+// process may be using them on another hart until it is shot
+// down by uvmflush().
+#define UNMAP_BATCH 32
+struct unmapbatch {
+  int n;
+  void *pa[UNMAP_BATCH];
+};
+
+static void unmap_flush(pagetable_t pagetable, struct unmapbatch *b) {
+  uvmflush(pagetable);
+  for (int i = 0; i < b->n; i++) kfree(b->pa[i]);
+  b->n = 0;
+}
+
+static void unmap_free(pagetable_t pagetable, struct unmapbatch *b,
+                       uint64 pa) {
+  if (b->n == UNMAP_BATCH) unmap_flush(pagetable, b);
+  b->pa[b->n++] = (void *)pa;
+}
+
 // Remove npages of mappings starting from va. va must be
 // page-aligned. It's OK if the mappings don't exist.
 // Optionally free the physical memory.
 // Handles both regular pages and superpages.
 void uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free) {
+  struct unmapbatch batch;
   uint64 a;
   pte_t *pte;
 
+  batch.n = 0;
+
   if ((va % PGSIZE) != 0) panic("uvmunmap: not aligned");
 
   for (a = va; a < va + npages * PGSIZE;) {
+    cond_resched();
     // Check if this is a superpage
     uint64 superpage_addr = SUPERPGROUNDDOWN(a);
     pte_t *pte_l1 = walk_superpage(pagetable, superpage_addr, 0);
@@ -264,40 +638,84 @@ void uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free) {
       // Check if we're unmapping the entire superpage
       if (a == superpage_addr && unmap_end >= superpage_end) {
         // Unmapping entire superpage
+        uint64 pa = PTE2PA(*pte_l1);
+        *pte_l1 = 0;
         if (do_free) {
-          uint64 pa = PTE2PA(*pte_l1);
+          uvmflush(pagetable);
           superfree((void *)pa);
         }
-        *pte_l1 = 0;
         a = superpage_end;
         continue;
       } else {
-        // Partially unmapping superpage - need to demote
-        if (demote_superpage(pagetable, superpage_addr) != 0) {
+        // Partially unmapping superpage - need to demote,
+        // after taking a private copy if it is shared.
+        if (krefcnt((void *)PTE2PA(*pte_l1)) > 1 &&
+            superpage_unshare(pte_l1) != 0) {
+          panic("uvmunmap: unshare failed");
+        }
+        if (is_superpage(*pte_l1) &&
+            demote_superpage(pagetable, superpage_addr) != 0) {
           panic("uvmunmap: demote failed");
         }
         // Now fall through to regular page handling
       }
     }
 
-    // Handle regular page
-    if ((pte = walk(pagetable, a, 0)) == 0)  // leaf page table entry allocated?
-    {
-      a += PGSIZE;
+    // Handle regular pages, to the end of this leaf page table.
+    uint64 stop = SUPERPGROUNDDOWN(a) + SUPERPGSIZE;
+    if (stop > va + npages * PGSIZE) stop = va + npages * PGSIZE;
+    if ((pte = walk(pagetable, a, 0)) == 0) {  // leaf page table allocated?
+      a = stop;
       continue;
     }
-    if ((*pte & PTE_V) == 0)  // has physical page been allocated?
-    {
-      a += PGSIZE;
-      continue;
+    for (; a < stop; a += PGSIZE, pte++) {
+      if (*pte & PTE_SWAP) {  // swapped out?
+        if (do_free) swapfree(PTE2SLOT(*pte));
+        *pte = 0;
+        continue;
+      }
+      if ((*pte & PTE_V) == 0)  // has physical page been allocated?
+        continue;
+      if (do_free) unmap_free(pagetable, &batch, PTE2PA(*pte));
+      *pte = 0;
     }
-    if (do_free) {
-      uint64 pa = PTE2PA(*pte);
-      kfree((void *)pa);
+  }
+  unmap_flush(pagetable, &batch);
+}
+
+// kalloc_zeroed(), reclaiming some of the current process's
+// pages if memory is out.
+static void *kalloc_reclaim(void) {
+  void *mem = kalloc_zeroed();
+  if (mem == 0 && uvmreclaim() > 0) mem = kalloc_zeroed();
+  return mem;
+}
+
+// Pages uvmalloc() takes from kalloc_batch() at a time.
+#define UVMALLOC_BATCH 32
+
+// Map zeroed 4KB pages at [a, stop), which must lie within one
+// 2MB region, filling its leaf page table without re-walking.
+// Returns the address mapped up to: stop, or less if memory ran out.
+static uint64 uvmalloc_run(pagetable_t pagetable, uint64 a, uint64 stop,
+                           int perm) {
+  void *mem[UVMALLOC_BATCH];
+  pte_t *pte;
+  int n, got;
+
+  if ((pte = walk(pagetable, a, 1)) == 0) return a;
+  while (a < stop) {
+    n = (stop - a) / PGSIZE;
+    if (n > UVMALLOC_BATCH) n = UVMALLOC_BATCH;
+    if ((got = kalloc_batch(mem, n)) == 0 && uvmreclaim() > 0)
+      got = kalloc_batch(mem, n);
+    if (got == 0) return a;
+    for (int i = 0; i < got; i++, pte++, a += PGSIZE) {
+      if (*pte & PTE_V) panic("uvmalloc: remap");
+      *pte = PA2PTE(mem[i]) | perm | PTE_V;
     }
-    *pte = 0;
-    a += PGSIZE;
   }
+  return a;
 }
 
 // Allocate PTEs and physical memory to grow a process from oldsz to
@@ -305,70 +723,42 @@ void uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free) {
 // Uses superpages (2MB pages) when possible for better performance.
 uint64 uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm) {
   char *mem;
-  uint64 a;
+  uint64 a, stop;
 
   if (newsz < oldsz) return oldsz;
 
   oldsz = PGROUNDUP(oldsz);
 
-  // Try to use superpages for 2MB-aligned regions
   for (a = oldsz; a < newsz;) {
-    // Check if we can use a superpage at this address
-    uint64 superpage_start = SUPERPGROUNDUP(a);
-    uint64 superpage_end = superpage_start + SUPERPGSIZE;
-
-    // Can use superpage if:
-    // 1. We have at least 2MB left to allocate
-    // 2. The superpage fits entirely within the allocation range
-    if (superpage_start < newsz && superpage_end <= newsz) {
-      // Fill any gap before the superpage with regular pages
-      while (a < superpage_start) {
-        mem = kalloc();
-        if (mem == 0) {
-          uvmdealloc(pagetable, a, oldsz);
-          return 0;
-        }
-        memset(mem, 0, PGSIZE);
-        if (mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_R | PTE_U | xperm) !=
-            0) {
-          kfree(mem);
-          uvmdealloc(pagetable, a, oldsz);
-          return 0;
-        }
-        a += PGSIZE;
-      }
-
-      // Try to allocate a superpage
-      mem = superalloc();
-      if (mem != 0) {
-        // Successfully allocated superpage
-        if (map_superpage(pagetable, a, (uint64)mem, PTE_R | PTE_U | xperm) !=
-            0) {
-          superfree(mem);
-          uvmdealloc(pagetable, a, oldsz);
-          return 0;
-        }
-        a += SUPERPGSIZE;
-        continue;
+    cond_resched();
+    // a whole 2MB region left to allocate gets a superpage.
+    if (a % SUPERPGSIZE == 0 && a + SUPERPGSIZE <= newsz &&
+        (mem = superalloc_compact()) != 0) {
+      if (map_superpage(pagetable, a, (uint64)mem, PTE_R | PTE_U | xperm) !=
+          0) {
+        superfree(mem);
+        uvmdealloc(pagetable, a, oldsz);
+        return 0;
       }
-      // If superpage allocation failed, fall back to regular pages
+      a += SUPERPGSIZE;
+      continue;
     }
 
-    // Use regular page
-    mem = kalloc();
-    if (mem == 0) {
-      uvmdealloc(pagetable, a, oldsz);
+    // otherwise regular pages, up to the next 2MB boundary.
+    stop = SUPERPGROUNDDOWN(a) + SUPERPGSIZE;
+    if (stop > PGROUNDUP(newsz)) stop = PGROUNDUP(newsz);
+    uint64 got = uvmalloc_run(pagetable, a, stop, PTE_R | PTE_U | xperm);
+    if (got < stop) {
+      uvmdealloc(pagetable, got, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
-    if (mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_R | PTE_U | xperm) !=
-        0) {
-      kfree(mem);
-      uvmdealloc(pagetable, a, oldsz);
-      return 0;
-    }
-    a += PGSIZE;
+    a = stop;
   }
+
+  // Regions completed from 4KB pages by this or earlier
+  // small allocations become superpages.
+  for (a = SUPERPGROUNDDOWN(oldsz); a + SUPERPGSIZE <= newsz; a += SUPERPGSIZE)
+    promote_superpage(pagetable, a);
   return newsz;
 }
 
@@ -396,6 +786,7 @@ void freewalk(pagetable_t pagetable) {
     if ((pte & PTE_V) && (pte & (PTE_R | PTE_W | PTE_X)) == 0) {
       // this PTE points to a lower-level page table.
       uint64 child = PTE2PA(pte);
+      cond_resched();
       freewalk((pagetable_t)child);
       pagetable[i] = 0;
     } else if (pte & PTE_V) {
@@ -412,42 +803,43 @@ void uvmfree(pagetable_t pagetable, uint64 sz) {
   freewalk(pagetable);
 }
 
-// Given a parent process's page table, copy
-// its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Given a parent process's page table, share
+// its memory with a child's page table.
+// Copies the page table but not the physical memory:
+// writable pages and superpages become read-only and
+// copy-on-write in both, and cowfault() copies them
+// when either process writes.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
-// Handles both regular pages and superpages.
 int uvmcopy(pagetable_t old, pagetable_t new, uint64 sz) {
+  return uvmcopyrange(old, new, 0, sz);
+}
+
+// Like uvmcopy(), for the page-aligned range [start, end).
+// A superpage must lie wholly inside or outside the range.
+int uvmcopyrange(pagetable_t old, pagetable_t new, uint64 start, uint64 end) {
   pte_t *pte;
   uint64 pa, i;
   uint flags;
-  char *mem;
 
-  for (i = 0; i < sz;) {
+  for (i = start; i < end;) {
+    if (i % SUPERPGSIZE == 0) cond_resched();
     // Check if this address is part of a superpage
     uint64 superpage_addr = SUPERPGROUNDDOWN(i);
     pte_t *pte_l1 = walk_superpage(old, superpage_addr, 0);
 
     if (pte_l1 != 0 && (*pte_l1 & PTE_V) && is_superpage(*pte_l1)) {
-      // This is a superpage - copy the entire 2MB page
+      // This is a superpage - share the entire 2MB page
       pa = PTE2PA(*pte_l1);
       flags = PTE_FLAGS(*pte_l1);
-
-      // Allocate a new superpage
-      mem = superalloc();
-      if (mem == 0) goto err;
-
-      // Copy the entire 2MB
-      memmove(mem, (char *)pa, SUPERPGSIZE);
-
-      // Map the new superpage
-      if (map_superpage(new, superpage_addr, (uint64)mem, flags) != 0) {
-        superfree(mem);
-        goto err;
+      if (flags & PTE_W) {
+        flags = (flags & ~PTE_W) | PTE_COW;
+        *pte_l1 = PA2PTE(pa) | flags;
       }
 
+      if (map_superpage(new, superpage_addr, pa, flags) != 0) goto err;
+      kref((void *)pa);
+
       // Skip to the next address after this superpage
       i = superpage_addr + SUPERPGSIZE;
       continue;
@@ -458,27 +850,75 @@ int uvmcopy(pagetable_t old, pagetable_t new, uint64 sz) {
       i += PGSIZE;
       continue;  // page table entry hasn't been allocated
     }
+    if (*pte & PTE_SWAP) {
+      // share the swap slot; each process reads in its own copy.
+      pte_t *npte = walk(new, i, 1);
+      if (npte == 0) goto err;
+      *npte = *pte;
+      swapdup(PTE2SLOT(*pte));
+      i += PGSIZE;
+      continue;
+    }
     if ((*pte & PTE_V) == 0) {
       i += PGSIZE;
       continue;  // physical page hasn't been allocated
     }
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
-    if ((mem = kalloc()) == 0) goto err;
-    memmove(mem, (char *)pa, PGSIZE);
-    if (mappages(new, i, PGSIZE, (uint64)mem, flags) != 0) {
-      kfree(mem);
-      goto err;
+    if (flags & PTE_W) {
+      flags = (flags & ~PTE_W) | PTE_COW;
+      *pte = PA2PTE(pa) | flags;
     }
+    if (mappages(new, i, PGSIZE, pa, flags) != 0) goto err;
+    kref((void *)pa);
     i += PGSIZE;
   }
+  // the parent's writable pages are now read-only.
+  uvmflush(old);
   return 0;
 
 err:
-  uvmunmap(new, 0, i / PGSIZE, 1);
+  uvmunmap(new, start, (i - start) / PGSIZE, 1);
+  uvmflush(old);
   return -1;
 }
 
+// Handle a write to the copy-on-write page containing va: copy it,
+// or just make it writable if no other page table shares it.
+// Returns the physical address of the (now writable) 4KB page
+// containing va, or 0 if va is not copy-on-write or memory is out.
+uint64 cowfault(pagetable_t pagetable, uint64 va) {
+  pte_t *pte;
+  uint64 pa;
+  uint flags;
+  int super;
+
+  if (va >= MAXVA) return 0;
+  pte = walkleaf(pagetable, va, &super);
+  if (pte == 0 || (*pte & (PTE_V | PTE_U | PTE_COW)) !=
+                      (PTE_V | PTE_U | PTE_COW))
+    return 0;
+
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+  if (krefcnt((void *)pa) == 1) {
+    // the other sharers are gone; reuse the page.
+    *pte = PA2PTE(pa) | flags;
+  } else if (super) {
+    if (superpage_unshare(pte) != 0) return 0;
+  } else {
+    char *mem = kalloc();
+    if (mem == 0 && uvmreclaim() > 0) mem = kalloc();
+    if (mem == 0) return 0;
+    memmove(mem, (char *)pa, PGSIZE);
+    *pte = PA2PTE(mem) | flags;
+    kfree((void *)pa);
+  }
+  uvmflush(pagetable);
+  countfault(FAULT_COW);
+  return walkaddr(pagetable, va);
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
 void uvmclear(pagetable_t pagetable, uint64 va) {
@@ -489,35 +929,126 @@ void uvmclear(pagetable_t pagetable, uint64 va) {
   *pte &= ~PTE_U;
 }
 
-// Copy from kernel to user.
-// Copy len bytes from src to virtual address dstva in a given page table.
-// Return 0 on success, -1 on error.
-int copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len) {
-  uint64 n, va0, pa0;
+// Translate user address va for a copy, faulting the page in
+// (and breaking copy-on-write sharing if write) as needed.
+// *n is set to the bytes from va on that are physically
+// contiguous: the rest of the superpage, or of the run of
+// adjacent 4KB pages in the same level-0 table that allow the
+// access, so that a large copy takes one walk per run instead of
+// one per page. Returns the physical address, or 0 if va is not
+// user memory that allows the access.
+static uint64 useraddr(pagetable_t pagetable, uint64 va, int write,
+                       uint64 *n) {
+  uint64 perm = PTE_V | PTE_U | (write ? PTE_W : 0);
+  uint64 pa, off;
   pte_t *pte;
+  int super;
 
-  while (len > 0) {
-    va0 = PGROUNDDOWN(dstva);
-    if (va0 >= MAXVA) return -1;
-
-    pa0 = walkaddr(pagetable, va0);
-    if (pa0 == 0) {
-      if ((pa0 = vmfault(pagetable, va0, 0)) == 0) {
-        return -1;
+  if (va >= MAXVA) return 0;
+  pte = walkleaf(pagetable, va, &super);
+  if (pte == 0 || (*pte & (PTE_V | PTE_U)) != (PTE_V | PTE_U) ||
+      (write && (*pte & PTE_W) == 0)) {
+    // a fault may sleep reading the page in, so a caller
+    // holding a spinlock (piperead(), say) gets an error, and
+    // faults the range in with userfaultin() after releasing it.
+    if (!intr_get()) return 0;
+    // a fault changes the page table, which other threads may
+    // be doing too.
+    int locked = pagetable == myproc()->pagetable ? lockvm() : 0;
+    myproc()->ru.nfault++;
+    if (pte == 0 || (*pte & (PTE_V | PTE_U)) != (PTE_V | PTE_U)) {
+      if (vmfault(pagetable, PGROUNDDOWN(va), write) == 0) {
+        unlockvm(locked);
+        return 0;
+      }
+      pte = walkleaf(pagetable, va, &super);
+    }
+    // forbid copyout over read-only user text pages,
+    // and break copy-on-write sharing.
+    if (write && (*pte & PTE_W) == 0) {
+      if ((*pte & PTE_COW) == 0 ||
+          cowfault(pagetable, PGROUNDDOWN(va)) == 0) {
+        unlockvm(locked);
+        return 0;
       }
+      pte = walkleaf(pagetable, va, &super);
     }
+    unlockvm(locked);
+  }
+  // the hardware sets PTE_D only for user stores.
+  if (write) *pte |= PTE_A | PTE_D;
+
+  if (super) {
+    off = va % SUPERPGSIZE;
+    *n = SUPERPGSIZE - off;
+    return PTE2PA(*pte) + off;
+  }
+  off = va % PGSIZE;
+  pa = PTE2PA(*pte);
+  *n = PGSIZE - off;
+  // extend the run to the end of this level-0 table.
+  for (pte_t *next = pte + 1; (uint64)next % PGSIZE != 0 &&
+                              (*next & perm) == perm &&
+                              PTE2PA(*next) == pa + off + *n;
+       next++) {
+    if (write) *next |= PTE_A | PTE_D;
+    *n += PGSIZE;
+  }
+  return pa + off;
+}
+
+// Translate user address va as a copy would, faulting the page
+// in as needed. Returns the physical address, or 0.
+uint64 userpa(pagetable_t pagetable, uint64 va, int write) {
+  uint64 n;
+
+  return useraddr(pagetable, va, write, &n);
+}
 
-    pte = walk(pagetable, va0, 0);
-    // forbid copyout over read-only user text pages.
-    if ((*pte & PTE_W) == 0) return -1;
+// Fault in the user pages of [va, va+len) as a copy would, for a
+// caller that is about to copy with a spinlock held and so cannot
+// fault. Returns 0, or -1 if some of it is not user memory that
+// allows the access.
+int userfaultin(pagetable_t pagetable, uint64 va, uint64 len, int write) {
+  uint64 n, end = va + len;
 
-    n = PGSIZE - (dstva - va0);
+  while (va < end) {
+    if (useraddr(pagetable, va, write, &n) == 0) return -1;
+    va += n;
+  }
+  return 0;
+}
+
+// Translate user address va as userpa() does, and take a
+// reference to the page or superpage holding it, which *page is
+// set to, so that it stays allocated while a device reads or
+// writes it. The caller drops the reference with kfree(*page).
+// Returns the physical address, or 0.
+uint64 userpin(pagetable_t pagetable, uint64 va, int write, uint64 *page) {
+  uint64 n, pa;
+  int super;
+
+  if ((pa = useraddr(pagetable, va, write, &n)) == 0) return 0;
+  pte_t *pte = walkleaf(pagetable, va, &super);
+  *page = super ? PTE2PA(*pte) : PGROUNDDOWN(pa);
+  kref((void *)*page);
+  return pa;
+}
+
+// Copy from kernel to user.
+// Copy len bytes from src to virtual address dstva in a given page table.
+// Return 0 on success, -1 on error.
+int copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len) {
+  uint64 n, pa;
+
+  while (len > 0) {
+    if ((pa = useraddr(pagetable, dstva, 1, &n)) == 0) return -1;
     if (n > len) n = len;
-    memmove((void *)(pa0 + (dstva - va0)), src, n);
+    memmove((void *)pa, src, n);
 
     len -= n;
     src += n;
-    dstva = va0 + PGSIZE;
+    dstva += n;
   }
   return 0;
 }
@@ -526,23 +1057,16 @@ int copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len) {
 // Copy len bytes to dst from virtual address srcva in a given page table.
 // Return 0 on success, -1 on error.
 int copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len) {
-  uint64 n, va0, pa0;
+  uint64 n, pa;
 
   while (len > 0) {
-    va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if (pa0 == 0) {
-      if ((pa0 = vmfault(pagetable, va0, 0)) == 0) {
-        return -1;
-      }
-    }
-    n = PGSIZE - (srcva - va0);
+    if ((pa = useraddr(pagetable, srcva, 0, &n)) == 0) return -1;
     if (n > len) n = len;
-    memmove(dst, (void *)(pa0 + (srcva - va0)), n);
+    memmove(dst, (void *)pa, n);
 
     len -= n;
     dst += n;
-    srcva = va0 + PGSIZE;
+    srcva += n;
   }
   return 0;
 }
@@ -552,98 +1076,328 @@ int copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len) {
 // until a '\0', or max.
 // Return 0 on success, -1 on error.
 int copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max) {
-  uint64 n, va0, pa0;
-  int got_null = 0;
-
-  while (got_null == 0 && max > 0) {
-    va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if (pa0 == 0) return -1;
-    n = PGSIZE - (srcva - va0);
+  uint64 n, pa;
+
+  while (max > 0) {
+    if ((pa = useraddr(pagetable, srcva, 0, &n)) == 0) return -1;
     if (n > max) n = max;
 
-    char *p = (char *)(pa0 + (srcva - va0));
-    while (n > 0) {
-      if (*p == '\0') {
-        *dst = '\0';
-        got_null = 1;
-        break;
-      } else {
-        *dst = *p;
-      }
-      --n;
-      --max;
-      p++;
-      dst++;
+    char *p = (char *)pa;
+    for (uint64 i = 0; i < n; i++) {
+      if ((*dst++ = p[i]) == '\0') return 0;
     }
+    max -= n;
+    srcva += n;
+  }
+  return -1;
+}
+
+// Can page va of private file mapping v be the file's cached
+// page? Only if the page holds nothing but file bytes, with no
+// bss to zero, and they start on a page of the file.
+static int vma_sharable(struct vma *v, uint64 va) {
+  uint64 offset_in_vma = va - v->addr;
+
+  return (v->offset + offset_in_vma) % PGSIZE == 0 &&
+         (offset_in_vma + PGSIZE <= v->filesz || v->filesz >= v->len);
+}
+
+// Read page va of file mapping v in and map it with perm.
+// A MAP_SHARED mapping maps the file's cached page itself. So
+// does a private one that only reads the page, e.g. an exec
+// segment's text, read-only or copy-on-write, so that every
+// process running a program shares one copy. A private write
+// fault, or a page with bss, gets a copy, zero past filesz.
+// Caller must hold v's inode lock.
+// Returns the physical address, or 0.
+static uint64 vma_mappage(pagetable_t pagetable, struct vma *v, uint64 va,
+                          int perm) {
+  uint64 offset_in_vma = va - v->addr;
+  uint64 file_offset = v->offset + offset_in_vma;
+  struct inode *ip = v->file->ip;
+  uint64 mem;
 
-    srcva = va0 + PGSIZE;
+  if (v->flags & MAP_SHARED) {
+    if ((mem = pagecache_get(ip, file_offset / PGSIZE)) == 0) return 0;
+  } else if ((perm & PTE_D) == 0 && vma_sharable(v, va)) {
+    if ((mem = pagecache_get(ip, file_offset / PGSIZE)) == 0) return 0;
+    if (perm & PTE_W) perm = (perm & ~PTE_W) | PTE_COW;
+  } else {
+    if ((mem = (uint64)kalloc_zeroed()) == 0) return 0;
+    uint64 n = 0;
+    if (offset_in_vma < v->filesz) n = v->filesz - offset_in_vma;
+    if (n > PGSIZE) n = PGSIZE;
+    if (n > 0 && readi(ip, 0, mem, file_offset, n) < 0) {
+      kfree((void *)mem);
+      return 0;
+    }
   }
-  if (got_null) {
+
+  if (mappages(pagetable, va, PGSIZE, mem, perm) != 0) {
+    kfree((void *)mem);
     return 0;
+  }
+  return mem;
+}
+
+// Map the zero page at va for a read fault, with perm made
+// copy-on-write if it allows writes. Returns the physical
+// address, or 0.
+static uint64 mapzero(pagetable_t pagetable, uint64 va, int perm) {
+  if (perm & PTE_W) perm = (perm & ~PTE_W) | PTE_COW;
+  if (mappages(pagetable, va, PGSIZE, (uint64)zeropage, perm) != 0) return 0;
+  kref(zeropage);
+  return (uint64)zeropage;
+}
+
+// Map zeroed memory at page va of anonymous mapping v with perm.
+// A shared mapping takes the page from its struct anon. With
+// MAP_HUGE, a private mapping's fault maps a whole superpage when
+// va's 2MB region lies inside v and nothing there is mapped yet;
+// otherwise a private read fault maps the zero page.
+// Returns the physical address of va's page, or 0.
+static uint64 vma_anonfault(pagetable_t pagetable, struct vma *v, uint64 va,
+                            int perm, int write) {
+  uint64 mem, super = SUPERPGROUNDDOWN(va);
+
+  if (v->flags & MAP_SHARED) {
+    mem = anon_getpage(v->anon, (v->offset + (va - v->addr)) / PGSIZE);
   } else {
-    return -1;
+    if ((v->flags & MAP_HUGE) && super >= v->addr &&
+        super + SUPERPGSIZE <= v->addr + v->len) {
+      pte_t *pte = walk_superpage(pagetable, super, 0);
+      if ((pte == 0 || (*pte & PTE_V) == 0) &&
+          (mem = (uint64)superalloc_compact()) != 0) {
+        if (map_superpage(pagetable, super, mem, perm) == 0)
+          return mem + (va - super);
+        superfree((void *)mem);
+      }
+    }
+    if (!write) return mapzero(pagetable, va, perm);
+    mem = (uint64)kalloc_zeroed();
+  }
+  if (mem == 0) return 0;
+
+  if (mappages(pagetable, va, PGSIZE, mem, perm) != 0) {
+    kfree((void *)mem);
+    return 0;
   }
+  return mem;
+}
+
+// Read the swapped-out page named by pte back in and map it.
+// Returns the physical address, or 0 if out of memory.
+static uint64 swapin(pte_t *pte) {
+  uint slot = PTE2SLOT(*pte);
+  char *mem = kalloc();
+
+  if (mem == 0 && uvmreclaim() > 0) mem = kalloc();
+  if (mem == 0) return 0;
+  swapread(slot, mem);
+  swapfree(slot);
+  *pte = PA2PTE(mem) | (PTE_FLAGS(*pte) & ~PTE_SWAP) | PTE_V | PTE_A;
+  return (uint64)mem;
+}
+
+// Evict the page p maps at va with leaf pte, whose PTE_A is
+// clear. A clean file page is just unmapped, to be read again on
+// the next fault: a private copy is freed here, a cached page by
+// pagecache_reclaim() once nothing else maps it. Other private
+// pages go to swap. Pages still shared with another page table
+// (copy-on-write after fork), dirty shared file pages and shared
+// anonymous pages stay. Returns the pages freed.
+static int reclaim_page(struct proc *p, uint64 va, pte_t *pte) {
+  uint64 pa = PTE2PA(*pte);
+  uint flags = PTE_FLAGS(*pte);
+  struct vma *v = vma_lookup(&p->vmas, va);
+  int slot;
+
+  // a sleeping futex waiter would miss wakeups at the new one.
+  if (futex_busy(pa)) return 0;
+
+  if (v && (v->flags & MAP_SHARED)) {
+    if (v->file == 0 || (flags & PTE_D)) return 0;
+    *pte = 0;
+    kfree((void *)pa);
+    return 0;
+  }
+  if (v && v->file && (flags & (PTE_W | PTE_COW | PTE_D)) == 0) {
+    // the page may be the page cache's, mapped by every process
+    // running the program; only the last mapping frees it.
+    int last = krefcnt((void *)pa) == 1;
+    *pte = 0;
+    kfree((void *)pa);
+    return last;
+  }
+  if (krefcnt((void *)pa) > 1) return 0;
+  if ((slot = swapalloc()) < 0) return 0;
+  swapwrite(slot, (void *)pa);
+  *pte = SLOT2PTE(slot, flags);
+  kfree((void *)pa);
+  return 1;
+}
+
+// Split the unshared superpage mapped by pte_l1 into 4KB
+// pages that reclaim_page() can evict. There may be no memory
+// for the level-0 page table, so the first 4KB page goes to swap
+// and its frame becomes the page table.
+// Returns 0 on success, -1 if not.
+static int reclaim_split(pte_t *pte_l1) {
+  uint64 pa = PTE2PA(*pte_l1);
+  uint flags = PTE_FLAGS(*pte_l1);
+  pagetable_t pt = (pagetable_t)pa;
+  int slot;
+
+  if (krefcnt((void *)pa) > 1 || (slot = swapalloc()) < 0) return -1;
+  swapwrite(slot, (void *)pa);
+  pt[0] = SLOT2PTE(slot, flags);
+  for (int i = 1; i < 512; i++) {
+    pt[i] = PA2PTE(pa + (uint64)i * PGSIZE) | flags;
+    pa2page((void *)(pa + (uint64)i * PGSIZE))->refcnt = 1;
+  }
+  *pte_l1 = PA2PTE(pt) | PTE_V;
+  return 0;
+}
+
+// Free some of the current process's memory when it runs out:
+// a clock sweeps its page table from where the last call
+// stopped, clearing PTE_A on recently used pages and evicting the
+// ones that stayed unused since the previous sweep. Then frees
+// cached file pages nothing maps. Only the current process is
+// scanned, so no reverse map is needed. As in uvmcompact(), one
+// with other threads keeps its pages, since they could store to
+// a page while it is written out, or through a stale TLB entry
+// after it is freed.
+// Returns the number of pages freed.
+int uvmreclaim(void) {
+  struct proc *p = myproc() ? myproc()->leader : 0;
+  int freed = 0, wraps = 0;
+  uint64 va;
+  pte_t *pte;
+
+  // swapping out and writing back sleep, which a caller holding
+  // a spinlock cannot.
+  if (!intr_get()) return 0;
+  if (p == 0 || p->threads > 0) return pagecache_reclaim();
+
+  for (va = p->swaphand; freed < RECLAIM_BATCH;) {
+    if (va >= UTOP) {
+      if (++wraps > 2) break;
+      va = 0;
+    }
+    if ((pte = walk_superpage(p->pagetable, va, 0)) == 0) {
+      va = (va | ((1L << 30) - 1)) + 1;  // no level-1 page table
+      continue;
+    }
+    if ((*pte & PTE_V) == 0 || (is_superpage(*pte) && (*pte & PTE_A))) {
+      *pte &= ~PTE_A;
+      va = SUPERPGROUNDDOWN(va) + SUPERPGSIZE;
+      continue;
+    }
+    if (is_superpage(*pte)) {
+      if ((*pte & PTE_U) == 0 || reclaim_split(pte) != 0)
+        va = SUPERPGROUNDDOWN(va) + SUPERPGSIZE;
+      continue;
+    }
+    pte = &((pagetable_t)PTE2PA(*pte))[PX(0, va)];
+    if ((*pte & (PTE_V | PTE_U)) == (PTE_V | PTE_U)) {
+      if (*pte & PTE_A)
+        *pte &= ~PTE_A;
+      else
+        freed += reclaim_page(p, va, pte);
+    }
+    va += PGSIZE;
+  }
+  p->swaphand = va;
+  uvmflush(p->pagetable);
+
+  return freed + pagecache_reclaim();
 }
 
 // allocate and map user memory if process is referencing a page
-// that was lazily allocated in sys_sbrk().
+// that was lazily allocated in sys_sbrk(), and copy a
+// copy-on-write page that is written. A read of a page nothing
+// has written maps the shared zero page instead.
 // returns 0 if va is invalid or already mapped, or if
 // out of physical memory, and physical address if successful.
 uint64 vmfault(pagetable_t pagetable, uint64 va, int write) {
   uint64 mem;
-  struct proc *p = myproc();
+  struct proc *p = myproc()->leader;
 
   va = PGROUNDDOWN(va);
 
+  // A swapped-out page comes back from the swap area.
+  int leafsuper;
+  pte_t *pte = va < MAXVA ? walkleaf(pagetable, va, &leafsuper) : 0;
+  if (pte && !leafsuper && (*pte & PTE_SWAP)) {
+    if ((mem = swapin(pte)) != 0) countfault(FAULT_SWAP);
+    if (mem == 0 || !write || (*pte & PTE_W)) return mem;
+    return cowfault(pagetable, va);
+  }
+
   // Check if already mapped
   if (ismapped(pagetable, va)) {
-    return 0;
+    // The PTE allows the access: the hart used a stale TLB entry
+    // or wants PTE_A or PTE_D set by software.
+    uint perm = PTE_V | PTE_U | (write ? PTE_W : PTE_R);
+    if ((*pte & perm) == perm) {
+      *pte |= write ? PTE_A | PTE_D : PTE_A;
+      uvmflush(pagetable);
+      countfault(FAULT_MINOR);
+      return walkaddr(pagetable, va);
+    }
+    return write ? cowfault(pagetable, va) : 0;
   }
 
   // Check if this is a mmap-ed region
-  struct vma *v = 0;
-  for (int i = 0; i < NVMA; i++) {
-    if (p->vmas[i].used &&
-        va >= p->vmas[i].addr &&
-        va < p->vmas[i].addr + p->vmas[i].len) {
-      v = &p->vmas[i];
-      break;
-    }
-  }
+  struct vma *v = vma_lookup(&p->vmas, va);
 
   if (v) {
     // This is a page fault in a mmap-ed region
-    // Allocate physical page
-    mem = (uint64)kalloc();
-    if (mem == 0) return 0;
-    memset((void *)mem, 0, PGSIZE);
-
-    // Read from file
-    uint64 offset_in_vma = va - v->addr;
-    uint64 file_offset = v->offset + offset_in_vma;
+    int perm = PTE_U | PTE_A;
+    if (v->prot & PROT_READ) perm |= PTE_R;
+    if (v->prot & PROT_WRITE) perm |= PTE_W;
+    if (v->prot & PROT_EXEC) perm |= PTE_X;
 
-    // Lock inode and read from file
+    if (v->file == 0) {
+      mem = vma_anonfault(pagetable, v, va, perm, write);
+      if (mem == 0 && uvmreclaim() > 0)
+        mem = vma_anonfault(pagetable, v, va, perm, write);
+      if (mem) countfault(FAULT_ANON);
+      return mem;
+    }
     struct inode *ip = v->file->ip;
-    ilock(ip);
-    int bytes_read = readi(ip, 0, mem, file_offset, PGSIZE);
-    iunlock(ip);
 
-    if (bytes_read < 0) {
-      kfree((void *)mem);
-      return 0;
+    // Faults that walk the mapping in order map a growing
+    // window of the pages after va along with it.
+    // madvise() can fix the window at either end.
+    int n = 1;
+    if (v->advice == MADV_SEQUENTIAL) {
+      n = FAULTAROUND_MAX;
+    } else if (v->advice == MADV_RANDOM) {
+      n = 1;
+    } else if (va == v->nextfault || va == v->addr) {
+      v->window = v->window ? v->window * 2 : FAULTAROUND_MIN;
+      if (v->window > FAULTAROUND_MAX) v->window = FAULTAROUND_MAX;
+      n = v->window;
+    } else {
+      v->window = 0;
     }
 
-    // Map page with correct permissions
-    int perm = PTE_U;
-    if (v->prot & PROT_READ) perm |= PTE_R;
-    if (v->prot & PROT_WRITE) perm |= PTE_W;
-    if (v->prot & PROT_EXEC) perm |= PTE_X;
-
-    if (mappages(pagetable, va, PGSIZE, mem, perm) != 0) {
-      kfree((void *)mem);
-      return 0;
+    ilock(ip);
+    // PTE_D tells vma_writeback() whether a shared page changed.
+    if (write) perm |= PTE_D;
+    mem = vma_mappage(pagetable, v, va, perm);
+    if (mem == 0 && uvmreclaim() > 0) mem = vma_mappage(pagetable, v, va, perm);
+    perm &= ~PTE_D;
+    uint64 a = va + PGSIZE;
+    for (int i = 1; mem && i < n && a < v->addr + v->len; i++, a += PGSIZE) {
+      if (ismapped(pagetable, a)) continue;
+      if (vma_mappage(pagetable, v, a, perm) == 0) break;
     }
+    iunlock(ip);
+    v->nextfault = a;
+    if (mem) countfault(FAULT_FILE);
 
     return mem;
   }
@@ -651,23 +1405,119 @@ uint64 vmfault(pagetable_t pagetable, uint64 va, int write) {
   // Handle lazy allocation (for sbrk)
   if (va >= p->sz) return 0;
 
-  mem = (uint64)kalloc();
+  if (!write) {
+    mem = mapzero(p->pagetable, va, PTE_W | PTE_U | PTE_R);
+    if (mem) countfault(FAULT_LAZY);
+    return mem;
+  }
+  mem = (uint64)kalloc_reclaim();
   if (mem == 0) return 0;
-  memset((void *)mem, 0, PGSIZE);
   if (mappages(p->pagetable, va, PGSIZE, mem, PTE_W | PTE_U | PTE_R) != 0) {
     kfree((void *)mem);
     return 0;
   }
+
+  // This page may have been the last missing one of its 2MB region.
+  uint64 super = SUPERPGROUNDDOWN(va);
+  if (super + SUPERPGSIZE <= p->sz &&
+      promote_superpage(p->pagetable, super) == 0)
+    mem = walkaddr(p->pagetable, va);
+  if (mem) countfault(FAULT_LAZY);
   return mem;
 }
 
+// Read in and map the pages of file mapping v in the page-aligned
+// range [start, end) that are not mapped yet, for MADV_WILLNEED.
+// Stops early if memory runs short.
+void vma_prefault(pagetable_t pagetable, struct vma *v, uint64 start,
+                  uint64 end) {
+  if (v->file == 0) return;  // anonymous pages start out zero
+  int perm = PTE_U | PTE_A;
+  if (v->prot & PROT_READ) perm |= PTE_R;
+  if (v->prot & PROT_WRITE) perm |= PTE_W;
+  if (v->prot & PROT_EXEC) perm |= PTE_X;
+
+  struct inode *ip = v->file->ip;
+  ilock(ip);
+  for (uint64 a = start; a < end; a += PGSIZE) {
+    if (ismapped(pagetable, a)) continue;
+    if (vma_mappage(pagetable, v, a, perm) == 0) break;
+  }
+  iunlock(ip);
+}
+
+// Write the dirty pages of v's [addr, addr+len) back to its file
+// and clear their PTE_D. Only MAP_SHARED mappings are written.
+// Must not be called inside a file system transaction.
+void vma_writeback(pagetable_t pagetable, struct vma *v, uint64 addr,
+                   uint64 len) {
+  int super;
+
+  if (!(v->flags & MAP_SHARED) || v->file == 0) return;
+  struct inode *ip = v->file->ip;
+
+  for (uint64 va = addr; va < addr + len; va += PGSIZE) {
+    pte_t *pte = walkleaf(pagetable, va, &super);
+    if (pte == 0 || super || (*pte & (PTE_V | PTE_D)) != (PTE_V | PTE_D))
+      continue;
+
+    uint64 off = v->offset + (va - v->addr);
+    begin_op();
+    ilock(ip);
+    if (off < ip->size) {
+      uint n = ip->size - off < PGSIZE ? ip->size - off : PGSIZE;
+      writei(ip, 0, PTE2PA(*pte), off, n);
+    }
+    iunlock(ip);
+    end_op();
+    *pte &= ~PTE_D;
+  }
+  uvmflush(pagetable);
+}
+
 int ismapped(pagetable_t pagetable, uint64 va) {
-  pte_t *pte = walk(pagetable, va, 0);
+  int super;
+
+  if (va >= MAXVA) return 0;
+  pte_t *pte = walkleaf(pagetable, va, &super);
   if (pte == 0) {
     return 0;
   }
-  if (*pte & PTE_V) {
+  if (*pte & (PTE_V | PTE_SWAP)) {
     return 1;
   }
   return 0;
 }
+
+// Fill in the page fault counts of mi.
+void vmstat(struct meminfo *mi) {
+  for (int i = 0; i < NFAULT; i++) mi->fault[i] = nfaults[i];
+}
+
+static uint64 residentwalk(pagetable_t pt, int level, uint64 *swapped) {
+  uint64 n = 0;
+
+  for (int i = 0; i < 512; i++) {
+    pte_t pte = pt[i];
+    if ((pte & PTE_V) == 0) {
+      if (level == 0 && (pte & PTE_SWAP)) (*swapped)++;
+    } else if (pte & (PTE_R | PTE_W | PTE_X)) {
+      // the zero page is not the process's own memory.
+      if ((pte & PTE_U) && PTE2PA(pte) != (uint64)zeropage)
+        n += 1L << (9 * level);
+    } else if (level > 0 && PTE2PA(pte) >= KERNBASE &&
+               PTE2PA(pte) < PHYSTOP) {
+      n += residentwalk((pagetable_t)PTE2PA(pte), level - 1, swapped);
+    }
+  }
+  return n;
+}
+
+// Count the user pages resident in pagetable, a superpage as
+// 512, and set *swapped to those out in the swap area. Takes no
+// lock, for pinfo() on any process: a table that a racing exec()
+// or promotion frees is still RAM, and only skews the counts.
+uint64 uvmresident(pagetable_t pagetable, uint64 *swapped) {
+  *swapped = 0;
+  return residentwalk(pagetable, 2, swapped);
+}
@@ -6,15 +6,21 @@
 #include "riscv.h"
 #include "types.h"
 
+struct meminfo;
+struct vma;
+
 // vm.c APIs
 void kvminit(void);
 void kvminithart(void);
 void kvmmap(pagetable_t, uint64, uint64, uint64, int);
+uint64 kstackalloc(void);
+void kstackfree(uint64);
 int mappages(pagetable_t, uint64, uint64, uint64, int);
 pagetable_t uvmcreate(void);
 uint64 uvmalloc(pagetable_t, uint64, uint64, int);
 uint64 uvmdealloc(pagetable_t, uint64, uint64);
 int uvmcopy(pagetable_t, pagetable_t, uint64);
+int uvmcopyrange(pagetable_t, pagetable_t, uint64, uint64);
 void uvmfree(pagetable_t, uint64);
 void uvmunmap(pagetable_t, uint64, uint64, int);
 void uvmclear(pagetable_t, uint64);
@@ -23,5 +29,20 @@ uint64 walkaddr(pagetable_t, uint64);
 int copyout(pagetable_t, uint64, char *, uint64);
 int copyin(pagetable_t, char *, uint64, uint64);
 int copyinstr(pagetable_t, char *, uint64, uint64);
+uint64 userpa(pagetable_t, uint64, int);
+int userfaultin(pagetable_t, uint64, uint64, int);
+uint64 userpin(pagetable_t, uint64, int, uint64 *);
 int ismapped(pagetable_t, uint64);
 uint64 vmfault(pagetable_t, uint64, int);
+uint64 cowfault(pagetable_t, uint64);
+int uvmreclaim(void);
+int uvmcompact(void);
+uint64 uvmresident(pagetable_t, uint64 *);
+void vmstat(struct meminfo *);
+void uvmflush(pagetable_t);
+int asidalloc(void);
+void asidfree(int);
+void vma_writeback(pagetable_t, struct vma *, uint64, uint64);
+void vma_prefault(pagetable_t, struct vma *, uint64, uint64);
+int map_superpage(pagetable_t, uint64, uint64, int);
+int promote_superpage(pagetable_t, uint64);
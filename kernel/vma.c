@@ -0,0 +1,216 @@
+// Per-process virtual memory areas.
+//
+// A process's VMAs live in an AVL tree keyed by start address, so
+// page faults find their VMA in O(log n) and the number of mappings
+// is limited only by memory. The tree is private to its process and
+// needs no lock.
+//
+// A VMA's addr may move up while it is in the tree (munmap of its
+// front part); that keeps the order, since VMAs never overlap.
+
+#include "vma.h"
+
+#include "file.h"
+#include "pagecache.h"
+#include "printf.h"
+#include "riscv.h"
+#include "slab.h"
+#include "string.h"
+#include "types.h"
+
+#define ALIGNUP(a, align) (((a) + (align) - 1) & ~((align) - 1))
+
+static struct kmem_cache *vma_cache;
+
+static void vmactor(void *obj) { memset(obj, 0, sizeof(struct vma)); }
+
+void vmainit(void) {
+  vma_cache = kmem_cache_create("vma", sizeof(struct vma), vmactor, 0,
+                                SLAB_HWCACHE_ALIGN);
+  if (vma_cache == 0) panic("vmainit");
+}
+
+// Allocate a zeroed VMA, or return 0 if memory is short.
+struct vma *vma_alloc(void) { return kmem_cache_alloc(vma_cache); }
+
+// Free a VMA that is in no tree, without releasing v->file
+// or v->anon.
+void vma_free(struct vma *v) { kmem_cache_free(vma_cache, v); }
+
+// Return a copy of v, outside any tree, with its own
+// reference to v's file or anonymous pages; 0 if memory is short.
+struct vma *vma_dup(struct vma *v) {
+  struct vma *nv = vma_alloc();
+  if (nv == 0) return 0;
+  *nv = *v;
+  nv->left = nv->right = 0;
+  if (nv->file) filedup(nv->file);
+  if (nv->anon) anon_dup(nv->anon);
+  return nv;
+}
+
+// Release v's file or anonymous pages and free v, which must
+// be in no tree. Does not touch any page table.
+void vma_put(struct vma *v) {
+  if (v->file) fileclose(v->file);
+  if (v->anon) anon_put(v->anon);
+  vma_free(v);
+}
+
+// vma_put() n VMAs, freeing them together.
+void vma_put_bulk(int n, struct vma **vs) {
+  for (int i = 0; i < n; i++) {
+    if (vs[i]->file) fileclose(vs[i]->file);
+    if (vs[i]->anon) anon_put(vs[i]->anon);
+  }
+  kmem_cache_free_bulk(vma_cache, n, (void **)vs);
+}
+
+static int height(struct vma *n) { return n ? n->height : 0; }
+
+static void update(struct vma *n) {
+  int l = height(n->left), r = height(n->right);
+  n->height = (l > r ? l : r) + 1;
+}
+
+static struct vma *rotate_right(struct vma *n) {
+  struct vma *l = n->left;
+  n->left = l->right;
+  l->right = n;
+  update(n);
+  update(l);
+  return l;
+}
+
+static struct vma *rotate_left(struct vma *n) {
+  struct vma *r = n->right;
+  n->right = r->left;
+  r->left = n;
+  update(n);
+  update(r);
+  return r;
+}
+
+// Restore the AVL balance at n after one of its subtrees
+// changed height by one. Returns the new subtree root.
+static struct vma *rebalance(struct vma *n) {
+  update(n);
+  int bf = height(n->left) - height(n->right);
+  if (bf > 1) {
+    if (height(n->left->left) < height(n->left->right))
+      n->left = rotate_left(n->left);
+    return rotate_right(n);
+  }
+  if (bf < -1) {
+    if (height(n->right->right) < height(n->right->left))
+      n->right = rotate_right(n->right);
+    return rotate_left(n);
+  }
+  return n;
+}
+
+static struct vma *tree_insert(struct vma *n, struct vma *v) {
+  if (n == 0) return v;
+  if (v->addr < n->addr)
+    n->left = tree_insert(n->left, v);
+  else
+    n->right = tree_insert(n->right, v);
+  return rebalance(n);
+}
+
+// Add v to t. Returns -1, leaving t alone, if v overlaps
+// a VMA already there.
+int vma_insert(struct vmatree *t, struct vma *v) {
+  if (v->len == 0 || v->addr + v->len < v->addr) return -1;
+  struct vma *n = vma_find(t, v->addr);
+  if (n && n->addr < v->addr + v->len) return -1;
+
+  v->left = v->right = 0;
+  v->height = 1;
+  t->root = tree_insert(t->root, v);
+  t->count++;
+  return 0;
+}
+
+// Unlink the leftmost node of subtree n into *min.
+static struct vma *tree_remove_min(struct vma *n, struct vma **min) {
+  if (n->left == 0) {
+    *min = n;
+    return n->right;
+  }
+  n->left = tree_remove_min(n->left, min);
+  return rebalance(n);
+}
+
+static struct vma *tree_remove(struct vma *n, struct vma *v) {
+  if (n == 0) panic("vma_remove");
+  if (v->addr < n->addr) {
+    n->left = tree_remove(n->left, v);
+  } else if (v->addr > n->addr) {
+    n->right = tree_remove(n->right, v);
+  } else {
+    if (n != v) panic("vma_remove");
+    struct vma *l = n->left, *r = n->right, *m;
+    if (r == 0) return l;
+    r = tree_remove_min(r, &m);
+    m->left = l;
+    m->right = r;
+    return rebalance(m);
+  }
+  return rebalance(n);
+}
+
+// Take v out of t. The caller still owns v.
+void vma_remove(struct vmatree *t, struct vma *v) {
+  t->root = tree_remove(t->root, v);
+  t->count--;
+  if (t->hint == v) t->hint = 0;
+  v->left = v->right = 0;
+}
+
+// Return the lowest VMA that ends above addr, or 0.
+// vma_find(t, 0) is the first VMA; vma_find(t, v->addr + v->len)
+// is the one after v, even if v has just been removed.
+struct vma *vma_find(struct vmatree *t, uint64 addr) {
+  struct vma *best = 0;
+  for (struct vma *n = t->root; n;) {
+    if (n->addr + n->len > addr) {
+      best = n;
+      n = n->left;
+    } else {
+      n = n->right;
+    }
+  }
+  return best;
+}
+
+// Return the VMA containing va, or 0.
+struct vma *vma_lookup(struct vmatree *t, uint64 va) {
+  struct vma *v = t->hint;
+  if (v && va >= v->addr && va < v->addr + v->len) return v;
+  v = vma_find(t, va);
+  if (v == 0 || va < v->addr) return 0;
+  t->hint = v;
+  return v;
+}
+
+// Find a hole of len bytes in [start, end), aligned to align (a
+// power of two no smaller than a page). Prefers the space above
+// the highest VMA, as successive mmaps expect, then falls back
+// to the lowest hole that fits. Returns 0 if there is none.
+uint64 vma_gap(struct vmatree *t, uint64 start, uint64 len, uint64 end,
+               uint64 align) {
+  uint64 addr = ALIGNUP(start, align);
+  struct vma *n = t->root;
+  while (n && n->right) n = n->right;
+  if (n && ALIGNUP(n->addr + n->len, align) > addr)
+    addr = ALIGNUP(n->addr + n->len, align);
+  if (addr + len <= end) return addr;
+
+  addr = ALIGNUP(start, align);
+  for (n = vma_find(t, addr); n && n->addr < addr + len;
+       n = vma_find(t, n->addr + n->len))
+    addr = ALIGNUP(n->addr + n->len, align);
+  if (addr + len > end) return 0;
+  return addr;
+}
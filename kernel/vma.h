@@ -0,0 +1,45 @@
+#pragma once
+
+#include "types.h"
+
+struct anon;
+struct file;
+
+// Virtual Memory Area - tracks memory-mapped regions.
+// VMAs come from a slab cache and each process keeps its own
+// in an AVL tree ordered by address; they never overlap.
+struct vma {
+  uint64 addr;        // Starting virtual address
+  uint64 len;         // Length in bytes
+  int prot;           // Protection flags (PROT_READ, PROT_WRITE, etc.)
+  int flags;          // MAP_SHARED or MAP_PRIVATE, MAP_ANONYMOUS, ...
+  struct file *file;  // Mapped file, 0 if anonymous
+  struct anon *anon;  // Pages of a shared anonymous mapping
+  uint64 offset;      // Offset in file
+  uint64 filesz;      // Bytes backed by the file; the rest is zero
+  uint64 nextfault;   // Where the next sequential fault would land
+  int window;         // Pages mapped by the last sequential fault
+  int advice;         // MADV_NORMAL, MADV_RANDOM or MADV_SEQUENTIAL
+  struct vma *left;   // Tree links
+  struct vma *right;
+  int height;  // Height of the subtree rooted here
+};
+
+// One address space's VMAs.
+struct vmatree {
+  struct vma *root;
+  struct vma *hint;  // VMA found by the last vma_lookup()
+  int count;
+};
+
+void vmainit(void);
+struct vma *vma_alloc(void);
+void vma_free(struct vma *);
+struct vma *vma_dup(struct vma *);
+void vma_put(struct vma *);
+void vma_put_bulk(int, struct vma **);
+int vma_insert(struct vmatree *, struct vma *);
+void vma_remove(struct vmatree *, struct vma *);
+struct vma *vma_find(struct vmatree *, uint64);
+struct vma *vma_lookup(struct vmatree *, uint64);
+uint64 vma_gap(struct vmatree *, uint64, uint64, uint64, uint64);
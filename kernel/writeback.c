@@ -0,0 +1,147 @@
+//
+// background writeback: files with delayed blocks (see writei())
+// wait on a list, oldest first, and the writeback thread places
+// each one's blocks with iflush() once it has waited WBDELAY
+// ticks, or all of them at once when memory runs short. A writer
+// that finds too many blocks delayed places its own file's.
+//
+
+#include "writeback.h"
+
+#include "file.h"
+#include "fs.h"
+#include "log.h"
+#include "param.h"
+#include "printf.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "trap.h"
+#include "types.h"
+
+static struct {
+  struct spinlock lock;
+  struct inode *head;  // through wbnext, in the order they joined
+  struct inode *tail;
+  int urgent;  // place everything now
+  uint kicks;  // wakeups of the thread; under tickslock
+} wb;
+
+static void wbd(void);
+
+void wbinit(void) {
+  initlock(&wb.lock, "writeback");
+  if (kthread("writeback", wbd) < 0) panic("wbinit");
+}
+
+// Wake the writeback thread, to place everything now if urgent.
+static void wake(int urgent) {
+  if (urgent) {
+    acquire(&wb.lock);
+    wb.urgent = 1;
+    release(&wb.lock);
+  }
+  acquire(&tickslock);
+  wb.kicks++;
+  wakeup(&ticks);
+  release(&tickslock);
+}
+
+// Memory is short: have all delayed blocks placed, so that their
+// pages can be reclaimed.
+void wbkick(void) { wake(1); }
+
+// Put ip, which has just got delayed blocks, at the end of the
+// list, with a reference, unless it is there already.
+// Caller must hold ip->lock.
+void wbqueue(struct inode *ip) {
+  int first;
+
+  acquire(&wb.lock);
+  if (ip->wbq) {
+    release(&wb.lock);
+    return;
+  }
+  ip->wbq = 1;
+  idup(ip);
+  ip->dirtied = ticks;
+  ip->wbnext = 0;
+  first = wb.head == 0;
+  if (wb.tail)
+    wb.tail->wbnext = ip;
+  else
+    wb.head = ip;
+  wb.tail = ip;
+  release(&wb.lock);
+  if (first) wake(0);  // so that it sets a deadline
+}
+
+// Take ip off the list, for iput(). Returns 1 if it was on it;
+// the list's reference is then the caller's to drop.
+int wbcancel(struct inode *ip) {
+  struct inode *prev = 0;
+
+  acquire(&wb.lock);
+  if (!ip->wbq) {
+    release(&wb.lock);
+    return 0;
+  }
+  for (struct inode *q = wb.head; q != ip; q = q->wbnext) prev = q;
+  if (prev)
+    prev->wbnext = ip->wbnext;
+  else
+    wb.head = ip->wbnext;
+  if (wb.tail == ip) wb.tail = prev;
+  ip->wbq = 0;
+  release(&wb.lock);
+  return 1;
+}
+
+// Called by filewrite() before it writes to ip. If too many
+// blocks are delayed, place ip's now, and the rest soon.
+// Must not be called inside a transaction.
+void wbthrottle(struct inode *ip) {
+  if (fsdelayed() < NDELAYED) return;
+  iflush(ip);
+  if (fsdelayed() >= NDELAYED) wake(1);
+}
+
+// The writeback thread.
+static void wbd(void) {
+  for (;;) {
+    struct inode *ip;
+    uint when = 0, seq;
+
+    acquire(&tickslock);
+    tickupdate();
+    seq = wb.kicks;
+    release(&tickslock);
+
+    // the first file on the list, once it is due.
+    acquire(&wb.lock);
+    ip = wb.head;
+    if (ip && !wb.urgent && (int)(ticks - ip->dirtied) < WBDELAY) {
+      when = ip->dirtied + WBDELAY;
+      ip = 0;
+    } else if (ip) {
+      if ((wb.head = ip->wbnext) == 0) wb.tail = 0;
+      ip->wbq = 0;
+    } else {
+      wb.urgent = 0;
+    }
+    release(&wb.lock);
+
+    if (ip) {
+      iflush(ip);
+      begin_op();
+      iput(ip);
+      end_op();
+      continue;
+    }
+    acquire(&tickslock);
+    if (wb.kicks == seq) {
+      if (when) tickwakeat(when);
+      sleep(&ticks, &tickslock);
+    }
+    release(&tickslock);
+  }
+}
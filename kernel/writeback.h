@@ -0,0 +1,9 @@
+#pragma once
+
+struct inode;
+
+void wbinit(void);
+void wbqueue(struct inode *);
+int wbcancel(struct inode *);
+void wbkick(void);
+void wbthrottle(struct inode *);
@@ -34,16 +34,20 @@
 
 // Disk layout:
 // [ boot block | sb block | log | inode blocks | free bit map | data blocks ]
-
-int nbitmap = FSSIZE / BPB + 1;
-int ninodeblocks = NINODES / IPB + 1;
-int nlog = LOGBLOCKS + 1;  // Header followed by LOGBLOCKS data blocks.
+//
+// The root directory's blocks come first among the data blocks,
+// next to the inodes, then each file's blocks in one run.
+
+uint fssize = FSSIZE;  // Blocks in the file system, not counting swap
+uint ninodes = NINODES;
+int nbitmap;
+int ninodeblocks;
+int nlog;     // Header followed by the log's data blocks
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
 
 int fsfd;
 struct superblock sb;
-char zeroes[BSIZE];
 uint freeinode = 1;
 uint freeblock;
 
@@ -54,6 +58,7 @@ void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
 uint ialloc(ushort type);
 void iappend(uint inum, void *p, int n);
+void wdir(uint inum, struct dirent *de, int n);
 void die(const char *);
 
 // convert to riscv byte order
@@ -75,47 +80,98 @@ uint xint(uint x) {
   return y;
 }
 
+static void usage(void) {
+  fprintf(stderr,
+          "Usage: mkfs [-s blocks] [-i inodes] [-l logblocks] fs.img "
+          "files...\n");
+  exit(1);
+}
+
 int main(int argc, char *argv[]) {
-  int i, cc, fd;
-  uint rootino, inum, off;
-  struct dirent de;
+  int i, c, cc, fd;
+  uint rootino, inum;
+  struct dirent de, *ents;
+  int nent = 0;
   char buf[BSIZE];
-  struct dinode din;
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
-  if (argc < 2) {
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
-    exit(1);
+  nlog = -1;
+  while ((c = getopt(argc, argv, "s:i:l:")) != -1) {
+    switch (c) {
+      case 's':
+        fssize = atoi(optarg);
+        break;
+      case 'i':
+        ninodes = atoi(optarg);
+        break;
+      case 'l':
+        nlog = atoi(optarg);
+        break;
+      default:
+        usage();
+    }
   }
+  argc -= optind - 1;
+  argv += optind - 1;
+  if (argc < 2) usage();
 
   assert((BSIZE % sizeof(struct dinode)) == 0);
   assert((BSIZE % sizeof(struct dirent)) == 0);
 
-  fsfd = open(argv[1], O_RDWR | O_CREAT | O_TRUNC, 0666);
-  if (fsfd < 0) die(argv[1]);
+  // directory entries hold 16-bit inode numbers.
+  if (ninodes < argc || ninodes > 0xffff) {
+    fprintf(stderr, "mkfs: need %d to 65535 inodes\n", argc);
+    exit(1);
+  }
+  // the log gets a share of the disk, but room for at least
+  // three concurrent operations, and no more than its header
+  // can describe.
+  if (nlog < 0) {
+    nlog = fssize / LOGDIV;
+    if (nlog < MAXOPBLOCKS * 3) nlog = MAXOPBLOCKS * 3;
+    if (nlog > LOGBLOCKS) nlog = LOGBLOCKS;
+  } else if (nlog < MAXOPBLOCKS || nlog > LOGBLOCKS) {
+    fprintf(stderr, "mkfs: log must be %d to %d blocks\n", MAXOPBLOCKS,
+            LOGBLOCKS);
+    exit(1);
+  }
+  nlog += 1;
 
   // 1 fs block = 1 disk sector
+  nbitmap = fssize / BPB + 1;
+  ninodeblocks = ninodes / IPB + 1;
   nmeta = 2 + nlog + ninodeblocks + nbitmap;
-  nblocks = FSSIZE - nmeta;
+  if (fssize <= nmeta) {
+    fprintf(stderr, "mkfs: %u blocks leave none for data\n", fssize);
+    exit(1);
+  }
+  nblocks = fssize - nmeta;
 
   sb.magic = FSMAGIC;
-  sb.size = xint(FSSIZE);
+  sb.size = xint(fssize);
   sb.nblocks = xint(nblocks);
-  sb.ninodes = xint(NINODES);
+  sb.ninodes = xint(ninodes);
   sb.nlog = xint(nlog);
   sb.logstart = xint(2);
   sb.inodestart = xint(2 + nlog);
   sb.bmapstart = xint(2 + nlog + ninodeblocks);
+  sb.swapstart = xint(fssize);
+  sb.nswap = xint(SWAPSIZE / BSIZE);
+  sb.bsize = xint(BSIZE);
 
   printf(
       "nmeta %d (boot, super, log blocks %u, inode blocks %u, bitmap blocks "
-      "%u) blocks %d total %d\n",
-      nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
+      "%u) blocks %d total %u swap %d\n",
+      nmeta, nlog, ninodeblocks, nbitmap, nblocks, fssize, SWAPSIZE / BSIZE);
 
   freeblock = nmeta;  // the first free block that we can allocate
 
-  for (i = 0; i < FSSIZE; i++) wsect(i, zeroes);
+  fsfd = open(argv[1], O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if (fsfd < 0) die(argv[1]);
+  // a file that is all holes reads as zeroes.
+  if (ftruncate(fsfd, ((off_t)fssize + SWAPSIZE / BSIZE) * BSIZE) < 0)
+    die("ftruncate");
 
   memset(buf, 0, sizeof(buf));
   memmove(buf, &sb, sizeof(sb));
@@ -124,28 +180,30 @@ int main(int argc, char *argv[]) {
   rootino = ialloc(T_DIR);
   assert(rootino == ROOTINO);
 
+  // the root's entries, written once all are known.
+  ents = calloc(argc, sizeof(de));
+  if (ents == 0) die("calloc");
+
   bzero(&de, sizeof(de));
   de.inum = xshort(rootino);
   strcpy(de.name, ".");
-  iappend(rootino, &de, sizeof(de));
+  ents[nent++] = de;
 
   bzero(&de, sizeof(de));
   de.inum = xshort(rootino);
   strcpy(de.name, "..");
-  iappend(rootino, &de, sizeof(de));
+  ents[nent++] = de;
 
+  // number the files and write the root directory first, so
+  // that its blocks sit next to the inodes.
   for (i = 2; i < argc; i++) {
-    // get rid of "user/"
+    // get rid of "user/", "kernel/" and the like
     char *shortname;
-    if (strncmp(argv[i], "user/", 5) == 0)
-      shortname = argv[i] + 5;
+    if ((shortname = strrchr(argv[i], '/')) != 0)
+      shortname++;
     else
       shortname = argv[i];
 
-    assert(index(shortname, '/') == 0);
-
-    if ((fd = open(argv[i], 0)) < 0) die(argv[i]);
-
     // Skip leading _ in name when writing to file system.
     // The binaries are named _rm, _cat, etc. to keep the
     // build operating system from trying to execute them
@@ -155,24 +213,24 @@ int main(int argc, char *argv[]) {
     assert(strlen(shortname) <= DIRSIZ);
 
     inum = ialloc(T_FILE);
+    assert(inum == rootino + i - 1);
 
     bzero(&de, sizeof(de));
     de.inum = xshort(inum);
     strncpy(de.name, shortname, DIRSIZ);
-    iappend(rootino, &de, sizeof(de));
+    ents[nent++] = de;
+  }
+  wdir(rootino, ents, nent);
+  free(ents);
 
+  // then each file, in one run of blocks.
+  for (i = 2; i < argc; i++) {
+    if ((fd = open(argv[i], 0)) < 0) die(argv[i]);
+    inum = rootino + i - 1;
     while ((cc = read(fd, buf, sizeof(buf))) > 0) iappend(inum, buf, cc);
-
     close(fd);
   }
 
-  // fix size of root inode dir
-  rinode(rootino, &din);
-  off = xint(din.size);
-  off = ((off / BSIZE) + 1) * BSIZE;
-  din.size = xint(off);
-  winode(rootino, &din);
-
   balloc(freeblock);
 
   exit(0);
@@ -225,50 +283,103 @@ uint ialloc(ushort type) {
 
 void balloc(int used) {
   uchar buf[BSIZE];
-  int i;
+  int i, b;
 
   printf("balloc: first %d blocks have been allocated\n", used);
-  assert(used < BPB);
-  bzero(buf, BSIZE);
-  for (i = 0; i < used; i++) {
-    buf[i / 8] = buf[i / 8] | (0x1 << (i % 8));
+  if (used > fssize) {
+    fprintf(stderr, "mkfs: files need %d blocks, image has %u\n", used,
+            fssize);
+    exit(1);
+  }
+  for (b = 0; b * BPB < used; b++) {
+    bzero(buf, BSIZE);
+    for (i = b * BPB; i < used && i < (b + 1) * BPB; i++)
+      buf[(i % BPB) / 8] |= 0x1 << (i % 8);
+    printf("balloc: write bitmap block at sector %d\n", sb.bmapstart + b);
+    wsect(sb.bmapstart + b, buf);
   }
-  printf("balloc: write bitmap block at sector %d\n", sb.bmapstart);
-  wsect(sb.bmapstart, buf);
 }
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// Return the file block address of tree block bn of din,
+// allocating it if necessary, as the kernel's tmap() does.
+uint tmap(struct dinode *din, uint bn) {
+  uint indirect[NINDIRECT];
+  uint addr, span;
+  int level;
+
+  for (level = 0, span = NINDIRECT; bn >= span; level++, span *= NINDIRECT) {
+    assert(level < NLEVEL - 1);
+    bn -= span;
+  }
+  if (xint(din->addrs[level]) == 0) din->addrs[level] = xint(freeblock++);
+  addr = xint(din->addrs[level]);
+  for (; level >= 0; level--) {
+    span /= NINDIRECT;
+    rsect(addr, (char *)indirect);
+    if (indirect[bn / span] == 0) {
+      indirect[bn / span] = xint(freeblock++);
+      wsect(addr, (char *)indirect);
+    }
+    addr = xint(indirect[bn / span]);
+    bn %= span;
+  }
+  return addr;
+}
+
+// Return the file block address of block fbn of din, the next
+// block to append or one before it, as the kernel's bmap() does.
+uint bmap(struct dinode *din, uint fbn) {
+  uint end = 0;
+  int i;
+
+  for (i = 0; i < NEXTENT && xint(din->ext[i].len) > 0; i++) {
+    if (fbn < end + xint(din->ext[i].len))
+      return xint(din->ext[i].start) + fbn - end;
+    end += xint(din->ext[i].len);
+  }
+  if (fbn == end && xint(din->addrs[0]) == 0) {
+    if (i > 0 &&
+        xint(din->ext[i - 1].start) + xint(din->ext[i - 1].len) == freeblock) {
+      din->ext[i - 1].len = xint(xint(din->ext[i - 1].len) + 1);
+      return freeblock++;
+    }
+    if (i < NEXTENT) {
+      din->ext[i].start = xint(freeblock);
+      din->ext[i].len = xint(1);
+      return freeblock++;
+    }
+  }
+  return tmap(din, fbn - end);
+}
+
 void iappend(uint inum, void *xp, int n) {
   char *p = (char *)xp;
   uint fbn, off, n1;
   struct dinode din;
   char buf[BSIZE];
-  uint indirect[NINDIRECT];
   uint x;
 
   rinode(inum, &din);
   off = xint(din.size);
   // printf("append inum %d at off %d sz %d\n", inum, off, n);
+  // a file that fits in the inode stays there, as the kernel's
+  // writei() leaves it. main() appends a file whole or in full
+  // blocks, so one never outgrows it here.
+  if (xshort(din.type) == T_FILE && off == 0 && n <= INLINESIZE)
+    din.major = xshort(FINLINE);
+  if (xshort(din.type) == T_FILE && xshort(din.major) == FINLINE) {
+    assert(off + n <= INLINESIZE);
+    bcopy(p, din.data + off, n);
+    din.size = xint(off + n);
+    winode(inum, &din);
+    return;
+  }
   while (n > 0) {
     fbn = off / BSIZE;
     assert(fbn < MAXFILE);
-    if (fbn < NDIRECT) {
-      if (xint(din.addrs[fbn]) == 0) {
-        din.addrs[fbn] = xint(freeblock++);
-      }
-      x = xint(din.addrs[fbn]);
-    } else {
-      if (xint(din.addrs[NDIRECT]) == 0) {
-        din.addrs[NDIRECT] = xint(freeblock++);
-      }
-      rsect(xint(din.addrs[NDIRECT]), (char *)indirect);
-      if (indirect[fbn - NDIRECT] == 0) {
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT]), (char *)indirect);
-      }
-      x = xint(indirect[fbn - NDIRECT]);
-    }
+    x = bmap(&din, fbn);
     n1 = min(n, (fbn + 1) * BSIZE - off);
     rsect(x, buf);
     bcopy(p, buf + off - (fbn * BSIZE), n1);
@@ -281,6 +392,61 @@ void iappend(uint inum, void *xp, int n) {
   winode(inum, &din);
 }
 
+static int hashcmp(const void *a, const void *b) {
+  uint ha = dirhash(((struct dirent *)a)->name);
+  uint hb = dirhash(((struct dirent *)b)->name);
+  return ha < hb ? -1 : ha > hb;
+}
+
+// Write the n entries de as the contents of directory inum:
+// linearly if they fit in a block, else indexed, in leaves
+// filled 3/4 of the way, as the kernel's dirlink() would grow
+// the directory.
+void wdir(uint inum, struct dirent *de, int n) {
+  struct dxentry x[NDX];
+  struct dinode din;
+  char buf[BSIZE];
+  int first[NDX];  // first entry of each leaf
+  int nleaf = 0;
+  uint off;
+
+  if (n <= DPB) {
+    iappend(inum, de, n * sizeof(*de));
+    // fix size of the dir to a whole block
+    rinode(inum, &din);
+    off = xint(din.size);
+    off = ((off + BSIZE - 1) / BSIZE) * BSIZE;
+    din.size = xint(off);
+    winode(inum, &din);
+    return;
+  }
+
+  qsort(de, n, sizeof(*de), hashcmp);
+  bzero(x, sizeof(x));
+  for (int i = 0; i < n; i = first[nleaf]) {
+    // a leaf holds all the names with a hash.
+    int end = min(n, i + DPB * 3 / 4);
+    while (end < n && hashcmp(&de[end], &de[end - 1]) == 0) end++;
+    assert(end - i <= DPB && nleaf + 2 < NDX);
+    first[nleaf++] = i;
+    x[nleaf].hash = xint(i == 0 ? 0 : dirhash(de[i].name));
+    x[nleaf].block = xint(nleaf);
+    first[nleaf] = end;
+  }
+  x[0].count = xshort(nleaf + 1);
+  iappend(inum, x, BSIZE);
+
+  for (int l = 0; l < nleaf; l++) {
+    bzero(buf, sizeof(buf));
+    memmove(buf, &de[first[l]], (first[l + 1] - first[l]) * sizeof(*de));
+    iappend(inum, buf, BSIZE);
+  }
+
+  rinode(inum, &din);
+  din.major = xshort(DIRHASHED);
+  winode(inum, &din);
+}
+
 void die(const char *s) {
   perror(s);
   exit(1);
@@ -7,6 +7,8 @@
 # ./test-xv6.py -q usertests (runs the quick tests of usertests)
 # ./test-xv6.py crash  (runs the crash tests)
 # ./test-xv6.py log (runs the log crash test)
+# ./test-xv6.py bench (runs bench, saving its results in bench.out)
+# ./test-xv6.py -b base.out bench (and compares them with base.out)
 
 import argparse, os, inspect, re, signal, subprocess, sys, time
 from subprocess import run
@@ -14,6 +16,9 @@ from subprocess import run
 parser = argparse.ArgumentParser()
 parser.add_argument('testrex', help="test name or regular expression")
 parser.add_argument("-q", action='store_true', help="usertests quick")
+parser.add_argument("-b", metavar="baseline", help="bench results to compare with")
+parser.add_argument("-t", type=int, default=20,
+                    help="percent worse than baseline that fails bench")
 args = parser.parse_args()
 
 class QEMU(object):
@@ -199,6 +204,49 @@ def test_usertests(test=""):
     q.monitor('^ALL TESTS PASSED', progress='test', timeout=timeout)
     q.stop()
 
+def read_bench(path):
+    results = {}
+    with open(path) as f:
+        for line in f:
+            m = re.match(r'^([\w.]+)=(\d+)\s*$', line)
+            if m:
+                results[m.group(1)] = int(m.group(2))
+    return results
+
+# Keys ending in .ns are times, where lower is better; the rest are
+# rates. .min and .max are for reading, not comparing.
+def compare_bench(results, baseline):
+    worse = []
+    for k in sorted(results):
+        if k not in baseline or re.search(r'\.(min|max)$', k):
+            continue
+        new, old = results[k], baseline[k]
+        if old == 0:
+            continue
+        change = (new - old) * 100 // old
+        if not k.endswith('.ns'):
+            change = -change
+        print("%-20s %10d %10d %+5d%%" % (k, old, new, change))
+        if change > args.t:
+            worse.append(k)
+    return worse
+
+def test_bench():
+    q = QEMU(True)
+    q.cmd("bench\n")
+    q.monitor('^bench done', progress=r'^[\w.]+=', timeout=900)
+    q.stop()
+    with open("bench.out", "w") as f:
+        for line in q.lines():
+            if re.match(r'^[\w.]+=\d+\s*$', line):
+                f.write(line.strip() + "\n")
+    if args.b:
+        worse = compare_bench(read_bench("bench.out"), read_bench(args.b))
+        if worse:
+            print("FAIL: worse than baseline:", " ".join(worse))
+            sys.exit(1)
+    print("OK")
+
 def main():
     print(args)
     rex = r'%s' % args.testrex
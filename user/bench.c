@@ -0,0 +1,340 @@
+#include "kernel/fcntl.h"
+#include "kernel/param.h"
+#include "kernel/riscv.h"
+#include "kernel/rusage.h"
+#include "kernel/types.h"
+#include "user/user.h"
+
+// bench [-r runs] [-s] [name ...]: time basic operations from
+// user space and print one key=value line per result, for
+// test-xv6.py to compare against a baseline.
+//
+// Each benchmark runs -r times (5 by default) and the median is
+// printed under its name.unit key, the smallest and largest under
+// key.min and key.max. Keys ending in .ns are nanoseconds per
+// operation, lower is better; .kbs are KB per second, higher is
+// better. With more than one hart, each benchmark runs again as
+// name.par.unit: one copy pinned to every hart at once, reporting
+// the mean of the copies. -s skips those. Names select benchmarks.
+
+#define MAXRUNS 16
+#define BUFSZ 4096
+
+static char buf[BUFSZ];
+static int pid;
+
+static uint64 ns(uint64 cycles, uint64 n) {
+  return cycles * (1000000000 / TIMEBASE) / n;
+}
+
+static uint64 kbs(uint64 cycles, uint64 bytes) {
+  return cycles ? bytes / 1024 * TIMEBASE / cycles : 0;
+}
+
+static void fail(char *what) {
+  fprintf(2, "bench: %s failed\n", what);
+  exit(1);
+}
+
+// "bNNNNN.i", unique to this process.
+static void fname(char *name, int i) {
+  char *s = name;
+  *s++ = 'b';
+  for (int d = 10000; d > 0; d /= 10) *s++ = '0' + pid / d % 10;
+  *s++ = '.';
+  *s++ = '0' + i / 100 % 10;
+  *s++ = '0' + i / 10 % 10;
+  *s++ = '0' + i % 10;
+  *s = 0;
+}
+
+static uint64 nullsys(void) {
+  int n = 10000;
+  uint64 t0 = r_time();
+  for (int i = 0; i < n; i++) getpid();
+  return ns(r_time() - t0, n);
+}
+
+static uint64 forkexit(void) {
+  int n = 100;
+  uint64 t0 = r_time();
+  for (int i = 0; i < n; i++) {
+    int p = fork();
+    if (p < 0) fail("fork");
+    if (p == 0) exit(0);
+    wait(0);
+  }
+  return ns(r_time() - t0, n);
+}
+
+static uint64 forkexec(void) {
+  char *argv[] = {"bench", "-x", 0};
+  int n = 50;
+  uint64 t0 = r_time();
+  for (int i = 0; i < n; i++) {
+    int p = fork();
+    if (p < 0) fail("fork");
+    if (p == 0) {
+      exec("/bench", argv);
+      fail("exec");
+    }
+    wait(0);
+  }
+  return ns(r_time() - t0, n);
+}
+
+// Two processes on one hart pass a byte back and forth; each
+// pass is a switch.
+static uint64 ctxsw(void) {
+  uint64 mask = getaffinity(0);
+  int n = 2000, ab[2], ba[2];
+  char c = 0;
+  uint64 t0;
+
+  if (setaffinity(0, mask & -mask) < 0) fail("setaffinity");
+  if (pipe(ab) < 0 || pipe(ba) < 0) fail("pipe");
+  int p = fork();
+  if (p < 0) fail("fork");
+  if (p == 0) {
+    for (int i = 0; i < n; i++) {
+      if (read(ab[0], &c, 1) != 1) fail("read");
+      write(ba[1], &c, 1);
+    }
+    exit(0);
+  }
+  t0 = r_time();
+  for (int i = 0; i < n; i++) {
+    write(ab[1], &c, 1);
+    if (read(ba[0], &c, 1) != 1) fail("read");
+  }
+  t0 = r_time() - t0;
+  wait(0);
+  close(ab[0]);
+  close(ab[1]);
+  close(ba[0]);
+  close(ba[1]);
+  setaffinity(0, mask);
+  return ns(t0, 2 * n);
+}
+
+static uint64 pipebw(void) {
+  uint64 total = 4 * 1024 * 1024, t0;
+  int fds[2];
+
+  if (pipe(fds) < 0) fail("pipe");
+  t0 = r_time();
+  int p = fork();
+  if (p < 0) fail("fork");
+  if (p == 0) {
+    close(fds[1]);
+    while (read(fds[0], buf, BUFSZ) > 0);
+    exit(0);
+  }
+  close(fds[0]);
+  for (uint64 off = 0; off < total; off += BUFSZ)
+    if (write(fds[1], buf, BUFSZ) != BUFSZ) fail("write");
+  close(fds[1]);
+  wait(0);
+  return kbs(r_time() - t0, total);
+}
+
+// Touching lazily allocated heap, sbrk() included.
+static uint64 pagefault(void) {
+  int n = 256;
+  uint64 t0 = r_time();
+  char *p = sbrklazy(n * PGSIZE);
+
+  if (p == SBRK_ERROR) fail("sbrklazy");
+  for (int i = 0; i < n; i++) p[i * PGSIZE] = 1;
+  sbrk(-n * PGSIZE);
+  return ns(r_time() - t0, n);
+}
+
+// Mapping anonymous memory, filling it and unmapping it.
+static uint64 mmapbw(void) {
+  int len = 1024 * 1024, n = 8;
+  uint64 t0 = r_time();
+
+  for (int i = 0; i < n; i++) {
+    char *p = mmap(0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                   -1, 0);
+    if (p == (char *)-1) fail("mmap");
+    memset(p, i, len);
+    munmap(p, len);
+  }
+  return kbs(r_time() - t0, (uint64)n * len);
+}
+
+// Creating and then unlinking empty files.
+static uint64 create(void) {
+  char name[16];
+  int n = 100;
+  uint64 t0 = r_time();
+
+  for (int i = 0; i < n; i++) {
+    fname(name, i);
+    int fd = open(name, O_CREATE | O_RDWR);
+    if (fd < 0) fail("create");
+    close(fd);
+  }
+  for (int i = 0; i < n; i++) {
+    fname(name, i);
+    unlink(name);
+  }
+  return ns(r_time() - t0, n);
+}
+
+#define FILESZ (1024 * 1024)
+
+static void mkfile(char *name) {
+  int fd;
+
+  if ((fd = open(name, O_CREATE | O_TRUNC | O_WRONLY)) < 0) fail("create");
+  for (int off = 0; off < FILESZ; off += BUFSZ)
+    if (write(fd, buf, BUFSZ) != BUFSZ) fail("write");
+  close(fd);
+}
+
+static uint64 writebw(void) {
+  char name[16];
+  uint64 t0 = r_time();
+
+  fname(name, 0);
+  mkfile(name);
+  t0 = r_time() - t0;
+  unlink(name);
+  return kbs(t0, FILESZ);
+}
+
+// Reading a file just written, so mostly from the buffer cache.
+static uint64 readbw(void) {
+  char name[16];
+  int fd, n, total = 0;
+  uint64 t0;
+
+  fname(name, 0);
+  mkfile(name);
+  t0 = r_time();
+  if ((fd = open(name, O_RDONLY)) < 0) fail("open");
+  while ((n = read(fd, buf, BUFSZ)) > 0) total += n;
+  close(fd);
+  t0 = r_time() - t0;
+  unlink(name);
+  if (total != FILESZ) fail("read");
+  return kbs(t0, FILESZ);
+}
+
+static struct bench {
+  char *key;
+  uint64 (*fn)(void);
+} benches[] = {
+    {"syscall.ns", nullsys},  {"fork.ns", forkexit},
+    {"forkexec.ns", forkexec}, {"ctxsw.ns", ctxsw},
+    {"pipe.kbs", pipebw},     {"pagefault.ns", pagefault},
+    {"mmap.kbs", mmapbw},     {"create.ns", create},
+    {"write.kbs", writebw},   {"read.kbs", readbw},
+};
+
+// One run of b on every hart in mask at once; the mean result.
+static uint64 parallel(struct bench *b, uint64 mask) {
+  int go[2], res[2], n = 0;
+  uint64 v, sum = 0;
+
+  if (pipe(go) < 0 || pipe(res) < 0) fail("pipe");
+  for (int h = 0; h < NCPU; h++) {
+    if ((mask & (1UL << h)) == 0) continue;
+    int p = fork();
+    if (p < 0) fail("fork");
+    if (p == 0) {
+      char c;
+      setaffinity(0, 1UL << h);
+      pid = getpid();
+      close(go[1]);
+      read(go[0], &c, 1);  // start together
+      v = b->fn();
+      write(res[1], &v, sizeof(v));
+      exit(0);
+    }
+    n++;
+  }
+  close(go[0]);
+  for (int i = 0; i < n; i++) write(go[1], "x", 1);
+  close(go[1]);
+  close(res[1]);
+  for (int i = 0; i < n; i++) {
+    if (read(res[0], &v, sizeof(v)) != sizeof(v)) fail("parallel run");
+    sum += v;
+  }
+  close(res[0]);
+  for (int i = 0; i < n; i++) wait(0);
+  return sum / n;
+}
+
+static void report(char *key, uint64 *v, int runs) {
+  for (int i = 1; i < runs; i++)
+    for (int j = i; j > 0 && v[j - 1] > v[j]; j--) {
+      uint64 t = v[j];
+      v[j] = v[j - 1];
+      v[j - 1] = t;
+    }
+  printf("%s=%lu\n", key, v[runs / 2]);
+  printf("%s.min=%lu\n", key, v[0]);
+  printf("%s.max=%lu\n", key, v[runs - 1]);
+}
+
+// "name.unit" to "name.par.unit".
+static char *parkey(char *key) {
+  static char k[32];
+  char *dot = strchr(key, '.');
+  int n = dot - key;
+
+  memmove(k, key, n);
+  strcpy(k + n, ".par");
+  strcpy(k + n + 4, dot);
+  return k;
+}
+
+// whether the arguments select the benchmark key.
+static int selected(char *key, char **names, int n) {
+  if (n == 0) return 1;
+  for (int i = 0; i < n; i++) {
+    int len = strlen(names[i]);
+    if (memcmp(key, names[i], len) == 0 && key[len] == '.') return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  uint64 v[MAXRUNS], mask = getaffinity(0);
+  int runs = 5, par = 1, harts = 0, i;
+
+  for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+    if (strcmp(argv[i], "-x") == 0) exit(0);  // forkexec's child
+    if (strcmp(argv[i], "-s") == 0) {
+      par = 0;
+    } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+      runs = atoi(argv[++i]);
+    } else {
+      fprintf(2, "usage: bench [-r runs] [-s] [name ...]\n");
+      exit(1);
+    }
+  }
+  if (runs < 1 || runs > MAXRUNS) {
+    fprintf(2, "bench: runs must be 1..%d\n", MAXRUNS);
+    exit(1);
+  }
+  for (int h = 0; h < NCPU; h++)
+    if (mask & (1UL << h)) harts++;
+  pid = getpid();
+  printf("harts=%d\nruns=%d\n", harts, runs);
+  for (struct bench *b = benches; b < &benches[NELEM(benches)]; b++) {
+    if (!selected(b->key, argv + i, argc - i)) continue;
+    for (int r = 0; r < runs; r++) v[r] = b->fn();
+    report(b->key, v, runs);
+    if (!par || harts < 2) continue;
+    for (int r = 0; r < runs; r++) v[r] = parallel(b, mask);
+    report(parkey(b->key), v, runs);
+  }
+  printf("bench done\n");
+  exit(0);
+}
@@ -0,0 +1,40 @@
+#include "kernel/diskstat.h"
+#include "kernel/rusage.h"
+#include "kernel/types.h"
+#include "user/user.h"
+
+// diskstat: print the virtio disk's statistics.
+// diskstat -r: zero them.
+// diskstat -p us: spin up to us microseconds for each synchronous
+// request before sleeping; 0 turns polling off.
+
+static uint64 us(uint64 cycles) { return cycles / (TIMEBASE / 1000000); }
+
+int main(int argc, char *argv[]) {
+  struct diskstat st;
+
+  if (argc == 2 && strcmp(argv[1], "-r") == 0) {
+    diskstat(DISKSTAT_RESET, 0, 0);
+    exit(0);
+  }
+  if (argc == 3 && strcmp(argv[1], "-p") == 0) {
+    if (diskstat(DISKSTAT_POLL, 0, atoi(argv[2])) < 0) {
+      fprintf(2, "diskstat: bad polling budget %s\n", argv[2]);
+      exit(1);
+    }
+    exit(0);
+  }
+  if (argc != 1) {
+    fprintf(2, "usage: diskstat [-r | -p us]\n");
+    exit(1);
+  }
+
+  if (diskstat(DISKSTAT_GET, &st, 0) < 0) {
+    fprintf(2, "diskstat: cannot read statistics\n");
+    exit(1);
+  }
+  printf("QUEUES\tREQ\tINTR\tPOLL\tHIT\tPOLLUS\tBUDGET\n");
+  printf("%d\t%lu\t%lu\t%lu\t%lu\t%lu\t%d\n", st.nqueue, st.nreq, st.nintr,
+         st.npoll, st.nhit, us(st.pollwait), st.pollus);
+  exit(0);
+}
@@ -0,0 +1,53 @@
+#include "kernel/dmesg.h"
+#include "kernel/param.h"
+#include "kernel/rusage.h"
+#include "kernel/types.h"
+#include "user/user.h"
+
+// dmesg: print the kernel log, oldest first, with the time
+// since boot at the start of each line.
+
+// the log is never bigger than the kernel's rings.
+static char buf[NCPU * KLOGSIZE];
+
+// did the last record from each hart end a line?
+static char atstart[NCPU];
+
+// print t, in time CSR cycles, as [seconds.microseconds].
+static void stamp(uint64 t) {
+  uint64 us = t / (TIMEBASE / 1000000);
+  char frac[7];
+
+  for (int i = 5; i >= 0; i--, us /= 10) frac[i] = '0' + us % 10;
+  frac[6] = 0;
+  printf("[%lu.%s] ", t / TIMEBASE, frac);
+}
+
+int main(int argc, char *argv[]) {
+  int n;
+
+  if (argc > 1) {
+    fprintf(2, "usage: dmesg\n");
+    exit(1);
+  }
+  if ((n = dmesg(buf, sizeof(buf))) < 0) {
+    fprintf(2, "dmesg: cannot read the kernel log\n");
+    exit(1);
+  }
+  memset(atstart, 1, sizeof(atstart));
+  for (int off = 0; off < n;) {
+    struct klogrec *r = (struct klogrec *)(buf + off);
+    char *s = (char *)(r + 1);
+    int cpu = r->cpu < NCPU ? r->cpu : 0;
+
+    for (int i = 0, j; i < r->len; i = j) {
+      j = i;
+      while (j < r->len && s[j++] != '\n');
+      if (atstart[cpu]) stamp(r->time);
+      write(1, s + i, j - i);
+      atstart[cpu] = s[j - 1] == '\n';
+    }
+    off += KLOGRECSIZE(r->len);
+  }
+  exit(0);
+}
@@ -1,11 +1,12 @@
 // Test that fork fails gracefully.
-// Tiny executable so that the limit can be filling the proc table.
+// Tiny executable, so that the limit is memory for the processes
+// themselves rather than for copies of a large image.
 
 #include "kernel/stat.h"
 #include "kernel/types.h"
 #include "user/user.h"
 
-#define N 1000
+#define N 10000
 
 void print(const char *s) { write(1, s, strlen(s)); }
 
@@ -0,0 +1,90 @@
+#include "kernel/hpm.h"
+#include "kernel/types.h"
+#include "user/user.h"
+
+// hpmstat [-e event,...] cmd [args...]: run cmd and print the
+// hardware counts it and its children took: cycles, instructions,
+// instructions per cycle and up to four events, by default the
+// TLB and cache misses. Choosing events is system-wide.
+
+static struct {
+  char *name;
+  uint64 code;
+} events[] = {
+    {"cache-miss", HPM_CACHE_MISS},
+    {"branch-miss", HPM_BRANCH_MISS},
+    {"dtlb-load-miss", HPM_DTLB_READ_MISS},
+    {"dtlb-store-miss", HPM_DTLB_WRITE_MISS},
+    {"itlb-miss", HPM_ITLB_MISS},
+};
+
+static uint64 chosen[NHPM] = {HPM_DTLB_READ_MISS, HPM_DTLB_WRITE_MISS,
+                              HPM_ITLB_MISS, HPM_CACHE_MISS};
+
+static char *name(uint64 code) {
+  for (int i = 0; i < NELEM(events); i++)
+    if (events[i].code == code) return events[i].name;
+  return "?";
+}
+
+// choose the events in a comma-separated list of names.
+static void parse(char *list) {
+  char *s = list, *e;
+  int n = 0;
+
+  memset(chosen, 0, sizeof(chosen));
+  while (*s) {
+    for (e = s; *e && *e != ','; e++);
+    int i;
+    for (i = 0; i < NELEM(events); i++)
+      if (strlen(events[i].name) == e - s &&
+          memcmp(events[i].name, s, e - s) == 0)
+        break;
+    if (i == NELEM(events) || n == NHPM) {
+      fprintf(2, "hpmstat: bad event list %s\n", list);
+      exit(1);
+    }
+    chosen[n++] = events[i].code;
+    s = *e ? e + 1 : e;
+  }
+}
+
+int main(int argc, char *argv[]) {
+  struct hpmcount before, after;
+  int pid, i = 1;
+
+  if (argc > 2 && strcmp(argv[1], "-e") == 0) {
+    parse(argv[2]);
+    i = 3;
+  }
+  if (i >= argc) {
+    fprintf(2, "usage: hpmstat [-e event,...] cmd [args...]\n");
+    exit(1);
+  }
+  if (hpm(HPM_SELECT, chosen, 0) < 0 || hpm(HPM_CHILDREN, &before, 0) < 0) {
+    fprintf(2, "hpmstat: hpm failed\n");
+    exit(1);
+  }
+  if ((pid = fork()) < 0) {
+    fprintf(2, "hpmstat: fork failed\n");
+    exit(1);
+  }
+  if (pid == 0) {
+    exec(argv[i], argv + i);
+    fprintf(2, "hpmstat: exec %s failed\n", argv[i]);
+    exit(1);
+  }
+  wait(0);
+  hpm(HPM_CHILDREN, &after, 0);
+
+  uint64 c[NHPMCOUNT];
+  for (int k = 0; k < NHPMCOUNT; k++) c[k] = after.count[k] - before.count[k];
+  uint64 ipc = c[HPM_CYCLE] ? c[HPM_INSTRET] * 100 / c[HPM_CYCLE] : 0;
+  printf("%lu\tcycles\n", c[HPM_CYCLE]);
+  printf("%lu\tinstructions\t%lu.%s%lu per cycle\n", c[HPM_INSTRET],
+         ipc / 100, ipc % 100 < 10 ? "0" : "", ipc % 100);
+  for (int k = 0; k < NHPM; k++)
+    if (after.event[HPM_COUNTER(k)] != HPM_NONE)
+      printf("%lu\t%s\n", c[HPM_COUNTER(k)], name(after.event[HPM_COUNTER(k)]));
+  exit(0);
+}
@@ -0,0 +1,82 @@
+#include "kernel/iostat.h"
+#include "kernel/types.h"
+#include "user/user.h"
+
+// iostat: print disk, buffer cache and log statistics.
+// iostat -r: zero them.
+// iostat cmd [args...]: zero them, run cmd, then print.
+
+static struct iostat st;
+
+// print the non-empty buckets of latency histogram h.
+static void hist(char *what, uint64 *h) {
+  uint64 n = 0;
+
+  for (int i = 0; i < NLAT; i++) n += h[i];
+  printf("%s latency, us:\n", what);
+  if (n == 0) {
+    printf("\tnone\n");
+    return;
+  }
+  for (int i = 0; i < NLAT; i++) {
+    if (h[i] == 0) continue;
+    if (i == 0)
+      printf("\t<2\t");
+    else if (i == NLAT - 1)
+      printf("\t>=%d\t", 1 << i);
+    else
+      printf("\t%d-%d\t", 1 << i, (1 << (i + 1)) - 1);
+    printf("%lu\t%lu%%\n", h[i], h[i] * 100 / n);
+  }
+}
+
+static void list(void) {
+  struct diskstat *d = &st.disk;
+  uint64 nread, nb;
+
+  if (iostat(IOSTAT_GET, &st) < 0) {
+    fprintf(2, "iostat: cannot read statistics\n");
+    exit(1);
+  }
+  nread = d->nreq - d->nwrite;
+  printf("disk: %d queues, %lu in flight, at most %lu\n", d->nqueue,
+         d->inflight, d->maxinflight);
+  printf("\t%lu reads of %lu blocks, %lu writes of %lu blocks\n", nread,
+         d->rblocks, d->nwrite, d->wblocks);
+  printf("\t%lu interrupts, %lu polls, %lu finished polling\n", d->nintr,
+         d->npoll, d->nhit);
+  nb = st.bhit + st.bmiss;
+  printf("cache: %lu hits, %lu misses, %lu%% hit\n", st.bhit, st.bmiss,
+         nb ? st.bhit * 100 / nb : 0);
+  printf("log: %lu commits of %lu blocks, at most %lu\n", st.ncommit,
+         st.commitblocks, st.maxcommit);
+  hist("disk", d->lat);
+  hist("commit", st.commitlat);
+}
+
+int main(int argc, char *argv[]) {
+  int pid;
+
+  if (argc < 2) {
+    list();
+    exit(0);
+  }
+  if (strcmp(argv[1], "-r") == 0) {
+    iostat(IOSTAT_RESET, 0);
+    exit(0);
+  }
+
+  iostat(IOSTAT_RESET, 0);
+  if ((pid = fork()) < 0) {
+    fprintf(2, "iostat: fork failed\n");
+    exit(1);
+  }
+  if (pid == 0) {
+    exec(argv[1], argv + 1);
+    fprintf(2, "iostat: exec %s failed\n", argv[1]);
+    exit(1);
+  }
+  wait(0);
+  list();
+  exit(0);
+}
@@ -0,0 +1,75 @@
+#include "kernel/lockstat.h"
+#include "kernel/rusage.h"
+#include "kernel/types.h"
+#include "user/user.h"
+
+// lockstat: list lock statistics, most waited-for first.
+// lockstat on|off: start or stop recording.
+// lockstat -r: zero the statistics.
+// lockstat cmd [args...]: record while cmd runs, then list.
+
+#define NSTAT 64
+
+static struct lockstat ls[NSTAT];
+static char *kinds[] = {"spin", "rw", "sleep"};
+
+static uint64 us(uint64 cycles) { return cycles / (TIMEBASE / 1000000); }
+
+static void list(void) {
+  int n;
+
+  if ((n = lockstat(LOCKSTAT_GET, ls, NSTAT)) < 0) {
+    fprintf(2, "lockstat: cannot read statistics\n");
+    exit(1);
+  }
+  for (int i = 1; i < n; i++) {
+    struct lockstat t = ls[i];
+    int j = i;
+    for (; j > 0 && ls[j - 1].wait < t.wait; j--) ls[j] = ls[j - 1];
+    ls[j] = t;
+  }
+  printf("NAME\t\tKIND\tACQUIRE\tCONTEND\tWAITUS\tMAXUS\n");
+  for (int i = 0; i < n; i++) {
+    char *kind = ls[i].kind >= 0 && ls[i].kind < 3 ? kinds[ls[i].kind] : "?";
+    printf("%s\t%s%s\t%lu\t%lu\t%lu\t%lu\n", ls[i].name,
+           strlen(ls[i].name) < 8 ? "\t" : "", kind, ls[i].nacquire,
+           ls[i].ncontend, us(ls[i].wait), us(ls[i].maxwait));
+  }
+}
+
+int main(int argc, char *argv[]) {
+  int pid;
+
+  if (argc < 2) {
+    list();
+    exit(0);
+  }
+  if (strcmp(argv[1], "on") == 0) {
+    lockstat(LOCKSTAT_ENABLE, 0, 0);
+    exit(0);
+  }
+  if (strcmp(argv[1], "off") == 0) {
+    lockstat(LOCKSTAT_DISABLE, 0, 0);
+    exit(0);
+  }
+  if (strcmp(argv[1], "-r") == 0) {
+    lockstat(LOCKSTAT_RESET, 0, 0);
+    exit(0);
+  }
+
+  lockstat(LOCKSTAT_RESET, 0, 0);
+  lockstat(LOCKSTAT_ENABLE, 0, 0);
+  if ((pid = fork()) < 0) {
+    fprintf(2, "lockstat: fork failed\n");
+    exit(1);
+  }
+  if (pid == 0) {
+    exec(argv[1], argv + 1);
+    fprintf(2, "lockstat: exec %s failed\n", argv[1]);
+    exit(1);
+  }
+  wait(0);
+  lockstat(LOCKSTAT_DISABLE, 0, 0);
+  list();
+  exit(0);
+}
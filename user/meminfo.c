@@ -0,0 +1,41 @@
+#include "kernel/meminfo.h"
+#include "kernel/rusage.h"
+#include "kernel/types.h"
+#include "user/user.h"
+
+// meminfo: print free and used memory, page faults by kind, and
+// each process's heap size, resident pages and swapped pages.
+
+static char *faults[] = {"lazy", "anon", "file", "cow", "swap", "minor"};
+
+static uint64 kb(uint64 pages) { return pages * 4; }
+
+int main(void) {
+  struct meminfo mi;
+  struct pinfo pi;
+  uint64 free;
+
+  if (meminfo(MEMINFO_GET, &mi, 0) < 0) {
+    fprintf(2, "meminfo: cannot read statistics\n");
+    exit(1);
+  }
+  free = mi.free + mi.cached + mi.zeroed;
+  printf("mem: %lu kB, %lu kB free, %lu kB used\n", kb(mi.total), kb(free),
+         kb(mi.total - free));
+  printf("\tfree: %lu kB buddy, %lu kB per-CPU, %lu kB zeroed\n",
+         kb(mi.free), kb(mi.cached), kb(mi.zeroed));
+  printf("superpages: %lu free, %lu in use, %lu compacted\n", mi.superfree,
+         mi.superused, mi.compacted);
+  printf("slab: %lu kB\n", kb(mi.slab));
+  printf("faults:");
+  for (int i = 0; i < NFAULT; i++) printf(" %s %lu", faults[i], mi.fault[i]);
+  printf("\n");
+
+  printf("PID\tSIZEKB\tRSSKB\tSWAPKB\tNAME\n");
+  for (int pid = 1; (pid = pinfo(pid, &pi)) > 0; pid++) {
+    if (pi.pid != pi.tgid) continue;  // threads share the leader's
+    printf("%d\t%lu\t%lu\t%lu\t%s\n", pi.pid, pi.sz / 1024, kb(pi.rss),
+           kb(pi.nswap), pi.name);
+  }
+  exit(0);
+}
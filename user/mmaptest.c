@@ -9,6 +9,11 @@
 void mmap_test();
 void fork_test();
 void more_test();
+void many_test();
+void share_test();
+void around_test();
+void anon_test();
+void advise_test();
 char buf[PGSIZE];
 
 #define MAP_FAILED ((char *) -1)
@@ -19,6 +24,11 @@ main(int argc, char *argv[])
   mmap_test();
   fork_test();
   more_test();
+  many_test();
+  share_test();
+  around_test();
+  anon_test();
+  advise_test();
   printf("mmaptest: all tests succeeded\n");
   exit(0);
 }
@@ -446,3 +456,323 @@ more_test()
 
   printf("test writes to read-only mapped memory: OK\n");
 }
+
+//
+// more mappings than the old fixed VMA table had room for.
+//
+#define NMANY 200
+char *many[NMANY];
+
+void
+many_test()
+{
+  int fd, i, pid;
+  const char * const f = "mmap.many";
+
+  printf("test many mappings\n");
+
+  makefile(f);
+  if ((fd = open(f, O_RDONLY)) == -1)
+    err("open");
+  for (i = 0; i < NMANY; i++) {
+    many[i] = mmap(0, PGSIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (many[i] == MAP_FAILED)
+      err("many mmap");
+  }
+  for (i = 0; i < NMANY; i++) {
+    if (many[i][0] != 'A' || many[i][PGSIZE-1] != 'A')
+      err("many mismatch");
+  }
+
+  // punch holes and map again.
+  for (i = 0; i < NMANY; i += 2) {
+    if (munmap(many[i], PGSIZE) == -1)
+      err("many munmap");
+  }
+  pid = fork();
+  if (pid < 0) err("fork");
+  if (pid == 0) {
+    // this should cause a fatal fault
+    printf("*many[0] = %x\n", many[0][0]);
+    exit(0);
+  }
+  int st = 0;
+  wait(&st);
+  if (st != -1)
+    err("read unmapped memory");
+  for (i = 0; i < NMANY; i += 2) {
+    many[i] = mmap(0, PGSIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (many[i] == MAP_FAILED)
+      err("many remap");
+  }
+  close(fd);
+
+  // a child sees every mapping.
+  pid = fork();
+  if (pid < 0) err("fork");
+  if (pid == 0) {
+    for (i = 0; i < NMANY; i++) {
+      if (many[i][0] != 'A')
+        err("many mismatch in child");
+    }
+    exit(0);
+  }
+  st = 0;
+  wait(&st);
+  if (st != 0)
+    err("many child");
+
+  for (i = 0; i < NMANY; i++) {
+    if (munmap(many[i], PGSIZE) == -1)
+      err("many munmap");
+  }
+  unlink(f);
+
+  printf("test many mappings: OK\n");
+}
+
+//
+// MAP_SHARED mappings of one file see each other's stores,
+// and so does read(), before anything is unmapped.
+//
+void
+share_test()
+{
+  int fd, pid;
+  char *p;
+  const char * const f = "mmap.share";
+
+  printf("test shared pages\n");
+
+  makefile(f);
+  pid = fork();
+  if (pid < 0) err("fork");
+  if (pid == 0) {
+    if ((fd = open(f, O_RDWR)) == -1)
+      err("open");
+    p = mmap(0, PGSIZE*2, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+      err("mmap");
+    // wait for the parent's mapping to change the file.
+    while (p[1] != 'S')
+      pause(1);
+    p[PGSIZE] = 'T';
+    // both stores must be visible through read() now.
+    if (read(fd, buf, PGSIZE) != PGSIZE || buf[1] != 'S')
+      err("read of shared store (1)");
+    if (read(fd, buf, 1) != 1 || buf[0] != 'T')
+      err("read of shared store (2)");
+    exit(0);
+  }
+
+  if ((fd = open(f, O_RDWR)) == -1)
+    err("open");
+  p = mmap(0, PGSIZE*2, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    err("mmap");
+  close(fd);
+  p[1] = 'S';
+  while (p[PGSIZE] != 'T')
+    pause(1);
+
+  int st = 0;
+  wait(&st);
+  if (st != 0)
+    err("shared child");
+  if (munmap(p, PGSIZE*2) == -1)
+    err("munmap");
+  unlink(f);
+
+  printf("test shared pages: OK\n");
+}
+
+//
+// sequential faults map pages ahead of the one touched; check
+// each lands at the right file offset, forwards and backwards.
+//
+#define NAROUND 48
+
+void
+around_test()
+{
+  int fd, i, j, flags;
+  char *p;
+  const char * const f = "mmap.around";
+
+  printf("test fault-around\n");
+
+  unlink(f);
+  if ((fd = open(f, O_RDWR | O_CREATE)) == -1)
+    err("open");
+  for (i = 0; i < NAROUND; i++) {
+    memset(buf, 'a' + i % 26, PGSIZE);
+    if (write(fd, buf, PGSIZE) != PGSIZE)
+      err("write");
+  }
+
+  for (j = 0; j < 2; j++) {
+    flags = j ? MAP_SHARED : MAP_PRIVATE;
+    p = mmap(0, PGSIZE*NAROUND, PROT_READ, flags, fd, 0);
+    if (p == MAP_FAILED)
+      err("mmap");
+    for (i = 0; i < NAROUND; i++) {
+      char c = 'a' + i % 26;
+      if (p[i*PGSIZE] != c || p[i*PGSIZE + PGSIZE-1] != c)
+        err("fault-around mismatch");
+    }
+    if (munmap(p, PGSIZE*NAROUND) == -1)
+      err("munmap");
+
+    p = mmap(0, PGSIZE*NAROUND, PROT_READ, flags, fd, 0);
+    if (p == MAP_FAILED)
+      err("mmap");
+    for (i = NAROUND-1; i >= 0; i -= 3) {
+      if (p[i*PGSIZE + 7] != 'a' + i % 26)
+        err("fault-around mismatch (backwards)");
+    }
+    if (munmap(p, PGSIZE*NAROUND) == -1)
+      err("munmap");
+  }
+  close(fd);
+  unlink(f);
+
+  printf("test fault-around: OK\n");
+}
+
+//
+// anonymous mappings: lazily zero-filled, private ones copied
+// across fork, shared ones shared with children.
+//
+void
+anon_test()
+{
+  int i, pid, st;
+  char *p, *q;
+
+  printf("test anonymous mappings\n");
+
+  p = mmap(0, PGSIZE*10, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    err("mmap anon private");
+  q = mmap(0, PGSIZE*10, PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (q == MAP_FAILED)
+    err("mmap anon shared");
+  for (i = 0; i < PGSIZE*10; i++) {
+    if (p[i] != 0 || q[i] != 0)
+      err("anon not zero");
+  }
+  for (i = 0; i < 5; i++) {
+    p[i*PGSIZE] = 'p';
+    q[i*PGSIZE] = 'q';
+  }
+
+  pid = fork();
+  if (pid < 0) err("fork");
+  if (pid == 0) {
+    for (i = 0; i < 5; i++) {
+      if (p[i*PGSIZE] != 'p' || q[i*PGSIZE] != 'q')
+        err("anon child mismatch");
+    }
+    // private stores stay in the child; shared ones,
+    // even to pages the parent has not touched, do not.
+    for (i = 0; i < 10; i++) {
+      p[i*PGSIZE] = 'c';
+      q[i*PGSIZE] = 'c';
+    }
+    exit(0);
+  }
+  st = 0;
+  wait(&st);
+  if (st != 0)
+    err("anon child");
+  for (i = 0; i < 10; i++) {
+    if (p[i*PGSIZE] != (i < 5 ? 'p' : 0))
+      err("anon private store leaked from child");
+    if (q[i*PGSIZE] != 'c')
+      err("anon shared store lost");
+  }
+
+  // unmapping the front keeps the rest of a shared mapping.
+  if (munmap(q, PGSIZE*2) == -1)
+    err("munmap anon");
+  if (q[PGSIZE*2] != 'c' || q[PGSIZE*9] != 'c')
+    err("anon shared after munmap");
+  if (munmap(p, PGSIZE*10) == -1 || munmap(q + PGSIZE*2, PGSIZE*8) == -1)
+    err("munmap anon");
+
+  printf("test anonymous mappings: OK\n");
+}
+
+//
+// madvise() and msync() on file and anonymous mappings.
+//
+void
+advise_test()
+{
+  int fd;
+  char *p, *q;
+  const char * const f = "mmap.advise";
+
+  printf("test madvise and msync\n");
+
+  makefile(f);
+  if ((fd = open(f, O_RDWR)) == -1)
+    err("open");
+  p = mmap(0, PGSIZE*2, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  q = mmap(0, PGSIZE*2, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (p == MAP_FAILED || q == MAP_FAILED)
+    err("mmap");
+
+  if (madvise(p, PGSIZE*2, MADV_SEQUENTIAL) != 0 ||
+      madvise(q, PGSIZE*2, MADV_RANDOM) != 0 ||
+      madvise(p, PGSIZE*2, MADV_WILLNEED) != 0)
+    err("madvise hint");
+  if (madvise(p, PGSIZE, 99) != -1)
+    err("madvise accepted bad advice");
+  if (madvise(p + PGSIZE*2, PGSIZE, MADV_WILLNEED) != -1 ||
+      msync(p + PGSIZE, PGSIZE*2, MS_SYNC) != -1)
+    err("madvise/msync accepted an unmapped range");
+  _v1(p);
+  _v1(q);
+
+  // msync writes back without unmapping.
+  p[0] = 'M';
+  if (msync(p, PGSIZE*2, MS_SYNC) != 0)
+    err("msync");
+  if (read(fd, buf, 1) != 1 || buf[0] != 'M')
+    err("msync did not write back");
+  if (p[0] != 'M')
+    err("msync lost the mapping");
+
+  // dropped shared pages keep their data; private ones revert.
+  p[1] = 'D';
+  q[1] = 'X';
+  if (madvise(p, PGSIZE*2, MADV_DONTNEED) != 0 ||
+      madvise(q, PGSIZE*2, MADV_DONTNEED) != 0)
+    err("madvise dontneed");
+  if (p[0] != 'M' || p[1] != 'D')
+    err("dontneed lost shared data");
+  if (q[0] != 'M' || q[1] != 'A')
+    err("dontneed kept private data");
+  if (munmap(p, PGSIZE*2) == -1 || munmap(q, PGSIZE*2) == -1)
+    err("munmap");
+  close(fd);
+  unlink(f);
+
+  // dropped anonymous pages come back zeroed.
+  p = mmap(0, PGSIZE*4, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    err("mmap anon");
+  p[PGSIZE] = 'z';
+  if (madvise(p, PGSIZE*4, MADV_DONTNEED) != 0)
+    err("madvise dontneed anon");
+  if (p[PGSIZE] != 0)
+    err("dontneed kept anonymous data");
+  if (munmap(p, PGSIZE*4) == -1)
+    err("munmap anon");
+
+  printf("test madvise and msync: OK\n");
+}
@@ -0,0 +1,270 @@
+#include "kernel/fcntl.h"
+#include "kernel/poll.h"
+#include "kernel/prof.h"
+#include "kernel/types.h"
+#include "user/user.h"
+
+// perf [-p us] cmd [args...]: run cmd with the profiler taking a
+// sample every us microseconds (1000 by default), then list the
+// functions cmd's samples fell in, by the kernel's symbols in
+// /kernel.sym and cmd's in /cmd.sym.
+//
+// self counts the samples taken in a function, total the ones
+// taken in it or in what it called, as far as a sample's
+// backtrace goes. The profiler samples every hart, so one perf
+// at a time should run.
+
+#define NBUF 64
+#define NSHOW 40
+
+struct sym {
+  uint64 addr;
+  char *name;
+  int user;
+  int self, total;
+  uint stamp;  // the last sample that counted toward total
+};
+
+struct symtab {
+  struct sym *s;
+  int n;
+};
+
+static struct symtab ksyms, usyms;
+static struct profsample buf[NBUF];
+static int pid;
+static uint nsample, nother, nidle, nunknown;
+
+static int hexval(int c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  return -1;
+}
+
+// Read a line of fd into line[n], without its newline, using
+// the buffered bytes in rb. Returns 0 at the end of the file.
+static int getline(int fd, char *line, int n) {
+  static char rb[512];
+  static int rn, ri, rfd = -1;
+  int i = 0;
+
+  if (fd != rfd) {
+    rfd = fd;
+    rn = ri = 0;
+  }
+  for (;;) {
+    if (ri == rn) {
+      if ((rn = read(fd, rb, sizeof(rb))) <= 0) {
+        rn = ri = 0;
+        line[i] = 0;
+        return i > 0;
+      }
+      ri = 0;
+    }
+    char c = rb[ri++];
+    if (c == '\n') break;
+    if (i < n - 1) line[i++] = c;
+  }
+  line[i] = 0;
+  return 1;
+}
+
+static void sortsyms(struct symtab *t) {
+  // shell sort by address.
+  for (int gap = t->n / 2; gap > 0; gap /= 2) {
+    for (int i = gap; i < t->n; i++) {
+      struct sym x = t->s[i];
+      int j = i;
+      for (; j >= gap && t->s[j - gap].addr > x.addr; j -= gap)
+        t->s[j] = t->s[j - gap];
+      t->s[j] = x;
+    }
+  }
+}
+
+// Load the "addr name" lines objdump -t left in path. Names with
+// a '.' in them are files, sections and local labels, and '$'
+// ones are assembler mapping symbols; those are skipped.
+static void load(struct symtab *t, char *path, int user) {
+  char line[128], *name;
+  int fd, cap = 0;
+  uint64 addr;
+
+  if ((fd = open(path, O_RDONLY)) < 0) {
+    fprintf(2, "perf: cannot open %s\n", path);
+    return;
+  }
+  while (getline(fd, line, sizeof(line))) {
+    addr = 0;
+    for (name = line; hexval(*name) >= 0; name++)
+      addr = addr * 16 + hexval(*name);
+    if (*name != ' ') continue;
+    name++;
+    if (*name == 0 || *name == '$' || strchr(name, '.')) continue;
+    if (t->n == cap) {
+      cap = cap ? cap * 2 : 256;
+      struct sym *s = malloc(cap * sizeof(*s));
+      if (s == 0) {
+        fprintf(2, "perf: out of memory\n");
+        exit(1);
+      }
+      if (t->n) {
+        memmove(s, t->s, t->n * sizeof(*s));
+        free(t->s);
+      }
+      t->s = s;
+    }
+    struct sym *s = &t->s[t->n++];
+    memset(s, 0, sizeof(*s));
+    s->addr = addr;
+    s->user = user;
+    if ((s->name = malloc(strlen(name) + 1)) == 0) {
+      fprintf(2, "perf: out of memory\n");
+      exit(1);
+    }
+    strcpy(s->name, name);
+  }
+  close(fd);
+  sortsyms(t);
+}
+
+// The symbol pc falls in: the last one at or below it.
+static struct sym *lookup(struct symtab *t, uint64 pc) {
+  int lo = 0, hi = t->n;
+
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (t->s[mid].addr <= pc)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo > 0 ? &t->s[lo - 1] : 0;
+}
+
+static void count(struct profsample *ps) {
+  struct symtab *t = ps->user ? &usyms : &ksyms;
+  struct sym *s;
+
+  if (ps->pid != pid) {
+    if (ps->pid == 0)
+      nidle++;
+    else
+      nother++;
+    return;
+  }
+  nsample++;
+  for (int i = 0; i < ps->depth && i < NPROFPC; i++) {
+    if ((s = lookup(t, ps->pc[i])) == 0) {
+      if (i == 0) nunknown++;
+      continue;
+    }
+    if (i == 0) s->self++;
+    if (s->stamp != nsample) {
+      s->stamp = nsample;
+      s->total++;
+    }
+  }
+}
+
+static void drain(void) {
+  int n;
+
+  while ((n = prof(PROF_GET, buf, NBUF)) > 0)
+    for (int i = 0; i < n; i++) count(&buf[i]);
+}
+
+// Print the symbols in the order of their self counts.
+static void report(void) {
+  static struct sym *show[NSHOW];
+  struct symtab *tabs[] = {&ksyms, &usyms};
+  int nshow = 0;
+
+  for (int k = 0; k < 2; k++) {
+    for (int i = 0; i < tabs[k]->n; i++) {
+      struct sym *s = &tabs[k]->s[i];
+      if (s->total == 0) continue;
+      int j;
+      if (nshow < NSHOW)
+        j = nshow++;
+      else if (show[NSHOW - 1]->self >= s->self)
+        continue;
+      else
+        j = NSHOW - 1;
+      for (; j > 0 && show[j - 1]->self < s->self; j--) show[j] = show[j - 1];
+      show[j] = s;
+    }
+  }
+
+  printf("%d samples, %d of other processes, %d idle, %d lost\n", nsample,
+         nother, nidle, prof(PROF_LOST, 0, 0));
+  if (nsample == 0) return;
+  printf("SELF%%\tTOTAL%%\tSELF\tSYMBOL\n");
+  for (int i = 0; i < nshow; i++)
+    printf("%d\t%d\t%d\t%s %s\n", show[i]->self * 100 / nsample,
+           show[i]->total * 100 / nsample, show[i]->self,
+           show[i]->user ? "[u]" : "[k]", show[i]->name);
+  if (nunknown) printf("%d samples at unknown pcs\n", nunknown);
+}
+
+int main(int argc, char *argv[]) {
+  char path[32], *base;
+  struct pollfd pfd;
+  int fds[2], period = 0, i = 1;
+
+  if (argc > 2 && strcmp(argv[1], "-p") == 0) {
+    period = atoi(argv[2]);
+    i = 3;
+  }
+  if (i >= argc || period < 0) {
+    fprintf(2, "usage: perf [-p us] cmd [args...]\n");
+    exit(1);
+  }
+
+  load(&ksyms, "/kernel.sym", 0);
+  base = argv[i];
+  for (char *c = argv[i]; *c; c++)
+    if (*c == '/') base = c + 1;
+  if (strlen(base) + 6 > sizeof(path)) {
+    fprintf(2, "perf: %s: name too long\n", argv[i]);
+    exit(1);
+  }
+  strcpy(path, "/");
+  strcpy(path + 1, base);
+  strcpy(path + 1 + strlen(base), ".sym");
+  load(&usyms, path, 1);
+
+  // as in strace, the pipe's hang-up says cmd has exited.
+  if (pipe(fds) < 0) {
+    fprintf(2, "perf: pipe failed\n");
+    exit(1);
+  }
+  if (prof(PROF_START, 0, period) < 0) {
+    fprintf(2, "perf: prof failed\n");
+    exit(1);
+  }
+  if ((pid = fork()) < 0) {
+    fprintf(2, "perf: fork failed\n");
+    exit(1);
+  }
+  if (pid == 0) {
+    close(fds[0]);
+    exec(argv[i], argv + i);
+    fprintf(2, "perf: exec %s failed\n", argv[i]);
+    exit(1);
+  }
+  close(fds[1]);
+  pfd.fd = fds[0];
+  pfd.events = POLLIN;
+  for (;;) {
+    pfd.revents = 0;
+    poll(&pfd, 1, 1);
+    drain();
+    if (pfd.revents & POLLHUP) break;
+  }
+  wait(0);
+  prof(PROF_STOP, 0, 0);
+  drain();
+  report();
+  exit(0);
+}
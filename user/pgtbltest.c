@@ -1,4 +1,5 @@
 #include "kernel/param.h"
+#include "kernel/fcntl.h"
 #include "kernel/types.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
@@ -74,6 +75,98 @@ void superpg_fork() {
   }
 }
 
+// Test that superpages shared by fork are copied on write:
+// a partial shrink and writes in the child leave the parent's
+// superpages intact.
+void superpg_cow() {
+  printf("superpg_cow starting\n");
+
+  char *base = sbrk(0);
+  char *p = sbrk(SUPERPGSIZE * 3);
+  if (p == (char *)-1) {
+    printf("superpg_cow: sbrk failed\n");
+    exit(1);
+  }
+  for (uint64 i = 0; i < SUPERPGSIZE * 3; i += PGSIZE) p[i] = 'p';
+
+  int pid = fork();
+  if (pid < 0) {
+    printf("superpg_cow: fork failed\n");
+    exit(1);
+  }
+
+  if (pid == 0) {
+    // Child: free the last 1MB while it is still shared,
+    // then write every page that is left
+    if (sbrk(-(SUPERPGSIZE / 2)) == (char *)-1) {
+      printf("superpg_cow: sbrk(-) failed\n");
+      exit(1);
+    }
+    for (uint64 i = 0; i < SUPERPGSIZE * 3 - SUPERPGSIZE / 2; i += PGSIZE) {
+      if (p[i] != 'p') {
+        printf("superpg_cow: FAIL - child read %c at %p\n", p[i], &p[i]);
+        exit(1);
+      }
+      p[i] = 'c';
+    }
+    exit(0);
+  }
+
+  int status;
+  wait(&status);
+  if (status != 0) {
+    printf("superpg_cow: FAIL - child exited with status %d\n", status);
+    exit(1);
+  }
+  for (uint64 i = 0; i < SUPERPGSIZE * 3; i += PGSIZE) {
+    if (p[i] != 'p') {
+      printf("superpg_cow: FAIL - parent sees %c at %p\n", p[i], &p[i]);
+      exit(1);
+    }
+  }
+  sbrk(-(sbrk(0) - base));
+  printf("superpg_cow: OK\n");
+}
+
+// Test that a heap grown a page at a time, eagerly and lazily,
+// keeps its contents when full 2MB regions become superpages.
+void superpg_promote() {
+  printf("superpg_promote starting\n");
+
+  char *base = sbrk(0);
+  for (int i = 0; i < 2 * SUPERPGSIZE / PGSIZE; i++) {
+    char *p = sbrk(PGSIZE);
+    if (p == (char *)-1) {
+      printf("superpg_promote: sbrk failed\n");
+      exit(1);
+    }
+    p[0] = (char)i;
+    p[PGSIZE - 1] = (char)~i;
+  }
+  char *lazy = sbrklazy(2 * SUPERPGSIZE);
+  if (lazy == (char *)-1) {
+    printf("superpg_promote: sbrklazy failed\n");
+    exit(1);
+  }
+  for (uint64 i = 0; i < 2 * SUPERPGSIZE; i += PGSIZE) lazy[i] = 'l';
+
+  for (int i = 0; i < 2 * SUPERPGSIZE / PGSIZE; i++) {
+    char *p = base + (uint64)i * PGSIZE;
+    if (p[0] != (char)i || p[PGSIZE - 1] != (char)~i) {
+      printf("superpg_promote: FAIL - data lost at %p\n", p);
+      exit(1);
+    }
+  }
+  for (uint64 i = 0; i < 2 * SUPERPGSIZE; i += PGSIZE) {
+    if (lazy[i] != 'l') {
+      printf("superpg_promote: FAIL - lazy data lost at %p\n", &lazy[i]);
+      exit(1);
+    }
+  }
+  sbrk(-(sbrk(0) - base));
+  printf("superpg_promote: OK\n");
+}
+
 // Test that superpages are properly freed
 void superpg_free() {
   printf("superpg_free starting\n");
@@ -119,13 +212,106 @@ void superpg_free() {
   printf("superpg_free: OK\n");
 }
 
+// Test that superpage allocation is no longer capped by a fixed
+// boot-time reserve: grab more 2MB pages than the old limit of 8,
+// release them, and do it again.
+void superpg_many() {
+  printf("superpg_many starting\n");
+
+  for (int round = 0; round < 2; round++) {
+    char *p = sbrk(SUPERPGSIZE * 16);
+    if (p == (char *)-1) {
+      printf("superpg_many: sbrk failed in round %d\n", round);
+      exit(1);
+    }
+    for (uint64 i = 0; i < SUPERPGSIZE * 16; i += PGSIZE) p[i] = (char)round;
+    for (uint64 i = 0; i < SUPERPGSIZE * 16; i += PGSIZE) {
+      if (p[i] != (char)round) {
+        printf("superpg_many: FAIL - mismatch at %p\n", &p[i]);
+        exit(1);
+      }
+    }
+    if (sbrk(-(SUPERPGSIZE * 16)) == (char *)-1) {
+      printf("superpg_many: sbrk(-) failed\n");
+      exit(1);
+    }
+  }
+
+  printf("superpg_many: OK\n");
+}
+
+// Test MAP_HUGE anonymous mappings: aligned, zeroed, copied on
+// write across fork, and still usable after a partial munmap.
+void superpg_mmap() {
+  printf("superpg_mmap starting\n");
+
+  int len = 2 * SUPERPGSIZE + PGSIZE;
+  char *p = mmap(0, len, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGE, -1, 0);
+  if (p == (char *)-1) {
+    printf("superpg_mmap: mmap failed\n");
+    exit(1);
+  }
+  if ((uint64)p % SUPERPGSIZE != 0) {
+    printf("superpg_mmap: FAIL - %p not superpage aligned\n", p);
+    exit(1);
+  }
+  for (int i = 0; i < len; i += PGSIZE) {
+    if (p[i] != 0) {
+      printf("superpg_mmap: FAIL - not zeroed at %p\n", &p[i]);
+      exit(1);
+    }
+    p[i] = (char)(i / PGSIZE);
+  }
+
+  int pid = fork();
+  if (pid < 0) {
+    printf("superpg_mmap: fork failed\n");
+    exit(1);
+  }
+  if (pid == 0) {
+    for (int i = 0; i < len; i += PGSIZE) {
+      if (p[i] != (char)(i / PGSIZE)) exit(1);
+      p[i] = 'c';
+    }
+    exit(0);
+  }
+  int status;
+  wait(&status);
+  if (status != 0) {
+    printf("superpg_mmap: FAIL - child saw wrong data\n");
+    exit(1);
+  }
+
+  // unmap the first page, splitting the first superpage.
+  if (munmap(p, PGSIZE) < 0) {
+    printf("superpg_mmap: munmap failed\n");
+    exit(1);
+  }
+  for (int i = PGSIZE; i < len; i += PGSIZE) {
+    if (p[i] != (char)(i / PGSIZE)) {
+      printf("superpg_mmap: FAIL - data lost at %p\n", &p[i]);
+      exit(1);
+    }
+  }
+  if (munmap(p + PGSIZE, len - PGSIZE) < 0) {
+    printf("superpg_mmap: munmap failed\n");
+    exit(1);
+  }
+  printf("superpg_mmap: OK\n");
+}
+
 int main(int argc, char *argv[]) {
   printf("pgtbltest: starting\n");
 
   ugetpid_test();
   pgaccess_test();
   superpg_fork();
+  superpg_cow();
   superpg_free();
+  superpg_many();
+  superpg_promote();
+  superpg_mmap();
 
   printf("pgtbltest: all tests passed\n");
   exit(0);
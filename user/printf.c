@@ -5,7 +5,7 @@
 
 static char digits[] = "0123456789ABCDEF";
 
-static void putc(int fd, char c) { write(fd, &c, 1); }
+static void putc(int fd, char c) { bputc(fd, c); }
 
 static void printint(int fd, long long xx, int base, int sgn) {
   char buf[20];
@@ -97,6 +97,7 @@ void vprintf(int fd, const char *fmt, va_list ap) {
       state = 0;
     }
   }
+  bdone(fd);
 }
 
 void fprintf(int fd, const char *fmt, ...) {
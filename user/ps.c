@@ -0,0 +1,73 @@
+#include "kernel/param.h"
+#include "kernel/rusage.h"
+#include "kernel/types.h"
+#include "user/user.h"
+
+// ps: list processes and threads with their CPU usage.
+// ps n: like top, list them again every n ticks, with the share
+// of the interval each one ran for.
+
+#define NSAMPLE 64
+
+static char *states[] = {"unused", "used", "sleep", "runble", "run",
+                         "zombie"};
+
+static struct {
+  int pid;
+  uint64 cycles;
+} prev[NSAMPLE], cur[NSAMPLE];
+static int nprev, ncur;
+
+static uint64 ms(uint64 cycles) { return cycles / (TIMEBASE / 1000); }
+
+// cycles pid ran for in the previous sample, or 0.
+static uint64 before(int pid) {
+  for (int i = 0; i < nprev; i++)
+    if (prev[i].pid == pid) return prev[i].cycles;
+  return 0;
+}
+
+static void list(uint64 interval) {
+  struct pinfo pi;
+  char *state;
+
+  printf("PID\tTGID\tPPID\tSTATE\tPRIO\tCPU\tUSERMS\tSYSMS\tWAITMS\t");
+  printf("VCSW\tIVCSW\tFAULTS\tSYSCALL\t%s\tNAME\n", interval ? "%CPU" : "");
+  ncur = 0;
+  for (int pid = 1; (pid = pinfo(pid, &pi)) > 0; pid++) {
+    uint64 cycles = pi.ru.utime + pi.ru.stime;
+    state = pi.state >= 0 && pi.state < 6 ? states[pi.state] : "???";
+    printf("%d\t%d\t%d\t%s\t%d\t%d\t%lu\t%lu\t%lu\t%lu\t%lu\t%lu\t%lu\t",
+           pi.pid, pi.tgid, pi.ppid, state, pi.prio, pi.cpu, ms(pi.ru.utime),
+           ms(pi.ru.stime), ms(pi.ru.wtime), pi.ru.nvcsw, pi.ru.nivcsw,
+           pi.ru.nfault, pi.ru.nsyscall);
+    if (interval) printf("%lu", (cycles - before(pi.pid)) * 100 / interval);
+    printf("\t%s\n", pi.name);
+    if (ncur < NSAMPLE) {
+      cur[ncur].pid = pi.pid;
+      cur[ncur].cycles = cycles;
+      ncur++;
+    }
+  }
+  memmove(prev, cur, sizeof(cur));
+  nprev = ncur;
+}
+
+int main(int argc, char *argv[]) {
+  int n;
+
+  if (argc < 2) {
+    list(0);
+    exit(0);
+  }
+  if ((n = atoi(argv[1])) <= 0) {
+    fprintf(2, "usage: ps [ticks]\n");
+    exit(1);
+  }
+  list(0);
+  for (;;) {
+    int t0 = uptime();
+    pause(n);
+    list((uptime() - t0) * TICKCYCLES);
+  }
+}
@@ -52,6 +52,7 @@ struct backcmd {
 int fork1(void);  // Fork but panics on failure.
 void panic(char *);
 struct cmd *parsecmd(char *);
+int spawnsimple(char *);
 void runcmd(struct cmd *) __attribute__((noreturn));
 
 // Execute cmd.  Never returns.
@@ -155,7 +156,7 @@ int main(void) {
       // Chdir must be called by the parent, not the child.
       cmd[strlen(cmd) - 1] = 0;  // chop \n
       if (chdir(cmd + 3) < 0) fprintf(2, "cannot cd %s\n", cmd + 3);
-    } else {
+    } else if (spawnsimple(cmd) < 0) {
       if (fork1() == 0) runcmd(parsecmd(cmd));
       wait(0);
     }
@@ -240,6 +241,40 @@ struct cmd *backcmd(struct cmd *subcmd) {
 char whitespace[] = " \t\r\n\v";
 char symbols[] = "<|>&;()";
 
+// Run a command line that is just a program and its arguments
+// with spawn(), which saves fork's copy of the shell.
+// Returns -1, leaving buf alone, if the line needs the parser.
+int spawnsimple(char *buf) {
+  char *argv[MAXARGS], *s;
+  int argc = 0;
+
+  for (s = buf; *s; s++)
+    if (strchr(symbols, *s)) return -1;
+  for (s = buf; *s;) {
+    while (*s && strchr(whitespace, *s)) s++;
+    if (*s == 0) break;
+    if (argc >= MAXARGS - 1) return -1;
+    while (*s && !strchr(whitespace, *s)) s++;
+    argc++;
+  }
+  if (argc == 0) return -1;
+
+  argc = 0;
+  for (s = buf; *s;) {
+    while (*s && strchr(whitespace, *s)) *s++ = 0;
+    if (*s == 0) break;
+    argv[argc++] = s;
+    while (*s && !strchr(whitespace, *s)) s++;
+  }
+  argv[argc] = 0;
+
+  if (spawn(argv[0], argv, 0, 0) < 0)
+    fprintf(2, "exec %s failed\n", argv[0]);
+  else
+    wait(0);
+  return 0;
+}
+
 int gettoken(char **ps, char *es, char **q, char **eq) {
   char *s;
   int ret;
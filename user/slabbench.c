@@ -0,0 +1,131 @@
+#include "kernel/fcntl.h"
+#include "kernel/lockstat.h"
+#include "kernel/param.h"
+#include "kernel/rusage.h"
+#include "kernel/slabbench.h"
+#include "kernel/types.h"
+#include "user/user.h"
+
+// slabbench [-s size] [-r rounds]: run the kernel's slab
+// benchmark on 1, 2, ... harts at once, all sharing one cache of
+// size-byte objects, and print for each number of harts h:
+//
+//   slab.hN.kops          thousand allocs and frees per second, in all
+//   slab.hN.pP.cycles     P-th percentile of a call's latency
+//   slab.hN.acquire       acquisitions of the cache's lock
+//   slab.hN.contend       of those, ones that had to spin
+//
+// as key=value lines, like bench. slabbench -t instead runs the
+// kernel's single-hart slab tests and pool benchmark, which print
+// to the console.
+
+static int pcts[] = {50, 90, 99};
+
+static void fail(char *what) {
+  fprintf(2, "slabbench: %s failed\n", what);
+  exit(1);
+}
+
+// The "slabbench" lock's statistics since the last reset.
+static void lockcounts(uint64 *acquire, uint64 *contend) {
+  static struct lockstat ls[64];
+  int n = lockstat(LOCKSTAT_GET, ls, NELEM(ls));
+
+  *acquire = *contend = 0;
+  for (int i = 0; i < n; i++) {
+    if (ls[i].kind == LOCK_SPIN && strcmp(ls[i].name, "slabbench") == 0) {
+      *acquire = ls[i].nacquire;
+      *contend = ls[i].ncontend;
+    }
+  }
+}
+
+// Run on the first h harts in mask at once; results in r[0..h).
+static void runon(int h, uint64 mask, int rounds, struct slabbench *r) {
+  int go[2], k = 0, xstatus, bad = 0;
+
+  if (pipe(go) < 0) fail("pipe");
+  for (int c = 0; c < NCPU && k < h; c++) {
+    if ((mask & (1UL << c)) == 0) continue;
+    int pid = fork();
+    if (pid < 0) fail("fork");
+    if (pid == 0) {
+      char x;
+      setaffinity(0, 1UL << c);
+      close(go[1]);
+      read(go[0], &x, 1);  // start together
+      exit(slabbench(SLABBENCH_RUN, &r[k], rounds) < 0);
+    }
+    k++;
+  }
+  close(go[0]);
+  for (int i = 0; i < h; i++) write(go[1], "x", 1);
+  close(go[1]);
+  for (int i = 0; i < h; i++) {
+    wait(&xstatus);
+    bad |= xstatus;
+  }
+  if (bad) fail("slabbench run");
+}
+
+static void report(int h, struct slabbench *r) {
+  static uint hist[SLABBENCH_NBUCKET];
+  uint64 ops = 0, start = r[0].start, end = r[0].end, acq, con;
+
+  memset(hist, 0, sizeof(hist));
+  for (int i = 0; i < h; i++) {
+    ops += r[i].ops;
+    if (r[i].start < start) start = r[i].start;
+    if (r[i].end > end) end = r[i].end;
+    for (int b = 0; b < SLABBENCH_NBUCKET; b++) hist[b] += r[i].hist[b];
+  }
+  printf("slab.h%d.kops=%lu\n", h,
+         end > start ? ops * TIMEBASE / (end - start) / 1000 : 0);
+  for (int i = 0; i < NELEM(pcts); i++) {
+    uint64 want = (ops * pcts[i] + 99) / 100, seen = 0;
+    int b;
+    for (b = 0; b < SLABBENCH_NBUCKET - 1; b++)
+      if ((seen += hist[b]) >= want) break;
+    printf("slab.h%d.p%d.cycles=%lu\n", h, pcts[i], slabbench_low(b));
+  }
+  lockcounts(&acq, &con);
+  printf("slab.h%d.acquire=%lu\n", h, acq);
+  printf("slab.h%d.contend=%lu\n", h, con);
+}
+
+int main(int argc, char *argv[]) {
+  uint64 mask = getaffinity(0);
+  int size = 64, rounds = 2000, harts = 0;
+  struct slabbench *r;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-t") == 0) {
+      if (slabbench(SLABBENCH_SELFTEST, 0, 0) < 0) fail("selftest");
+      exit(0);
+    } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      size = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+      rounds = atoi(argv[++i]);
+    } else {
+      fprintf(2, "usage: slabbench [-t] [-s size] [-r rounds]\n");
+      exit(1);
+    }
+  }
+  for (int c = 0; c < NCPU; c++)
+    if (mask & (1UL << c)) harts++;
+  if (slabbench(SLABBENCH_SETUP, 0, size) < 0) fail("setup");
+  r = mmap(0, NCPU * sizeof(*r), PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (r == (struct slabbench *)-1) fail("mmap");
+
+  printf("harts=%d\nobjsize=%d\nrounds=%d\n", harts, size, rounds);
+  for (int h = 1; h <= harts; h++) {
+    lockstat(LOCKSTAT_RESET, 0, 0);
+    lockstat(LOCKSTAT_ENABLE, 0, 0);
+    runon(h, mask, rounds, r);
+    lockstat(LOCKSTAT_DISABLE, 0, 0);
+    report(h, r);
+  }
+  printf("slabbench done\n");
+  exit(0);
+}
@@ -0,0 +1,59 @@
+#include "kernel/meminfo.h"
+#include "kernel/types.h"
+#include "user/user.h"
+
+// slabtop: list the slab caches, biggest first.
+// slabtop n: list them again every n ticks.
+
+#define NCACHE 64
+
+static struct slabinfo si[NCACHE];
+
+static uint64 kb(struct slabinfo *s) { return (s->nslab << s->order) * 4; }
+
+static void list(void) {
+  uint64 active = 0, total = 0, pages = 0;
+  int n;
+
+  if ((n = meminfo(MEMINFO_SLABS, si, NCACHE)) < 0) {
+    fprintf(2, "slabtop: cannot read statistics\n");
+    exit(1);
+  }
+  for (int i = 1; i < n; i++) {
+    struct slabinfo t = si[i];
+    int j = i;
+    for (; j > 0 && kb(&si[j - 1]) < kb(&t); j--) si[j] = si[j - 1];
+    si[j] = t;
+  }
+  for (int i = 0; i < n; i++) {
+    active += si[i].active;
+    total += si[i].total;
+    pages += si[i].nslab << si[i].order;
+  }
+  printf("%d caches, %lu of %lu objects active, %lu kB\n", n, active, total,
+         pages * 4);
+  printf("OBJS\tACTIVE\tUSE\tOBJSIZE\tSLABS\tKB\tMAG\tNAME\n");
+  for (int i = 0; i < n; i++) {
+    struct slabinfo *s = &si[i];
+    printf("%lu\t%lu\t%lu%%\t%d\t%lu\t%lu\t%lu\t%s\n", s->total, s->active,
+           s->total ? s->active * 100 / s->total : 0, s->objsize, s->nslab,
+           kb(s), s->nmag, s->name);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  int n;
+
+  if (argc < 2) {
+    list();
+    exit(0);
+  }
+  if ((n = atoi(argv[1])) <= 0) {
+    fprintf(2, "usage: slabtop [ticks]\n");
+    exit(1);
+  }
+  for (;;) {
+    list();
+    pause(n);
+  }
+}
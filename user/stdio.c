@@ -0,0 +1,119 @@
+#include "kernel/param.h"
+#include "kernel/stat.h"
+#include "kernel/types.h"
+#include "user/user.h"
+
+// Buffered output for printf() and fprintf(), and input for
+// gets().
+//
+// Each descriptor below NOFILE that printf() writes to gets a
+// buffer. The console's is written out at the end of each
+// printf(), so a prompt shows and a fork() does not copy unwritten
+// text; the buffer of a file or a pipe when it fills, and on
+// fflush(), exit() and close(). write() passes the buffer by, so a
+// program that mixes the two on a file should fflush() first.
+//
+// gets() reads standard input a buffer at a time. The console
+// returns a line per read() anyway.
+
+#define BUFSZ 512
+
+enum { UNKNOWN, CONSOLE, FULL };
+
+static struct obuf {
+  char buf[BUFSZ];
+  int n;
+  int mode;  // how to flush, set at the first printf()
+} obufs[NOFILE];
+
+static struct {
+  char buf[BUFSZ];
+  int n;
+  int pos;
+} in;
+
+static struct obuf *obuf(int fd) {
+  struct obuf *b;
+  struct stat st;
+
+  if (fd < 0 || fd >= NOFILE) return 0;
+  b = &obufs[fd];
+  if (b->mode == UNKNOWN)
+    b->mode = fstat(fd, &st) == 0 && st.type == T_DEVICE ? CONSOLE : FULL;
+  return b;
+}
+
+// Write out what fd's buffer holds. Returns 0, or -1.
+int fflush(int fd) {
+  struct obuf *b;
+  int n, off = 0;
+
+  if (fd < 0 || fd >= NOFILE) return 0;
+  b = &obufs[fd];
+  while (off < b->n) {
+    if ((n = write(fd, b->buf + off, b->n - off)) <= 0) {
+      b->n = 0;
+      return -1;
+    }
+    off += n;
+  }
+  b->n = 0;
+  return 0;
+}
+
+// From exit(): write out every buffer.
+void fflushall(void) {
+  for (int fd = 0; fd < NOFILE; fd++)
+    if (obufs[fd].n) fflush(fd);
+}
+
+// From close(): write out fd's buffer, and find out afresh what
+// fd is when it is next used.
+void fclosed(int fd) {
+  if (fd < 0 || fd >= NOFILE) return;
+  fflush(fd);
+  obufs[fd].mode = UNKNOWN;
+  if (fd == 0) in.n = in.pos = 0;
+}
+
+// Add c to fd's buffer, for printf().
+void bputc(int fd, char c) {
+  struct obuf *b = obuf(fd);
+
+  if (b == 0) {
+    write(fd, &c, 1);
+    return;
+  }
+  if (b->n == BUFSZ) fflush(fd);
+  b->buf[b->n++] = c;
+}
+
+// printf() has finished writing to fd.
+void bdone(int fd) {
+  struct obuf *b = obuf(fd);
+
+  if (b && b->mode == CONSOLE) fflush(fd);
+}
+
+static int getc(void) {
+  if (in.pos == in.n) {
+    in.pos = 0;
+    if ((in.n = read(0, in.buf, sizeof(in.buf))) <= 0) {
+      in.n = 0;
+      return -1;
+    }
+  }
+  return in.buf[in.pos++];
+}
+
+char *gets(char *buf, int max) {
+  int i, c;
+
+  for (i = 0; i + 1 < max;) {
+    if ((c = getc()) < 0) break;
+    buf[i++] = c;
+    if (c == '\n' || c == '\r') break;
+  }
+  buf[i] = '\0';
+  return buf;
+}
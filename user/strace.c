@@ -0,0 +1,122 @@
+#include "kernel/poll.h"
+#include "kernel/rusage.h"
+#include "kernel/sysstat.h"
+#include "kernel/types.h"
+#include "user/user.h"
+
+// strace cmd [args...]: run cmd and print each system call it
+// and its children make, with its first arguments, return
+// value and time.
+// strace -e call,... cmd [args...]: only the named calls.
+//
+// The kernel keeps the calls in a ring of its own, which one
+// strace at a time should read.
+
+#define NSTAT 64
+#define NREC 32
+
+static struct sysstat st[NSTAT];
+static char *names[NSTAT];
+static struct tracerec rec[NREC];
+static uint64 nextseq;
+static int started;
+
+static uint64 us(uint64 cycles) { return cycles / (TIMEBASE / 1000000); }
+
+// learn the names of the calls from sysstat().
+static void getnames(void) {
+  int n = sysstat(SYSSTAT_GET, st, NSTAT);
+
+  for (int i = 0; i < n; i++)
+    if (st[i].num >= 0 && st[i].num < NSTAT) names[st[i].num] = st[i].name;
+}
+
+// the mask for a comma-separated list of call names.
+static uint64 parse(char *list) {
+  uint64 mask = 0;
+  char *s = list, *e;
+
+  while (*s) {
+    for (e = s; *e && *e != ','; e++);
+    int found = 0;
+    for (int i = 0; i < NSTAT; i++) {
+      if (names[i] && strlen(names[i]) == e - s &&
+          memcmp(names[i], s, e - s) == 0) {
+        mask |= 1UL << i;
+        found = 1;
+      }
+    }
+    if (!found) {
+      fprintf(2, "strace: unknown call in %s\n", list);
+      exit(1);
+    }
+    s = *e ? e + 1 : e;
+  }
+  return mask;
+}
+
+static void drain(void) {
+  int n;
+
+  while ((n = sysstat(SYSSTAT_TRACE, rec, NREC)) > 0) {
+    for (int i = 0; i < n; i++) {
+      struct tracerec *r = &rec[i];
+      if (started && r->seq != nextseq)
+        printf("strace: lost %lu calls\n", r->seq - nextseq);
+      started = 1;
+      nextseq = r->seq + 1;
+      char *name = r->num < NSTAT && names[r->num] ? names[r->num] : "?";
+      printf("%d %s(0x%lx, 0x%lx, 0x%lx) = %ld\t<%lu us>\n", r->pid, name,
+             r->arg[0], r->arg[1], r->arg[2], r->ret, us(r->cycles));
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  uint64 mask = ~0UL;
+  struct pollfd pfd;
+  int fds[2], pid, i = 1;
+
+  getnames();
+  if (argc > 2 && strcmp(argv[1], "-e") == 0) {
+    mask = parse(argv[2]);
+    i = 3;
+  }
+  if (i >= argc) {
+    fprintf(2, "usage: strace [-e call,...] cmd [args...]\n");
+    exit(1);
+  }
+
+  // skip what is in the ring already.
+  while (sysstat(SYSSTAT_TRACE, rec, NREC) > 0);
+
+  // the child holds the pipe's write end until it and all its
+  // children exit, which poll() sees as a hang-up.
+  if (pipe(fds) < 0) {
+    fprintf(2, "strace: pipe failed\n");
+    exit(1);
+  }
+  if ((pid = fork()) < 0) {
+    fprintf(2, "strace: fork failed\n");
+    exit(1);
+  }
+  if (pid == 0) {
+    close(fds[0]);
+    trace(mask);
+    exec(argv[i], argv + i);
+    fprintf(2, "strace: exec %s failed\n", argv[i]);
+    exit(1);
+  }
+  close(fds[1]);
+  pfd.fd = fds[0];
+  pfd.events = POLLIN;
+  for (;;) {
+    pfd.revents = 0;
+    poll(&pfd, 1, 1);
+    drain();
+    if (pfd.revents & POLLHUP) break;
+  }
+  wait(0);
+  drain();
+  exit(0);
+}
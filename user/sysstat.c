@@ -0,0 +1,76 @@
+#include "kernel/rusage.h"
+#include "kernel/sysstat.h"
+#include "kernel/types.h"
+#include "user/user.h"
+
+// sysstat: list system call counts and latencies, most time
+// spent first.
+// sysstat -r: zero them.
+// sysstat cmd [args...]: zero them, run cmd, then list.
+
+#define NSTAT 64
+
+static struct sysstat st[NSTAT];
+
+static uint64 us(uint64 cycles) { return cycles / (TIMEBASE / 1000000); }
+
+// the latency under which at least pct percent of s's calls
+// finished, in us, by its histogram bucket.
+static uint64 pctl(struct sysstat *s, int pct) {
+  uint64 n = 0;
+
+  for (int i = 0; i < NLAT; i++) {
+    n += s->lat[i];
+    if (n * 100 >= s->ncall * pct) return 2UL << i;
+  }
+  return 2UL << (NLAT - 1);
+}
+
+static void list(void) {
+  int n;
+
+  if ((n = sysstat(SYSSTAT_GET, st, NSTAT)) < 0) {
+    fprintf(2, "sysstat: cannot read statistics\n");
+    exit(1);
+  }
+  for (int i = 1; i < n; i++) {
+    struct sysstat t = st[i];
+    int j = i;
+    for (; j > 0 && st[j - 1].time < t.time; j--) st[j] = st[j - 1];
+    st[j] = t;
+  }
+  printf("NAME\t\tCALLS\tTOTALUS\tAVGUS\tP50US\tP99US\tMAXUS\n");
+  for (int i = 0; i < n && st[i].ncall > 0; i++) {
+    printf("%s\t%s%lu\t%lu\t%lu\t<%lu\t<%lu\t%lu\n", st[i].name,
+           strlen(st[i].name) < 8 ? "\t" : "", st[i].ncall, us(st[i].time),
+           us(st[i].time / st[i].ncall), pctl(&st[i], 50), pctl(&st[i], 99),
+           us(st[i].maxtime));
+  }
+}
+
+int main(int argc, char *argv[]) {
+  int pid;
+
+  if (argc < 2) {
+    list();
+    exit(0);
+  }
+  if (strcmp(argv[1], "-r") == 0) {
+    sysstat(SYSSTAT_RESET, 0, 0);
+    exit(0);
+  }
+
+  sysstat(SYSSTAT_RESET, 0, 0);
+  if ((pid = fork()) < 0) {
+    fprintf(2, "sysstat: fork failed\n");
+    exit(1);
+  }
+  if (pid == 0) {
+    exec(argv[1], argv + 1);
+    fprintf(2, "sysstat: exec %s failed\n", argv[1]);
+    exit(1);
+  }
+  wait(0);
+  list();
+  exit(0);
+}
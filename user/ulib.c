@@ -1,4 +1,5 @@
 #include "kernel/fcntl.h"
+#include "kernel/memlayout.h"
 #include "kernel/riscv.h"
 #include "kernel/stat.h"
 #include "kernel/types.h"
@@ -15,6 +16,23 @@ void start(int argc, char **argv) {
   exit(r);
 }
 
+// stdio.c's, in programs linked with it.
+extern void fflushall(void) __attribute__((weak));
+extern void fclosed(int) __attribute__((weak));
+
+// write out buffered output, then exit.
+int exit(int status) {
+  if (fflushall) fflushall();
+  sys_exit(status);
+}
+
+// write out fd's buffered output, which a file opened as fd
+// later must not get, then close it.
+int close(int fd) {
+  if (fclosed) fclosed(fd);
+  return sys_close(fd);
+}
+
 char *strcpy(char *s, const char *t) {
   char *os;
 
@@ -35,12 +53,28 @@ uint strlen(const char *s) {
   return n;
 }
 
+// memset, memcmp and memmove work a word at a time once the
+// pointers are aligned, as in kernel/string.c.
+typedef uint64 __attribute__((may_alias)) word;
+
+#define WSIZE sizeof(word)
+#define WMASK (WSIZE - 1)
+
 void *memset(void *dst, int c, uint n) {
-  char *cdst = (char *)dst;
-  int i;
-  for (i = 0; i < n; i++) {
-    cdst[i] = c;
+  uchar *d = dst;
+  word w = (uchar)c * 0x0101010101010101UL;
+
+  while (n > 0 && ((uint64)d & WMASK) != 0) *d++ = c, n--;
+  word *wd = (word *)d;
+  for (; n >= 4 * WSIZE; n -= 4 * WSIZE, wd += 4) {
+    wd[0] = w;
+    wd[1] = w;
+    wd[2] = w;
+    wd[3] = w;
   }
+  for (; n >= WSIZE; n -= WSIZE) *wd++ = w;
+  d = (uchar *)wd;
+  while (n-- > 0) *d++ = c;
   return dst;
 }
 
@@ -50,20 +84,6 @@ char *strchr(const char *s, char c) {
   return 0;
 }
 
-char *gets(char *buf, int max) {
-  int i, cc;
-  char c;
-
-  for (i = 0; i + 1 < max;) {
-    cc = read(0, &c, 1);
-    if (cc < 1) break;
-    buf[i++] = c;
-    if (c == '\n' || c == '\r') break;
-  }
-  buf[i] = '\0';
-  return buf;
-}
-
 int stat(const char *n, struct stat *st) {
   int fd;
   int r;
@@ -83,31 +103,78 @@ int atoi(const char *s) {
   return n;
 }
 
-void *memmove(void *vdst, const void *vsrc, int n) {
-  char *dst;
-  const char *src;
-
-  dst = vdst;
-  src = vsrc;
-  if (src > dst) {
-    while (n-- > 0) *dst++ = *src++;
+void *memmove(void *dst, const void *src, int sn) {
+  const char *s;
+  char *d;
+
+  if (sn <= 0) return dst;
+  uint n = sn;
+
+  s = src;
+  d = dst;
+  int aligned = (((uint64)s ^ (uint64)d) & WMASK) == 0;
+  if (s < d && s + n > d) {
+    s += n;
+    d += n;
+    if (aligned) {
+      while (n > 0 && ((uint64)d & WMASK) != 0) *--d = *--s, n--;
+      for (; n >= 4 * WSIZE; n -= 4 * WSIZE) {
+        d -= 4 * WSIZE;
+        s -= 4 * WSIZE;
+        ((word *)d)[3] = ((word *)s)[3];
+        ((word *)d)[2] = ((word *)s)[2];
+        ((word *)d)[1] = ((word *)s)[1];
+        ((word *)d)[0] = ((word *)s)[0];
+      }
+      for (; n >= WSIZE; n -= WSIZE) {
+        d -= WSIZE;
+        s -= WSIZE;
+        *(word *)d = *(word *)s;
+      }
+    }
+    while (n-- > 0) *--d = *--s;
   } else {
-    dst += n;
-    src += n;
-    while (n-- > 0) *--dst = *--src;
+    if (aligned) {
+      while (n > 0 && ((uint64)d & WMASK) != 0) *d++ = *s++, n--;
+      for (; n >= 4 * WSIZE; n -= 4 * WSIZE) {
+        ((word *)d)[0] = ((word *)s)[0];
+        ((word *)d)[1] = ((word *)s)[1];
+        ((word *)d)[2] = ((word *)s)[2];
+        ((word *)d)[3] = ((word *)s)[3];
+        d += 4 * WSIZE;
+        s += 4 * WSIZE;
+      }
+      for (; n >= WSIZE; n -= WSIZE) {
+        *(word *)d = *(word *)s;
+        d += WSIZE;
+        s += WSIZE;
+      }
+    }
+    while (n-- > 0) *d++ = *s++;
   }
-  return vdst;
+
+  return dst;
 }
 
-int memcmp(const void *s1, const void *s2, uint n) {
-  const char *p1 = s1, *p2 = s2;
-  while (n-- > 0) {
-    if (*p1 != *p2) {
-      return *p1 - *p2;
+int memcmp(const void *v1, const void *v2, uint n) {
+  const uchar *s1, *s2;
+
+  s1 = v1;
+  s2 = v2;
+  if ((((uint64)s1 ^ (uint64)s2) & WMASK) == 0) {
+    while (n > 0 && ((uint64)s1 & WMASK) != 0) {
+      if (*s1 != *s2) return *s1 - *s2;
+      s1++, s2++, n--;
     }
-    p1++;
-    p2++;
+    // skip equal words; the bytes below find the difference.
+    while (n >= WSIZE && *(word *)s1 == *(word *)s2)
+      s1 += WSIZE, s2 += WSIZE, n -= WSIZE;
+  }
+  while (n-- > 0) {
+    if (*s1 != *s2) return *s1 - *s2;
+    s1++, s2++;
   }
+
   return 0;
 }
 
@@ -118,3 +185,45 @@ void *memcpy(void *dst, const void *src, uint n) {
 char *sbrk(int n) { return sys_sbrk(n, SBRK_EAGER); }
 
 char *sbrklazy(int n) { return sys_sbrk(n, SBRK_LAZY); }
+
+// The rest read the usyscall page and the time CSR instead of
+// trapping into the kernel.
+
+// uptime() without a system call.
+int ugetuptime(void) {
+  struct usyscall *u = (struct usyscall *)USYSCALL;
+  return r_time() / u->tickcycles;
+}
+
+// The process's usage as of its threads' last returns to user
+// space, summed.
+int ugetrusage(struct rusage *ru) {
+  struct usyscall *u = (struct usyscall *)USYSCALL;
+  uint seq;
+
+  do {
+    while ((seq = u->seq) & 1);
+    __sync_synchronize();
+    *ru = u->ru;
+    __sync_synchronize();
+  } while (u->seq != seq);
+  return 0;
+}
+
+int clock_gettime(int clock, struct timespec *ts) {
+  struct usyscall *u = (struct usyscall *)USYSCALL;
+  struct rusage ru;
+  uint64 t;
+
+  if (clock == CLOCK_MONOTONIC) {
+    t = r_time();
+  } else if (clock == CLOCK_PROCESS_CPUTIME_ID) {
+    ugetrusage(&ru);
+    t = ru.utime + ru.stime;
+  } else {
+    return -1;
+  }
+  ts->tv_sec = t / u->timebase;
+  ts->tv_nsec = t % u->timebase * 1000000000 / u->timebase;
+  return 0;
+}
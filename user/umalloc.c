@@ -1,80 +1,108 @@
+#include "kernel/fcntl.h"
 #include "kernel/param.h"
+#include "kernel/riscv.h"
 #include "kernel/stat.h"
 #include "kernel/types.h"
 #include "user/user.h"
 
-// Memory allocator by Kernighan and Ritchie,
-// The C programming Language, 2nd ed.  Section 8.7.
+// Memory allocator with segregated size classes.
+//
+// A small request is rounded up to one of the sizes in classes[]
+// and served from that size's free list, which a free() pushes
+// back onto, both in O(1). A list that runs dry is refilled by
+// carving up CHUNK bytes from sbrk(); that memory is never given
+// back, but stays on the lists for reuse. A request bigger than
+// the largest class gets a mapping of its own from mmap(), which
+// free() unmaps.
+//
+// Threads made with clone() share one lock; tools are mostly
+// single-threaded, so it is rarely contended.
 
-typedef long Align;
+#define CHUNK (4 * PGSIZE)
+#define LARGE (-1UL)  // header.cls of an mmap()ed block
 
-union header {
-  struct {
-    union header *ptr;
-    uint size;
-  } s;
-  Align x;
+// Ahead of every block; 16 bytes, so blocks stay 16-byte aligned.
+struct header {
+  uint64 cls;  // index into classes[], or LARGE
+  uint64 len;  // a LARGE block's mapped bytes
 };
 
-typedef union header Header;
+// A free block, on its class's list.
+struct block {
+  struct header h;
+  struct block *next;
+};
 
-static Header base;
-static Header *freep;
+static uint classes[] = {16,  32,  48,  64,   96,   128,  192,
+                         256, 384, 512, 768, 1024, 1536, 2048};
+#define NCLASS NELEM(classes)
 
-void free(void *ap) {
-  Header *bp, *p;
-
-  bp = (Header *)ap - 1;
-  for (p = freep; !(bp > p && bp < p->s.ptr); p = p->s.ptr)
-    if (p >= p->s.ptr && (bp > p || bp < p->s.ptr)) break;
-  if (bp + bp->s.size == p->s.ptr) {
-    bp->s.size += p->s.ptr->s.size;
-    bp->s.ptr = p->s.ptr->s.ptr;
-  } else
-    bp->s.ptr = p->s.ptr;
-  if (p + p->s.size == bp) {
-    p->s.size += bp->s.size;
-    p->s.ptr = bp->s.ptr;
-  } else
-    p->s.ptr = bp;
-  freep = p;
+static struct block *freelist[NCLASS];
+static volatile int lock;
+
+static void acquire(void) {
+  while (__sync_lock_test_and_set(&lock, 1));
 }
 
-static Header *morecore(uint nu) {
-  char *p;
-  Header *hp;
-
-  if (nu < 4096) nu = 4096;
-  p = sbrk(nu * sizeof(Header));
-  if (p == SBRK_ERROR) return 0;
-  hp = (Header *)p;
-  hp->s.size = nu;
-  free((void *)(hp + 1));
-  return freep;
+static void release(void) { __sync_lock_release(&lock); }
+
+// Carve a chunk from sbrk() into blocks of class c.
+// Caller holds lock.
+static int refill(int c) {
+  uint size = sizeof(struct header) + classes[c];
+  char *p = sbrk(CHUNK);
+
+  if (p == SBRK_ERROR) return -1;
+  for (char *b = p; b + size <= p + CHUNK; b += size) {
+    ((struct block *)b)->h.cls = c;
+    ((struct block *)b)->next = freelist[c];
+    freelist[c] = (struct block *)b;
+  }
+  return 0;
 }
 
-void *malloc(uint nbytes) {
-  Header *p, *prevp;
-  uint nunits;
+static void *malloclarge(uint nbytes) {
+  uint64 len = PGROUNDUP(sizeof(struct header) + (uint64)nbytes);
+  struct header *h;
 
-  nunits = (nbytes + sizeof(Header) - 1) / sizeof(Header) + 1;
-  if ((prevp = freep) == 0) {
-    base.s.ptr = freep = prevp = &base;
-    base.s.size = 0;
+  if (len > 0x7fffffff) return 0;
+  h = mmap(0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (h == (struct header *)-1) return 0;
+  h->cls = LARGE;
+  h->len = len;
+  return h + 1;
+}
+
+void free(void *ap) {
+  struct header *h;
+  struct block *b;
+
+  if (ap == 0) return;
+  h = (struct header *)ap - 1;
+  if (h->cls == LARGE) {
+    munmap(h, h->len);
+    return;
   }
-  for (p = prevp->s.ptr;; prevp = p, p = p->s.ptr) {
-    if (p->s.size >= nunits) {
-      if (p->s.size == nunits)
-        prevp->s.ptr = p->s.ptr;
-      else {
-        p->s.size -= nunits;
-        p += p->s.size;
-        p->s.size = nunits;
-      }
-      freep = prevp;
-      return (void *)(p + 1);
-    }
-    if (p == freep)
-      if ((p = morecore(nunits)) == 0) return 0;
+  b = (struct block *)h;
+  acquire();
+  b->next = freelist[h->cls];
+  freelist[h->cls] = b;
+  release();
+}
+
+void *malloc(uint nbytes) {
+  struct block *b;
+  int c;
+
+  for (c = 0; c < NCLASS && classes[c] < nbytes; c++);
+  if (c == NCLASS) return malloclarge(nbytes);
+  acquire();
+  if (freelist[c] == 0 && refill(c) < 0) {
+    release();
+    return 0;
   }
+  b = freelist[c];
+  freelist[c] = b->next;
+  release();
+  return &b->h + 1;
 }
@@ -3,6 +3,18 @@
 #include "kernel/types.h"
 
 struct stat;
+struct rusage;
+struct pinfo;
+struct timespec;
+struct lockstat;
+struct iovec;
+struct diskstat;
+struct iostat;
+struct pollfd;
+struct ring;
+struct profsample;
+struct hpmcount;
+struct slabbench;
 
 // system calls
 int fork(void);
@@ -24,10 +36,46 @@ int chdir(const char*);
 int dup(int);
 int getpid(void);
 char* sys_sbrk(int, int);
+void sys_exit(int) __attribute__((noreturn));
+int sys_close(int);
 int pause(int);
 int uptime(void);
 void* mmap(void*, int, int, int, int, int);
 int munmap(void*, int);
+int spawn(const char*, char**, int*, int);
+int madvise(void*, int, int);
+int msync(void*, int, int);
+int setpriority(int, int);
+int clone(void (*)(void*), void*, void*);
+int join(int, int*);
+int futex(int*, int, int);
+int setaffinity(int, uint64);
+uint64 getaffinity(int);
+int getrusage(int, struct rusage*);
+int pinfo(int, struct pinfo*);
+int lockstat(int, struct lockstat*, int);
+int fsync(int);
+int sendfile(int, int, uint*, int);
+int splice(int, int, int);
+int pread(int, void*, int, uint);
+int pwrite(int, const void*, int, uint);
+int readv(int, const struct iovec*, int);
+int writev(int, const struct iovec*, int);
+int diskstat(int, struct diskstat*, int);
+int iostat(int, struct iostat*);
+int fcntl(int, int, int);
+int memfd(int);
+int poll(struct pollfd*, int, int);
+int dmesg(char*, int);
+int trace(uint64);
+int sysstat(int, void*, int);
+struct ring* ringsetup(int);
+int ringenter(int, int);
+int prof(int, struct profsample*, int);
+int hpm(int, void*, int);
+int slabbench(int, struct slabbench*, int);
+int nanosleep(const struct timespec*, struct timespec*);
+int meminfo(int, void*, int);
 
 
 // ulib.c
@@ -36,7 +84,6 @@ char* strcpy(char*, const char*);
 void* memmove(void*, const void*, int);
 char* strchr(const char*, char c);
 int strcmp(const char*, const char*);
-char* gets(char*, int max);
 uint strlen(const char*);
 void* memset(void*, int, uint);
 int atoi(const char*);
@@ -44,11 +91,20 @@ int memcmp(const void*, const void*, uint);
 void* memcpy(void*, const void*, uint);
 char* sbrk(int);
 char* sbrklazy(int);
+int ugetuptime(void);
+int ugetrusage(struct rusage*);
+int clock_gettime(int, struct timespec*);
 
 // printf.c
 void fprintf(int, const char*, ...) __attribute__((format(printf, 2, 3)));
 void printf(const char*, ...) __attribute__((format(printf, 1, 2)));
 
+// stdio.c
+int fflush(int);
+void bputc(int, char);
+void bdone(int);
+char* gets(char*, int max);
+
 // umalloc.c
 void* malloc(uint);
 void free(void*);
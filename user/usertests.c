@@ -1,11 +1,24 @@
+#include "kernel/diskstat.h"
+#include "kernel/dmesg.h"
 #include "kernel/fcntl.h"
 #include "kernel/fs.h"
+#include "kernel/hpm.h"
+#include "kernel/iostat.h"
+#include "kernel/lockstat.h"
+#include "kernel/meminfo.h"
 #include "kernel/memlayout.h"
 #include "kernel/param.h"
+#include "kernel/poll.h"
+#include "kernel/prof.h"
 #include "kernel/riscv.h"
+#include "kernel/ring.h"
+#include "kernel/rusage.h"
+#include "kernel/slabbench.h"
 #include "kernel/stat.h"
 #include "kernel/syscall.h"
+#include "kernel/sysstat.h"
 #include "kernel/types.h"
+#include "kernel/uio.h"
 #include "user/user.h"
 
 //
@@ -549,7 +562,10 @@ void writetest(char *s) {
   }
 }
 
+// a file past what a single indirect block can map, but that
+// fits on the disk.
 void writebig(char *s) {
+  enum { NBIG = NINDIRECT + NINDIRECT / 2 };
   int i, fd, n;
 
   fd = open("big", O_CREATE | O_RDWR);
@@ -558,7 +574,7 @@ void writebig(char *s) {
     exit(1);
   }
 
-  for (i = 0; i < MAXFILE; i++) {
+  for (i = 0; i < NBIG; i++) {
     ((int *)buf)[0] = i;
     if (write(fd, buf, BSIZE) != BSIZE) {
       printf("%s: error: write big file failed i=%d\n", s, i);
@@ -578,7 +594,7 @@ void writebig(char *s) {
   for (;;) {
     i = read(fd, buf, BSIZE);
     if (i == 0) {
-      if (n != MAXFILE) {
+      if (n != NBIG) {
         printf("%s: read only %d blocks from big", s, n);
         exit(1);
       }
@@ -600,6 +616,55 @@ void writebig(char *s) {
   }
 }
 
+// two files written a block at a time in turn, so that neither
+// can grow its extents for long, and both run out of them and
+// go on into the indirect trees.
+void interleave(char *s) {
+  enum { N = NEXTENT * NPREALLOC + 16 };
+  char *names[2] = {"ilva", "ilvb"};
+  int fd[2];
+
+  for (int f = 0; f < 2; f++) {
+    if ((fd[f] = open(names[f], O_CREATE | O_RDWR | O_TRUNC)) < 0) {
+      printf("%s: create %s failed\n", s, names[f]);
+      exit(1);
+    }
+  }
+  for (int i = 0; i < N; i++) {
+    for (int f = 0; f < 2; f++) {
+      ((int *)buf)[0] = i;
+      ((int *)buf)[1] = f;
+      if (write(fd[f], buf, BSIZE) != BSIZE) {
+        printf("%s: write %s failed at %d\n", s, names[f], i);
+        exit(1);
+      }
+    }
+  }
+  for (int f = 0; f < 2; f++) {
+    close(fd[f]);
+    if ((fd[f] = open(names[f], O_RDONLY)) < 0) {
+      printf("%s: open %s failed\n", s, names[f]);
+      exit(1);
+    }
+    for (int i = 0; i < N; i++) {
+      if (read(fd[f], buf, BSIZE) != BSIZE || ((int *)buf)[0] != i ||
+          ((int *)buf)[1] != f) {
+        printf("%s: %s: bad block %d\n", s, names[f], i);
+        exit(1);
+      }
+    }
+    if (read(fd[f], buf, BSIZE) != 0) {
+      printf("%s: %s too long\n", s, names[f]);
+      exit(1);
+    }
+    close(fd[f]);
+    if (unlink(names[f]) < 0) {
+      printf("%s: unlink %s failed\n", s, names[f]);
+      exit(1);
+    }
+  }
+}
+
 // many creates, followed by unlink test
 void createtest(char *s) {
   int i, fd;
@@ -761,15 +826,1462 @@ void killstatus(char *s) {
       }
       exit(0);
     }
-    pause(1);
-    kill(pid1);
+    pause(1);
+    kill(pid1);
+    wait(&xst);
+    if (xst != -1) {
+      printf("%s: status should be -1\n", s);
+      exit(1);
+    }
+  }
+  exit(0);
+}
+
+// setpriority() checks its arguments, returns the old level,
+// and fork passes the level on.
+void priority(char *s) {
+  int xst;
+
+  if (setpriority(getpid(), NPRIO) != -1 || setpriority(getpid(), -1) != -1) {
+    printf("%s: setpriority accepted a bad level\n", s);
+    exit(1);
+  }
+  if (setpriority(1000000, 0) != -1) {
+    printf("%s: setpriority found a bad pid\n", s);
+    exit(1);
+  }
+  if (setpriority(getpid(), NPRIO - 1) != 0) {
+    printf("%s: default level is not 0\n", s);
+    exit(1);
+  }
+  int pid = fork();
+  if (pid < 0) {
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if (pid == 0) exit(setpriority(getpid(), 0));
+  wait(&xst);
+  if (xst != NPRIO - 1) {
+    printf("%s: child got level %d, not %d\n", s, xst, NPRIO - 1);
+    exit(1);
+  }
+  if (setpriority(getpid(), 0) != NPRIO - 1) {
+    printf("%s: setpriority returned the wrong old level\n", s);
+    exit(1);
+  }
+}
+
+void affinity(char *s) {
+  uint64 all, one;
+  int xst;
+
+  all = getaffinity(0);
+  one = all & -all;
+  if (all == 0 || getaffinity(getpid()) != all) {
+    printf("%s: no harts to run on\n", s);
+    exit(1);
+  }
+  if (setaffinity(0, 0) != -1 || setaffinity(0, ~all) != -1 ||
+      setaffinity(1000000, all) != -1) {
+    printf("%s: setaffinity accepted a bad mask or pid\n", s);
+    exit(1);
+  }
+  if (setaffinity(0, one) != 0 || getaffinity(0) != one) {
+    printf("%s: setaffinity failed\n", s);
+    exit(1);
+  }
+  int pid = fork();
+  if (pid < 0) {
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if (pid == 0) {
+    for (int i = 0; i < 100; i++) pause(0);
+    exit(getaffinity(0) != one);
+  }
+  wait(&xst);
+  if (xst != 0) {
+    printf("%s: child did not inherit affinity\n", s);
+    exit(1);
+  }
+  if (setaffinity(0, ~0UL) != 0 || getaffinity(0) != all) {
+    printf("%s: could not unpin\n", s);
+    exit(1);
+  }
+}
+
+// the kernel charges time, switches and faults to the process
+// that incurred them, and pinfo() lists it.
+void rusage(char *s) {
+  struct rusage ru0, ru1;
+  struct pinfo pi;
+  char *p;
+  int t0;
+
+  if (getrusage(0, &ru0) != 0 || getrusage(1000000, &ru0) != -1) {
+    printf("%s: getrusage failed\n", s);
+    exit(1);
+  }
+  getrusage(getpid(), &ru0);
+  t0 = uptime();
+  while (uptime() - t0 < 2);
+  pause(1);
+  p = sbrklazy(10 * 4096);
+  for (int i = 0; i < 10; i++) p[i * 4096] = 1;
+  sbrk(-10 * 4096);
+  getrusage(0, &ru1);
+  if (ru1.utime <= ru0.utime || ru1.stime <= ru0.stime) {
+    printf("%s: time not charged\n", s);
+    exit(1);
+  }
+  if (ru1.nvcsw <= ru0.nvcsw || ru1.nfault < ru0.nfault + 10) {
+    printf("%s: switches or faults not counted\n", s);
+    exit(1);
+  }
+  if (pinfo(getpid(), &pi) != getpid() || pi.tgid != getpid() ||
+      strcmp(pi.name, "usertests") != 0 || pi.state != 4) {
+    printf("%s: pinfo does not describe us\n", s);
+    exit(1);
+  }
+  if (pinfo(1, &pi) != 1 || strcmp(pi.name, "init") != 0) {
+    printf("%s: pinfo does not find init\n", s);
+    exit(1);
+  }
+}
+
+// clock_gettime(), ugetuptime() and ugetrusage() agree with
+// their system calls without making any.
+void vdsotime(char *s) {
+  struct timespec t0, t1, c0, c1;
+  struct rusage ru, kru;
+  int up;
+
+  up = uptime();
+  if (ugetuptime() < up || ugetuptime() > up + 1) {
+    printf("%s: ugetuptime %d, uptime %d\n", s, ugetuptime(), up);
+    exit(1);
+  }
+  if (clock_gettime(0, &t0) != -1) {
+    printf("%s: clock_gettime accepted a bad clock\n", s);
+    exit(1);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &c0);
+  while (uptime() - up < 3);
+  getpid();  // publish the spin
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &c1);
+  if (t0.tv_nsec >= 1000000000 || t1.tv_sec * 1000000000 + t1.tv_nsec <=
+                                      t0.tv_sec * 1000000000 + t0.tv_nsec) {
+    printf("%s: monotonic clock went wrong\n", s);
+    exit(1);
+  }
+  if (c1.tv_sec * 1000000000 + c1.tv_nsec <=
+      c0.tv_sec * 1000000000 + c0.tv_nsec) {
+    printf("%s: cpu time did not advance\n", s);
+    exit(1);
+  }
+  getrusage(0, &kru);
+  ugetrusage(&ru);
+  if (ru.utime > kru.utime || ru.nvcsw > kru.nvcsw || ru.utime == 0) {
+    printf("%s: ugetrusage disagrees with getrusage\n", s);
+    exit(1);
+  }
+}
+
+// with no periodic tick, pause() deadlines drive the timer;
+// overlapping pauses of different lengths must each last at
+// least as long as asked, and none may sleep forever.
+void pausewake(char *s) {
+  int xst;
+
+  for (int i = 0; i < 4; i++) {
+    int pid = fork();
+    if (pid < 0) {
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if (pid == 0) {
+      int n = 1 + 3 * (3 - i);
+      int t0 = uptime();
+      pause(n);
+      exit(uptime() - t0 < n);
+    }
+  }
+  for (int i = 0; i < 4; i++) {
+    wait(&xst);
+    if (xst != 0) {
+      printf("%s: pause returned early\n", s);
+      exit(1);
+    }
+  }
+}
+
+#define NCLONE 4
+
+int clonefd;
+volatile int clonesum[NCLONE];
+
+void clonethread(void *arg) {
+  int i = (int)(uint64)arg;
+  char c = 'a' + i;
+
+  for (int j = 0; j < 1000; j++) clonesum[i] += j;
+  if (write(clonefd, &c, 1) != 1) exit(1);
+  exit(i);
+}
+
+void clonespin(void *arg) {
+  for (;;);
+}
+
+// threads share memory and open files, and are joined; a
+// process exit takes its threads with it.
+void clonetest(char *s) {
+  int tid[NCLONE], fds[2], xst, pid;
+  char *stack, buf[NCLONE];
+
+  if (pipe(fds) < 0) {
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  clonefd = fds[1];
+  if ((stack = malloc(NCLONE * 4096)) == 0) {
+    printf("%s: malloc failed\n", s);
+    exit(1);
+  }
+  for (int i = 0; i < NCLONE; i++) {
+    tid[i] = clone(clonethread, (void *)(uint64)i, stack + (i + 1) * 4096);
+    if (tid[i] < 0) {
+      printf("%s: clone failed\n", s);
+      exit(1);
+    }
+  }
+  for (int i = 0; i < NCLONE; i++) {
+    if (join(tid[i], &xst) != tid[i] || xst != i) {
+      printf("%s: join failed\n", s);
+      exit(1);
+    }
+    if (clonesum[i] != 999 * 1000 / 2) {
+      printf("%s: thread's writes lost\n", s);
+      exit(1);
+    }
+  }
+  if (join(tid[0], 0) != -1) {
+    printf("%s: joined a thread twice\n", s);
+    exit(1);
+  }
+  close(fds[1]);
+  if (read(fds[0], buf, sizeof(buf)) != NCLONE) {
+    printf("%s: threads did not write the pipe\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+
+  pid = fork();
+  if (pid < 0) {
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if (pid == 0) {
+    for (int i = 0; i < NCLONE; i++)
+      if (clone(clonespin, 0, stack + (i + 1) * 4096) < 0) exit(1);
+    exit(0);
+  }
+  wait(&xst);
+  if (xst != 0) {
+    printf("%s: clone in child failed\n", s);
+    exit(1);
+  }
+  free(stack);
+}
+
+// 0 unlocked, 1 locked, 2 locked with waiters.
+void futexlock(int *l) {
+  int c = __sync_val_compare_and_swap(l, 0, 1);
+  if (c == 0) return;
+  if (c != 2) c = __sync_lock_test_and_set(l, 2);
+  while (c != 0) {
+    futex(l, FUTEX_WAIT, 2);
+    c = __sync_lock_test_and_set(l, 2);
+  }
+}
+
+void futexunlock(int *l) {
+  if (__sync_fetch_and_sub(l, 1) != 1) {
+    *l = 0;
+    futex(l, FUTEX_WAKE, 1);
+  }
+}
+
+int futexword;
+volatile int futexcount;
+
+void futexthread(void *arg) {
+  for (int i = 0; i < 1000; i++) {
+    futexlock(&futexword);
+    int c = futexcount;
+    if (i % 100 == 0) pause(0);
+    futexcount = c + 1;
+    futexunlock(&futexword);
+  }
+  exit(0);
+}
+
+// threads and processes sharing a page block on a futex until
+// woken, and a futex lock excludes.
+void futextest(char *s) {
+  int tid[NCLONE], xst, pid;
+  char *stack;
+  int *w;
+
+  w = &futexword;
+  if (futex(w, FUTEX_WAIT, 1) != -1) {
+    printf("%s: waited on a changed word\n", s);
+    exit(1);
+  }
+  if (futex(w, FUTEX_WAKE, 1) != 0) {
+    printf("%s: woke a sleeper that isn't there\n", s);
+    exit(1);
+  }
+
+  if ((stack = malloc(NCLONE * 4096)) == 0) {
+    printf("%s: malloc failed\n", s);
+    exit(1);
+  }
+  for (int i = 0; i < NCLONE; i++) {
+    if ((tid[i] = clone(futexthread, 0, stack + (i + 1) * 4096)) < 0) {
+      printf("%s: clone failed\n", s);
+      exit(1);
+    }
+  }
+  for (int i = 0; i < NCLONE; i++) join(tid[i], 0);
+  free(stack);
+  if (futexcount != NCLONE * 1000) {
+    printf("%s: lost updates, count %d\n", s, futexcount);
+    exit(1);
+  }
+
+  w = mmap(0, 4096, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1,
+           0);
+  if (w == (int *)-1) {
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if (pid < 0) {
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if (pid == 0) {
+    while (*w == 0) futex(w, FUTEX_WAIT, 0);
+    exit(*w != 1);
+  }
+  pause(2);
+  *w = 1;
+  futex(w, FUTEX_WAKE, 1);
+  wait(&xst);
+  if (xst != 0) {
+    printf("%s: child saw the wrong value\n", s);
+    exit(1);
+  }
+  munmap(w, 4096);
+}
+
+// many processes resolve the same paths at once, while another
+// creates and removes entries in the same directory.
+void rwlookup(char *s) {
+  enum { NPROC = 4, N = 200 };
+  int pids[NPROC], pid, xst, fd;
+  struct stat st;
+
+  if (mkdir("rwd") < 0 || mkdir("rwd/a") < 0 ||
+      (fd = open("rwd/a/f", O_CREATE | O_RDWR)) < 0) {
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  for (int i = 0; i < NPROC; i++) {
+    if ((pids[i] = fork()) < 0) {
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if (pids[i] == 0 && i == 0) {
+      for (int j = 0; j < N; j++) {
+        if ((fd = open("rwd/a/t", O_CREATE | O_RDWR)) < 0) exit(1);
+        close(fd);
+        if (unlink("rwd/a/t") < 0) exit(1);
+      }
+      exit(0);
+    }
+    if (pids[i] == 0) {
+      for (int j = 0; j < N; j++) {
+        if (stat("rwd/a/f", &st) < 0 || st.type != T_FILE) {
+          printf("%s: stat failed\n", s);
+          exit(1);
+        }
+        fd = open("rwd/../rwd/a/f", O_RDONLY);
+        if (fd < 0 || fstat(fd, &st) < 0 || st.type != T_FILE) {
+          printf("%s: open failed\n", s);
+          exit(1);
+        }
+        close(fd);
+      }
+      exit(0);
+    }
+  }
+  for (int i = 0; i < NPROC; i++) {
+    wait(&xst);
+    if (xst != 0) exit(1);
+  }
+
+  // a reaped process can no longer be found by pid.
+  if ((pid = fork()) == 0) exit(0);
+  wait(0);
+  if (kill(pid) != -1) {
+    printf("%s: killed a reaped process\n", s);
+    exit(1);
+  }
+  unlink("rwd/a/f");
+  unlink("rwd/a");
+  unlink("rwd");
+}
+
+// lockstat() counts acquisitions by lock name while enabled.
+void lockstats(char *s) {
+  static struct lockstat ls[64];
+  int n, fd, seen = 0;
+
+  if (lockstat(99, 0, 0) != -1) {
+    printf("%s: lockstat accepted a bad op\n", s);
+    exit(1);
+  }
+  lockstat(LOCKSTAT_RESET, 0, 0);
+  lockstat(LOCKSTAT_ENABLE, 0, 0);
+  if ((fd = open("README", O_RDONLY)) < 0) {
+    printf("%s: open README failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if (fork() == 0) exit(0);
+  wait(0);
+  lockstat(LOCKSTAT_DISABLE, 0, 0);
+
+  n = lockstat(LOCKSTAT_GET, ls, 64);
+  for (int i = 0; i < n; i++) {
+    if (ls[i].ncontend > ls[i].nacquire || ls[i].maxwait > ls[i].wait) {
+      printf("%s: %s: inconsistent counts\n", s, ls[i].name);
+      exit(1);
+    }
+    if (strcmp(ls[i].name, "proc") == 0 && ls[i].kind == LOCK_SPIN) seen |= 1;
+    if (strcmp(ls[i].name, "inode") == 0 && ls[i].kind == LOCK_SLEEP)
+      seen |= 2;
+  }
+  if (seen != 3) {
+    printf("%s: missing lock classes\n", s);
+    exit(1);
+  }
+
+  // nothing is counted while disabled, but a hart may have
+  // been about to count when it was.
+  lockstat(LOCKSTAT_RESET, 0, 0);
+  n = lockstat(LOCKSTAT_GET, ls, 64);
+  if (n > 2) {
+    printf("%s: reset left %d classes\n", s, n);
+    exit(1);
+  }
+}
+
+// with a polling budget, synchronous disk requests spin for
+// their completion, and diskstat() counts them.
+void diskpoll(char *s) {
+  struct diskstat st;
+  char buf[64];
+  int fd, old;
+
+  if (diskstat(99, 0, 0) != -1 || diskstat(DISKSTAT_POLL, 0, -1) != -1) {
+    printf("%s: diskstat accepted a bad op\n", s);
+    exit(1);
+  }
+  if (diskstat(DISKSTAT_GET, &st, 0) < 0) {
+    printf("%s: diskstat get failed\n", s);
+    exit(1);
+  }
+  old = st.pollus;
+  diskstat(DISKSTAT_POLL, 0, 1000);
+  diskstat(DISKSTAT_RESET, 0, 0);
+
+  // committing the file's creation writes the log header.
+  if ((fd = open("dpoll", O_CREATE | O_RDWR)) < 0) {
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  memset(buf, 'p', sizeof(buf));
+  if (write(fd, buf, sizeof(buf)) != sizeof(buf) || fsync(fd) < 0) {
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("dpoll");
+
+  diskstat(DISKSTAT_GET, &st, 0);
+  diskstat(DISKSTAT_POLL, 0, old);
+  if (st.pollus != 1000 || st.npoll == 0 || st.nhit > st.npoll ||
+      st.nreq == 0) {
+    printf("%s: req %lu poll %lu hit %lu budget %d\n", s, st.nreq, st.npoll,
+           st.nhit, st.pollus);
+    exit(1);
+  }
+}
+
+// a memfd's pages are the same through read(), write() and every
+// shared mapping of it, a fork()ed child's among them.
+void memfdtest(char *s) {
+  char buf[8], *m, *c;
+  int fd, pid, xst;
+
+  if ((fd = memfd(2 * PGSIZE)) < 0) {
+    printf("%s: memfd failed\n", s);
+    exit(1);
+  }
+  if (mmap(0, PGSIZE, PROT_READ, MAP_PRIVATE, fd, 0) != (char *)-1 ||
+      mmap(0, PGSIZE, PROT_READ, MAP_SHARED, fd, 2 * PGSIZE) != (char *)-1) {
+    printf("%s: mmap of a memfd accepted bad flags or offset\n", s);
+    exit(1);
+  }
+  m = mmap(0, 2 * PGSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (m == (char *)-1) {
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  if (write(fd, "hello", 5) != 5 || strcmp(m, "hello") != 0) {
+    printf("%s: write not seen through the mapping\n", s);
+    exit(1);
+  }
+
+  if ((pid = fork()) < 0) {
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if (pid == 0) {
+    c = mmap(0, PGSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, PGSIZE);
+    if (c == (char *)-1) exit(1);
+    m[5] = '!';
+    strcpy(c, "child");
+    exit(0);
+  }
+  wait(&xst);
+  if (xst != 0 || m[5] != '!' || strcmp(m + PGSIZE, "child") != 0) {
+    printf("%s: child's writes not seen\n", s);
+    exit(1);
+  }
+  if (read(fd, buf, 1) != 1 || buf[0] != '!') {
+    printf("%s: read not at offset 5\n", s);
+    exit(1);
+  }
+  munmap(m, 2 * PGSIZE);
+  close(fd);
+}
+
+// poll() waits for whichever of several pipes becomes ready.
+void polltest(char *s) {
+  struct pollfd pfds[4];
+  int a[2], b[2], pid;
+
+  if (pipe(a) != 0 || pipe(b) != 0) {
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  pfds[0].fd = a[0];
+  pfds[0].events = POLLIN;
+  pfds[1].fd = b[0];
+  pfds[1].events = POLLIN;
+  pfds[2].fd = a[1];
+  pfds[2].events = POLLOUT;
+  pfds[3].fd = 99;
+  pfds[3].events = POLLIN;
+  if (poll(pfds, 4, 0) != 2 || pfds[0].revents || pfds[1].revents ||
+      pfds[2].revents != POLLOUT || pfds[3].revents != POLLNVAL) {
+    printf("%s: wrong events of idle pipes\n", s);
+    exit(1);
+  }
+  if (poll(pfds, 2, 1) != 0) {
+    printf("%s: timed poll found events\n", s);
+    exit(1);
+  }
+
+  if ((pid = fork()) < 0) {
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if (pid == 0) {
+    pause(2);
+    write(b[1], "x", 1);
+    exit(0);
+  }
+  if (poll(pfds, 2, -1) != 1 || pfds[0].revents ||
+      pfds[1].revents != POLLIN) {
+    printf("%s: poll missed the write\n", s);
+    exit(1);
+  }
+  wait(0);
+
+  close(a[1]);
+  if (poll(pfds, 1, -1) != 1 || pfds[0].revents != POLLHUP) {
+    printf("%s: poll missed the close\n", s);
+    exit(1);
+  }
+  close(a[0]);
+  close(b[0]);
+  close(b[1]);
+}
+
+// a kernel printf() lands in the log that dmesg() reads, in
+// time order.
+void dmesgtest(char *s) {
+  static char buf[NCPU * KLOGSIZE];
+  uint64 t0 = r_time(), last = 0;
+  int n, pid, xstatus, found = 0;
+
+  pid = fork();
+  if (pid < 0) {
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if (pid == 0) {
+    // the kernel logs the bad store and kills us.
+    *(volatile char *)KERNBASE = 1;
+    exit(0);
+  }
+  wait(&xstatus);
+  if ((n = dmesg(buf, sizeof(buf))) <= 0) {
+    printf("%s: dmesg returned %d\n", s, n);
+    exit(1);
+  }
+  for (int off = 0; off < n;) {
+    struct klogrec *r = (struct klogrec *)(buf + off);
+    if (r->time < last) {
+      printf("%s: records out of order\n", s);
+      exit(1);
+    }
+    last = r->time;
+    if (r->time >= t0 && r->len >= 10 &&
+        memcmp(r + 1, "usertrap()", 10) == 0)
+      found = 1;
+    off += KLOGRECSIZE(r->len);
+    if (off > n) {
+      printf("%s: record overruns the log\n", s);
+      exit(1);
+    }
+  }
+  if (!found) {
+    printf("%s: no usertrap() message in the log\n", s);
+    exit(1);
+  }
+}
+
+// sysstat() counts calls, and trace() logs the selected calls
+// of a process and its children.
+void sysstattest(char *s) {
+  static struct sysstat st[64];
+  struct tracerec r[8];
+  uint64 before = 0, after = 0;
+  int n, pid, found = 0;
+
+  n = sysstat(SYSSTAT_GET, st, 64);
+  for (int i = 0; i < n; i++)
+    if (st[i].num == SYS_getpid) before = st[i].ncall;
+  for (int i = 0; i < 10; i++) getpid();
+  n = sysstat(SYSSTAT_GET, st, 64);
+  for (int i = 0; i < n; i++)
+    if (st[i].num == SYS_getpid) after = st[i].ncall;
+  if (after < before + 10) {
+    printf("%s: getpid count went from %lu to %lu\n", s, before, after);
+    exit(1);
+  }
+
+  while (sysstat(SYSSTAT_TRACE, r, 8) > 0);
+  pid = fork();
+  if (pid < 0) {
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if (pid == 0) {
+    trace(1UL << SYS_getpid);
+    if (fork() == 0) {
+      getpid();
+      exit(0);
+    }
+    wait(0);
+    getpid();
+    exit(0);
+  }
+  wait(0);
+  while ((n = sysstat(SYSSTAT_TRACE, r, 8)) > 0) {
+    for (int i = 0; i < n; i++) {
+      if (r[i].num != SYS_getpid) {
+        printf("%s: traced call %d\n", s, r[i].num);
+        exit(1);
+      }
+      found++;
+    }
+  }
+  if (found != 2) {
+    printf("%s: traced %d getpid calls, not 2\n", s, found);
+    exit(1);
+  }
+}
+
+static void ringsub(struct ring *r, int op, int fd, void *addr, int len,
+                    uint64 data) {
+  struct sqe *e = &r->sq[r->sqtail % NSQE];
+
+  e->op = op;
+  e->fd = fd;
+  e->addr = (uint64)addr;
+  e->len = len;
+  e->off = 0;
+  e->data = data;
+  __sync_synchronize();
+  r->sqtail++;
+}
+
+// wait for n completions from ring r, waking its poller if it
+// sleeps, and return the first's result.
+static int ringwait(struct ring *r, int n, int sqpoll) {
+  if (!sqpoll && ringenter(n, 0) != n) return -2;
+  for (;;) {
+    __sync_synchronize();
+    if (r->cqtail - r->cqhead >= n) break;
+    if (r->flags & RING_NEED_WAKEUP) ringenter(0, RING_ENTER_WAKEUP);
+  }
+  return r->cq[r->cqhead % NCQE].res;
+}
+
+// a batch of pipe writes and reads, and an open and close, through
+// an io ring, with and without a polling thread.
+void ringtest(char *s) {
+  char buf[8];
+  int fds[2], xstatus;
+
+  for (int sqpoll = 0; sqpoll < 2; sqpoll++) {
+    int pid = fork();
+    if (pid < 0) {
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if (pid == 0) {
+      struct ring *r = ringsetup(sqpoll ? RING_SQPOLL : 0);
+      if (r == (struct ring *)-1 || ringsetup(0) != (struct ring *)-1) {
+        printf("%s: ringsetup\n", s);
+        exit(1);
+      }
+      if (pipe(fds) != 0) {
+        printf("%s: pipe failed\n", s);
+        exit(1);
+      }
+      for (int i = 0; i < 8; i++)
+        ringsub(r, RING_WRITE, fds[1], "abcdefgh" + i, 1, i);
+      for (int i = 0; i < 8; i++)
+        ringsub(r, RING_READ, fds[0], buf + i, 1, 8 + i);
+      ringwait(r, 16, sqpoll);
+      for (int i = 0; i < 16; i++) {
+        struct cqe *c = &r->cq[r->cqhead++ % NCQE];
+        if (c->data != i || c->res != 1) {
+          printf("%s: completion %d: data %d res %d\n", s, i, (int)c->data,
+                 c->res);
+          exit(1);
+        }
+      }
+      if (memcmp(buf, "abcdefgh", 8) != 0) {
+        printf("%s: read the wrong bytes\n", s);
+        exit(1);
+      }
+      ringsub(r, RING_OPEN, 0, "README", O_RDONLY, 0);
+      int fd = ringwait(r, 1, sqpoll), res[3];
+      r->cqhead++;
+      if (fd < 0) {
+        printf("%s: ring open failed\n", s);
+        exit(1);
+      }
+      ringsub(r, RING_PREAD, fd, buf, 1, 0);
+      ringsub(r, RING_CLOSE, fd, 0, 0, 0);
+      ringsub(r, RING_CLOSE, fd, 0, 0, 0);
+      ringwait(r, 3, sqpoll);
+      for (int i = 0; i < 3; i++) res[i] = r->cq[r->cqhead++ % NCQE].res;
+      if (res[0] != 1 || res[1] != 0 || res[2] != -1) {
+        printf("%s: pread %d, close %d, close again %d\n", s, res[0], res[1],
+               res[2]);
+        exit(1);
+      }
+      exit(0);
+    }
+    wait(&xstatus);
+    if (xstatus != 0) exit(1);
+  }
+}
+
+// the profiler samples this process while it spins, and stops.
+void proftest(char *s) {
+  static struct profsample ps[64];
+  int n, mine = 0, t0;
+
+  if (prof(PROF_START, 0, -1) != -1) {
+    printf("%s: prof accepted a negative period\n", s);
+    exit(1);
+  }
+  if (prof(PROF_START, 0, 100) < 0) {
+    printf("%s: prof start failed\n", s);
+    exit(1);
+  }
+  t0 = uptime();
+  while (uptime() - t0 < 3) {
+    n = prof(PROF_GET, ps, 64);
+    for (int i = 0; i < n; i++)
+      if (ps[i].pid == getpid() && ps[i].user && ps[i].depth >= 1) mine++;
+  }
+  prof(PROF_STOP, 0, 0);
+  while (prof(PROF_GET, ps, 64) > 0);
+  if (mine == 0) {
+    printf("%s: no user samples of this process\n", s);
+    exit(1);
+  }
+  t0 = uptime();
+  while (uptime() - t0 < 1);
+  if ((n = prof(PROF_GET, ps, 64)) != 0) {
+    printf("%s: %d samples after stop\n", s, n);
+    exit(1);
+  }
+}
+
+// a store to a program's data page, read in first, must get a
+// private copy, not change the cached file page that the other
+// processes running the program share.
+static char textmagic[] = "sharedtext-magic-0";
+
+void sharedtexttest(char *s) {
+  char want[sizeof(textmagic)], *buf;
+  struct stat st;
+  int fd, n = 0, k, found = 0, changed = 0;
+
+  memmove(want, textmagic, sizeof(want));
+  textmagic[sizeof(textmagic) - 2] = '1';
+  if ((fd = open("usertests", O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+    printf("%s: cannot open usertests\n", s);
+    exit(1);
+  }
+  if ((buf = malloc(st.size)) == 0) {
+    printf("%s: malloc failed\n", s);
+    exit(1);
+  }
+  while (n < st.size && (k = read(fd, buf + n, st.size - n)) > 0) n += k;
+  close(fd);
+  for (int i = 0; i + sizeof(want) <= n; i++) {
+    if (memcmp(buf + i, want, sizeof(want)) == 0) found = 1;
+    if (memcmp(buf + i, textmagic, sizeof(textmagic)) == 0) changed = 1;
+  }
+  free(buf);
+  textmagic[sizeof(textmagic) - 2] = '0';
+  if (!found || changed) {
+    printf("%s: file data %s\n", s, changed ? "changed" : "missing");
+    exit(1);
+  }
+}
+
+// the counters charge this process for its spinning, and user
+// code may read the cycle counter itself.
+void hpmtest(char *s) {
+  uint64 ev[NHPM] = {HPM_DTLB_READ_MISS, HPM_DTLB_WRITE_MISS, HPM_ITLB_MISS,
+                     HPM_CACHE_MISS};
+  uint64 none[NHPM] = {0};
+  struct hpmcount hc;
+  uint64 c0, c1;
+  volatile int x = 0;
+
+  if (hpm(HPM_SELECT, ev, 0) < 0) {
+    printf("%s: select failed\n", s);
+    exit(1);
+  }
+  asm volatile("rdcycle %0" : "=r"(c0));
+  for (int i = 0; i < 1000000; i++) x++;
+  asm volatile("rdcycle %0" : "=r"(c1));
+  if (hpm(HPM_GET, &hc, 0) < 0 || hc.count[HPM_CYCLE] == 0 ||
+      hc.count[HPM_INSTRET] == 0) {
+    printf("%s: no cycles or instructions counted\n", s);
+    exit(1);
+  }
+  if (hc.event[HPM_COUNTER(0)] != HPM_DTLB_READ_MISS || c1 <= c0) {
+    printf("%s: bad events or cycle counter\n", s);
+    exit(1);
+  }
+  if (hpm(HPM_SYSTEM, &hc, 0) < 0 || hpm(HPM_GET, &hc, 1 << 30) != -1 ||
+      hpm(99, &hc, 0) != -1) {
+    printf("%s: bad hpm() results\n", s);
+    exit(1);
+  }
+  hpm(HPM_SELECT, none, 0);
+}
+
+// small blocks are reused from their size's free list, and big
+// ones are mapped apart from the heap and unmapped when freed.
+void malloctest(char *s) {
+  enum { N = 64 };
+  char *p[N], *a, *b, *brk;
+
+  for (int i = 0; i < N; i++) {
+    if ((p[i] = malloc(i * 97)) == 0 || (uint64)p[i] % 16 != 0) {
+      printf("%s: malloc(%d) failed or misaligned\n", s, i * 97);
+      exit(1);
+    }
+    memset(p[i], i, i * 97);
+  }
+  for (int i = 0; i < N; i++) {
+    for (int j = 0; j < i * 97; j++) {
+      if (p[i][j] != (char)i) {
+        printf("%s: block %d overwritten\n", s, i);
+        exit(1);
+      }
+    }
+    free(p[i]);
+  }
+
+  a = malloc(100);
+  free(a);
+  if ((b = malloc(90)) != a) {
+    printf("%s: freed block not reused\n", s);
+    exit(1);
+  }
+  free(b);
+  free(0);
+
+  brk = sbrk(0);
+  for (int i = 0; i < 8; i++) {
+    if ((a = malloc(1 << 20)) == 0) {
+      printf("%s: malloc(1MB) failed\n", s);
+      exit(1);
+    }
+    memset(a, 1, 1 << 20);
+    free(a);
+  }
+  if (sbrk(0) != brk) {
+    printf("%s: big blocks grew the heap\n", s);
+    exit(1);
+  }
+}
+
+// printf() to a file is buffered, taking a few writes for many
+// lines, and exit() writes out the rest.
+void stdiotest(char *s) {
+  char buf[16];
+  struct rusage ru0, ru1;
+  int fd, pid, xstatus, n;
+
+  unlink("stdio");
+  if ((pid = fork()) < 0) {
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if (pid == 0) {
+    if ((fd = open("stdio", O_CREATE | O_WRONLY)) < 0) exit(1);
+    getrusage(0, &ru0);
+    for (int i = 0; i < 100; i++) fprintf(fd, "%d\n", i % 10);
+    getrusage(0, &ru1);
+    exit(ru1.nsyscall - ru0.nsyscall > 10 ? 2 : 0);
+  }
+  wait(&xstatus);
+  if (xstatus != 0) {
+    printf("%s: child failed or made too many syscalls\n", s);
+    exit(1);
+  }
+  if ((fd = open("stdio", O_RDONLY)) < 0) {
+    printf("%s: no file\n", s);
+    exit(1);
+  }
+  for (int i = 0; i < 100; i++) {
+    if ((n = read(fd, buf, 2)) != 2 || buf[0] != '0' + i % 10 ||
+        buf[1] != '\n') {
+      printf("%s: bad line %d\n", s, i);
+      exit(1);
+    }
+  }
+  if (read(fd, buf, 1) != 0) {
+    printf("%s: file too long\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("stdio");
+}
+
+// slabbench() times every alloc and free of a run, and refuses
+// bad sizes and round counts.
+void slabbenchtest(char *s) {
+  static struct slabbench r;
+  uint64 n = 0;
+
+  if (slabbench(SLABBENCH_SETUP, 0, 0) != -1 ||
+      slabbench(SLABBENCH_SETUP, 0, 1 << 20) != -1 ||
+      slabbench(99, 0, 0) != -1) {
+    printf("%s: slabbench accepted a bad request\n", s);
+    exit(1);
+  }
+  if (slabbench(SLABBENCH_SETUP, 0, 100) != 0 ||
+      slabbench(SLABBENCH_RUN, &r, 0) != -1 ||
+      slabbench(SLABBENCH_RUN, &r, 10) != 0) {
+    printf("%s: slabbench failed\n", s);
+    exit(1);
+  }
+  for (int b = 0; b < SLABBENCH_NBUCKET; b++) n += r.hist[b];
+  if (r.ops != 10 * 2 * SLABBENCH_BURST || n != r.ops || r.end < r.start) {
+    printf("%s: ops %lu, %lu timed\n", s, r.ops, n);
+    exit(1);
+  }
+}
+
+// nanosleep() sleeps at least as long as asked, but not until the
+// next tick, and refuses a bad timespec.
+void nanosleeptest(char *s) {
+  struct timespec ts = {0, 5000000}, bad = {0, 1000000000};
+  uint64 best = ~0UL;
+
+  for (int i = 0; i < 5; i++) {
+    uint64 t0 = r_time();
+    if (nanosleep(&ts, 0) != 0) {
+      printf("%s: nanosleep failed\n", s);
+      exit(1);
+    }
+    uint64 t = r_time() - t0;
+    if (t < TIMEBASE / 200) {
+      printf("%s: slept %lu cycles, wanted %d\n", s, t, TIMEBASE / 200);
+      exit(1);
+    }
+    if (t < best) best = t;
+  }
+  if (best >= TICKCYCLES) {
+    printf("%s: a 5ms sleep took %lu cycles\n", s, best);
+    exit(1);
+  }
+  if (nanosleep(&bad, 0) != -1) {
+    printf("%s: nanosleep accepted a bad timespec\n", s);
+    exit(1);
+  }
+}
+
+// meminfo() and pinfo() tell pages sbrklazy() reserved from the
+// ones faulted in, and meminfo() lists the slab caches.
+void meminfotest(char *s) {
+  static struct slabinfo si[64];
+  struct meminfo m0, m1;
+  struct pinfo p0, p1, p2;
+  int n, found = 0;
+  char *a;
+
+  if (meminfo(MEMINFO_GET, &m0, 0) != 0 || m0.total == 0 ||
+      m0.free + m0.cached + m0.zeroed > m0.total || m0.slab == 0 ||
+      meminfo(99, 0, 0) != -1) {
+    printf("%s: bad meminfo\n", s);
+    exit(1);
+  }
+  pinfo(getpid(), &p0);
+  if ((a = sbrklazy(64 * PGSIZE)) == SBRK_ERROR) {
+    printf("%s: sbrklazy failed\n", s);
+    exit(1);
+  }
+  pinfo(getpid(), &p1);
+  for (int i = 0; i < 64; i++) a[i * PGSIZE] = i;
+  pinfo(getpid(), &p2);
+  meminfo(MEMINFO_GET, &m1, 0);
+  sbrk(-64 * PGSIZE);
+  if (p1.sz != p0.sz + 64 * PGSIZE || p1.rss > p0.rss + 8 ||
+      p2.rss < p1.rss + 64 ||
+      m1.fault[FAULT_LAZY] < m0.fault[FAULT_LAZY] + 64) {
+    printf("%s: rss %lu, %lu, %lu; %lu lazy faults\n", s, p0.rss, p1.rss,
+           p2.rss, m1.fault[FAULT_LAZY] - m0.fault[FAULT_LAZY]);
+    exit(1);
+  }
+
+  if ((n = meminfo(MEMINFO_SLABS, si, NELEM(si))) <= 0) {
+    printf("%s: no slab caches\n", s);
+    exit(1);
+  }
+  for (int i = 0; i < n; i++)
+    if (strcmp(si[i].name, "proc") == 0 && si[i].active > 0 &&
+        si[i].active <= si[i].total)
+      found = 1;
+  if (!found) {
+    printf("%s: no proc cache\n", s);
+    exit(1);
+  }
+}
+
+// When no 2MB block is free, a superpage fault moves this
+// process's pages out of one, and they keep their contents.
+static void compact(char *s) {
+  enum { CHUNK = 64 * PGSIZE, NCHUNK = 512 };
+  static char *chunks[NCHUNK];
+  struct meminfo m0, m1;
+  int n = 0, prot = PROT_READ | PROT_WRITE;
+  char *a, *huge;
+
+  // fill memory with 4KB pages until no 2MB block is left.
+  meminfo(MEMINFO_GET, &m0, 0);
+  while (m0.superfree > 0 && n < NCHUNK) {
+    a = mmap(0, CHUNK, prot, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (a == (char *)-1) break;
+    for (int i = 0; i < CHUNK; i += PGSIZE) a[i] = n + i / PGSIZE;
+    chunks[n++] = a;
+    meminfo(MEMINFO_GET, &m0, 0);
+  }
+  if (m0.superfree > 0) {
+    printf("%s: %d chunks left %lu free 2MB blocks\n", s, n, m0.superfree);
+    exit(1);
+  }
+  // free every other chunk, leaving holes in the 2MB blocks.
+  for (int c = 0; c < n; c += 2) munmap(chunks[c], CHUNK);
+
+  huge = mmap(0, 2 * SUPERPGSIZE, prot,
+              MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGE, -1, 0);
+  if (huge == (char *)-1) {
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  huge[SUPERPGROUNDUP((uint64)huge) - (uint64)huge] = 1;
+  meminfo(MEMINFO_GET, &m1, 0);
+  munmap(huge, 2 * SUPERPGSIZE);
+  for (int c = 1; c < n; c += 2) {
+    for (int i = 0; i < CHUNK; i += PGSIZE) {
+      if (chunks[c][i] != (char)(c + i / PGSIZE)) {
+        printf("%s: chunk %d page %d changed\n", s, c, i / PGSIZE);
+        exit(1);
+      }
+    }
+    munmap(chunks[c], CHUNK);
+  }
+  if (m1.compacted <= m0.compacted) {
+    printf("%s: nothing compacted\n", s);
+    exit(1);
+  }
+}
+
+void compacttest(char *s) { compact(s); }
+
+// compaction leaves alone the pages the kernel keeps writing to:
+// afterwards the usyscall page still counts system calls, and
+// the io ring still completes requests.
+void compactkpages(char *s) {
+  struct ring *r = ringsetup(0);
+  struct rusage ru0, ru1;
+  int fds[2];
+  char c;
+
+  if (r == (struct ring *)-1 || pipe(fds) != 0) {
+    printf("%s: ringsetup or pipe failed\n", s);
+    exit(1);
+  }
+  compact(s);
+  ugetrusage(&ru0);
+  for (int i = 0; i < 100; i++) getpid();
+  ugetrusage(&ru1);
+  if (ru1.nsyscall < ru0.nsyscall + 100) {
+    printf("%s: usyscall page not updated\n", s);
+    exit(1);
+  }
+  ringsub(r, RING_WRITE, fds[1], "x", 1, 7);
+  if (ringwait(r, 1, 0) != 1 || r->cq[r->cqhead++ % NCQE].data != 7 ||
+      read(fds[0], &c, 1) != 1 || c != 'x') {
+    printf("%s: ring write failed\n", s);
+    exit(1);
+  }
+}
+
+// Reading untouched lazy or anonymous memory maps the shared zero
+// page; the first write to a page gives it a private copy.
+void zeropagetest(char *s) {
+  enum { N = 256 };
+  struct pinfo p0, p1, p2;
+  int fds[2], sum = 0;
+  char *a, *m;
+
+  pinfo(getpid(), &p0);
+  if ((a = sbrklazy(N * PGSIZE)) == SBRK_ERROR) {
+    printf("%s: sbrklazy failed\n", s);
+    exit(1);
+  }
+  m = mmap(0, N * PGSIZE, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (m == (char *)-1) {
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  for (int i = 0; i < N * PGSIZE; i += 512) sum += a[i] + m[i];
+  pinfo(getpid(), &p1);
+  if (sum != 0 || p1.rss > p0.rss + 8) {
+    printf("%s: sum %d, rss %lu then %lu\n", s, sum, p0.rss, p1.rss);
+    exit(1);
+  }
+
+  a[5 * PGSIZE] = 1;
+  m[7 * PGSIZE + 1] = 2;
+  // a read() into a zero page copies it too.
+  if (pipe(fds) != 0 || write(fds[1], "x", 1) != 1 ||
+      read(fds[0], a + 9 * PGSIZE, 1) != 1) {
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+  pinfo(getpid(), &p2);
+  for (int i = 0; i < N * PGSIZE; i++) {
+    char wa = i == 5 * PGSIZE ? 1 : i == 9 * PGSIZE ? 'x' : 0;
+    char wm = i == 7 * PGSIZE + 1 ? 2 : 0;
+    if (a[i] != wa || m[i] != wm) {
+      printf("%s: byte %d is %d, %d\n", s, i, a[i], m[i]);
+      exit(1);
+    }
+  }
+  if (p2.rss < p1.rss + 3 || p2.rss > p1.rss + 8) {
+    printf("%s: rss %lu then %lu\n", s, p1.rss, p2.rss);
+    exit(1);
+  }
+  munmap(m, N * PGSIZE);
+  sbrk(-N * PGSIZE);
+}
+
+// Small appends to a file stay in the cache until fsync() places
+// its blocks, logging the metadata but not the data.
+void delayalloc(char *s) {
+  enum { N = 64 * BSIZE, CHUNK = 128 };
+  static struct iostat st;
+  static char buf[CHUNK];
+  struct stat sb;
+  int fd;
+
+  unlink("delayed");
+  iostat(IOSTAT_RESET, 0);
+  if ((fd = open("delayed", O_CREATE | O_RDWR)) < 0) {
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  for (int off = 0; off < N; off += CHUNK) {
+    for (int i = 0; i < CHUNK; i++) buf[i] = (off + i) % 251;
+    if (write(fd, buf, CHUNK) != CHUNK) {
+      printf("%s: write at %d failed\n", s, off);
+      exit(1);
+    }
+  }
+  for (int pass = 0; pass < 2; pass++) {
+    if (fstat(fd, &sb) < 0 || sb.size != N) {
+      printf("%s: size %lu\n", s, sb.size);
+      exit(1);
+    }
+    close(fd);
+    if ((fd = open("delayed", O_RDWR)) < 0) {
+      printf("%s: open failed\n", s);
+      exit(1);
+    }
+    for (int off = 0; off < N; off += CHUNK) {
+      if (read(fd, buf, CHUNK) != CHUNK) {
+        printf("%s: read at %d failed\n", s, off);
+        exit(1);
+      }
+      for (int i = 0; i < CHUNK; i++) {
+        if (buf[i] != (char)((off + i) % 251)) {
+          printf("%s: byte %d wrong, pass %d\n", s, off + i, pass);
+          exit(1);
+        }
+      }
+    }
+    if (pass == 0 && fsync(fd) < 0) {
+      printf("%s: fsync failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+  iostat(IOSTAT_GET, &st);
+  unlink("delayed");
+  if (st.commitblocks >= N / BSIZE / 2) {
+    printf("%s: %lu blocks logged\n", s, st.commitblocks);
+    exit(1);
+  }
+}
+
+// fcntl() resizes a pipe's buffer, keeping what is in it.
+void pipesize(char *s) {
+  static char buf[10000];
+  int fds[2], n;
+
+  if (pipe(fds) != 0) {
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  if (fcntl(fds[0], F_GETPIPE_SZ, 0) != PGSIZE ||
+      fcntl(fds[1], F_SETPIPE_SZ, sizeof(buf)) != 4 * PGSIZE ||
+      fcntl(fds[0], F_GETPIPE_SZ, 0) != 4 * PGSIZE) {
+    printf("%s: wrong pipe sizes\n", s);
+    exit(1);
+  }
+  if (fcntl(fds[0], F_SETPIPE_SZ, 1 << 30) != -1 ||
+      fcntl(1, F_GETPIPE_SZ, 0) != -1) {
+    printf("%s: fcntl accepted a bad size or fd\n", s);
+    exit(1);
+  }
+
+  // all of it fits without a reader.
+  for (int i = 0; i < sizeof(buf); i++) buf[i] = i % 251;
+  if (write(fds[1], buf, sizeof(buf)) != sizeof(buf)) {
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  if (fcntl(fds[0], F_SETPIPE_SZ, PGSIZE) != -1) {
+    printf("%s: shrank below its contents\n", s);
+    exit(1);
+  }
+  memset(buf, 0, sizeof(buf));
+  n = read(fds[0], buf, 100);
+  if (n != 100 || fcntl(fds[0], F_SETPIPE_SZ, 3 * PGSIZE) != 4 * PGSIZE) {
+    printf("%s: read or regrow failed\n", s);
+    exit(1);
+  }
+  for (int i = 100; i < sizeof(buf); i += n)
+    if ((n = read(fds[0], buf + i, sizeof(buf) - i)) <= 0) {
+      printf("%s: read failed\n", s);
+      exit(1);
+    }
+  for (int i = 0; i < sizeof(buf); i++)
+    if (buf[i] != (char)(i % 251)) {
+      printf("%s: byte %d is wrong\n", s, i);
+      exit(1);
+    }
+  close(fds[0]);
+  close(fds[1]);
+}
+
+// Pipe copies fault in the user pages they touch without holding
+// the pipe's lock: a write from an untouched file mapping, which
+// reads the file in, and a read into untouched lazy memory.
+void pipefault(char *s) {
+  static char b[PGSIZE];
+  int fd, fds[2];
+  char *m, *a;
+
+  for (int i = 0; i < PGSIZE; i++) b[i] = i % 251;
+  if ((fd = open("pf", O_CREATE | O_RDWR)) < 0 ||
+      write(fd, b, PGSIZE) != PGSIZE) {
+    printf("%s: create pf failed\n", s);
+    exit(1);
+  }
+  m = mmap(0, PGSIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+  a = sbrklazy(PGSIZE);
+  if (m == (char *)-1 || a == SBRK_ERROR || pipe(fds) != 0) {
+    printf("%s: mmap, sbrklazy or pipe failed\n", s);
+    exit(1);
+  }
+  if (write(fds[1], m, PGSIZE) != PGSIZE ||
+      read(fds[0], a, PGSIZE) != PGSIZE) {
+    printf("%s: pipe copy failed\n", s);
+    exit(1);
+  }
+  if (memcmp(a, b, PGSIZE) != 0) {
+    printf("%s: wrong bytes through the pipe\n", s);
+    exit(1);
+  }
+  munmap(m, PGSIZE);
+  close(fd);
+  close(fds[0]);
+  close(fds[1]);
+  unlink("pf");
+}
+
+// iostat() counts bread()s, disk requests and log commits.
+void iostats(char *s) {
+  static struct iostat st;
+  char buf[64];
+  uint64 n = 0;
+  int fd;
+
+  if (iostat(99, &st) != -1) {
+    printf("%s: iostat accepted a bad op\n", s);
+    exit(1);
+  }
+  iostat(IOSTAT_RESET, 0);
+  if ((fd = open("iost", O_CREATE | O_RDWR)) < 0) {
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  memset(buf, 'i', sizeof(buf));
+  if (write(fd, buf, sizeof(buf)) != sizeof(buf) || fsync(fd) < 0) {
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("iost");
+
+  if (iostat(IOSTAT_GET, &st) < 0) {
+    printf("%s: iostat get failed\n", s);
+    exit(1);
+  }
+  for (int i = 0; i < NLAT; i++) n += st.commitlat[i];
+  if (st.bhit + st.bmiss == 0 || st.ncommit == 0 || n != st.ncommit ||
+      st.commitblocks < st.ncommit || st.maxcommit > st.commitblocks) {
+    printf("%s: cache %lu/%lu commits %lu/%lu blocks %lu\n", s, st.bhit,
+           st.bmiss, st.ncommit, n, st.commitblocks);
+    exit(1);
+  }
+  if (st.disk.nwrite == 0 || st.disk.nwrite > st.disk.nreq ||
+      st.disk.wblocks < st.disk.nwrite) {
+    printf("%s: disk writes %lu of %lu, %lu blocks\n", s, st.disk.nwrite,
+           st.disk.nreq, st.disk.wblocks);
+    exit(1);
+  }
+}
+
+// several processes write and fsync at once, so that their
+// transactions are committed in batches.
+void fsyncs(char *s) {
+  enum { NCHILD = 4, NWRITE = 20 };
+  char name[] = "fsync0";
+  char buf[64];
+  int fd, xst;
+
+  if (fsync(-1) != -1 || fsync(NOFILE) != -1) {
+    printf("%s: fsync accepted a bad fd\n", s);
+    exit(1);
+  }
+  for (int i = 0; i < NCHILD; i++) {
+    name[5] = '0' + i;
+    if (fork() == 0) {
+      if ((fd = open(name, O_CREATE | O_RDWR)) < 0) exit(1);
+      memset(buf, 'a' + i, sizeof(buf));
+      for (int j = 0; j < NWRITE; j++) {
+        if (write(fd, buf, sizeof(buf)) != sizeof(buf)) exit(1);
+        if (fsync(fd) != 0) exit(1);
+      }
+      close(fd);
+      exit(0);
+    }
+  }
+  for (int i = 0; i < NCHILD; i++) {
     wait(&xst);
-    if (xst != -1) {
-      printf("%s: status should be -1\n", s);
+    if (xst != 0) {
+      printf("%s: child failed\n", s);
       exit(1);
     }
   }
-  exit(0);
+  for (int i = 0; i < NCHILD; i++) {
+    name[5] = '0' + i;
+    if ((fd = open(name, O_RDONLY)) < 0) {
+      printf("%s: open %s failed\n", s, name);
+      exit(1);
+    }
+    for (int j = 0; j < NWRITE; j++) {
+      if (read(fd, buf, sizeof(buf)) != sizeof(buf) || buf[0] != 'a' + i ||
+          buf[sizeof(buf) - 1] != 'a' + i) {
+        printf("%s: %s has wrong contents\n", s, name);
+        exit(1);
+      }
+    }
+    close(fd);
+    unlink(name);
+  }
 }
 
 // meant to be run w/ at most two CPUs
@@ -1669,192 +3181,728 @@ void bigfile(char *s) {
       printf("%s: short read bigfile\n", s);
       exit(1);
     }
-    if (buf[0] != i / 2 || buf[SZ / 2 - 1] != i / 2) {
-      printf("%s: read bigfile wrong data\n", s);
+    if (buf[0] != i / 2 || buf[SZ / 2 - 1] != i / 2) {
+      printf("%s: read bigfile wrong data\n", s);
+      exit(1);
+    }
+    total += cc;
+  }
+  close(fd);
+  if (total != N * SZ) {
+    printf("%s: read bigfile wrong total\n", s);
+    exit(1);
+  }
+  unlink("bigfile.dat");
+}
+
+void fourteen(char *s) {
+  int fd;
+
+  // DIRSIZ is 14.
+
+  if (mkdir("12345678901234") != 0) {
+    printf("%s: mkdir 12345678901234 failed\n", s);
+    exit(1);
+  }
+  if (mkdir("12345678901234/123456789012345") != 0) {
+    printf("%s: mkdir 12345678901234/123456789012345 failed\n", s);
+    exit(1);
+  }
+  fd = open("123456789012345/123456789012345/123456789012345", O_CREATE);
+  if (fd < 0) {
+    printf(
+        "%s: create 123456789012345/123456789012345/123456789012345 failed\n",
+        s);
+    exit(1);
+  }
+  close(fd);
+  fd = open("12345678901234/12345678901234/12345678901234", 0);
+  if (fd < 0) {
+    printf("%s: open 12345678901234/12345678901234/12345678901234 failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  if (mkdir("12345678901234/12345678901234") == 0) {
+    printf("%s: mkdir 12345678901234/12345678901234 succeeded!\n", s);
+    exit(1);
+  }
+  if (mkdir("123456789012345/12345678901234") == 0) {
+    printf("%s: mkdir 12345678901234/123456789012345 succeeded!\n", s);
+    exit(1);
+  }
+
+  // clean up
+  unlink("123456789012345/12345678901234");
+  unlink("12345678901234/12345678901234");
+  unlink("12345678901234/12345678901234/12345678901234");
+  unlink("123456789012345/123456789012345/123456789012345");
+  unlink("12345678901234/123456789012345");
+  unlink("12345678901234");
+}
+
+void rmdot(char *s) {
+  if (mkdir("dots") != 0) {
+    printf("%s: mkdir dots failed\n", s);
+    exit(1);
+  }
+  if (chdir("dots") != 0) {
+    printf("%s: chdir dots failed\n", s);
+    exit(1);
+  }
+  if (unlink(".") == 0) {
+    printf("%s: rm . worked!\n", s);
+    exit(1);
+  }
+  if (unlink("..") == 0) {
+    printf("%s: rm .. worked!\n", s);
+    exit(1);
+  }
+  if (chdir("/") != 0) {
+    printf("%s: chdir / failed\n", s);
+    exit(1);
+  }
+  if (unlink("dots/.") == 0) {
+    printf("%s: unlink dots/. worked!\n", s);
+    exit(1);
+  }
+  if (unlink("dots/..") == 0) {
+    printf("%s: unlink dots/.. worked!\n", s);
+    exit(1);
+  }
+  if (unlink("dots") != 0) {
+    printf("%s: unlink dots failed!\n", s);
+    exit(1);
+  }
+}
+
+void dirfile(char *s) {
+  int fd;
+
+  fd = open("dirfile", O_CREATE);
+  if (fd < 0) {
+    printf("%s: create dirfile failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if (chdir("dirfile") == 0) {
+    printf("%s: chdir dirfile succeeded!\n", s);
+    exit(1);
+  }
+  fd = open("dirfile/xx", 0);
+  if (fd >= 0) {
+    printf("%s: create dirfile/xx succeeded!\n", s);
+    exit(1);
+  }
+  fd = open("dirfile/xx", O_CREATE);
+  if (fd >= 0) {
+    printf("%s: create dirfile/xx succeeded!\n", s);
+    exit(1);
+  }
+  if (mkdir("dirfile/xx") == 0) {
+    printf("%s: mkdir dirfile/xx succeeded!\n", s);
+    exit(1);
+  }
+  if (unlink("dirfile/xx") == 0) {
+    printf("%s: unlink dirfile/xx succeeded!\n", s);
+    exit(1);
+  }
+  if (link("README", "dirfile/xx") == 0) {
+    printf("%s: link to dirfile/xx succeeded!\n", s);
+    exit(1);
+  }
+  if (unlink("dirfile") != 0) {
+    printf("%s: unlink dirfile failed!\n", s);
+    exit(1);
+  }
+
+  fd = open(".", O_RDWR);
+  if (fd >= 0) {
+    printf("%s: open . for writing succeeded!\n", s);
+    exit(1);
+  }
+  fd = open(".", 0);
+  if (write(fd, "x", 1) > 0) {
+    printf("%s: write . succeeded!\n", s);
+    exit(1);
+  }
+  close(fd);
+}
+
+// test that iput() is called at the end of _namei().
+// also tests empty file names.
+void iref(char *s) {
+  int i, fd;
+
+  for (i = 0; i < NINODE + 1; i++) {
+    if (mkdir("irefd") != 0) {
+      printf("%s: mkdir irefd failed\n", s);
+      exit(1);
+    }
+    if (chdir("irefd") != 0) {
+      printf("%s: chdir irefd failed\n", s);
+      exit(1);
+    }
+
+    mkdir("");
+    link("README", "");
+    fd = open("", O_CREATE);
+    if (fd >= 0) close(fd);
+    fd = open("xx", O_CREATE);
+    if (fd >= 0) close(fd);
+    unlink("xx");
+  }
+
+  // clean up
+  for (i = 0; i < NINODE + 1; i++) {
+    chdir("..");
+    unlink("irefd");
+  }
+
+  chdir("/");
+}
+
+// lookups that the directory entry cache answers must follow
+// creates and unlinks, including of a name that was absent, and
+// of a directory whose inode is then reused.
+void dentries(char *s) {
+  int fd;
+
+  for (int i = 0; i < 3; i++) {
+    if (open("dent", O_RDONLY) >= 0) {
+      printf("%s: opened dent before creating it\n", s);
+      exit(1);
+    }
+    if ((fd = open("dent", O_CREATE | O_RDWR)) < 0) {
+      printf("%s: create dent failed\n", s);
+      exit(1);
+    }
+    close(fd);
+    if ((fd = open("dent", O_RDONLY)) < 0) {
+      printf("%s: open dent failed\n", s);
+      exit(1);
+    }
+    close(fd);
+    if (unlink("dent") != 0) {
+      printf("%s: unlink dent failed\n", s);
+      exit(1);
+    }
+  }
+
+  for (int i = 0; i < 3; i++) {
+    if (mkdir("dentd") != 0 || (fd = open("dentd/x", O_CREATE)) < 0) {
+      printf("%s: mkdir dentd failed\n", s);
+      exit(1);
+    }
+    close(fd);
+    if (unlink("dentd/x") != 0 || open("dentd/x", O_RDONLY) >= 0) {
+      printf("%s: unlink dentd/x failed\n", s);
+      exit(1);
+    }
+    if (unlink("dentd") != 0) {
+      printf("%s: unlink dentd failed\n", s);
+      exit(1);
+    }
+    // a new directory may get dentd's inode.
+    if (mkdir("dente") != 0 || open("dente/x", O_RDONLY) >= 0 ||
+        (fd = open("dente/../dente", O_RDONLY)) < 0) {
+      printf("%s: stale entries in dente\n", s);
+      exit(1);
+    }
+    close(fd);
+    if (unlink("dente") != 0) {
+      printf("%s: unlink dente failed\n", s);
+      exit(1);
+    }
+  }
+}
+
+// file data written and read in sizes that straddle blocks and
+// pages, and seen the same through read() and a shared mapping.
+void pagedata(char *s) {
+  enum { SZ = 3 * PGSIZE + 300 };
+  static char b[1500];
+  int fd, n, off;
+  char *m;
+
+  if ((fd = open("pd", O_CREATE | O_RDWR)) < 0) {
+    printf("%s: create pd failed\n", s);
+    exit(1);
+  }
+  for (off = 0; off < SZ; off += n) {
+    n = SZ - off < 777 ? SZ - off : 777;
+    for (int i = 0; i < n; i++) b[i] = (off + i) * 7 % 251;
+    if (write(fd, b, n) != n) {
+      printf("%s: write pd failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+
+  // overwrite the start of the second block.
+  if ((fd = open("pd", O_RDWR)) < 0 || read(fd, b, BSIZE) != BSIZE ||
+      write(fd, "xyz", 3) != 3) {
+    printf("%s: overwrite pd failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  if ((fd = open("pd", O_RDONLY)) < 0) {
+    printf("%s: open pd failed\n", s);
+    exit(1);
+  }
+  for (off = 0; (n = read(fd, b, sizeof(b))) > 0; off += n) {
+    for (int i = 0; i < n; i++) {
+      int o = off + i;
+      char want = o >= BSIZE && o < BSIZE + 3 ? "xyz"[o - BSIZE] : o * 7 % 251;
+      if (b[i] != want) {
+        printf("%s: byte %d of pd is wrong\n", s, o);
+        exit(1);
+      }
+    }
+  }
+  if (off != SZ) {
+    printf("%s: read %d bytes of pd, not %d\n", s, off, SZ);
+    exit(1);
+  }
+
+  m = mmap(0, SZ, PROT_READ, MAP_SHARED, fd, 0);
+  if (m == (char *)-1) {
+    printf("%s: mmap pd failed\n", s);
+    exit(1);
+  }
+  if (m[BSIZE] != 'x' || m[SZ - 1] != (char)((SZ - 1) * 7 % 251) ||
+      m[2 * PGSIZE] != (char)(2 * PGSIZE * 7 % 251)) {
+    printf("%s: mapping of pd differs from read()\n", s);
+    exit(1);
+  }
+  munmap(m, SZ);
+  close(fd);
+  unlink("pd");
+}
+
+// sendfile() from a file to a pipe and to another file, and
+// splice() from a pipe to a file.
+void sendfiles(char *s) {
+  enum { SZ = 5000, OFF = 100 };
+  static char b[SZ];
+  int fd, fd2, p[2], n, pid, xst;
+  uint off = OFF;
+
+  if ((fd = open("sf", O_CREATE | O_RDWR)) < 0) {
+    printf("%s: create sf failed\n", s);
+    exit(1);
+  }
+  for (int i = 0; i < SZ; i++) b[i] = i % 253;
+  if (write(fd, b, SZ) != SZ || pipe(p) < 0) {
+    printf("%s: write sf failed\n", s);
+    exit(1);
+  }
+  if ((pid = fork()) < 0) {
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if (pid == 0) {
+    close(p[0]);
+    n = sendfile(p[1], fd, &off, SZ);
+    exit(n != SZ - OFF || off != SZ);
+  }
+  close(p[1]);
+  memset(b, 0, SZ);
+  for (int got = 0; got < SZ - OFF; got += n) {
+    if ((n = read(p[0], b + got, SZ)) <= 0) {
+      printf("%s: pipe ended early\n", s);
+      exit(1);
+    }
+  }
+  close(p[0]);
+  wait(&xst);
+  for (int i = 0; i < SZ - OFF; i++) {
+    if (b[i] != (char)((i + OFF) % 253)) {
+      printf("%s: byte %d through the pipe is wrong\n", s, i);
       exit(1);
     }
-    total += cc;
   }
-  close(fd);
-  if (total != N * SZ) {
-    printf("%s: read bigfile wrong total\n", s);
+  if (xst != 0) {
+    printf("%s: sendfile to pipe failed\n", s);
     exit(1);
   }
-  unlink("bigfile.dat");
-}
-
-void fourteen(char *s) {
-  int fd;
 
-  // DIRSIZ is 14.
+  // the file's own offset is at its end; sendfile() from 0.
+  off = 0;
+  if ((fd2 = open("sf2", O_CREATE | O_RDWR)) < 0 ||
+      sendfile(fd2, fd, &off, SZ) != SZ || sendfile(fd2, fd, 0, SZ) != 0) {
+    printf("%s: sendfile to file failed\n", s);
+    exit(1);
+  }
+  close(fd2);
 
-  if (mkdir("12345678901234") != 0) {
-    printf("%s: mkdir 12345678901234 failed\n", s);
+  if (pipe(p) < 0 || (fd2 = open("sf2", O_RDWR)) < 0) {
+    printf("%s: pipe failed\n", s);
     exit(1);
   }
-  if (mkdir("12345678901234/123456789012345") != 0) {
-    printf("%s: mkdir 12345678901234/123456789012345 failed\n", s);
+  if (write(p[1], "spliced", 7) != 7 || splice(p[0], fd2, 100) != 7 ||
+      splice(fd, fd2, 100) != -1) {
+    printf("%s: splice failed\n", s);
     exit(1);
   }
-  fd = open("123456789012345/123456789012345/123456789012345", O_CREATE);
-  if (fd < 0) {
-    printf(
-        "%s: create 123456789012345/123456789012345/123456789012345 failed\n",
-        s);
+  close(p[0]);
+  close(p[1]);
+  close(fd2);
+  if ((fd2 = open("sf2", O_RDONLY)) < 0 || read(fd2, b, SZ) != SZ ||
+      memcmp(b, "spliced", 7) != 0 || b[7] != 7 ||
+      b[SZ - 1] != (char)((SZ - 1) % 253)) {
+    printf("%s: sf2 has the wrong contents\n", s);
     exit(1);
   }
+  close(fd2);
   close(fd);
-  fd = open("12345678901234/12345678901234/12345678901234", 0);
-  if (fd < 0) {
-    printf("%s: open 12345678901234/12345678901234/12345678901234 failed\n", s);
+  unlink("sf");
+  unlink("sf2");
+}
+
+// positional and vectored I/O on a file, and readv() of a pipe
+// holding less than asked for.
+void rwvec(char *s) {
+  char h[4], body[2000], got[2000];
+  struct iovec iov[3];
+  int fd, p[2], i;
+
+  for (i = 0; i < sizeof(body); i++) body[i] = 'a' + i % 26;
+  if ((fd = open("rw", O_CREATE | O_RDWR)) < 0) {
+    printf("%s: create rw failed\n", s);
+    exit(1);
+  }
+  iov[0].iov_base = "hdr:";
+  iov[0].iov_len = 4;
+  iov[1].iov_base = 0;
+  iov[1].iov_len = 0;
+  iov[2].iov_base = body;
+  iov[2].iov_len = sizeof(body);
+  if (writev(fd, iov, 3) != 4 + sizeof(body)) {
+    printf("%s: writev failed\n", s);
+    exit(1);
+  }
+  if (pwrite(fd, "HD", 2, 0) != 2 || pread(fd, h, 4, 0) != 4 ||
+      memcmp(h, "HDr:", 4) != 0 || pread(fd, got, 10, 4 + 1990) != 10 ||
+      memcmp(got, body + 1990, 10) != 0 || pread(fd, got, 10, 9999) != 0) {
+    printf("%s: pread/pwrite failed\n", s);
+    exit(1);
+  }
+  // neither moved the file's offset from the end of the writev().
+  if (read(fd, got, 1) != 0) {
+    printf("%s: pread moved the offset\n", s);
     exit(1);
   }
   close(fd);
 
-  if (mkdir("12345678901234/12345678901234") == 0) {
-    printf("%s: mkdir 12345678901234/12345678901234 succeeded!\n", s);
+  if ((fd = open("rw", O_RDONLY)) < 0) {
+    printf("%s: open rw failed\n", s);
     exit(1);
   }
-  if (mkdir("123456789012345/12345678901234") == 0) {
-    printf("%s: mkdir 12345678901234/123456789012345 succeeded!\n", s);
+  iov[0].iov_base = h;
+  iov[0].iov_len = 4;
+  iov[1].iov_base = got;
+  iov[1].iov_len = sizeof(got);
+  if (readv(fd, iov, 2) != 4 + sizeof(got) || memcmp(h, "HDr:", 4) != 0 ||
+      memcmp(got, body, sizeof(body)) != 0) {
+    printf("%s: readv of rw failed\n", s);
     exit(1);
   }
+  close(fd);
+  unlink("rw");
 
-  // clean up
-  unlink("123456789012345/12345678901234");
-  unlink("12345678901234/12345678901234");
-  unlink("12345678901234/12345678901234/12345678901234");
-  unlink("123456789012345/123456789012345/123456789012345");
-  unlink("12345678901234/123456789012345");
-  unlink("12345678901234");
+  if (pipe(p) < 0 || write(p[1], "hdr:xy", 6) != 6) {
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  if (readv(p[0], iov, 2) != 6 || memcmp(got, "xy", 2) != 0 ||
+      pread(p[0], got, 1, 0) != -1) {
+    printf("%s: readv of pipe failed\n", s);
+    exit(1);
+  }
+  close(p[0]);
+  close(p[1]);
 }
 
-void rmdot(char *s) {
-  if (mkdir("dots") != 0) {
-    printf("%s: mkdir dots failed\n", s);
+// O_DIRECT reads and writes, aligned and not, agree with
+// buffered ones in both directions.
+void directio(char *s) {
+  enum { NB = 8 };
+  static char b[(NB + 1) * BSIZE] __attribute__((aligned(PGSIZE)));
+  int fd, i;
+
+  for (i = 0; i < NB * BSIZE; i++) b[i] = i % 249;
+  if ((fd = open("dio", O_CREATE | O_RDWR | O_DIRECT)) < 0) {
+    printf("%s: create dio failed\n", s);
     exit(1);
   }
-  if (chdir("dots") != 0) {
-    printf("%s: chdir dots failed\n", s);
+  if (write(fd, b, NB * BSIZE) != NB * BSIZE || write(fd, b, 100) != 100) {
+    printf("%s: direct write failed\n", s);
     exit(1);
   }
-  if (unlink(".") == 0) {
-    printf("%s: rm . worked!\n", s);
+  close(fd);
+
+  memset(b, 0, sizeof(b));
+  if ((fd = open("dio", O_RDWR)) < 0 ||
+      read(fd, b + 1, sizeof(b) - 1) != NB * BSIZE + 100) {
+    printf("%s: buffered read of dio failed\n", s);
     exit(1);
   }
-  if (unlink("..") == 0) {
-    printf("%s: rm .. worked!\n", s);
+  for (i = 0; i < NB * BSIZE; i++) {
+    if (b[i + 1] != (char)(i % 249)) {
+      printf("%s: byte %d written directly is wrong\n", s, i);
+      exit(1);
+    }
+  }
+  close(fd);
+
+  // a buffered write the direct read must see.
+  if ((fd = open("dio", O_RDWR)) < 0 || write(fd, "new", 3) != 3) {
+    printf("%s: buffered write of dio failed\n", s);
     exit(1);
   }
-  if (chdir("/") != 0) {
-    printf("%s: chdir / failed\n", s);
+  close(fd);
+  memset(b, 0, sizeof(b));
+  if ((fd = open("dio", O_RDONLY | O_DIRECT)) < 0 ||
+      read(fd, b, sizeof(b)) != NB * BSIZE + 100) {
+    printf("%s: direct read of dio failed\n", s);
     exit(1);
   }
-  if (unlink("dots/.") == 0) {
-    printf("%s: unlink dots/. worked!\n", s);
+  for (i = 0; i < NB * BSIZE + 100; i++) {
+    char want = i < 3 ? "new"[i] : (i % (NB * BSIZE)) % 249;
+    if (b[i] != want) {
+      printf("%s: byte %d read directly is wrong\n", s, i);
+      exit(1);
+    }
+  }
+  close(fd);
+  unlink("dio");
+}
+
+// a small file kept in its inode reads back, through read() and
+// a mapping, and keeps its data as it grows out of the inode and
+// is truncated back into it.
+void inlinedata(char *s) {
+  enum { SZ = INLINESIZE + 300 };
+  static char b[SZ], r[SZ + 1];
+  int fd, i;
+  char *m;
+
+  for (i = 0; i < SZ; i++) b[i] = 'a' + i % 23;
+  if ((fd = open("inl", O_CREATE | O_RDWR)) < 0 || write(fd, b, 10) != 10 ||
+      write(fd, b + 10, INLINESIZE - 10) != INLINESIZE - 10) {
+    printf("%s: small write failed\n", s);
     exit(1);
   }
-  if (unlink("dots/..") == 0) {
-    printf("%s: unlink dots/.. worked!\n", s);
+  close(fd);
+
+  if ((fd = open("inl", O_RDONLY)) < 0 || read(fd, r, SZ) != INLINESIZE ||
+      memcmp(r, b, INLINESIZE) != 0) {
+    printf("%s: small read failed\n", s);
     exit(1);
   }
-  if (unlink("dots") != 0) {
-    printf("%s: unlink dots failed!\n", s);
+  m = mmap(0, PGSIZE, PROT_READ, MAP_SHARED, fd, 0);
+  if (m == (char *)-1 || m[INLINESIZE - 1] != 'a' + (INLINESIZE - 1) % 23 ||
+      m[INLINESIZE] != 0) {
+    printf("%s: mapping of small file is wrong\n", s);
     exit(1);
   }
-}
-
-void dirfile(char *s) {
-  int fd;
+  munmap(m, PGSIZE);
+  close(fd);
 
-  fd = open("dirfile", O_CREATE);
-  if (fd < 0) {
-    printf("%s: create dirfile failed\n", s);
+  // grow it past the inode.
+  if ((fd = open("inl", O_RDWR)) < 0 || read(fd, r, 5) != 5 ||
+      write(fd, "XY", 2) != 2 || read(fd, r, SZ) != INLINESIZE - 7 ||
+      write(fd, b + INLINESIZE, SZ - INLINESIZE) != SZ - INLINESIZE) {
+    printf("%s: growing write failed\n", s);
     exit(1);
   }
   close(fd);
-  if (chdir("dirfile") == 0) {
-    printf("%s: chdir dirfile succeeded!\n", s);
+  b[5] = 'X';
+  b[6] = 'Y';
+  if ((fd = open("inl", O_RDONLY)) < 0 || read(fd, r, SZ + 1) != SZ) {
+    printf("%s: read of grown file failed\n", s);
     exit(1);
   }
-  fd = open("dirfile/xx", 0);
-  if (fd >= 0) {
-    printf("%s: create dirfile/xx succeeded!\n", s);
+  close(fd);
+  if (memcmp(r, b, SZ) != 0) {
+    printf("%s: grown file differs\n", s);
     exit(1);
   }
-  fd = open("dirfile/xx", O_CREATE);
-  if (fd >= 0) {
-    printf("%s: create dirfile/xx succeeded!\n", s);
+
+  // truncated, it takes small writes inline again.
+  if ((fd = open("inl", O_RDWR | O_TRUNC)) < 0 || write(fd, "tiny", 4) != 4) {
+    printf("%s: truncate failed\n", s);
     exit(1);
   }
-  if (mkdir("dirfile/xx") == 0) {
-    printf("%s: mkdir dirfile/xx succeeded!\n", s);
+  close(fd);
+  if ((fd = open("inl", O_RDONLY)) < 0 || read(fd, r, SZ) != 4 ||
+      memcmp(r, "tiny", 4) != 0) {
+    printf("%s: truncated file is wrong\n", s);
     exit(1);
   }
-  if (unlink("dirfile/xx") == 0) {
-    printf("%s: unlink dirfile/xx succeeded!\n", s);
+  close(fd);
+  unlink("inl");
+}
+
+// a process can open far more than NOFILE descriptors, always
+// gets the lowest free one, and keeps them all across fork().
+void manyfds(char *s) {
+  struct stat st;
+  int fd, i, n, xst;
+
+  if ((fd = open("mf", O_CREATE | O_RDWR)) < 0 || write(fd, "m", 1) != 1) {
+    printf("%s: create mf failed\n", s);
     exit(1);
   }
-  if (link("README", "dirfile/xx") == 0) {
-    printf("%s: link to dirfile/xx succeeded!\n", s);
+  for (n = fd + 1; (i = dup(fd)) >= 0; n++) {
+    if (i != n) {
+      printf("%s: dup returned %d, not %d\n", s, i, n);
+      exit(1);
+    }
+  }
+  if (n != NOFILEMAX) {
+    printf("%s: only %d descriptors\n", s, n);
     exit(1);
   }
-  if (unlink("dirfile") != 0) {
-    printf("%s: unlink dirfile failed!\n", s);
+  close(100);
+  if (dup(fd) != 100) {
+    printf("%s: dup did not reuse the lowest free descriptor\n", s);
     exit(1);
   }
 
-  fd = open(".", O_RDWR);
-  if (fd >= 0) {
-    printf("%s: open . for writing succeeded!\n", s);
+  int pid = fork();
+  if (pid < 0) {
+    printf("%s: fork failed\n", s);
     exit(1);
   }
-  fd = open(".", 0);
-  if (write(fd, "x", 1) > 0) {
-    printf("%s: write . succeeded!\n", s);
+  if (pid == 0) {
+    if (fstat(NOFILEMAX - 1, &st) < 0 || st.size != 1) exit(1);
+    exit(0);
+  }
+  wait(&xst);
+  if (xst != 0) {
+    printf("%s: child lost its descriptors\n", s);
     exit(1);
   }
-  close(fd);
+  for (i = fd; i < NOFILEMAX; i++) close(i);
+  unlink("mf");
 }
 
-// test that iput() is called at the end of _namei().
-// also tests empty file names.
-void iref(char *s) {
-  int i, fd;
+// a directory that outgrows a block becomes indexed; its
+// entries must still all be found, and be all that read() sees.
+void hashdir(char *s) {
+  enum { N = 4 * DPB };
+  char name[8];
+  struct dirent de;
+  int fd, n = 0;
 
-  for (i = 0; i < NINODE + 1; i++) {
-    if (mkdir("irefd") != 0) {
-      printf("%s: mkdir irefd failed\n", s);
+  if (mkdir("hd") != 0 || (fd = open("hd/f", O_CREATE)) < 0) {
+    printf("%s: mkdir hd failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  for (int i = 0; i < N; i++) {
+    name[0] = 'h';
+    name[1] = 'd';
+    name[2] = '/';
+    name[3] = 'a' + i / 26 % 26;
+    name[4] = 'a' + i % 26;
+    name[5] = '\0';
+    if (link("hd/f", name) != 0) {
+      printf("%s: link %s failed\n", s, name);
       exit(1);
     }
-    if (chdir("irefd") != 0) {
-      printf("%s: chdir irefd failed\n", s);
+  }
+  for (int i = 0; i < N; i++) {
+    name[3] = 'a' + i / 26 % 26;
+    name[4] = 'a' + i % 26;
+    if ((fd = open(name, O_RDONLY)) < 0) {
+      printf("%s: open %s failed\n", s, name);
       exit(1);
     }
-
-    mkdir("");
-    link("README", "");
-    fd = open("", O_CREATE);
-    if (fd >= 0) close(fd);
-    fd = open("xx", O_CREATE);
-    if (fd >= 0) close(fd);
-    unlink("xx");
+    close(fd);
   }
-
-  // clean up
-  for (i = 0; i < NINODE + 1; i++) {
-    chdir("..");
-    unlink("irefd");
+  if ((fd = open("hd", O_RDONLY)) < 0) {
+    printf("%s: open hd failed\n", s);
+    exit(1);
+  }
+  while (read(fd, &de, sizeof(de)) == sizeof(de))
+    if (de.inum != 0) n++;
+  close(fd);
+  if (n != N + 3) {
+    printf("%s: read %d entries from hd, not %d\n", s, n, N + 3);
+    exit(1);
+  }
+  if (unlink("hd") == 0) {
+    printf("%s: unlinked non-empty hd\n", s);
+    exit(1);
+  }
+  for (int i = 0; i < N; i++) {
+    name[3] = 'a' + i / 26 % 26;
+    name[4] = 'a' + i % 26;
+    if (unlink(name) != 0) {
+      printf("%s: unlink %s failed\n", s, name);
+      exit(1);
+    }
+  }
+  if (unlink("hd/f") != 0 || unlink("hd") != 0) {
+    printf("%s: unlink hd failed\n", s);
+    exit(1);
   }
+}
 
-  chdir("/");
+// more inodes in use at once than the old fixed table held.
+void manyinodes(char *s) {
+  enum { NCHILD = 6, NF = NOFILE - 4 };
+  char name[] = "mi00";
+  int ready[2], hold[2], xst;
+  char c;
+
+  if (pipe(ready) < 0 || pipe(hold) < 0) {
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  for (int i = 0; i < NCHILD; i++) {
+    if (fork() == 0) {
+      close(ready[0]);
+      close(hold[1]);
+      c = 'x';
+      for (int j = 0; j < NF && c == 'x'; j++) {
+        name[2] = '0' + i;
+        name[3] = 'a' + j;
+        if (open(name, O_CREATE | O_RDWR) < 0) c = '!';
+        unlink(name);
+      }
+      write(ready[1], &c, 1);
+      read(hold[0], &c, 1);  // until the parent closes it
+      exit(0);
+    }
+  }
+  close(ready[1]);
+  close(hold[0]);
+  for (int i = 0; i < NCHILD; i++) {
+    if (read(ready[0], &c, 1) != 1 || c != 'x') {
+      printf("%s: child failed to open its files\n", s);
+      exit(1);
+    }
+  }
+  close(hold[1]);
+  close(ready[0]);
+  for (int i = 0; i < NCHILD; i++) {
+    wait(&xst);
+    if (xst != 0) {
+      printf("%s: child failed\n", s);
+      exit(1);
+    }
+  }
 }
 
-// test that fork fails gracefully
-// the forktest binary also does this, but it runs out of proc entries first.
-// inside the bigger usertests binary, we run out of memory first.
+// test that fork fails gracefully, once memory for processes
+// runs out.
 void forktest(char *s) {
-  enum { N = 1000 };
+  enum { N = 10000 };
   int n, pid;
 
   for (n = 0; n < N; n++) {
@@ -1869,7 +3917,7 @@ void forktest(char *s) {
   }
 
   if (n == N) {
-    printf("%s: fork claimed to work 1000 times!\n", s);
+    printf("%s: fork claimed to work %d times!\n", s, N);
     exit(1);
   }
 
@@ -2545,6 +4593,108 @@ void lazy_copy(char *s) {
   exit(0);
 }
 
+// fork shares memory copy-on-write: two children of a parent with
+// a large heap must fit in memory, and writes by any of them, from
+// user code or from a system call, stay private to the writer.
+void cowfork(char *s) {
+  const int sz = 48 * 1024 * 1024;
+  int fds[2], pids[2], xstatus;
+
+  char *p = sbrk(sz);
+  if (p == SBRK_ERROR) {
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for (uint64 i = 0; i < sz; i += PGSIZE) p[i] = 'p';
+  if (pipe(fds) < 0) {
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+
+  for (int k = 0; k < 2; k++) {
+    pids[k] = fork();
+    if (pids[k] < 0) {
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if (pids[k] == 0) {
+      for (uint64 i = 0; i < sz; i += 64 * PGSIZE) {
+        if (p[i] != 'p') exit(1);
+        p[i] = '0' + k;
+      }
+      // copyout into a shared page
+      if (read(fds[0], p + PGSIZE, 1) != 1 || p[PGSIZE] != 'x') exit(2);
+      for (uint64 i = 0; i < sz; i += 64 * PGSIZE)
+        if (p[i] != '0' + k) exit(3);
+      exit(0);
+    }
+  }
+
+  if (write(fds[1], "xx", 2) != 2) {
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  for (int k = 0; k < 2; k++) {
+    wait(&xstatus);
+    if (xstatus != 0) {
+      printf("%s: child failed with %d\n", s, xstatus);
+      exit(1);
+    }
+  }
+  for (uint64 i = 0; i < sz; i += PGSIZE) {
+    if (p[i] != 'p') {
+      printf("%s: parent memory changed at %p\n", s, p + i);
+      exit(1);
+    }
+  }
+  close(fds[0]);
+  close(fds[1]);
+  sbrk(-sz);
+}
+
+// spawn() starts a program without fork, with fd remaps.
+void spawntest(char *s) {
+  char *echoargv[] = {"echo", "spawned", 0};
+  int fds[2], fdmap[2], xstatus;
+  char buf[16];
+
+  if (spawn("nosuchfile", echoargv, 0, 0) >= 0) {
+    printf("%s: spawn of a missing file succeeded\n", s);
+    exit(1);
+  }
+  fdmap[0] = 0;
+  fdmap[1] = NOFILE - 1;  // not open
+  if (spawn("echo", echoargv, fdmap, 2) >= 0) {
+    printf("%s: spawn with a bad fd succeeded\n", s);
+    exit(1);
+  }
+
+  if (pipe(fds) < 0) {
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  fdmap[0] = -1;
+  fdmap[1] = fds[1];
+  int pid = spawn("echo", echoargv, fdmap, 2);
+  if (pid < 0) {
+    printf("%s: spawn failed\n", s);
+    exit(1);
+  }
+  close(fds[1]);
+  int n = 0, cc;
+  while (n < sizeof(buf) - 1 && (cc = read(fds[0], buf + n, 1)) == 1) n++;
+  buf[n] = 0;
+  close(fds[0]);
+  if (wait(&xstatus) != pid || xstatus != 0) {
+    printf("%s: wait for spawned child failed\n", s);
+    exit(1);
+  }
+  if (strcmp(buf, "spawned\n") != 0) {
+    printf("%s: spawned echo wrote '%s'\n", s, buf);
+    exit(1);
+  }
+}
+
 struct test {
   void (*f)(char *);
   char *s;
@@ -2564,11 +4714,22 @@ struct test {
     {opentest, "opentest"},
     {writetest, "writetest"},
     {writebig, "writebig"},
+    {interleave, "interleave"},
     {createtest, "createtest"},
     {dirtest, "dirtest"},
     {exectest, "exectest"},
     {pipe1, "pipe1"},
     {killstatus, "killstatus"},
+    {priority, "priority"},
+    {affinity, "affinity"},
+    {rusage, "rusage"},
+    {vdsotime, "vdsotime"},
+    {pausewake, "pausewake"},
+    {clonetest, "clonetest"},
+    {futextest, "futextest"},
+    {rwlookup, "rwlookup"},
+    {lockstats, "lockstats"},
+    {fsyncs, "fsyncs"},
     {preempt, "preempt"},
     {exitwait, "exitwait"},
     {reparent, "reparent"},
@@ -2591,6 +4752,36 @@ struct test {
     {rmdot, "rmdot"},
     {dirfile, "dirfile"},
     {iref, "iref"},
+    {manyinodes, "manyinodes"},
+    {dentries, "dentries"},
+    {pagedata, "pagedata"},
+    {sendfiles, "sendfiles"},
+    {rwvec, "rwvec"},
+    {directio, "directio"},
+    {inlinedata, "inlinedata"},
+    {manyfds, "manyfds"},
+    {diskpoll, "diskpoll"},
+    {iostats, "iostats"},
+    {pipesize, "pipesize"},
+    {pipefault, "pipefault"},
+    {memfdtest, "memfd"},
+    {polltest, "poll"},
+    {dmesgtest, "dmesg"},
+    {sysstattest, "sysstat"},
+    {ringtest, "ring"},
+    {proftest, "prof"},
+    {sharedtexttest, "sharedtext"},
+    {hpmtest, "hpm"},
+    {malloctest, "malloc"},
+    {stdiotest, "stdio"},
+    {slabbenchtest, "slabbench"},
+    {nanosleeptest, "nanosleep"},
+    {meminfotest, "meminfo"},
+    {compacttest, "compact"},
+    {compactkpages, "compactkpages"},
+    {zeropagetest, "zeropage"},
+    {delayalloc, "delayalloc"},
+    {hashdir, "hashdir"},
     {forktest, "forktest"},
     {sbrkbasic, "sbrkbasic"},
     {sbrkmuch, "sbrkmuch"},
@@ -2612,6 +4803,8 @@ struct test {
     {lazy_alloc, "lazy_alloc"},
     {lazy_unmap, "lazy_unmap"},
     {lazy_copy, "lazy_copy"},
+    {cowfork, "cowfork"},
+    {spawntest, "spawntest"},
     {0, 0},
 };
 
@@ -2800,7 +4993,7 @@ void diskfull(char *s) {
       break;
     }
     for (int i = 0; i < MAXFILE; i++) {
-      char buf[BSIZE];
+      static char buf[BSIZE];
       if (write(fd, buf, BSIZE) != BSIZE) {
         done = 1;
         close(fd);
@@ -2884,6 +5077,34 @@ void outofinodes(char *s) {
   }
 }
 
+// grow past physical memory, so that pages go out to the swap
+// area, and check that every page comes back intact.
+void swapout(char *s) {
+  enum { STEP = 1024 * 1024, SLACK = 4 * 1024 * 1024 };
+  char *start = sbrk(0);
+  uint64 n = 0;
+
+  while (sbrk(STEP) != SBRK_ERROR) {
+    for (uint64 i = n; i < n + STEP; i += PGSIZE)
+      *(uint64 *)(start + i) = i / PGSIZE;
+    n += STEP;
+  }
+  if (n < 2 * SLACK) {
+    printf("%s: sbrk grew only %ld bytes\n", s, n);
+    exit(1);
+  }
+
+  // leave some memory free to read pages back into.
+  sbrk(-SLACK);
+  n -= SLACK;
+  for (uint64 i = 0; i < n; i += PGSIZE) {
+    if (*(uint64 *)(start + i) != i / PGSIZE) {
+      printf("%s: page %ld lost its contents\n", s, i / PGSIZE);
+      exit(1);
+    }
+  }
+}
+
 struct test slowtests[] = {
     {bigdir, "bigdir"},
     {manywrites, "manywrites"},
@@ -2891,6 +5112,7 @@ struct test slowtests[] = {
     {execout, "execout"},
     {diskfull, "diskfull"},
     {outofinodes, "outofinodes"},
+    {swapout, "swapout"},
 
     {0, 0},
 };
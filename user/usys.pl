@@ -9,7 +9,7 @@ print "#include \"kernel/syscall.h\"\n";
 sub entry {
     my $prefix = "sys_";
     my $name = shift;
-    if ($name eq "sbrk") {
+    if ($name eq "sbrk" || $name eq "exit" || $name eq "close") {
 	print ".global $prefix$name\n";
 	print "$prefix$name:\n";
     } else {
@@ -44,3 +44,37 @@ entry("pause");
 entry("uptime");
 entry("mmap");
 entry("munmap");
+entry("spawn");
+entry("madvise");
+entry("msync");
+entry("setpriority");
+entry("clone");
+entry("join");
+entry("futex");
+entry("setaffinity");
+entry("getaffinity");
+entry("getrusage");
+entry("pinfo");
+entry("lockstat");
+entry("fsync");
+entry("sendfile");
+entry("splice");
+entry("pread");
+entry("pwrite");
+entry("readv");
+entry("writev");
+entry("diskstat");
+entry("iostat");
+entry("fcntl");
+entry("memfd");
+entry("poll");
+entry("dmesg");
+entry("trace");
+entry("sysstat");
+entry("ringsetup");
+entry("ringenter");
+entry("prof");
+entry("hpm");
+entry("slabbench");
+entry("nanosleep");
+entry("meminfo");